@@ -237,6 +237,9 @@ static NSColor *macro_color(char macro, CGFloat alpha) {
 @property(strong) MacroVizView *macroViz;
 @property(strong) WavePreviewView *waveViz;
 @property(strong) NSTimer *vizTimer;
+@property(assign) NSUInteger vizSkipped;
+@property(assign) Expr *previewExpr;
+@property(assign) uint64_t previewGen;
 @property(strong) EquationVisualView *visualView;
 @end
 
@@ -287,6 +290,19 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     return true;
 }
 
+static bool write_flac16_mono(const char *path, const int16_t *samples, uint32_t frameCount) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    FlacWriter fw;
+    bool ok = flac_open(&fw, f, default_thread_count());
+    if (ok) {
+        flac_write(&fw, samples, frameCount);
+        ok = flac_close(&fw);
+    }
+    ok &= fclose(f) == 0;
+    return ok;
+}
+
 - (NSTextField *)label:(NSRect)frame text:(NSString *)text {
     NSTextField *label = [[NSTextField alloc] initWithFrame:frame];
     label.stringValue = text;
@@ -388,12 +404,10 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     self.cSlider.doubleValue = c;
     self.dSlider.doubleValue = d;
 
-    atomic_store_explicit(&g_synth.macro_a, a, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_b, b, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_c, c, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_d, d, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_shift, sh, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_mask, mask, memory_order_relaxed);
+    uint64_t stamp = now_ns();
+    ControlEvent batch[6] = {{CTL_A, a, stamp},     {CTL_B, b, stamp},         {CTL_C, c, stamp},
+                             {CTL_D, d, stamp},     {CTL_SHIFT, sh, stamp},    {CTL_MASK, mask, stamp}};
+    synth_post_controls(&g_synth, batch, 6);
 }
 
 - (void)refreshVisualization {
@@ -418,11 +432,24 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     const int sampleCount = 256;
     double tempo = atomic_load_explicit(&g_synth.target_tempo, memory_order_relaxed);
     double pitch = atomic_load_explicit(&g_synth.target_pitch, memory_order_relaxed);
-    double base = g_synth.timeline;
+    double base = (double)atomic_load_explicit(&g_synth.position, memory_order_relaxed);
     double step = fmax(1.0, tempo * 12.0);
 
+    // The preview evaluates a private copy of the equation, recompiled when the
+    // generation changes, so the lock is only held to copy the source and the
+    // audio thread never waits for a preview evaluation.
     pthread_mutex_lock(&g_synth.expr_lock);
-    Expr *expr = g_synth.expr;
+    uint64_t gen = g_synth.expr_gen;
+    char *src = gen != self.previewGen && g_synth.expr_src ? strdup(g_synth.expr_src) : NULL;
+    pthread_mutex_unlock(&g_synth.expr_lock);
+    if (gen != self.previewGen) {
+        char err[256];
+        expr_free(self.previewExpr);
+        self.previewExpr = src ? compile_expr(src, err, sizeof(err)) : NULL;
+        self.previewGen = gen;
+        free(src);
+    }
+    Expr *expr = self.previewExpr;
     EvalContext ctx;
     memset(&ctx, 0, sizeof(ctx));
     ctx.a = a;
@@ -431,18 +458,26 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     ctx.d = d;
     ctx.sh = sh;
     ctx.mask = mask;
-    for (int i = 0; i < sampleCount; ++i) {
-        ctx.t = floor((base + i * step) * pitch);
-        double y = expr ? expr_eval(expr, &ctx) : 0.0;
-        samples[i] = bytebeat_to_float(y);
+    ctx.seed = g_synth.seed;
+    // The preview runs on its own frame so it never touches the voice's variables.
+    ExprFrame frame;
+    if (expr && expr_frame_init(&frame, expr)) {
+        double *t = frame.scratch;
+        double *out = frame.scratch + EVAL_BLOCK;
+        for (int i = 0; i < sampleCount; ++i) t[i] = floor(base + i * step * pitch);
+        expr_eval_frame(expr, &frame, &ctx, t, out, sampleCount);
+        for (int i = 0; i < sampleCount; ++i) samples[i] = bytebeat_to_float(out[i]);
+        expr_frame_free(&frame);
     }
-    pthread_mutex_unlock(&g_synth.expr_lock);
 
     [self.waveViz updateWithSamples:samples count:sampleCount];
 }
 
 - (void)vizTick:(NSTimer *)timer {
     (void)timer;
+    // While the governor is shedding, refresh the preview at a quarter of the rate
+    // to leave the CPU to the audio thread.
+    if (atomic_load_explicit(&g_synth.stats.gov_step, memory_order_relaxed) > 0 && self.vizSkipped++ % 4 != 0) return;
     [self refreshVisualization];
 }
 
@@ -456,17 +491,15 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     self.bSlider.doubleValue = b;
     self.cSlider.doubleValue = c;
     self.dSlider.doubleValue = d;
-    atomic_store_explicit(&g_synth.macro_a, a, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_b, b, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_c, c, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_d, d, memory_order_relaxed);
 
     double shift = floor(self.shiftSlider.doubleValue + 0.5);
     double mask = floor(self.maskSlider.doubleValue + 0.5);
     self.shiftSlider.doubleValue = shift;
     self.maskSlider.doubleValue = mask;
-    atomic_store_explicit(&g_synth.macro_shift, shift, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_mask, mask, memory_order_relaxed);
+    uint64_t stamp = now_ns();
+    ControlEvent batch[6] = {{CTL_A, a, stamp},         {CTL_B, b, stamp},         {CTL_C, c, stamp},
+                             {CTL_D, d, stamp},         {CTL_SHIFT, shift, stamp}, {CTL_MASK, mask, stamp}};
+    synth_post_controls(&g_synth, batch, 6);
     [self updateValueLabels];
 }
 
@@ -474,7 +507,7 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     (void)sender;
     NSString *eq = self.equationField.stringValue;
     if (set_expr(&g_synth, eq.UTF8String)) {
-        g_synth.current_preset = -1;
+        atomic_store_explicit(&g_synth.current_preset, -1, memory_order_relaxed);
         [self.presetPopup selectItemAtIndex:-1];
         [self updateValueLabels];
     } else {
@@ -483,10 +516,11 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
 }
 
 - (void)selectPreset:(NSInteger)idx {
-    if (idx < 0 || idx >= PRESET_COUNT) return;
+    if (idx < 0 || idx >= preset_count()) return;
     set_preset(&g_synth, (int)idx);
+    [self applyMacroSliderRanges];  // bank presets may carry default macros
     [self.presetPopup selectItemAtIndex:idx];
-    self.equationField.stringValue = [NSString stringWithUTF8String:kPresets[idx].js];
+    self.equationField.stringValue = [NSString stringWithUTF8String:preset_js((int)idx)];
     [self updateValueLabels];
 }
 
@@ -497,9 +531,9 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
 
 - (void)nextPreset:(id)sender {
     (void)sender;
-    NSInteger idx = g_synth.current_preset;
+    NSInteger idx = atomic_load_explicit(&g_synth.current_preset, memory_order_relaxed);
     if (idx < 0) idx = 0;
-    idx = (idx + 1) % PRESET_COUNT;
+    idx = (idx + 1) % preset_count();
     [self selectPreset:idx];
 }
 
@@ -549,7 +583,7 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     NSSavePanel *panel = [NSSavePanel savePanel];
     panel.title = @"Export Normalized WAV";
     panel.nameFieldStringValue = @"bytebeat_export.wav";
-    panel.allowedFileTypes = @[@"wav"];
+    panel.allowedFileTypes = @[@"wav", @"flac"];
     panel.canCreateDirectories = YES;
     if ([panel runModal] != NSModalResponseOK) return;
 
@@ -583,23 +617,37 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     ctx.d = atomic_load_explicit(&g_synth.macro_d, memory_order_relaxed);
     ctx.sh = floor(atomic_load_explicit(&g_synth.macro_shift, memory_order_relaxed) + 0.5);
     ctx.mask = floor(atomic_load_explicit(&g_synth.macro_mask, memory_order_relaxed) + 0.5);
+    ctx.seed = g_synth.seed;
 
     double tempo = atomic_load_explicit(&g_synth.target_tempo, memory_order_relaxed);
     double pitch = atomic_load_explicit(&g_synth.target_pitch, memory_order_relaxed);
     if (tempo <= 0.0) tempo = 1.0;
     if (pitch <= 0.0) pitch = 1.0;
 
-    double timeline = 0.0;
+    PhaseAcc phase = {0, 0};
+    const PhaseAcc inc = phase_increment(tempo * pitch);
     double peak = 0.0;
-    for (uint32_t i = 0; i < frameCount; ++i) {
-        timeline += tempo;
-        ctx.t = floor(timeline * pitch);
-        double y = expr ? expr_eval(expr, &ctx) : 0.0;
-        float s = bytebeat_to_float(y);
-        tmp[i] = s;
-        double a = fabs((double)s);
-        if (a > peak) peak = a;
+    ExprFrame frame;
+    bool have_frame = expr && expr_frame_init(&frame, expr);
+    for (uint32_t base = 0; base < frameCount; base += EVAL_BLOCK) {
+        int n = frameCount - base < EVAL_BLOCK ? (int)(frameCount - base) : EVAL_BLOCK;
+        double y[EVAL_BLOCK] = {0};
+        if (have_frame) {
+            double *t = frame.scratch;
+            for (int i = 0; i < n; ++i) {
+                phase_advance(&phase, inc);
+                t[i] = (double)phase.t;
+            }
+            expr_eval_frame(expr, &frame, &ctx, t, y, n);
+        }
+        for (int i = 0; i < n; ++i) {
+            float s = bytebeat_to_float(y[i]);
+            tmp[base + (uint32_t)i] = s;
+            double a = fabs((double)s);
+            if (a > peak) peak = a;
+        }
     }
+    if (have_frame) expr_frame_free(&frame);
 
     double gain = (peak > 1e-9) ? (0.98 / peak) : 1.0;
     for (uint32_t i = 0; i < frameCount; ++i) {
@@ -609,7 +657,9 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
         pcm[i] = (int16_t)lrint(v * 32767.0);
     }
 
-    BOOL wrote = write_wav16_mono(panel.URL.fileSystemRepresentation, pcm, frameCount, SAMPLE_RATE);
+    BOOL flac = [panel.URL.pathExtension.lowercaseString isEqualToString:@"flac"];
+    BOOL wrote = flac ? write_flac16_mono(panel.URL.fileSystemRepresentation, pcm, frameCount)
+                      : write_wav16_mono(panel.URL.fileSystemRepresentation, pcm, frameCount, SAMPLE_RATE);
     free(tmp);
     free(pcm);
 
@@ -617,20 +667,22 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
         NSAlert *err = [[NSAlert alloc] init];
         err.alertStyle = NSAlertStyleCritical;
         err.messageText = @"Export failed";
-        err.informativeText = @"Could not write WAV file to selected destination.";
+        err.informativeText = flac ? @"Could not write FLAC file to selected destination."
+                                   : @"Could not write WAV file to selected destination.";
         [err addButtonWithTitle:@"OK"];
         [err runModal];
         return;
     }
 
-    self.statusLabel.stringValue = [NSString stringWithFormat:@"Exported %.2fs normalized WAV.", durationSec];
+    self.statusLabel.stringValue =
+        [NSString stringWithFormat:@"Exported %.2fs normalized %@.", durationSec, flac ? @"FLAC" : @"WAV"];
 }
 
 - (void)prevPreset:(id)sender {
     (void)sender;
-    NSInteger idx = g_synth.current_preset;
+    NSInteger idx = atomic_load_explicit(&g_synth.current_preset, memory_order_relaxed);
     if (idx < 0) idx = 0;
-    idx = (idx - 1 + PRESET_COUNT) % PRESET_COUNT;
+    idx = (idx - 1 + preset_count()) % preset_count();
     [self selectPreset:idx];
 }
 
@@ -638,14 +690,14 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     (void)sender;
     double semitones = self.pitchSlider.doubleValue;
     double ratio = pow(2.0, semitones / 12.0);
-    atomic_store_explicit(&g_synth.target_pitch, ratio, memory_order_relaxed);
+    synth_set_control(&g_synth, CTL_PITCH, ratio);
     [self updateValueLabels];
 }
 
 - (void)tempoChanged:(id)sender {
     (void)sender;
     double tempo = self.tempoSlider.doubleValue;
-    atomic_store_explicit(&g_synth.target_tempo, tempo, memory_order_relaxed);
+    synth_set_control(&g_synth, CTL_TEMPO, tempo);
     [self updateValueLabels];
 }
 
@@ -700,10 +752,16 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     applyButton.keyEquivalent = @"\r";
     [content addSubview:applyButton];
 
+    // NORA_BANK=<file.bank> replaces the built-in presets with a preset bank.
+    const char *bankPath = getenv("NORA_BANK");
+    char bankErr[300];
+    if (bankPath && *bankPath && !preset_bank_load(bankPath, bankErr, sizeof(bankErr))) {
+        fprintf(stderr, "%s\n", bankErr);
+    }
     [content addSubview:[self sectionLabel:NSMakeRect(20, 470, 120, 20) text:@"PRESET"]];
     self.presetPopup = [[NSPopUpButton alloc] initWithFrame:NSMakeRect(20, 438, 360, 28) pullsDown:NO];
-    for (int i = 0; i < PRESET_COUNT; ++i) {
-        NSString *item = [NSString stringWithFormat:@"%2d. %s", i + 1, kPresets[i].name];
+    for (int i = 0; i < preset_count(); ++i) {
+        NSString *item = [NSString stringWithFormat:@"%2d. %s", i + 1, preset_name(i)];
         [self.presetPopup addItemWithTitle:item];
     }
     self.presetPopup.target = self;
@@ -848,20 +906,14 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     self.statusLabel.textColor = [NSColor secondaryLabelColor];
     [content addSubview:self.statusLabel];
 
-    memset(&g_synth, 0, sizeof(g_synth));
-    pthread_mutex_init(&g_synth.expr_lock, NULL);
-    atomic_store_explicit(&g_synth.target_tempo, 1.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.target_pitch, 1.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_a, 5.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_b, 3.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_c, 7.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_d, 10.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_shift, 8.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_mask, 127.0, memory_order_relaxed);
-    g_synth.smooth_tempo = 1.0;
-    g_synth.smooth_pitch = 1.0;
-    atomic_store_explicit(&g_synth.running, true, memory_order_relaxed);
-    g_synth.current_preset = 0;
+    synth_init(&g_synth);
+    g_synth.cost_budget_ns = admit_budget_ns(1);
+    // The app bundle carries the presets built to native code (make app).
+    NSString *presetLib = [[NSBundle mainBundle] pathForResource:@"nora_presets" ofType:@"so"];
+    if (presetLib) {
+        char err[300];
+        if (!aot_load_library(presetLib.fileSystemRepresentation, err, sizeof(err))) NSLog(@"%s", err);
+    }
     [self selectPreset:0];
     [self applyMacroSliderRanges];
 
@@ -884,15 +936,11 @@ static bool write_wav16_mono(const char *path, const int16_t *samples, uint32_t
     (void)notification;
     [self.vizTimer invalidate];
     self.vizTimer = nil;
+    expr_free(self.previewExpr);
+    self.previewExpr = NULL;
     atomic_store_explicit(&g_synth.running, false, memory_order_relaxed);
     audio_stop(&g_synth);
-
-    pthread_mutex_lock(&g_synth.expr_lock);
-    Expr *final_expr = g_synth.expr;
-    g_synth.expr = NULL;
-    pthread_mutex_unlock(&g_synth.expr_lock);
-    expr_free(final_expr);
-    pthread_mutex_destroy(&g_synth.expr_lock);
+    synth_destroy(&g_synth);
 }
 
 - (BOOL)applicationShouldTerminateAfterLastWindowClosed:(NSApplication *)sender {
@@ -1,15 +1,47 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <AudioToolbox/AudioToolbox.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <arpa/inet.h>
 #include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 #define SAMPLE_RATE 48000
 #define CHANNELS 1
@@ -17,6 +49,20 @@
 #define BUFFER_COUNT 3
 #define INPUT_LINE_MAX 4096
 #define SMOOTHING_COEFF 0.0008
+#define CONTROL_QUEUE_SIZE 1024
+#define OSC_PACKET_MAX 8192
+#define OSC_BATCH_MAX 256
+#define DAEMON_MAX_STREAMS 256
+#define SHM_RING_FRAMES (1u << 16)
+#define LOOP_CACHE_MAX_PERIOD (1u << 21)
+#define LOOP_CACHE_POLL_NS 20000000L
+#define LOOP_CACHE_STABLE_POLLS 3
+#define SESSION_RING_SIZE 4096
+#define SESSION_CHECKPOINT_FRAMES (10 * SAMPLE_RATE)
+#define SEEK_MAX_SECONDS 1e9
+#define SEQ_AHEAD 64
+#define SEQ_MAX_STEPS 4096
+#define SEQ_POLL_NS 5000000L
 
 typedef enum {
     TOK_EOF = 0,
@@ -47,7 +93,23 @@ typedef enum {
     TOK_BXOR,
     TOK_SHL,
     TOK_SHR,
-    TOK_USHR
+    TOK_USHR,
+    TOK_SEMI,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
+    TOK_DOT,
+    TOK_ASSIGN,
+    TOK_ADD_ASSIGN,
+    TOK_SUB_ASSIGN,
+    TOK_MUL_ASSIGN,
+    TOK_DIV_ASSIGN,
+    TOK_MOD_ASSIGN,
+    TOK_BAND_ASSIGN,
+    TOK_BOR_ASSIGN,
+    TOK_BXOR_ASSIGN,
+    TOK_SHL_ASSIGN,
+    TOK_SHR_ASSIGN,
+    TOK_USHR_ASSIGN
 } TokenType;
 
 typedef struct {
@@ -69,7 +131,12 @@ typedef enum {
     EX_UNARY,
     EX_BINARY,
     EX_TERNARY,
-    EX_FUNC
+    EX_FUNC,
+    EX_LOCAL,   // per-sample local (let/var/const)
+    EX_STATE,   // persistent scalar
+    EX_INDEX,   // persistent array element
+    EX_ASSIGN,  // target = value, or target op= value
+    EX_SEQ      // statement; rest of program
 } ExprType;
 
 typedef enum {
@@ -104,7 +171,8 @@ typedef enum {
     OP_BXOR,
     OP_SHL,
     OP_SHR,
-    OP_USHR
+    OP_USHR,
+    OP_ASSIGN  // plain `=` in EX_ASSIGN
 } Op;
 
 typedef struct Expr Expr;
@@ -131,19 +199,408 @@ struct Expr {
             char name[16];
             Expr **args;
             int argc;
+            uint32_t site;  // random(): its call site, numbered in source order
         } func;
+        struct {
+            uint32_t slot;    // local slot, or offset into the persistent state
+            uint32_t length;  // array length (EX_INDEX)
+            Expr *index;      // EX_INDEX
+        } ref;
+        struct {
+            Op op;
+            Expr *target;  // EX_LOCAL, EX_STATE or EX_INDEX
+            Expr *value;
+        } assign;
+        struct {
+            Expr *first;
+            Expr *rest;
+        } seq;
     } as;
 };
 
+// Programs can name values and keep state. Every name gets a fixed slot when the
+// program is compiled: locals live in a per-evaluation frame, persistent scalars
+// and arrays in a zero-initialized state block owned by the voice, so running a
+// program never allocates.
+#define PROGRAM_MAX_NAMES 64
+#define PROGRAM_MAX_STATE (1u << 20)
+
+typedef enum { NAME_LOCAL, NAME_STATE, NAME_ARRAY } NameKind;
+
+typedef struct {
+    char name[64];
+    NameKind kind;
+    uint32_t slot;
+    uint32_t length;
+} ProgramName;
+
 typedef struct {
     Lexer lx;
+    ProgramName names[PROGRAM_MAX_NAMES];
+    int name_count;
+    uint32_t random_sites;
 } Parser;
 
+// Working memory for running one program, sized when it is installed so the
+// render path never allocates. scratch holds t and the output block, then (for
+// the block evaluator) one row per local and the node slots; vars holds the
+// per-sample locals followed by the persistent state.
+typedef struct {
+    double *scratch;
+    double *vars;
+    uint32_t locals;
+    uint32_t state;
+    bool block;
+} ExprFrame;
+
+// Effects chain parameters, in control order from CTL_FX.
+typedef enum {
+    FX_ON,          // 0 bypasses the whole chain
+    FX_DC,          // DC blocker on/off
+    FX_FILTER,      // FxFilterMode
+    FX_CUTOFF,      // Hz
+    FX_Q,           // filter resonance, 0.5..20
+    FX_BITS,        // bitcrusher depth, 0 = off
+    FX_DOWNSAMPLE,  // bitcrusher sample-and-hold factor, 1 = off
+    FX_DRIVE,       // soft limiter input gain, 0 = off
+    FX_DELAY_MS,    // 0 = delay off
+    FX_FEEDBACK,
+    FX_MIX,
+    FX_PARAM_COUNT
+} FxParam;
+
+typedef enum { FX_FILTER_OFF, FX_FILTER_LP, FX_FILTER_HP, FX_FILTER_BP } FxFilterMode;
+
+typedef enum {
+    CTL_A = 0,
+    CTL_B,
+    CTL_C,
+    CTL_D,
+    CTL_SHIFT,
+    CTL_MASK,
+    CTL_PITCH,
+    CTL_TEMPO,
+    CTL_FX,  // CTL_FX + FxParam, up to CTL_FX_LAST
+    CTL_FX_LAST = CTL_FX + FX_PARAM_COUNT - 1,
+    CTL_DECIMATE,  // internal rate divisor: the equation runs on every n-th frame
+    CTL_SEEK,      // jump to an absolute time in seconds
+    CTL_SCRUB,     // move by a signed number of seconds
+    CTL_PING
+} ControlId;
+
+// One control change on its way to the audio thread. stamp_ns is the monotonic
+// time the change entered the engine (or the sender's send time for pings).
+typedef struct {
+    ControlId id;
+    double value;
+    uint64_t stamp_ns;
+} ControlEvent;
+
+// Multi-producer / single-consumer ring. Producers (REPL, GUI, OSC) serialize on
+// producer_lock; the audio thread drains it lock-free at the start of every buffer.
+// A batch becomes visible with a single write_pos store, so it is applied whole.
+typedef struct {
+    ControlEvent events[CONTROL_QUEUE_SIZE];
+    _Atomic uint32_t write_pos;
+    _Atomic uint32_t read_pos;
+    pthread_mutex_t producer_lock;
+} ControlQueue;
+
+// Control values as currently applied by the audio thread.
+typedef struct {
+    double tempo;
+    double pitch;
+    double a;
+    double b;
+    double c;
+    double d;
+    double sh;
+    double mask;
+    double fx[FX_PARAM_COUNT];
+    double decimate;
+} SynthControls;
+
+typedef struct {
+    _Atomic uint64_t ctl_events;
+    _Atomic uint64_t ctl_dropped;
+    _Atomic uint64_t ctl_latency_sum_ns;
+    _Atomic uint64_t ctl_latency_max_ns;
+    _Atomic uint64_t ping_seq;
+    _Atomic uint64_t ping_send_ns;
+    _Atomic uint64_t ping_render_ns;
+    _Atomic uint64_t loop_cache_buffers;
+    _Atomic uint64_t spec_buffers;   // rendered with the specialized program
+    _Atomic uint64_t render_gen;     // newest equation generation rendered
+    _Atomic uint64_t render_gen_ns;  // when its first buffer was rendered
+    _Atomic double gov_load;         // smoothed render time over the voice's deadline share
+    _Atomic double gov_peak;         // worst single buffer since stats were last read
+    _Atomic uint64_t gov_step;       // internal rate halvings the governor applies
+    _Atomic uint64_t gov_sheds;
+    _Atomic uint64_t gov_restores;
+    _Atomic uint64_t gov_overruns;   // buffers that took longer than their deadline share
+    _Atomic uint64_t render_lock_waits;  // buffers that had to wait for expr_lock
+} SynthStats;
+
+// Admission control. An equation may plan on ADMIT_SHARE of the time a buffer
+// lasts, split between the voices that render on the same core; the rest is left
+// for the effects, the OS and the estimate's error. One that does not fit runs at
+// a lower internal rate, down to 1/ADMIT_MAX_DIVIDE, or is refused.
+#define ADMIT_SHARE 0.5
+#define ADMIT_MAX_DIVIDE 8
+
+// CPU governor. After every buffer the render time is compared with the voice's
+// share of the buffer's duration. When the smoothed load nears the deadline the
+// governor halves the internal rate on top of what admission chose, and doubles
+// it again once the load has stayed low for a while. Each change is followed by
+// a settling period so its effect is judged before the next one. A shed that
+// comes soon after a restore doubles the calm period the next restore needs, so
+// a voice that only just fits does not flap between two rates.
+#define GOV_SMOOTHING 0.2      // weight of the newest buffer in the smoothed load
+#define GOV_SHED_LOAD 0.7      // smoothed load that sheds a step
+#define GOV_PANIC_LOAD 0.9     // two buffers in a row this close to the deadline shed at once
+#define GOV_RESTORE_LOAD 0.3   // low enough that doubling the rate stays under GOV_SHED_LOAD
+#define GOV_CALM_BUFFERS 94    // about 1 s below GOV_RESTORE_LOAD before stepping up
+#define GOV_SETTLE_BUFFERS 8
+#define GOV_MAX_BACKOFF 4      // calm period up to 16x GOV_CALM_BUFFERS
+
+typedef struct {
+    double load;
+    double admitted;  // internal rate divisor from admission (the last CTL_DECIMATE)
+    int step;         // extra halvings of the internal rate
+    int settle;       // buffers left before the next decision
+    int calm;         // consecutive buffers below GOV_RESTORE_LOAD
+    int backoff;      // the calm period is GOV_CALM_BUFFERS << backoff
+    bool hot;         // the previous buffer was above GOV_PANIC_LOAD
+    uint64_t buffers;
+    uint64_t restored_at;  // buffer count at the last restore, 0 = none
+} Governor;
+
+// Playback position as 64.64 fixed point: `t` is the integer sample index fed to
+// the equation and `frac` the 64-bit fraction. Tempo and pitch enter only as the
+// per-sample increment, so advancing is an add-with-carry and t is read directly.
+typedef struct {
+    uint64_t t;
+    uint64_t frac;
+} PhaseAcc;
+
+// One rendered period of an equation whose output provably repeats, valid only
+// for the equation generation and macro values it was rendered with.
+typedef struct {
+    uint64_t gen;
+    double key[6];
+    uint64_t period;
+    uint8_t *bytes;
+} LoopCache;
+
+// The equation partially evaluated for fixed macro values (expr_specialize),
+// valid only for the generation and macros it was built for. Only programs
+// without persistent state are specialized, so moving between this and the
+// generic program at any buffer loses nothing.
+typedef struct {
+    uint64_t gen;
+    double key[6];
+    Expr *expr;
+    ExprFrame frame;
+    int nodes;          // after folding
+    int generic_nodes;  // before
+} SpecProgram;
+
+#define FX_DELAY_FRAMES (2 * SAMPLE_RATE)
+#define FX_DC_POLE 0.995f
+
+// Effects chain working state, owned by whoever calls synth_render. Coefficients
+// are derived from the fx controls when one changes; the delay line is allocated
+// with the synth, so the render path never allocates.
+typedef struct {
+    bool dirty;
+    bool dc_on;
+    bool filter_on;
+    bool delay_on;
+    float dc_x1;
+    float dc_y1;
+    float svf_a1;  // topology-preserving SVF: a1..a3 from cutoff and Q,
+    float svf_a2;  // mix weights pick low, band or high pass
+    float svf_a3;
+    float svf_mix[3];
+    float svf_ic1;
+    float svf_ic2;
+    float crush_levels;  // 0 = no bit reduction
+    uint32_t crush_hold;
+    uint32_t crush_count;
+    float crush_last;
+    float drive;  // 0 = limiter off
+    float feedback;
+    float mix;
+    float *delay;
+    uint32_t delay_frames;
+    uint32_t delay_pos;
+} FxChain;
+
+// Everything the renderer carries from one sample to the next, apart from the
+// equation and the effects' filter and delay memory. A session checkpoint stores
+// it bit for bit.
+typedef struct {
+    PhaseAcc phase;
+    PhaseAcc phase_inc;
+    double smooth_tempo;
+    double smooth_pitch;
+    bool rate_steady;
+    SynthControls live;
+} SynthState;
+
+typedef enum { SES_CONTROL = 1, SES_EQ, SES_CHECKPOINT, SES_END, SES_SEEK } SessionRecordKind;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t id;       // SES_CONTROL: ControlId
+    uint64_t sample;  // session sample index the record takes effect before
+    double value;     // SES_CONTROL
+    uint64_t gen;     // SES_EQ: equation generation; SES_END: records dropped
+    char *src;        // SES_EQ: source handed over with a sequencer switch, else looked up by gen
+    SynthState state; // SES_CHECKPOINT, SES_SEEK
+} SessionRecord;
+
+typedef struct SessionSource {
+    uint64_t gen;
+    char *src;
+    struct SessionSource *next;
+} SessionSource;
+
+typedef enum { SESSION_STARTING, SESSION_ACTIVE, SESSION_DONE } SessionState;
+
+// Performance recorder. The audio thread logs what it applied at each buffer
+// boundary into an SPSC ring; a writer thread encodes the ring to the session
+// file. Equation sources are noted by whoever installs them, keyed by generation.
+typedef struct {
+    SessionRecord ring[SESSION_RING_SIZE];
+    _Atomic uint32_t write_pos;
+    _Atomic uint32_t read_pos;
+    _Atomic int state;
+    // Audio thread only.
+    uint64_t start_frame;
+    uint64_t last_checkpoint;
+    uint64_t logged_gen;
+    uint64_t logged_seeks;
+    SynthControls logged;
+    uint64_t dropped;
+    // Sources not yet written, oldest first.
+    pthread_mutex_t src_lock;
+    SessionSource *sources;
+    SessionSource **sources_tail;
+    FILE *file;
+    pthread_t thread;
+    uint64_t bytes_written;
+} SessionRecorder;
+
+// --lookahead: a render thread keeps `target` frames queued in an SPSC ring and
+// the audio callback only copies out of it, so a slow render is absorbed by the
+// queue instead of being heard. Controls are given the frame they take effect at
+// from their timestamp and the playback position the callback last published.
+typedef struct {
+    int16_t *pcm;
+    uint32_t capacity;  // frames, a power of two
+    uint32_t target;    // frames the render thread keeps queued
+    _Atomic uint64_t write_frames;
+    _Atomic uint64_t read_frames;
+    _Atomic uint32_t anchor_seq;  // odd while the callback updates the anchor
+    _Atomic uint64_t anchor_frames;
+    _Atomic uint64_t anchor_ns;
+    // Render thread only: controls taken off the queue that are not due yet.
+    ControlEvent pending[CONTROL_QUEUE_SIZE];
+    uint64_t pending_due[CONTROL_QUEUE_SIZE];
+    uint32_t pending_head;
+    uint32_t pending_tail;
+    uint64_t last_due;
+    pthread_t thread;
+    _Atomic bool running;
+    _Atomic uint64_t underruns;        // callbacks that found the ring short
+    _Atomic uint64_t underrun_frames;  // silence played in their place
+    _Atomic uint64_t low_fill;         // fewest frames queued after a callback since stats
+    _Atomic uint64_t scheduled;
+    _Atomic uint64_t late;             // controls applied after their frame
+    _Atomic uint64_t late_max_frames;
+    _Atomic uint64_t chunk_max_ns;     // slowest synth_render call since stats
+} Lookahead;
+
+// An equation built to native code (see aot_write_module): evaluates t[0..n) into
+// out with macros a, b, c, d, sh, mask (then the seed's bits) and the program's
+// persistent state.
+typedef void (*AotFn)(const double *macros, const double *t, double *out, int n, double *state);
+
+// One line of a pattern file: its length on the grid, the macros it sets and
+// the transpiled equation it switches to (NULL keeps the playing one).
+typedef struct {
+    uint32_t length;
+    uint32_t macro_set;  // bit i: macros[i] is set (a, b, c, d, sh, mask)
+    double macros[6];
+    char *src;
+} SeqStep;
+
+// A step compiled by the sequencer thread, ready for the audio thread to swap
+// in. After the switch the slot holds the program it replaced until the
+// sequencer thread frees it.
+typedef struct {
+    uint64_t at;  // frames from the start of the pattern
+    uint32_t step;
+    uint32_t macro_set;
+    double macros[6];
+    Expr *expr;  // NULL keeps the playing equation
+    char *src;
+    char *note;  // a copy of src for the session log
+    ExprFrame frame;
+    AotFn native;
+    void *native_handle;  // only ever a replaced one
+    int divide;           // admitted internal rate
+    double cost_ns;
+} SeqSlot;
+
+// Pattern sequencer: the sequencer thread keeps the next SEQ_AHEAD steps
+// compiled in an SPSC ring; the audio thread switches to each on its frame.
+typedef struct {
+    char *path;
+    SeqStep *steps;
+    uint32_t step_count;
+    double bpm;
+    uint32_t grid;         // steps per bar
+    uint32_t beats;        // beats per bar
+    double grid_frames;    // frames per grid step
+    double budget_ns;      // admission budget the steps are compiled against
+    SeqSlot slots[SEQ_AHEAD];
+    _Atomic uint32_t write_pos;  // sequencer thread
+    _Atomic uint32_t read_pos;   // audio thread
+    // Sequencer thread only.
+    uint32_t clean_pos;
+    uint32_t next_step;
+    uint64_t next_grid;
+    // Audio thread only.
+    bool started;
+    uint64_t origin;  // s->frames at the first step
+    pthread_t thread;
+    _Atomic bool running;
+    _Atomic uint32_t playing;  // pattern line sounding
+    _Atomic uint64_t switches;
+    _Atomic uint64_t late;  // steps switched in after their frame (compiled too late)
+    _Atomic uint64_t late_max_frames;
+} Sequencer;
+
 typedef struct {
     AudioQueueRef queue;
     AudioQueueBufferRef buffers[BUFFER_COUNT];
     pthread_mutex_t expr_lock;
     Expr *expr;
+    char *expr_src;
+    ExprFrame expr_frame;  // evaluation buffers and program state sized for expr
+    uint64_t expr_gen;
+    AotFn native;         // expr built to native code, or NULL to interpret it
+    void *native_handle;  // module owned by the synth (native built for it), else NULL
+    LoopCache *loop_cache;
+    _Atomic bool loop_cache_enabled;
+    _Atomic uint64_t loop_period;
+    SpecProgram *spec;  // guarded by expr_lock
+    _Atomic bool spec_enabled;
+    uint64_t seed;  // random() and noise(); fixed while the voice renders
+    pthread_t worker;
+    _Atomic bool worker_running;
     _Atomic double target_tempo;
     _Atomic double target_pitch;
     _Atomic double macro_a;
@@ -152,10 +609,32 @@ typedef struct {
     _Atomic double macro_d;
     _Atomic double macro_shift;
     _Atomic double macro_mask;
+    _Atomic double fx_target[FX_PARAM_COUNT];
+    _Atomic double target_decimate;
+    double cost_budget_ns;        // per-sample equation budget for admission, 0 = unlimited
+    _Atomic double expr_cost_ns;  // static cost estimate of the installed equation
+    ControlQueue controls;
+    _Atomic bool controls_resync;
+    SynthControls live;
+    FxChain fx;
+    _Atomic bool governor_enabled;
+    Governor gov;  // audio thread
+    SynthStats stats;
     double smooth_tempo;
     double smooth_pitch;
-    double timeline;
-    int current_preset;
+    PhaseAcc phase;
+    PhaseAcc phase_inc;
+    bool rate_steady;
+    uint64_t frames;              // frames rendered so far (audio thread)
+    uint64_t seeks;               // seeks and scrubs applied so far (audio thread)
+    SessionRecorder *recorder;    // guarded by expr_lock
+    _Atomic uint64_t position;
+    Lookahead *ahead;             // render ring the callback copies from, or NULL to render there
+    Sequencer *seq;               // guarded by expr_lock
+    _Atomic uint64_t seq_due;     // frame of the next sequencer switch, UINT64_MAX for none
+    char *seq_note;               // source of the last switch, until the session log takes it
+    uint64_t seq_note_gen;
+    _Atomic int current_preset;  // set by the REPL, GUI and file watcher; -1 for a custom equation
     _Atomic bool running;
 } Synth;
 
@@ -204,6 +683,17 @@ static const Preset kPresets[] = {
 static void expr_free(Expr *e) {
     if (!e) return;
     switch (e->type) {
+        case EX_INDEX:
+            expr_free(e->as.ref.index);
+            break;
+        case EX_ASSIGN:
+            expr_free(e->as.assign.target);
+            expr_free(e->as.assign.value);
+            break;
+        case EX_SEQ:
+            expr_free(e->as.seq.first);
+            expr_free(e->as.seq.rest);
+            break;
         case EX_UNARY:
             expr_free(e->as.unary.a);
             break;
@@ -236,19 +726,105 @@ static Expr *expr_new(ExprType t) {
 static int32_t to_i32(double v) { return (int32_t)((int64_t)llround(floor(v))); }
 static uint32_t to_u32(double v) { return (uint32_t)to_i32(v); }
 
-static double fn_eval(const char *name, double *a, int n) {
-    if (!strcmp(name, "sin") && n == 1) return sin(a[0]);
-    if (!strcmp(name, "cos") && n == 1) return cos(a[0]);
-    if (!strcmp(name, "tan") && n == 1) return tan(a[0]);
-    if (!strcmp(name, "abs") && n == 1) return fabs(a[0]);
-    if (!strcmp(name, "sqrt") && n == 1) return sqrt(fabs(a[0]));
-    if (!strcmp(name, "floor") && n == 1) return floor(a[0]);
-    if (!strcmp(name, "ceil") && n == 1) return ceil(a[0]);
-    if (!strcmp(name, "pow") && n == 2) return pow(a[0], a[1]);
-    if (!strcmp(name, "min") && n == 2) return fmin(a[0], a[1]);
-    if (!strcmp(name, "max") && n == 2) return fmax(a[0], a[1]);
-    if (!strcmp(name, "clamp") && n == 3) return fmax(a[1], fmin(a[2], a[0]));
-    return 0.0;
+// Fast transcendentals (--math fast). sin, cos and tan reduce by pi/2 in three
+// exact steps (Cody-Waite) and use fdlibm's kernel polynomials. The kernels are
+// branch-free so the block loops vectorize. Outside |x| <= 2^20 libm is used.
+// pow stays on libm; --math-bench times an in-tree pow against it.
+typedef enum { MATH_EXACT, MATH_FAST } MathMode;
+
+static MathMode g_math_mode = MATH_EXACT;  // set before anything renders
+
+#define FAST_TRIG_MAX 0x1p20
+
+// x - k pi/2 for the k nearest x 2/pi, and k's low bits for the quadrant. pi/2 is
+// split into 33-bit parts, so each k * part is exact while |k| < 2^20.
+static inline double fast_reduce(double x, uint64_t *quadrant) {
+    double kb = x * 6.36619772367581382433e-01 + 0x1.8p52;
+    double k = kb - 0x1.8p52;
+    memcpy(quadrant, &kb, sizeof(*quadrant));  // k in two's complement in the low mantissa bits
+    return ((x - k * 1.57079632673412561417e+00) - k * 6.07710050630396597660e-11) - k * 2.02226624871116645580e-21;
+}
+
+// a if pick is 0, else b; negated if flip is 1. Done on the bits so it stays a
+// vector select.
+static inline double fast_select(double a, double b, uint64_t pick, uint64_t flip) {
+    uint64_t ab, bb;
+    memcpy(&ab, &a, sizeof(ab));
+    memcpy(&bb, &b, sizeof(bb));
+    uint64_t mask = (uint64_t)0 - pick;
+    uint64_t v = ((ab & ~mask) | (bb & mask)) ^ (flip << 63);
+    double out;
+    memcpy(&out, &v, sizeof(out));
+    return out;
+}
+
+static inline double fast_sin_kernel(double r) {
+    double z = r * r;
+    return r + r * z *
+                   (-1.66666666666666324348e-01 +
+                    z * (8.33333333332248946124e-03 +
+                         z * (-1.98412698298579493134e-04 +
+                              z * (2.75573137070700676789e-06 +
+                                   z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));
+}
+
+static inline double fast_cos_kernel(double r) {
+    double z = r * r;
+    return 1.0 - (0.5 * z - z * z *
+                                (4.16666666666666019037e-02 +
+                                 z * (-1.38888888888741095749e-03 +
+                                      z * (2.48015872894767294178e-05 +
+                                           z * (-2.75573143513906633035e-07 +
+                                                z * (2.08757232129817482790e-09 +
+                                                     z * -1.13596475577881948265e-11))))));
+}
+
+static inline double fast_sin_core(double x) {
+    uint64_t q;
+    double r = fast_reduce(x, &q);
+    return fast_select(fast_sin_kernel(r), fast_cos_kernel(r), q & 1, (q >> 1) & 1);
+}
+
+static inline double fast_cos_core(double x) {
+    uint64_t q;
+    double r = fast_reduce(x, &q);
+    return fast_select(fast_cos_kernel(r), fast_sin_kernel(r), q & 1, ((q + 1) >> 1) & 1);
+}
+
+static inline double fast_tan_core(double x) {
+    uint64_t q;
+    double r = fast_reduce(x, &q);
+    double s = fast_sin_kernel(r);
+    double c = fast_cos_kernel(r);
+    return fast_select(s / c, c / s, q & 1, q & 1);
+}
+
+static double fast_sin(double x) { return fabs(x) <= FAST_TRIG_MAX ? fast_sin_core(x) : sin(x); }
+static double fast_cos(double x) { return fabs(x) <= FAST_TRIG_MAX ? fast_cos_core(x) : cos(x); }
+static double fast_tan(double x) { return fabs(x) <= FAST_TRIG_MAX ? fast_tan_core(x) : tan(x); }
+
+// Block forms: the kernel runs on every lane (it is only bit operations and
+// arithmetic, so out-of-range lanes just give garbage), then the few lanes out of
+// range are redone with libm.
+static void fast_sin_block(const double *x, double *out, int n) {
+    for (int i = 0; i < n; ++i) out[i] = fast_sin_core(x[i]);
+    for (int i = 0; i < n; ++i) {
+        if (!(fabs(x[i]) <= FAST_TRIG_MAX)) out[i] = sin(x[i]);
+    }
+}
+
+static void fast_cos_block(const double *x, double *out, int n) {
+    for (int i = 0; i < n; ++i) out[i] = fast_cos_core(x[i]);
+    for (int i = 0; i < n; ++i) {
+        if (!(fabs(x[i]) <= FAST_TRIG_MAX)) out[i] = cos(x[i]);
+    }
+}
+
+static void fast_tan_block(const double *x, double *out, int n) {
+    for (int i = 0; i < n; ++i) out[i] = fast_tan_core(x[i]);
+    for (int i = 0; i < n; ++i) {
+        if (!(fabs(x[i]) <= FAST_TRIG_MAX)) out[i] = tan(x[i]);
+    }
 }
 
 typedef struct {
@@ -259,6 +835,12 @@ typedef struct {
     double d;
     double sh;
     double mask;
+    double *locals;  // program locals (rows of EVAL_BLOCK in block evaluation)
+    double *state;   // persistent scalars and arrays of the program
+    // Macro sweeps: one row of EVAL_BLOCK per macro a..mask, so every lane of a
+    // block evaluation can have its own settings. NULL uses the scalars above.
+    const double *lane_macros;
+    uint64_t seed;  // random() and noise()
 } EvalContext;
 
 static double eval_var(const EvalContext *ctx, VarId id) {
@@ -281,6 +863,137 @@ static double eval_var(const EvalContext *ctx, VarId id) {
     return 0.0;
 }
 
+// random() and noise(x) are counter-based: every value is a hash of the seed and
+// a counter (t for random(), the lattice point for noise), with no generator
+// state to advance or share. So a seed gives the same values at the same t on any
+// thread, in any chunk of a parallel render, and in the block and per-sample
+// evaluators alike. The hash is SplitMix64's: the counter times the golden ratio
+// plus a key, through its bijective finalizer.
+#define RNG_GOLDEN 0x9e3779b97f4a7c15ull
+
+static inline uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Each random() call site has its own stream, so two calls in one equation are
+// independent. noise() has one per seed: it is the same function of x wherever
+// it is called.
+static inline uint64_t rng_site_key(uint64_t seed, uint32_t site) {
+    return rng_mix(seed ^ ((uint64_t)site + 1) * RNG_GOLDEN);
+}
+
+static inline uint64_t rng_noise_key(uint64_t seed) { return rng_mix(seed ^ 0x6e6f697365ull); }
+
+// An integral value as a counter; 0 outside the int64 range and for NaN.
+static inline uint64_t rng_counter(double v) { return fabs(v) < 0x1p63 ? (uint64_t)(int64_t)v : 0; }
+
+// [0, 1) from the top 53 bits, like Math.random().
+static inline double rng_unit(uint64_t key, uint64_t counter) {
+    return (double)(rng_mix(key + counter * RNG_GOLDEN) >> 11) * 0x1p-53;
+}
+
+// Value noise in [0, 1): a random value at every integer, eased between them.
+static inline double rng_noise(uint64_t key, double x) {
+    const double cell = floor(x);
+    const double f = fabs(cell) < 0x1p63 ? x - cell : 0.0;
+    const uint64_t i = rng_counter(cell);
+    const double lo = rng_unit(key, i);
+    const double hi = rng_unit(key, i + 1);
+    return lo + (hi - lo) * (f * f * (3.0 - 2.0 * f));
+}
+
+// --seed: every voice's seed unless it sets its own (daemon streams, replays).
+static uint64_t g_seed = 0;
+
+// Built-in function e (EX_FUNC) of the argument values a[0..n).
+static double fn_eval(const Expr *e, double *a, int n, const EvalContext *ctx) {
+    const char *name = e->as.func.name;
+    const bool fast = g_math_mode == MATH_FAST;
+    if (!strcmp(name, "sin") && n == 1) return fast ? fast_sin(a[0]) : sin(a[0]);
+    if (!strcmp(name, "cos") && n == 1) return fast ? fast_cos(a[0]) : cos(a[0]);
+    if (!strcmp(name, "tan") && n == 1) return fast ? fast_tan(a[0]) : tan(a[0]);
+    if (!strcmp(name, "abs") && n == 1) return fabs(a[0]);
+    if (!strcmp(name, "sqrt") && n == 1) return sqrt(fabs(a[0]));
+    if (!strcmp(name, "floor") && n == 1) return floor(a[0]);
+    if (!strcmp(name, "ceil") && n == 1) return ceil(a[0]);
+    if (!strcmp(name, "pow") && n == 2) return pow(a[0], a[1]);
+    if (!strcmp(name, "min") && n == 2) return fmin(a[0], a[1]);
+    if (!strcmp(name, "max") && n == 2) return fmax(a[0], a[1]);
+    if (!strcmp(name, "clamp") && n == 3) return fmax(a[1], fmin(a[2], a[0]));
+    if (!strcmp(name, "random") && n == 0) {
+        return rng_unit(rng_site_key(ctx->seed, e->as.func.site), rng_counter(ctx->t));
+    }
+    if (!strcmp(name, "noise") && n == 1) return rng_noise(rng_noise_key(ctx->seed), a[0]);
+    return 0.0;
+}
+
+static double expr_eval(const Expr *e, const EvalContext *ctx);
+
+// Non-short-circuit binary operators, shared by EX_BINARY and compound assignment.
+static double binary_apply(Op op, double a, double b) {
+    switch (op) {
+        case OP_ADD:
+            return a + b;
+        case OP_SUB:
+            return a - b;
+        case OP_MUL:
+            return a * b;
+        case OP_DIV:
+            return fabs(b) < 1e-12 ? 0.0 : a / b;
+        case OP_MOD: {
+            int32_t ib = to_i32(b);
+            return ib == 0 ? 0.0 : (double)(to_i32(a) % ib);
+        }
+        case OP_LT:
+            return a < b ? 1.0 : 0.0;
+        case OP_GT:
+            return a > b ? 1.0 : 0.0;
+        case OP_LE:
+            return a <= b ? 1.0 : 0.0;
+        case OP_GE:
+            return a >= b ? 1.0 : 0.0;
+        case OP_EQ:
+            return fabs(a - b) < 1e-12 ? 1.0 : 0.0;
+        case OP_NE:
+            return fabs(a - b) >= 1e-12 ? 1.0 : 0.0;
+        case OP_BAND:
+            return (double)(to_i32(a) & to_i32(b));
+        case OP_BOR:
+            return (double)(to_i32(a) | to_i32(b));
+        case OP_BXOR:
+            return (double)(to_i32(a) ^ to_i32(b));
+        case OP_SHL:
+            return (double)(to_i32(a) << (to_i32(b) & 31));
+        case OP_SHR:
+            return (double)(to_i32(a) >> (to_i32(b) & 31));
+        case OP_USHR:
+            return (double)(to_u32(a) >> (to_i32(b) & 31));
+        default:
+            return 0.0;
+    }
+}
+
+// Wraps an array index like a ring buffer, so any integer is in range.
+static inline uint32_t ref_wrap(int32_t i, uint32_t length) {
+    int64_t r = (int64_t)i % (int64_t)length;
+    return (uint32_t)(r < 0 ? r + (int64_t)length : r);
+}
+
+static double *ref_lvalue(const Expr *target, const EvalContext *ctx) {
+    switch (target->type) {
+        case EX_LOCAL:
+            return &ctx->locals[target->as.ref.slot];
+        case EX_STATE:
+            return &ctx->state[target->as.ref.slot];
+        default: {
+            double i = expr_eval(target->as.ref.index, ctx);
+            return &ctx->state[target->as.ref.slot + ref_wrap(to_i32(i), target->as.ref.length)];
+        }
+    }
+}
+
 static double expr_eval(const Expr *e, const EvalContext *ctx) {
     switch (e->type) {
         case EX_NUM:
@@ -311,46 +1024,7 @@ static double expr_eval(const Expr *e, const EvalContext *ctx) {
             }
             double a = expr_eval(e->as.binary.a, ctx);
             double b = expr_eval(e->as.binary.b, ctx);
-            switch (e->as.binary.op) {
-                case OP_ADD:
-                    return a + b;
-                case OP_SUB:
-                    return a - b;
-                case OP_MUL:
-                    return a * b;
-                case OP_DIV:
-                    return fabs(b) < 1e-12 ? 0.0 : a / b;
-                case OP_MOD: {
-                    int32_t ib = to_i32(b);
-                    return ib == 0 ? 0.0 : (double)(to_i32(a) % ib);
-                }
-                case OP_LT:
-                    return a < b ? 1.0 : 0.0;
-                case OP_GT:
-                    return a > b ? 1.0 : 0.0;
-                case OP_LE:
-                    return a <= b ? 1.0 : 0.0;
-                case OP_GE:
-                    return a >= b ? 1.0 : 0.0;
-                case OP_EQ:
-                    return fabs(a - b) < 1e-12 ? 1.0 : 0.0;
-                case OP_NE:
-                    return fabs(a - b) >= 1e-12 ? 1.0 : 0.0;
-                case OP_BAND:
-                    return (double)(to_i32(a) & to_i32(b));
-                case OP_BOR:
-                    return (double)(to_i32(a) | to_i32(b));
-                case OP_BXOR:
-                    return (double)(to_i32(a) ^ to_i32(b));
-                case OP_SHL:
-                    return (double)(to_i32(a) << (to_i32(b) & 31));
-                case OP_SHR:
-                    return (double)(to_i32(a) >> (to_i32(b) & 31));
-                case OP_USHR:
-                    return (double)(to_u32(a) >> (to_i32(b) & 31));
-                default:
-                    return 0.0;
-            }
+            return binary_apply(e->as.binary.op, a, b);
         }
         case EX_TERNARY:
             return expr_eval(e->as.ternary.cond, ctx) ? expr_eval(e->as.ternary.yes, ctx)
@@ -360,62 +1034,735 @@ static double expr_eval(const Expr *e, const EvalContext *ctx) {
             int argc = e->as.func.argc;
             if (argc > 8) argc = 8;
             for (int i = 0; i < argc; ++i) vals[i] = expr_eval(e->as.func.args[i], ctx);
-            return fn_eval(e->as.func.name, vals, argc);
+            return fn_eval(e, vals, argc, ctx);
+        }
+        case EX_LOCAL:
+            return ctx->locals[e->as.ref.slot];
+        case EX_STATE:
+            return ctx->state[e->as.ref.slot];
+        case EX_INDEX: {
+            double i = expr_eval(e->as.ref.index, ctx);
+            return ctx->state[e->as.ref.slot + ref_wrap(to_i32(i), e->as.ref.length)];
+        }
+        case EX_ASSIGN: {
+            double v = expr_eval(e->as.assign.value, ctx);
+            double *dst = ref_lvalue(e->as.assign.target, ctx);
+            if (e->as.assign.op != OP_ASSIGN) v = binary_apply(e->as.assign.op, *dst, v);
+            *dst = v;
+            return v;
         }
+        case EX_SEQ:
+            expr_eval(e->as.seq.first, ctx);
+            return expr_eval(e->as.seq.rest, ctx);
     }
     return 0.0;
 }
 
-static void lexer_skip_ws(Lexer *lx) {
-    while (isspace((unsigned char)lx->src[lx->pos])) lx->pos++;
+// Block evaluation: one tree over up to EVAL_BLOCK values of t. Each node runs a
+// tight loop over the whole block, so the tree walk and operator dispatch are paid
+// once per block instead of once per sample and the arithmetic loops vectorize.
+#define EVAL_BLOCK 256
+
+typedef enum {
+    FN_NONE,
+    FN_SIN,
+    FN_COS,
+    FN_TAN,
+    FN_ABS,
+    FN_SQRT,
+    FN_FLOOR,
+    FN_CEIL,
+    FN_POW,
+    FN_MIN,
+    FN_MAX,
+    FN_CLAMP,
+    FN_RANDOM,
+    FN_NOISE
+} FnId;
+
+static const struct {
+    const char *name;
+    int argc;
+    FnId id;
+} kFunctions[] = {{"sin", 1, FN_SIN},   {"cos", 1, FN_COS},     {"tan", 1, FN_TAN},   {"abs", 1, FN_ABS},
+                  {"sqrt", 1, FN_SQRT}, {"floor", 1, FN_FLOOR}, {"ceil", 1, FN_CEIL}, {"pow", 2, FN_POW},
+                  {"min", 2, FN_MIN},   {"max", 2, FN_MAX},     {"clamp", 3, FN_CLAMP},
+                  {"random", 0, FN_RANDOM}, {"noise", 1, FN_NOISE}};
+
+#define FUNCTION_COUNT ((int)(sizeof(kFunctions) / sizeof(kFunctions[0])))
+
+static FnId fn_lookup(const char *name, int n) {
+    for (int i = 0; i < FUNCTION_COUNT; ++i) {
+        if (kFunctions[i].argc == n && !strcmp(kFunctions[i].name, name)) return kFunctions[i].id;
+    }
+    return FN_NONE;
 }
 
-static bool lexer_starts_with(Lexer *lx, const char *s) {
-    size_t i = 0;
-    while (s[i]) {
-        if (lx->src[lx->pos + i] != s[i]) return false;
-        i++;
+static const char *fn_name(FnId id) {
+    for (int i = 0; i < FUNCTION_COUNT; ++i) {
+        if (kFunctions[i].id == id) return kFunctions[i].name;
     }
-    return true;
+    return "";
 }
 
-static void lexer_next(Lexer *lx) {
-    lexer_skip_ws(lx);
-    lx->tok.type = TOK_EOF;
-    lx->tok.number = 0;
-    lx->tok.ident[0] = '\0';
+static const char *op_symbol(Op op) {
+    static const char *const kSymbols[] = {"-",  "~",  "!",  "+",  "-", "*", "/", "%",  "<",  ">",   "<=", ">=",
+                                           "==", "!=", "&&", "||", "&", "|", "^", "<<", ">>", ">>>", "="};
+    return (size_t)op < sizeof(kSymbols) / sizeof(kSymbols[0]) ? kSymbols[op] : "?";
+}
 
-    char c = lx->src[lx->pos];
-    if (!c) {
-        lx->tok.type = TOK_EOF;
-        return;
+// Same result as to_i32 for every finite value below 2^63 in magnitude (the only
+// range where either conversion is defined), but vectorizable.
+static inline int32_t block_i32(double v) { return (int32_t)(int64_t)floor(v); }
+
+// Number of EVAL_BLOCK-sized scratch slots expr_eval_block needs for e.
+static int expr_block_slots(const Expr *e) {
+    int slots = 0;
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+            break;
+        case EX_UNARY:
+            slots = expr_block_slots(e->as.unary.a);
+            break;
+        case EX_BINARY:
+            slots = expr_block_slots(e->as.binary.a);
+            if (1 + expr_block_slots(e->as.binary.b) > slots) slots = 1 + expr_block_slots(e->as.binary.b);
+            break;
+        case EX_TERNARY:
+            slots = expr_block_slots(e->as.ternary.cond);
+            if (1 + expr_block_slots(e->as.ternary.yes) > slots) slots = 1 + expr_block_slots(e->as.ternary.yes);
+            if (2 + expr_block_slots(e->as.ternary.no) > slots) slots = 2 + expr_block_slots(e->as.ternary.no);
+            break;
+        case EX_FUNC:
+            for (int i = 0; i < e->as.func.argc && i < 8; ++i) {
+                int need = i + 1 + expr_block_slots(e->as.func.args[i]);
+                if (need > slots) slots = need;
+            }
+            break;
+        case EX_LOCAL:
+        case EX_STATE:
+            break;
+        case EX_INDEX:
+            slots = expr_block_slots(e->as.ref.index);
+            break;
+        case EX_ASSIGN:
+            slots = expr_block_slots(e->as.assign.value);
+            break;
+        case EX_SEQ:
+            slots = expr_block_slots(e->as.seq.first);
+            if (expr_block_slots(e->as.seq.rest) > slots) slots = expr_block_slots(e->as.seq.rest);
+            break;
     }
+    return slots;
+}
 
-    if (isdigit((unsigned char)c)) {
-        char *end = NULL;
-        lx->tok.number = strtod(&lx->src[lx->pos], &end);
-        lx->pos = (size_t)(end - lx->src);
-        lx->tok.type = TOK_NUM;
-        return;
+static bool expr_has_side_effects(const Expr *e) {
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+        case EX_LOCAL:
+            return false;
+        case EX_UNARY:
+            return expr_has_side_effects(e->as.unary.a);
+        case EX_BINARY:
+            return expr_has_side_effects(e->as.binary.a) || expr_has_side_effects(e->as.binary.b);
+        case EX_TERNARY:
+            return expr_has_side_effects(e->as.ternary.cond) || expr_has_side_effects(e->as.ternary.yes) ||
+                   expr_has_side_effects(e->as.ternary.no);
+        case EX_FUNC:
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                if (expr_has_side_effects(e->as.func.args[i])) return true;
+            }
+            return false;
+        default:
+            return true;  // state reads count too: they depend on earlier samples
     }
+}
 
-    if (isalpha((unsigned char)c) || c == '_') {
-        size_t start = lx->pos;
-        while (isalnum((unsigned char)lx->src[lx->pos]) || lx->src[lx->pos] == '_') lx->pos++;
-        size_t len = lx->pos - start;
-        if (len >= sizeof(lx->tok.ident)) len = sizeof(lx->tok.ident) - 1;
-        memcpy(lx->tok.ident, lx->src + start, len);
-        lx->tok.ident[len] = '\0';
-        lx->tok.type = TOK_IDENT;
-        return;
+// True if the block evaluator can run e: no persistent state, and assignments
+// only as whole statements, so every sample of a block sees them in program order.
+static bool expr_block_ok(const Expr *e) {
+    switch (e->type) {
+        case EX_SEQ:
+            return expr_block_ok(e->as.seq.first) && expr_block_ok(e->as.seq.rest);
+        case EX_ASSIGN:
+            return e->as.assign.target->type == EX_LOCAL && !expr_has_side_effects(e->as.assign.value);
+        default:
+            return !expr_has_side_effects(e);
     }
+}
 
-    if (lexer_starts_with(lx, ">>>")) {
-        lx->tok.type = TOK_USHR;
-        lx->pos += 3;
-        return;
+// Frame sizes a program needs: local slots and doubles of persistent state.
+static void expr_frame_size(const Expr *e, uint32_t *locals, uint32_t *state) {
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+            break;
+        case EX_UNARY:
+            expr_frame_size(e->as.unary.a, locals, state);
+            break;
+        case EX_BINARY:
+            expr_frame_size(e->as.binary.a, locals, state);
+            expr_frame_size(e->as.binary.b, locals, state);
+            break;
+        case EX_TERNARY:
+            expr_frame_size(e->as.ternary.cond, locals, state);
+            expr_frame_size(e->as.ternary.yes, locals, state);
+            expr_frame_size(e->as.ternary.no, locals, state);
+            break;
+        case EX_FUNC:
+            for (int i = 0; i < e->as.func.argc; ++i) expr_frame_size(e->as.func.args[i], locals, state);
+            break;
+        case EX_LOCAL:
+            if (e->as.ref.slot + 1 > *locals) *locals = e->as.ref.slot + 1;
+            break;
+        case EX_STATE:
+            if (e->as.ref.slot + 1 > *state) *state = e->as.ref.slot + 1;
+            break;
+        case EX_INDEX:
+            if (e->as.ref.slot + e->as.ref.length > *state) *state = e->as.ref.slot + e->as.ref.length;
+            expr_frame_size(e->as.ref.index, locals, state);
+            break;
+        case EX_ASSIGN:
+            expr_frame_size(e->as.assign.target, locals, state);
+            expr_frame_size(e->as.assign.value, locals, state);
+            break;
+        case EX_SEQ:
+            expr_frame_size(e->as.seq.first, locals, state);
+            expr_frame_size(e->as.seq.rest, locals, state);
+            break;
     }
-    if (lexer_starts_with(lx, "<<")) {
+}
+
+static void fn_eval_block(FnId fn, double *const *args, double *out, int n) {
+    switch (fn) {
+        case FN_SIN:
+            if (g_math_mode == MATH_FAST) {
+                fast_sin_block(args[0], out, n);
+            } else {
+                for (int i = 0; i < n; ++i) out[i] = sin(args[0][i]);
+            }
+            return;
+        case FN_COS:
+            if (g_math_mode == MATH_FAST) {
+                fast_cos_block(args[0], out, n);
+            } else {
+                for (int i = 0; i < n; ++i) out[i] = cos(args[0][i]);
+            }
+            return;
+        case FN_TAN:
+            if (g_math_mode == MATH_FAST) {
+                fast_tan_block(args[0], out, n);
+            } else {
+                for (int i = 0; i < n; ++i) out[i] = tan(args[0][i]);
+            }
+            return;
+        case FN_ABS:
+            for (int i = 0; i < n; ++i) out[i] = fabs(args[0][i]);
+            return;
+        case FN_SQRT:
+            for (int i = 0; i < n; ++i) out[i] = sqrt(fabs(args[0][i]));
+            return;
+        case FN_FLOOR:
+            for (int i = 0; i < n; ++i) out[i] = floor(args[0][i]);
+            return;
+        case FN_CEIL:
+            for (int i = 0; i < n; ++i) out[i] = ceil(args[0][i]);
+            return;
+        case FN_POW:
+            for (int i = 0; i < n; ++i) out[i] = pow(args[0][i], args[1][i]);
+            return;
+        case FN_MIN:
+            for (int i = 0; i < n; ++i) out[i] = fmin(args[0][i], args[1][i]);
+            return;
+        case FN_MAX:
+            for (int i = 0; i < n; ++i) out[i] = fmax(args[0][i], args[1][i]);
+            return;
+        case FN_CLAMP:
+            for (int i = 0; i < n; ++i) out[i] = fmax(args[1][i], fmin(args[2][i], args[0][i]));
+            return;
+        case FN_RANDOM:
+        case FN_NOISE:  // need t and the seed: expr_eval_block runs them
+        case FN_NONE:
+            break;
+    }
+    for (int i = 0; i < n; ++i) out[i] = 0.0;
+}
+
+// Elementwise binary operator over a block; out may alias a.
+static void binary_block(Op op, const double *a, const double *b, double *out, int n) {
+    switch (op) {
+        case OP_ADD:
+            for (int i = 0; i < n; ++i) out[i] = a[i] + b[i];
+            return;
+        case OP_SUB:
+            for (int i = 0; i < n; ++i) out[i] = a[i] - b[i];
+            return;
+        case OP_MUL:
+            for (int i = 0; i < n; ++i) out[i] = a[i] * b[i];
+            return;
+        case OP_DIV:
+            for (int i = 0; i < n; ++i) out[i] = fabs(b[i]) < 1e-12 ? 0.0 : a[i] / b[i];
+            return;
+        case OP_MOD:
+            for (int i = 0; i < n; ++i) {
+                int32_t ib = block_i32(b[i]);
+                out[i] = ib == 0 ? 0.0 : (double)(block_i32(a[i]) % ib);
+            }
+            return;
+        case OP_LT:
+            for (int i = 0; i < n; ++i) out[i] = a[i] < b[i] ? 1.0 : 0.0;
+            return;
+        case OP_GT:
+            for (int i = 0; i < n; ++i) out[i] = a[i] > b[i] ? 1.0 : 0.0;
+            return;
+        case OP_LE:
+            for (int i = 0; i < n; ++i) out[i] = a[i] <= b[i] ? 1.0 : 0.0;
+            return;
+        case OP_GE:
+            for (int i = 0; i < n; ++i) out[i] = a[i] >= b[i] ? 1.0 : 0.0;
+            return;
+        case OP_EQ:
+            for (int i = 0; i < n; ++i) out[i] = fabs(a[i] - b[i]) < 1e-12 ? 1.0 : 0.0;
+            return;
+        case OP_NE:
+            for (int i = 0; i < n; ++i) out[i] = fabs(a[i] - b[i]) >= 1e-12 ? 1.0 : 0.0;
+            return;
+        case OP_LAND:
+            for (int i = 0; i < n; ++i) out[i] = (a[i] != 0.0 && b[i] != 0.0) ? 1.0 : 0.0;
+            return;
+        case OP_LOR:
+            for (int i = 0; i < n; ++i) out[i] = (a[i] != 0.0 || b[i] != 0.0) ? 1.0 : 0.0;
+            return;
+        case OP_BAND:
+            for (int i = 0; i < n; ++i) out[i] = (double)(block_i32(a[i]) & block_i32(b[i]));
+            return;
+        case OP_BOR:
+            for (int i = 0; i < n; ++i) out[i] = (double)(block_i32(a[i]) | block_i32(b[i]));
+            return;
+        case OP_BXOR:
+            for (int i = 0; i < n; ++i) out[i] = (double)(block_i32(a[i]) ^ block_i32(b[i]));
+            return;
+        case OP_SHL:
+            for (int i = 0; i < n; ++i) out[i] = (double)(block_i32(a[i]) << (block_i32(b[i]) & 31));
+            return;
+        case OP_SHR:
+            for (int i = 0; i < n; ++i) out[i] = (double)(block_i32(a[i]) >> (block_i32(b[i]) & 31));
+            return;
+        case OP_USHR:
+            for (int i = 0; i < n; ++i) {
+                out[i] = (double)((uint32_t)block_i32(a[i]) >> (block_i32(b[i]) & 31));
+            }
+            return;
+        default:
+            for (int i = 0; i < n; ++i) out[i] = 0.0;
+            return;
+    }
+}
+
+// op with a constant right operand k, in place: the same results as
+// binary_block with a row of k, converting k to an integer once.
+static bool binary_block_has_const(Op op) {
+    switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_USHR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void binary_block_const(Op op, double *x, double k, int n) {
+    const int32_t ik = block_i32(k);
+    const int s = ik & 31;
+    switch (op) {
+        case OP_ADD:
+            for (int i = 0; i < n; ++i) x[i] = x[i] + k;
+            return;
+        case OP_SUB:
+            for (int i = 0; i < n; ++i) x[i] = x[i] - k;
+            return;
+        case OP_MUL:
+            for (int i = 0; i < n; ++i) x[i] = x[i] * k;
+            return;
+        case OP_DIV:
+            for (int i = 0; i < n; ++i) x[i] = fabs(k) < 1e-12 ? 0.0 : x[i] / k;
+            return;
+        case OP_MOD:
+            for (int i = 0; i < n; ++i) x[i] = ik == 0 ? 0.0 : (double)(block_i32(x[i]) % ik);
+            return;
+        case OP_BAND:
+            for (int i = 0; i < n; ++i) x[i] = (double)(block_i32(x[i]) & ik);
+            return;
+        case OP_BOR:
+            for (int i = 0; i < n; ++i) x[i] = (double)(block_i32(x[i]) | ik);
+            return;
+        case OP_BXOR:
+            for (int i = 0; i < n; ++i) x[i] = (double)(block_i32(x[i]) ^ ik);
+            return;
+        case OP_SHL:
+            for (int i = 0; i < n; ++i) x[i] = (double)(block_i32(x[i]) << s);
+            return;
+        case OP_SHR:
+            for (int i = 0; i < n; ++i) x[i] = (double)(block_i32(x[i]) >> s);
+            return;
+        case OP_USHR:
+            for (int i = 0; i < n; ++i) x[i] = (double)((uint32_t)block_i32(x[i]) >> s);
+            return;
+        default:
+            return;
+    }
+}
+
+// random() and noise(): functions of t or x and the seed, not of their arguments alone.
+static bool fn_is_random(const Expr *e) {
+    FnId fn = fn_lookup(e->as.func.name, e->as.func.argc);
+    return fn == FN_RANDOM || fn == FN_NOISE;
+}
+
+static bool op_commutes(Op op) {
+    return op == OP_ADD || op == OP_MUL || op == OP_BAND || op == OP_BOR || op == OP_BXOR;
+}
+
+// Evaluates e for t[0..n) into out[0..n), n <= EVAL_BLOCK, matching expr_eval
+// sample for sample. scratch must hold expr_block_slots(e) * EVAL_BLOCK doubles.
+// &&, || and ?: evaluate both sides and select per sample, which is safe because
+// only programs accepted by expr_block_ok get here: their sole side effects are
+// statement-level assignments to locals, which run for the whole block in order.
+// ctx->locals holds one EVAL_BLOCK row per local.
+static void expr_eval_block(const Expr *e, const EvalContext *ctx, const double *t, double *out, int n,
+                            double *scratch) {
+    switch (e->type) {
+        case EX_NUM:
+            for (int i = 0; i < n; ++i) out[i] = e->as.num;
+            return;
+        case EX_VAR:
+            if (e->as.var == VAR_T) {
+                memcpy(out, t, (size_t)n * sizeof(double));
+            } else if (ctx->lane_macros) {
+                memcpy(out, ctx->lane_macros + (size_t)(e->as.var - VAR_A) * EVAL_BLOCK, (size_t)n * sizeof(double));
+            } else {
+                double v = eval_var(ctx, e->as.var);
+                for (int i = 0; i < n; ++i) out[i] = v;
+            }
+            return;
+        case EX_UNARY:
+            expr_eval_block(e->as.unary.a, ctx, t, out, n, scratch);
+            switch (e->as.unary.op) {
+                case OP_NEG:
+                    for (int i = 0; i < n; ++i) out[i] = -out[i];
+                    return;
+                case OP_BNOT:
+                    for (int i = 0; i < n; ++i) out[i] = (double)(~block_i32(out[i]));
+                    return;
+                case OP_LNOT:
+                    for (int i = 0; i < n; ++i) out[i] = out[i] == 0.0 ? 1.0 : 0.0;
+                    return;
+                default:
+                    for (int i = 0; i < n; ++i) out[i] = 0.0;
+                    return;
+            }
+        case EX_BINARY: {
+            // A constant operand (a literal, or a macro the program was
+            // specialized for) needs no row of its own.
+            const Expr *x = e->as.binary.a;
+            const Expr *k = e->as.binary.b;
+            if (x->type == EX_NUM && k->type != EX_NUM && op_commutes(e->as.binary.op)) {
+                x = e->as.binary.b;
+                k = e->as.binary.a;
+            }
+            if (k->type == EX_NUM && binary_block_has_const(e->as.binary.op)) {
+                expr_eval_block(x, ctx, t, out, n, scratch);
+                binary_block_const(e->as.binary.op, out, k->as.num, n);
+                return;
+            }
+            expr_eval_block(e->as.binary.a, ctx, t, out, n, scratch);
+            expr_eval_block(e->as.binary.b, ctx, t, scratch, n, scratch + EVAL_BLOCK);
+            binary_block(e->as.binary.op, out, scratch, out, n);
+            return;
+        }
+        case EX_TERNARY: {
+            double *yes = scratch;
+            double *no = scratch + EVAL_BLOCK;
+            expr_eval_block(e->as.ternary.cond, ctx, t, out, n, scratch);
+            expr_eval_block(e->as.ternary.yes, ctx, t, yes, n, scratch + EVAL_BLOCK);
+            expr_eval_block(e->as.ternary.no, ctx, t, no, n, scratch + 2 * EVAL_BLOCK);
+            for (int i = 0; i < n; ++i) out[i] = out[i] != 0.0 ? yes[i] : no[i];
+            return;
+        }
+        case EX_FUNC: {
+            int argc = e->as.func.argc;
+            if (argc > 8) argc = 8;
+            FnId fn = fn_lookup(e->as.func.name, argc);
+            if (fn == FN_RANDOM) {
+                const uint64_t key = rng_site_key(ctx->seed, e->as.func.site);
+                for (int i = 0; i < n; ++i) out[i] = rng_unit(key, rng_counter(t[i]));
+                return;
+            }
+            double *args[8];
+            for (int k = 0; k < argc; ++k) {
+                args[k] = scratch + (size_t)k * EVAL_BLOCK;
+                expr_eval_block(e->as.func.args[k], ctx, t, args[k], n, scratch + (size_t)(k + 1) * EVAL_BLOCK);
+            }
+            if (fn == FN_NOISE) {
+                const uint64_t key = rng_noise_key(ctx->seed);
+                for (int i = 0; i < n; ++i) out[i] = rng_noise(key, args[0][i]);
+                return;
+            }
+            fn_eval_block(fn, args, out, n);
+            return;
+        }
+        case EX_LOCAL:
+            memcpy(out, ctx->locals + (size_t)e->as.ref.slot * EVAL_BLOCK, (size_t)n * sizeof(double));
+            return;
+        case EX_ASSIGN: {
+            // Only statement-level assignments to locals get here (expr_block_ok).
+            double *row = ctx->locals + (size_t)e->as.assign.target->as.ref.slot * EVAL_BLOCK;
+            expr_eval_block(e->as.assign.value, ctx, t, out, n, scratch);
+            if (e->as.assign.op != OP_ASSIGN) binary_block(e->as.assign.op, row, out, out, n);
+            memcpy(row, out, (size_t)n * sizeof(double));
+            return;
+        }
+        case EX_SEQ:
+            expr_eval_block(e->as.seq.first, ctx, t, out, n, scratch);
+            expr_eval_block(e->as.seq.rest, ctx, t, out, n, scratch);
+            return;
+        case EX_STATE:
+        case EX_INDEX:
+            break;
+    }
+    for (int i = 0; i < n; ++i) out[i] = 0.0;
+}
+
+static void expr_frame_free(ExprFrame *f) {
+    free(f->scratch);
+    free(f->vars);
+    f->scratch = NULL;
+    f->vars = NULL;
+}
+
+// On failure both buffers are NULL but the sizes are still filled in.
+static bool expr_frame_init(ExprFrame *f, const Expr *e) {
+    memset(f, 0, sizeof(*f));
+    expr_frame_size(e, &f->locals, &f->state);
+    f->block = expr_block_ok(e);
+    size_t rows = 2 + (f->block ? (size_t)f->locals + (size_t)expr_block_slots(e) : 0);
+    f->scratch = (double *)malloc(rows * EVAL_BLOCK * sizeof(double));
+    f->vars = (double *)calloc((size_t)f->locals + f->state + 1, sizeof(double));
+    if (f->scratch && f->vars) {
+        // Touch every page here, on the installing thread, so the first buffer
+        // that uses the frame does not take the page faults.
+        memset(f->scratch, 0, rows * EVAL_BLOCK * sizeof(double));
+        return true;
+    }
+    expr_frame_free(f);
+    return false;
+}
+
+// Evaluates e at t[0..n) (n <= EVAL_BLOCK) into out, with the block evaluator
+// when the program allows it and sample by sample otherwise. Locals start at 0
+// for every sample; the persistent state carries over between calls.
+static void expr_eval_frame(const Expr *e, ExprFrame *f, EvalContext *ctx, const double *t, double *out, int n) {
+    if (f->block) {
+        ctx->locals = f->scratch + 2 * EVAL_BLOCK;
+        memset(ctx->locals, 0, (size_t)f->locals * EVAL_BLOCK * sizeof(double));
+        expr_eval_block(e, ctx, t, out, n, ctx->locals + (size_t)f->locals * EVAL_BLOCK);
+        return;
+    }
+    ctx->locals = f->vars;
+    ctx->state = f->vars + f->locals;
+    for (int i = 0; i < n; ++i) {
+        memset(ctx->locals, 0, (size_t)f->locals * sizeof(double));
+        ctx->t = t[i];
+        out[i] = expr_eval(e, ctx);
+    }
+}
+
+// Partial evaluation for fixed macros: a copy of e with a..mask replaced by their
+// values in ctx and every operator or function whose operands all became
+// constants folded. Folding uses expr_eval, so each constant is exactly what the
+// generic program computes. A ternary with a constant condition keeps only the
+// branch it takes. random() and noise() depend on the seed as well, so they are
+// never folded. NULL when out of memory.
+static Expr *expr_specialize(const Expr *e, const EvalContext *ctx) {
+    if (e->type == EX_TERNARY) {
+        Expr *cond = expr_specialize(e->as.ternary.cond, ctx);
+        if (cond && cond->type == EX_NUM) {
+            const Expr *taken = cond->as.num != 0.0 ? e->as.ternary.yes : e->as.ternary.no;
+            expr_free(cond);
+            return expr_specialize(taken, ctx);
+        }
+        Expr *c = expr_new(EX_TERNARY);
+        if (!cond || !c) {
+            expr_free(cond);
+            free(c);
+            return NULL;
+        }
+        c->as.ternary.cond = cond;
+        c->as.ternary.yes = expr_specialize(e->as.ternary.yes, ctx);
+        c->as.ternary.no = expr_specialize(e->as.ternary.no, ctx);
+        if (!c->as.ternary.yes || !c->as.ternary.no) {
+            expr_free(c);
+            return NULL;
+        }
+        return c;
+    }
+    Expr *c = expr_new(e->type);
+    if (!c) return NULL;
+    bool ok = true;
+    bool fold = false;
+    switch (e->type) {
+        case EX_NUM:
+            c->as.num = e->as.num;
+            break;
+        case EX_VAR:
+            if (e->as.var == VAR_T) {
+                c->as.var = VAR_T;
+            } else {
+                c->type = EX_NUM;
+                c->as.num = eval_var(ctx, e->as.var);
+            }
+            break;
+        case EX_UNARY:
+            c->as.unary.op = e->as.unary.op;
+            c->as.unary.a = expr_specialize(e->as.unary.a, ctx);
+            ok = c->as.unary.a != NULL;
+            fold = ok && c->as.unary.a->type == EX_NUM;
+            break;
+        case EX_BINARY:
+            c->as.binary.op = e->as.binary.op;
+            c->as.binary.a = expr_specialize(e->as.binary.a, ctx);
+            c->as.binary.b = expr_specialize(e->as.binary.b, ctx);
+            ok = c->as.binary.a && c->as.binary.b;
+            fold = ok && c->as.binary.a->type == EX_NUM && c->as.binary.b->type == EX_NUM;
+            break;
+        case EX_FUNC:
+            memcpy(c->as.func.name, e->as.func.name, sizeof(c->as.func.name));
+            c->as.func.site = e->as.func.site;
+            c->as.func.args = (Expr **)calloc((size_t)e->as.func.argc + 1, sizeof(Expr *));
+            if (!c->as.func.args) {
+                ok = false;
+                break;
+            }
+            c->as.func.argc = e->as.func.argc;
+            fold = !fn_is_random(e);
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                c->as.func.args[i] = expr_specialize(e->as.func.args[i], ctx);
+                if (!c->as.func.args[i]) {
+                    ok = false;
+                    break;
+                }
+                if (c->as.func.args[i]->type != EX_NUM) fold = false;
+            }
+            break;
+        case EX_LOCAL:
+        case EX_STATE:
+            c->as.ref = e->as.ref;
+            break;
+        case EX_INDEX:
+            c->as.ref = e->as.ref;
+            c->as.ref.index = expr_specialize(e->as.ref.index, ctx);
+            ok = c->as.ref.index != NULL;
+            break;
+        case EX_ASSIGN:
+            c->as.assign.op = e->as.assign.op;
+            c->as.assign.target = expr_specialize(e->as.assign.target, ctx);
+            c->as.assign.value = expr_specialize(e->as.assign.value, ctx);
+            ok = c->as.assign.target && c->as.assign.value;
+            break;
+        case EX_SEQ:
+            c->as.seq.first = expr_specialize(e->as.seq.first, ctx);
+            c->as.seq.rest = expr_specialize(e->as.seq.rest, ctx);
+            ok = c->as.seq.first && c->as.seq.rest;
+            break;
+        case EX_TERNARY:
+            break;
+    }
+    if (!ok) {
+        expr_free(c);
+        return NULL;
+    }
+    if (!fold) return c;
+    Expr *k = expr_new(EX_NUM);
+    if (k) k->as.num = expr_eval(c, ctx);
+    expr_free(c);
+    return k;
+}
+
+static void lexer_skip_ws(Lexer *lx) {
+    while (isspace((unsigned char)lx->src[lx->pos])) lx->pos++;
+}
+
+static bool lexer_starts_with(Lexer *lx, const char *s) {
+    size_t i = 0;
+    while (s[i]) {
+        if (lx->src[lx->pos + i] != s[i]) return false;
+        i++;
+    }
+    return true;
+}
+
+static void lexer_next(Lexer *lx) {
+    lexer_skip_ws(lx);
+    lx->tok.type = TOK_EOF;
+    lx->tok.number = 0;
+    lx->tok.ident[0] = '\0';
+
+    char c = lx->src[lx->pos];
+    if (!c) {
+        lx->tok.type = TOK_EOF;
+        return;
+    }
+
+    if (isdigit((unsigned char)c)) {
+        char *end = NULL;
+        lx->tok.number = strtod(&lx->src[lx->pos], &end);
+        lx->pos = (size_t)(end - lx->src);
+        lx->tok.type = TOK_NUM;
+        return;
+    }
+
+    if (isalpha((unsigned char)c) || c == '_') {
+        size_t start = lx->pos;
+        while (isalnum((unsigned char)lx->src[lx->pos]) || lx->src[lx->pos] == '_') lx->pos++;
+        size_t len = lx->pos - start;
+        if (len >= sizeof(lx->tok.ident)) len = sizeof(lx->tok.ident) - 1;
+        memcpy(lx->tok.ident, lx->src + start, len);
+        lx->tok.ident[len] = '\0';
+        lx->tok.type = TOK_IDENT;
+        return;
+    }
+
+    static const struct {
+        const char *text;
+        TokenType type;
+    } kAssignOps[] = {{">>>=", TOK_USHR_ASSIGN}, {"<<=", TOK_SHL_ASSIGN}, {">>=", TOK_SHR_ASSIGN},
+                      {"+=", TOK_ADD_ASSIGN},    {"-=", TOK_SUB_ASSIGN},  {"*=", TOK_MUL_ASSIGN},
+                      {"/=", TOK_DIV_ASSIGN},    {"%=", TOK_MOD_ASSIGN},  {"&=", TOK_BAND_ASSIGN},
+                      {"|=", TOK_BOR_ASSIGN},    {"^=", TOK_BXOR_ASSIGN}};
+    for (size_t i = 0; i < sizeof(kAssignOps) / sizeof(kAssignOps[0]); ++i) {
+        if (lexer_starts_with(lx, kAssignOps[i].text)) {
+            lx->tok.type = kAssignOps[i].type;
+            lx->pos += strlen(kAssignOps[i].text);
+            return;
+        }
+    }
+    if (lexer_starts_with(lx, ">>>")) {
+        lx->tok.type = TOK_USHR;
+        lx->pos += 3;
+        return;
+    }
+    if (lexer_starts_with(lx, "<<")) {
         lx->tok.type = TOK_SHL;
         lx->pos += 2;
         return;
@@ -435,6 +1782,16 @@ static void lexer_next(Lexer *lx) {
         lx->pos += 2;
         return;
     }
+    if (lexer_starts_with(lx, "===")) {
+        lx->tok.type = TOK_EQ;
+        lx->pos += 3;
+        return;
+    }
+    if (lexer_starts_with(lx, "!==")) {
+        lx->tok.type = TOK_NE;
+        lx->pos += 3;
+        return;
+    }
     if (lexer_starts_with(lx, "==")) {
         lx->tok.type = TOK_EQ;
         lx->pos += 2;
@@ -509,6 +1866,21 @@ static void lexer_next(Lexer *lx) {
         case '^':
             lx->tok.type = TOK_BXOR;
             break;
+        case ';':
+            lx->tok.type = TOK_SEMI;
+            break;
+        case '[':
+            lx->tok.type = TOK_LBRACKET;
+            break;
+        case ']':
+            lx->tok.type = TOK_RBRACKET;
+            break;
+        case '.':
+            lx->tok.type = TOK_DOT;
+            break;
+        case '=':
+            lx->tok.type = TOK_ASSIGN;
+            break;
         default:
             snprintf(lx->err, sizeof(lx->err), "Unexpected character '%c'", c);
             lx->tok.type = TOK_EOF;
@@ -558,6 +1930,210 @@ static bool parse_var_id(const char *ident, VarId *out) {
     return false;
 }
 
+static bool tok_is_word(const Token *tok, const char *word) {
+    return tok->type == TOK_IDENT && !strcmp(tok->ident, word);
+}
+
+static bool is_decl_keyword(const Token *tok) {
+    return tok_is_word(tok, "let") || tok_is_word(tok, "var") || tok_is_word(tok, "const");
+}
+
+static bool is_reserved_name(const char *name) {
+    VarId id;
+    if (parse_var_id(name, &id)) return true;
+    for (int i = 0; i < FUNCTION_COUNT; ++i) {
+        if (!strcmp(kFunctions[i].name, name)) return true;
+    }
+    static const char *kKeywords[] = {"let", "var", "const", "return", "new"};
+    for (size_t i = 0; i < sizeof(kKeywords) / sizeof(kKeywords[0]); ++i) {
+        if (!strcmp(kKeywords[i], name)) return true;
+    }
+    return false;
+}
+
+static bool assign_token_op(TokenType t, Op *op) {
+    switch (t) {
+        case TOK_ASSIGN:
+            *op = OP_ASSIGN;
+            return true;
+        case TOK_ADD_ASSIGN:
+            *op = OP_ADD;
+            return true;
+        case TOK_SUB_ASSIGN:
+            *op = OP_SUB;
+            return true;
+        case TOK_MUL_ASSIGN:
+            *op = OP_MUL;
+            return true;
+        case TOK_DIV_ASSIGN:
+            *op = OP_DIV;
+            return true;
+        case TOK_MOD_ASSIGN:
+            *op = OP_MOD;
+            return true;
+        case TOK_BAND_ASSIGN:
+            *op = OP_BAND;
+            return true;
+        case TOK_BOR_ASSIGN:
+            *op = OP_BOR;
+            return true;
+        case TOK_BXOR_ASSIGN:
+            *op = OP_BXOR;
+            return true;
+        case TOK_SHL_ASSIGN:
+            *op = OP_SHL;
+            return true;
+        case TOK_SHR_ASSIGN:
+            *op = OP_SHR;
+            return true;
+        case TOK_USHR_ASSIGN:
+            *op = OP_USHR;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool lex_expect(Lexer *lx, TokenType t) {
+    if (lx->tok.type != t) return false;
+    lexer_next(lx);
+    return true;
+}
+
+// Consumes `new Array(n)` or `new Float64Array(n)`, optionally followed by
+// `.fill(0)`, starting at the `new` token. Arrays are always zero-filled.
+static bool lex_array_ctor(Lexer *lx, uint32_t *length) {
+    lexer_next(lx);
+    if (!tok_is_word(&lx->tok, "Array") && !tok_is_word(&lx->tok, "Float64Array")) {
+        snprintf(lx->err, sizeof(lx->err), "Expected Array or Float64Array after 'new'");
+        return false;
+    }
+    lexer_next(lx);
+    bool ok = lex_expect(lx, TOK_LPAREN);
+    double n = lx->tok.number;
+    if (ok && (lx->tok.type != TOK_NUM || n != floor(n) || n < 1 || n > PROGRAM_MAX_STATE)) {
+        snprintf(lx->err, sizeof(lx->err), "Array length must be an integer from 1 to %u", PROGRAM_MAX_STATE);
+        return false;
+    }
+    *length = (uint32_t)n;
+    ok = ok && lex_expect(lx, TOK_NUM) && lex_expect(lx, TOK_RPAREN);
+    if (ok && lx->tok.type == TOK_DOT) {
+        lexer_next(lx);
+        ok = tok_is_word(&lx->tok, "fill");
+        if (ok) lexer_next(lx);
+        ok = ok && lex_expect(lx, TOK_LPAREN);
+        if (ok && (lx->tok.type != TOK_NUM || lx->tok.number != 0.0)) {
+            snprintf(lx->err, sizeof(lx->err), "Arrays can only be filled with 0");
+            return false;
+        }
+        ok = ok && lex_expect(lx, TOK_NUM) && lex_expect(lx, TOK_RPAREN);
+    }
+    if (!ok) snprintf(lx->err, sizeof(lx->err), "Expected new Array(<length>)");
+    return ok;
+}
+
+static ProgramName *program_find(Parser *p, const char *name) {
+    for (int i = 0; i < p->name_count; ++i) {
+        if (!strcmp(p->names[i].name, name)) return &p->names[i];
+    }
+    return NULL;
+}
+
+static bool program_declare(Parser *p, Lexer *lx, const char *name, NameKind kind, uint32_t length) {
+    if (is_reserved_name(name)) {
+        snprintf(lx->err, sizeof(lx->err), "Cannot use '%s' as a variable name", name);
+        return false;
+    }
+    ProgramName *pn = program_find(p, name);
+    if (!pn) {
+        if (p->name_count == PROGRAM_MAX_NAMES) {
+            snprintf(lx->err, sizeof(lx->err), "Too many variables (max %d)", PROGRAM_MAX_NAMES);
+            return false;
+        }
+        pn = &p->names[p->name_count++];
+        snprintf(pn->name, sizeof(pn->name), "%s", name);
+        pn->kind = kind;
+        pn->length = length;
+        return true;
+    }
+    if (pn->kind == NAME_ARRAY || kind == NAME_ARRAY) {
+        if (pn->kind == kind && pn->length == length) return true;
+        snprintf(lx->err, sizeof(lx->err), "'%s' is an array; assign to its elements", name);
+        return false;
+    }
+    if (kind == NAME_LOCAL) pn->kind = NAME_LOCAL;  // a declaration makes the name local everywhere
+    return true;
+}
+
+// Finds every name the program assigns before parsing it, so a persistent
+// variable can be read before the statement that writes it (`out = fb; fb = t`).
+// Names declared with let/var/const are per-sample locals, `new Array(n)` makes a
+// persistent array, and any other assigned name is a persistent scalar, like an
+// undeclared global in JavaScript. Slots are then laid out: locals first, the
+// state block holds the scalars followed by the arrays.
+static bool program_scan_names(Parser *p, const char *src) {
+    Lexer lx;
+    memset(&lx, 0, sizeof(lx));
+    lx.src = src;
+    lexer_next(&lx);
+    bool in_decl = false;
+    bool prev_decl = false;
+    TokenType prev = TOK_EOF;
+    int depth = 0;
+    while (lx.tok.type != TOK_EOF && !lx.err[0]) {
+        Token tok = lx.tok;
+        if (tok.type == TOK_LPAREN || tok.type == TOK_LBRACKET) depth++;
+        if (tok.type == TOK_RPAREN || tok.type == TOK_RBRACKET) depth--;
+        if (tok.type == TOK_SEMI && depth == 0) in_decl = false;
+        if (is_decl_keyword(&tok)) {
+            in_decl = true;
+        } else if (tok.type == TOK_IDENT) {
+            bool declared = in_decl && depth == 0 && (prev_decl || prev == TOK_COMMA);
+            Lexer ahead = lx;
+            lexer_next(&ahead);
+            Op op;
+            if (declared || assign_token_op(ahead.tok.type, &op)) {
+                NameKind kind = declared ? NAME_LOCAL : NAME_STATE;
+                uint32_t length = 0;
+                if (ahead.tok.type == TOK_ASSIGN) {
+                    lexer_next(&ahead);
+                    if (tok_is_word(&ahead.tok, "new")) {
+                        if (!lex_array_ctor(&ahead, &length)) {
+                            snprintf(p->lx.err, sizeof(p->lx.err), "%s", ahead.err);
+                            return false;
+                        }
+                        kind = NAME_ARRAY;
+                    }
+                }
+                if (!program_declare(p, &p->lx, tok.ident, kind, length)) return false;
+            }
+        }
+        prev_decl = is_decl_keyword(&tok);
+        prev = tok.type;
+        lexer_next(&lx);
+    }
+    if (lx.err[0]) {
+        snprintf(p->lx.err, sizeof(p->lx.err), "%s", lx.err);
+        return false;
+    }
+    uint32_t locals = 0;
+    uint32_t state = 0;
+    for (int i = 0; i < p->name_count; ++i) {
+        if (p->names[i].kind == NAME_LOCAL) p->names[i].slot = locals++;
+        if (p->names[i].kind == NAME_STATE) p->names[i].slot = state++;
+    }
+    for (int i = 0; i < p->name_count; ++i) {
+        if (p->names[i].kind != NAME_ARRAY) continue;
+        if (p->names[i].length > PROGRAM_MAX_STATE - state) {
+            snprintf(p->lx.err, sizeof(p->lx.err), "Arrays too large (max %u values in total)", PROGRAM_MAX_STATE);
+            return false;
+        }
+        p->names[i].slot = state;
+        state += p->names[i].length;
+    }
+    return true;
+}
+
 static Expr *parse_primary(Parser *p) {
     if (p->lx.tok.type == TOK_NUM) {
         Expr *e = expr_new(EX_NUM);
@@ -604,6 +2180,7 @@ static Expr *parse_primary(Parser *p) {
                     }
                 }
             }
+            if (!e->as.func.argc && !strcmp(e->as.func.name, "random")) e->as.func.site = p->random_sites++;
             return e;
         }
 
@@ -615,6 +2192,45 @@ static Expr *parse_primary(Parser *p) {
             return e;
         }
 
+        const ProgramName *pn = program_find(p, ident);
+        if (pn && pn->kind == NAME_ARRAY) {
+            if (consume(p, TOK_ASSIGN)) {
+                // `buf = new Array(n)`: the array already exists, this is a no-op.
+                uint32_t length;
+                if (!tok_is_word(&p->lx.tok, "new") || !lex_array_ctor(&p->lx, &length)) {
+                    if (!p->lx.err[0]) snprintf(p->lx.err, sizeof(p->lx.err), "'%s' is an array", ident);
+                    return NULL;
+                }
+                return expr_new(EX_NUM);
+            }
+            if (!consume(p, TOK_LBRACKET)) {
+                snprintf(p->lx.err, sizeof(p->lx.err), "Array '%s' needs an index", ident);
+                return NULL;
+            }
+            Expr *index = parse_expr(p);
+            if (!index) return NULL;
+            if (!consume(p, TOK_RBRACKET)) {
+                snprintf(p->lx.err, sizeof(p->lx.err), "Expected ']'");
+                expr_free(index);
+                return NULL;
+            }
+            Expr *e = expr_new(EX_INDEX);
+            if (!e) {
+                expr_free(index);
+                return NULL;
+            }
+            e->as.ref.slot = pn->slot;
+            e->as.ref.length = pn->length;
+            e->as.ref.index = index;
+            return e;
+        }
+        if (pn) {
+            Expr *e = expr_new(pn->kind == NAME_LOCAL ? EX_LOCAL : EX_STATE);
+            if (!e) return NULL;
+            e->as.ref.slot = pn->slot;
+            return e;
+        }
+
         snprintf(p->lx.err, sizeof(p->lx.err), "Unknown identifier '%s'", ident);
         return NULL;
     }
@@ -958,41 +2574,217 @@ static Expr *parse_cond(Parser *p) {
     return e;
 }
 
-static Expr *parse_expr(Parser *p) { return parse_cond(p); }
-
-static char *str_trim_copy(const char *s) {
-    while (*s && isspace((unsigned char)*s)) s++;
-    size_t len = strlen(s);
-    while (len > 0 && isspace((unsigned char)s[len - 1])) len--;
-    char *out = (char *)malloc(len + 1);
-    if (!out) return NULL;
-    memcpy(out, s, len);
-    out[len] = '\0';
-    return out;
-}
-
-static char *extract_js_expr(const char *js) {
-    const char *r = strstr(js, "return");
-    if (r) {
-        r += 6;
-        while (*r && isspace((unsigned char)*r)) r++;
-        const char *end = strchr(r, ';');
-        if (!end) end = js + strlen(js);
-        size_t len = (size_t)(end - r);
-        char *tmp = (char *)malloc(len + 1);
-        if (!tmp) return NULL;
-        memcpy(tmp, r, len);
-        tmp[len] = '\0';
-        char *trimmed = str_trim_copy(tmp);
-        free(tmp);
-        return trimmed;
+static Expr *parse_assign(Parser *p) {
+    Expr *target = parse_cond(p);
+    if (!target) return NULL;
+    Op op;
+    if (!assign_token_op(p->lx.tok.type, &op)) return target;
+    if (target->type != EX_LOCAL && target->type != EX_STATE && target->type != EX_INDEX) {
+        snprintf(p->lx.err, sizeof(p->lx.err), "Invalid assignment target");
+        expr_free(target);
+        return NULL;
     }
-    return str_trim_copy(js);
-}
-
-static char *transpile_js_to_c(const char *js) {
-    char *expr = extract_js_expr(js);
-    if (!expr) return NULL;
+    lexer_next(&p->lx);
+    Expr *value = parse_assign(p);
+    if (!value) {
+        expr_free(target);
+        return NULL;
+    }
+    Expr *e = expr_new(EX_ASSIGN);
+    if (!e) {
+        expr_free(target);
+        expr_free(value);
+        return NULL;
+    }
+    e->as.assign.op = op;
+    e->as.assign.target = target;
+    e->as.assign.value = value;
+    return e;
+}
+
+static Expr *parse_expr(Parser *p) { return parse_assign(p); }
+
+static Expr *expr_seq(Expr *first, Expr *rest) {
+    if (!first || !rest) {
+        expr_free(first);
+        return rest;
+    }
+    Expr *e = expr_new(EX_SEQ);
+    if (!e) {
+        expr_free(first);
+        expr_free(rest);
+        return NULL;
+    }
+    e->as.seq.first = first;
+    e->as.seq.rest = rest;
+    return e;
+}
+
+// statement := 'return' expr | ('let'|'var'|'const') name ['=' expr] {',' ...} | expr
+// *out is NULL for a declaration without code (`let x;`).
+static bool parse_statement(Parser *p, Expr **out, bool *is_return) {
+    *out = NULL;
+    *is_return = false;
+    if (tok_is_word(&p->lx.tok, "return")) {
+        lexer_next(&p->lx);
+        *is_return = true;
+        *out = parse_expr(p);
+        return *out != NULL;
+    }
+    if (!is_decl_keyword(&p->lx.tok)) {
+        *out = parse_expr(p);
+        return *out != NULL;
+    }
+    lexer_next(&p->lx);
+    do {
+        if (p->lx.tok.type != TOK_IDENT) {
+            snprintf(p->lx.err, sizeof(p->lx.err), "Expected a variable name");
+            expr_free(*out);
+            *out = NULL;
+            return false;
+        }
+        Lexer ahead = p->lx;
+        lexer_next(&ahead);
+        if (ahead.tok.type != TOK_ASSIGN) {
+            lexer_next(&p->lx);
+            continue;
+        }
+        Expr *init = parse_assign(p);
+        if (!init) {
+            expr_free(*out);
+            *out = NULL;
+            return false;
+        }
+        *out = *out ? expr_seq(*out, init) : init;
+        if (!*out) return false;
+    } while (consume(p, TOK_COMMA));
+    return true;
+}
+
+// program := statement {';' statement}. Statements run in order and the value
+// of the program is the value of the last one; a `return` ends the program.
+static Expr *parse_program(Parser *p) {
+    while (consume(p, TOK_SEMI)) {
+    }
+    Expr *first;
+    bool is_return;
+    if (!parse_statement(p, &first, &is_return)) return NULL;
+    bool more = false;
+    while (consume(p, TOK_SEMI)) more = true;
+    if (is_return || !more || p->lx.tok.type == TOK_EOF) return first ? first : expr_new(EX_NUM);
+    Expr *rest = parse_program(p);
+    if (!rest) {
+        expr_free(first);
+        return NULL;
+    }
+    return expr_seq(first, rest);
+}
+
+static char *str_trim_copy(const char *s) {
+    while (*s && isspace((unsigned char)*s)) s++;
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1])) len--;
+    char *out = (char *)malloc(len + 1);
+    if (!out) return NULL;
+    memcpy(out, s, len);
+    out[len] = '\0';
+    return out;
+}
+
+static bool is_ident_char(char c) { return isalnum((unsigned char)c) || c == '_' || c == '$'; }
+
+// Copy of js with // and /* */ comments replaced by spaces.
+static char *strip_js_comments(const char *js) {
+    size_t len = strlen(js);
+    char *out = (char *)malloc(len + 1);
+    if (!out) return NULL;
+    size_t o = 0;
+    for (size_t i = 0; i < len;) {
+        if (js[i] == '/' && js[i + 1] == '/') {
+            while (i < len && js[i] != '\n') i++;
+        } else if (js[i] == '/' && js[i + 1] == '*') {
+            const char *end = strstr(js + i + 2, "*/");
+            i = end ? (size_t)(end - js) + 2 : len;
+            out[o++] = ' ';
+        } else {
+            out[o++] = js[i++];
+        }
+    }
+    out[o] = '\0';
+    return out;
+}
+
+// True if a line break between prev and next ends a statement: the line so far
+// is complete and the next one starts with a name, as JavaScript's automatic
+// semicolon insertion would treat it.
+static bool line_break_ends_statement(char prev, char next) {
+    return (is_ident_char(prev) || prev == ')' || prev == ']') && (isalpha((unsigned char)next) || next == '_');
+}
+
+// Pulls the program out of a JS snippet, arrow function or function body.
+// Comments are dropped, a `function ... {` or `=> {` wrapper is unwrapped, line
+// breaks that end a statement become `;`, and everything after the `;` that ends
+// the first `return` is ignored. The result is one line; a program that is only
+// `return <expr>` becomes the bare expression.
+static char *extract_js_program(const char *js) {
+    char *clean = strip_js_comments(js);
+    if (!clean) return NULL;
+    char *start = clean;
+    char *stop = clean + strlen(clean);
+    char *brace = strchr(clean, '{');
+    char *arrow = strstr(clean, "=>");
+    while (*start && isspace((unsigned char)*start)) start++;
+    bool is_function = !strncmp(start, "function", 8) && !is_ident_char(start[8]);
+    if (brace && (is_function || (arrow && arrow < brace))) {
+        char *close = strrchr(clean, '}');
+        start = brace + 1;
+        if (close > brace) stop = close;
+    } else if (arrow) {
+        start = arrow + 2;
+    }
+    *stop = '\0';
+
+    char *out = (char *)malloc(strlen(start) * 2 + 1);
+    if (!out) {
+        free(clean);
+        return NULL;
+    }
+    size_t o = 0;
+    int depth = 0;
+    bool returned = false;
+    for (const char *c = start; *c; ++c) {
+        if (isspace((unsigned char)*c)) {
+            bool newline = false;
+            for (; isspace((unsigned char)*c); ++c) newline = newline || *c == '\n';
+            char prev = o > 0 ? out[o - 1] : '\0';
+            if (newline && depth == 0 && line_break_ends_statement(prev, *c)) {
+                if (returned) break;
+                out[o++] = ';';
+            }
+            if (o > 0 && *c) out[o++] = ' ';
+            c--;
+            continue;
+        }
+        if (*c == '(' || *c == '[') depth++;
+        if ((*c == ')' || *c == ']') && depth > 0) depth--;
+        if (*c == ';' && depth == 0 && returned) break;
+        if (!strncmp(c, "return", 6) && (c == start || !is_ident_char(c[-1])) && !is_ident_char(c[6])) returned = true;
+        out[o++] = *c;
+    }
+    out[o] = '\0';
+    free(clean);
+    while (o > 0 && (out[o - 1] == ';' || out[o - 1] == ' ')) out[--o] = '\0';
+    const char *body = out;
+    while (*body == ';' || *body == ' ') body++;
+    if (!strncmp(body, "return", 6) && !is_ident_char(body[6]) && !strchr(body, ';')) body += 6;
+    char *trimmed = str_trim_copy(body);
+    free(out);
+    return trimmed;
+}
+
+static char *transpile_js_to_c(const char *js) {
+    char *expr = extract_js_program(js);
+    if (!expr) return NULL;
 
     size_t in_len = strlen(expr);
     char *out = (char *)malloc(in_len * 2 + 1);
@@ -1000,244 +2792,8307 @@ static char *transpile_js_to_c(const char *js) {
         free(expr);
         return NULL;
     }
-
-    size_t i = 0, o = 0;
-    while (i < in_len) {
-        if (i + 5 <= in_len && !strncmp(expr + i, "Math.", 5)) {
-            i += 5;
-            continue;
+
+    size_t i = 0, o = 0;
+    while (i < in_len) {
+        if (i + 5 <= in_len && !strncmp(expr + i, "Math.", 5)) {
+            i += 5;
+            continue;
+        }
+        if (expr[i] == '|' && i + 1 < in_len && expr[i + 1] == '|') {
+            out[o++] = '|';
+            out[o++] = '|';
+            i += 2;
+            continue;
+        }
+        if (expr[i] == '&' && i + 1 < in_len && expr[i + 1] == '&') {
+            out[o++] = '&';
+            out[o++] = '&';
+            i += 2;
+            continue;
+        }
+        out[o++] = expr[i++];
+    }
+    out[o] = '\0';
+    free(expr);
+    return out;
+}
+
+static Expr *compile_expr(const char *src, char *err, size_t err_sz) {
+    Parser p;
+    memset(&p, 0, sizeof(p));
+    if (!program_scan_names(&p, src)) {
+        snprintf(err, err_sz, "%s", p.lx.err);
+        return NULL;
+    }
+    p.lx.src = src;
+    lexer_next(&p.lx);
+
+    Expr *root = parse_program(&p);
+    if (!root) {
+        snprintf(err, err_sz, "%s", p.lx.err[0] ? p.lx.err : "Parse error");
+        return NULL;
+    }
+    if (p.lx.tok.type != TOK_EOF) {
+        snprintf(err, err_sz, "Unexpected trailing tokens");
+        expr_free(root);
+        return NULL;
+    }
+    err[0] = '\0';
+    return root;
+}
+
+// Periodicity analysis. period_analyze proves that a view of an expression's
+// value repeats in t: for need <= 32 the view is the low `need` bits of
+// to_i32(value), for PERIOD_EXACT it is the value itself. A period of 0 means no
+// bound could be proven. Macros are taken as the constants in ctx, t is an
+// integer in [0, 2^40), and a sum, difference or product is only reduced to its
+// low bits when expr_magnitude shows it stays below 2^53, where doubles are
+// exact integers.
+#define PERIOD_EXACT 64
+#define PERIOD_LIMIT (1ull << 40)
+#define PERIOD_T_MAX 0x1p40
+#define PERIOD_EXACT_MAX 0x1p53
+
+typedef struct {
+    bool is_const;
+    double value;
+    uint64_t period;
+} PeriodInfo;
+
+static bool expr_uses_t(const Expr *e) {
+    switch (e->type) {
+        case EX_NUM:
+            return false;
+        case EX_VAR:
+            return e->as.var == VAR_T;
+        case EX_UNARY:
+            return expr_uses_t(e->as.unary.a);
+        case EX_BINARY:
+            return expr_uses_t(e->as.binary.a) || expr_uses_t(e->as.binary.b);
+        case EX_TERNARY:
+            return expr_uses_t(e->as.ternary.cond) || expr_uses_t(e->as.ternary.yes) ||
+                   expr_uses_t(e->as.ternary.no);
+        case EX_FUNC:
+            if (fn_lookup(e->as.func.name, e->as.func.argc) == FN_RANDOM) return true;
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                if (expr_uses_t(e->as.func.args[i])) return true;
+            }
+            return false;
+        case EX_LOCAL:
+        case EX_STATE:
+        case EX_INDEX:
+        case EX_ASSIGN:
+        case EX_SEQ:
+            return true;  // programs with variables are not analysed
+    }
+    return true;
+}
+
+// True if the expression is integer-valued for every integer t.
+static bool expr_is_int(const Expr *e, const EvalContext *ctx) {
+    if (!expr_uses_t(e)) {
+        double v = expr_eval(e, ctx);
+        return v == floor(v);
+    }
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+            return true;
+        case EX_UNARY:
+            return e->as.unary.op != OP_NEG || expr_is_int(e->as.unary.a, ctx);
+        case EX_BINARY:
+            switch (e->as.binary.op) {
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                    return expr_is_int(e->as.binary.a, ctx) && expr_is_int(e->as.binary.b, ctx);
+                case OP_DIV:
+                    return false;
+                default:
+                    return true;
+            }
+        case EX_TERNARY:
+            return expr_is_int(e->as.ternary.yes, ctx) && expr_is_int(e->as.ternary.no, ctx);
+        case EX_FUNC:
+            if (!strcmp(e->as.func.name, "floor") || !strcmp(e->as.func.name, "ceil")) return true;
+            if (strcmp(e->as.func.name, "abs") && strcmp(e->as.func.name, "min") && strcmp(e->as.func.name, "max") &&
+                strcmp(e->as.func.name, "clamp")) {
+                return false;
+            }
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                if (!expr_is_int(e->as.func.args[i], ctx)) return false;
+            }
+            return true;
+        case EX_LOCAL:
+        case EX_STATE:
+        case EX_INDEX:
+        case EX_ASSIGN:
+        case EX_SEQ:
+            return false;
+    }
+    return false;
+}
+
+// Upper bound on |e| for t in [0, PERIOD_T_MAX], or INFINITY if none is known.
+static double expr_magnitude(const Expr *e, const EvalContext *ctx) {
+    if (!expr_uses_t(e)) return fabs(expr_eval(e, ctx));
+    switch (e->type) {
+        case EX_VAR:
+            return PERIOD_T_MAX;  // only t gets here
+        case EX_UNARY:
+            if (e->as.unary.op == OP_NEG) return expr_magnitude(e->as.unary.a, ctx);
+            return e->as.unary.op == OP_BNOT ? 0x1p31 : 1.0;
+        case EX_BINARY: {
+            double a = expr_magnitude(e->as.binary.a, ctx);
+            switch (e->as.binary.op) {
+                case OP_ADD:
+                case OP_SUB:
+                    return a + expr_magnitude(e->as.binary.b, ctx);
+                case OP_MUL:
+                    return a * expr_magnitude(e->as.binary.b, ctx);
+                case OP_DIV:
+                    return INFINITY;
+                case OP_MOD:
+                    return a;
+                case OP_LAND:
+                case OP_LOR:
+                    return fmax(a, expr_magnitude(e->as.binary.b, ctx));
+                case OP_BAND:
+                case OP_BOR:
+                case OP_BXOR:
+                case OP_SHL:
+                case OP_SHR:
+                case OP_USHR:
+                    return 0x1p32;
+                default:
+                    return 1.0;  // comparisons
+            }
+        }
+        case EX_TERNARY:
+            return fmax(expr_magnitude(e->as.ternary.yes, ctx), expr_magnitude(e->as.ternary.no, ctx));
+        case EX_FUNC: {
+            FnId fn = fn_lookup(e->as.func.name, e->as.func.argc);
+            if (fn == FN_SIN || fn == FN_COS) return 1.0;
+            if (fn != FN_ABS && fn != FN_FLOOR && fn != FN_CEIL && fn != FN_MIN && fn != FN_MAX && fn != FN_CLAMP) {
+                return INFINITY;
+            }
+            double m = 0.0;
+            for (int i = 0; i < e->as.func.argc; ++i) m = fmax(m, expr_magnitude(e->as.func.args[i], ctx));
+            return m + 1.0;  // floor/ceil may round away from zero
+        }
+        default:
+            return INFINITY;
+    }
+}
+
+static uint64_t period_lcm(uint64_t a, uint64_t b) {
+    if (!a || !b) return 0;
+    uint64_t x = a, y = b;
+    while (y) {
+        uint64_t r = x % y;
+        x = y;
+        y = r;
+    }
+    uint64_t l = (a / x) * b;
+    return l > PERIOD_LIMIT ? 0 : l;
+}
+
+static PeriodInfo period_analyze(const Expr *e, const EvalContext *ctx, int need);
+
+// Period of the low `bits` bits of to_i32(e): those only depend on the low bits of
+// an integer operand, but on the whole value of a fractional one.
+static uint64_t period_int_bits(const Expr *e, const EvalContext *ctx, int bits) {
+    if (bits <= 0) return 1;
+    if (bits > 32) bits = 32;
+    return period_analyze(e, ctx, expr_is_int(e, ctx) ? bits : PERIOD_EXACT).period;
+}
+
+static int bit_length(int32_t m) {
+    if (m < 0) return 32;
+    int n = 0;
+    while (m) {
+        n++;
+        m >>= 1;
+    }
+    return n;
+}
+
+static PeriodInfo period_analyze(const Expr *e, const EvalContext *ctx, int need) {
+    PeriodInfo info = {false, 0.0, 0};
+    if (!expr_uses_t(e)) {
+        info.is_const = true;
+        info.value = expr_eval(e, ctx);
+        info.period = 1;
+        return info;
+    }
+    if (need <= 0) {
+        info.period = 1;
+        return info;
+    }
+    int bits = need > 32 ? 32 : need;
+
+    switch (e->type) {
+        case EX_NUM:
+            break;
+        case EX_VAR:
+            info.period = need <= 32 ? (1ull << need) : 0;  // only t gets here
+            break;
+        case EX_UNARY:
+            if (e->as.unary.op == OP_BNOT) {
+                info.period = period_int_bits(e->as.unary.a, ctx, bits);
+            } else if (e->as.unary.op == OP_NEG && need <= 32 && expr_is_int(e->as.unary.a, ctx)) {
+                info.period = period_analyze(e->as.unary.a, ctx, need).period;
+            } else {
+                info.period = period_analyze(e->as.unary.a, ctx, PERIOD_EXACT).period;
+            }
+            break;
+        case EX_BINARY: {
+            const Expr *a = e->as.binary.a;
+            const Expr *b = e->as.binary.b;
+            PeriodInfo pb = period_analyze(b, ctx, PERIOD_EXACT);
+            switch (e->as.binary.op) {
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL: {
+                    // Low bits of the result follow from low bits of the operands
+                    // only while the result is an exact integer.
+                    bool ring = need <= 32 && expr_is_int(a, ctx) && expr_is_int(b, ctx) &&
+                                expr_magnitude(e, ctx) < PERIOD_EXACT_MAX;
+                    int sub_need = ring ? need : PERIOD_EXACT;
+                    info.period = period_lcm(period_analyze(a, ctx, sub_need).period,
+                                             period_analyze(b, ctx, sub_need).period);
+                    break;
+                }
+                case OP_MOD:
+                    info.period = period_lcm(period_int_bits(a, ctx, 32), period_int_bits(b, ctx, 32));
+                    break;
+                case OP_BAND: {
+                    PeriodInfo pa = period_analyze(a, ctx, PERIOD_EXACT);
+                    int need_a = bits, need_b = bits;
+                    if (pb.is_const) need_a = bit_length(to_i32(pb.value)) < bits ? bit_length(to_i32(pb.value)) : bits;
+                    if (pa.is_const) need_b = bit_length(to_i32(pa.value)) < bits ? bit_length(to_i32(pa.value)) : bits;
+                    info.period = period_lcm(period_int_bits(a, ctx, need_a), period_int_bits(b, ctx, need_b));
+                    break;
+                }
+                case OP_BOR:
+                case OP_BXOR:
+                    info.period = period_lcm(period_int_bits(a, ctx, bits), period_int_bits(b, ctx, bits));
+                    break;
+                case OP_SHL:
+                    if (pb.is_const) {
+                        info.period = period_int_bits(a, ctx, bits - (to_i32(pb.value) & 31));
+                    } else {
+                        info.period = period_lcm(period_int_bits(a, ctx, bits), period_int_bits(b, ctx, 5));
+                    }
+                    break;
+                case OP_SHR:
+                case OP_USHR:
+                    if (pb.is_const) {
+                        info.period = period_int_bits(a, ctx, bits + (to_i32(pb.value) & 31));
+                    } else {
+                        info.period = period_lcm(period_int_bits(a, ctx, 32), period_int_bits(b, ctx, 5));
+                    }
+                    break;
+                default:
+                    info.period = period_lcm(period_analyze(a, ctx, PERIOD_EXACT).period, pb.period);
+                    break;
+            }
+            break;
+        }
+        case EX_TERNARY:
+            info.period = period_lcm(period_analyze(e->as.ternary.cond, ctx, PERIOD_EXACT).period,
+                                     period_lcm(period_analyze(e->as.ternary.yes, ctx, need).period,
+                                                period_analyze(e->as.ternary.no, ctx, need).period));
+            break;
+        case EX_FUNC:
+            // random() never repeats; noise() repeats with its argument.
+            info.period = fn_lookup(e->as.func.name, e->as.func.argc) == FN_RANDOM ? 0 : 1;
+            for (int i = 0; i < e->as.func.argc && info.period; ++i) {
+                info.period = period_lcm(info.period, period_analyze(e->as.func.args[i], ctx, PERIOD_EXACT).period);
+            }
+            break;
+        case EX_LOCAL:
+        case EX_STATE:
+        case EX_INDEX:
+        case EX_ASSIGN:
+        case EX_SEQ:
+            break;  // no proof for programs with variables
+    }
+    return info;
+}
+
+// Proven upper bound on the period of the output byte, or 0 if none was found.
+static uint64_t expr_output_period(const Expr *e, const EvalContext *ctx) {
+    return period_int_bits(e, ctx, 8);
+}
+
+static inline float byte_to_float(uint8_t b) { return ((float)b - 128.0f) / 128.0f; }
+
+static inline uint8_t bytebeat_to_byte(double v) { return (uint8_t)(to_i32(v) & 0xFF); }
+
+static inline float bytebeat_to_float(double v) { return byte_to_float(bytebeat_to_byte(v)); }
+
+// Every sample is one byte until it reaches the effects chain or the output, so
+// the conversions are tables: the float the effects chain takes, output gain
+// included, and the int16 sample the float path would have produced from it.
+#define OUTPUT_GAIN 0.6f
+
+static float g_byte_float[256];
+static int16_t g_byte_pcm[256];
+static pthread_once_t g_byte_tables_once = PTHREAD_ONCE_INIT;
+
+static inline int16_t sample_to_pcm(float x) { return (int16_t)fmaxf(-32768.0f, fminf(32767.0f, x * 32767.0f)); }
+
+// Back to the byte scale, for 8-bit output after the effects chain.
+static inline uint8_t sample_to_u8(float x) {
+    return (uint8_t)lrintf(fmaxf(0.0f, fminf(255.0f, x / OUTPUT_GAIN * 128.0f + 128.0f)));
+}
+
+static void byte_tables_init(void) {
+    for (int b = 0; b < 256; ++b) {
+        g_byte_float[b] = byte_to_float((uint8_t)b) * OUTPUT_GAIN;
+        g_byte_pcm[b] = sample_to_pcm(g_byte_float[b]);
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static _Atomic double *control_target(Synth *s, ControlId id) {
+    switch (id) {
+        case CTL_A:
+            return &s->macro_a;
+        case CTL_B:
+            return &s->macro_b;
+        case CTL_C:
+            return &s->macro_c;
+        case CTL_D:
+            return &s->macro_d;
+        case CTL_SHIFT:
+            return &s->macro_shift;
+        case CTL_MASK:
+            return &s->macro_mask;
+        case CTL_PITCH:
+            return &s->target_pitch;
+        case CTL_TEMPO:
+            return &s->target_tempo;
+        case CTL_DECIMATE:
+            return &s->target_decimate;
+        case CTL_FX:
+        case CTL_FX_LAST:
+        case CTL_SEEK:
+        case CTL_SCRUB:
+        case CTL_PING:
+            break;
+    }
+    if (id >= CTL_FX && id <= CTL_FX_LAST) return &s->fx_target[id - CTL_FX];
+    return NULL;
+}
+
+// The applied internal rate is the admitted one lowered by the governor's steps.
+// Sessions log the applied value, so a replay (which runs no governor) matches.
+static void governor_apply(Synth *s) {
+    s->live.decimate = fmin(s->gov.admitted * (double)(1 << s->gov.step), ADMIT_MAX_DIVIDE);
+}
+
+static void controls_load_targets(Synth *s) {
+    s->live.tempo = atomic_load_explicit(&s->target_tempo, memory_order_relaxed);
+    s->live.pitch = atomic_load_explicit(&s->target_pitch, memory_order_relaxed);
+    s->live.a = atomic_load_explicit(&s->macro_a, memory_order_relaxed);
+    s->live.b = atomic_load_explicit(&s->macro_b, memory_order_relaxed);
+    s->live.c = atomic_load_explicit(&s->macro_c, memory_order_relaxed);
+    s->live.d = atomic_load_explicit(&s->macro_d, memory_order_relaxed);
+    s->live.sh = atomic_load_explicit(&s->macro_shift, memory_order_relaxed);
+    s->live.mask = atomic_load_explicit(&s->macro_mask, memory_order_relaxed);
+    s->gov.admitted = atomic_load_explicit(&s->target_decimate, memory_order_relaxed);
+    governor_apply(s);
+    for (int i = 0; i < FX_PARAM_COUNT; ++i) {
+        s->live.fx[i] = atomic_load_explicit(&s->fx_target[i], memory_order_relaxed);
+    }
+    s->fx.dirty = true;
+}
+
+// Posts a batch of control changes. The atomics are updated immediately so UI
+// readback is current; the audio thread applies the whole batch at its next
+// buffer boundary. If the ring is full the batch is dropped and the audio thread
+// is asked to resync from the atomics instead, so no change is ever lost.
+static void synth_post_controls(Synth *s, const ControlEvent *events, int count) {
+    if (count <= 0) return;
+    ControlQueue *q = &s->controls;
+    pthread_mutex_lock(&q->producer_lock);
+    for (int i = 0; i < count; ++i) {
+        _Atomic double *target = control_target(s, events[i].id);
+        if (target) atomic_store_explicit(target, events[i].value, memory_order_relaxed);
+    }
+    uint32_t w = atomic_load_explicit(&q->write_pos, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&q->read_pos, memory_order_acquire);
+    if ((uint32_t)(CONTROL_QUEUE_SIZE - (w - r)) < (uint32_t)count) {
+        atomic_fetch_add_explicit(&s->stats.ctl_dropped, (uint64_t)count, memory_order_relaxed);
+        atomic_store_explicit(&s->controls_resync, true, memory_order_release);
+    } else {
+        for (int i = 0; i < count; ++i) q->events[(w + (uint32_t)i) & (CONTROL_QUEUE_SIZE - 1)] = events[i];
+        atomic_store_explicit(&q->write_pos, w + (uint32_t)count, memory_order_release);
+    }
+    pthread_mutex_unlock(&q->producer_lock);
+}
+
+static void synth_set_control(Synth *s, ControlId id, double value) {
+    ControlEvent ev = {id, value, now_ns()};
+    synth_post_controls(s, &ev, 1);
+}
+
+// Pitch shifts are clamped to +-PITCH_SEMITONES_MAX (a ratio of 1/8..8) where
+// they are parsed, as tempo is to 0.05..8, so the per-sample rate stays below 64.
+#define PITCH_SEMITONES_MAX 36.0
+// phase_increment clamps anything else (a NaN, infinity or a rate from a session
+// file) to 0..PHASE_RATE_MAX before converting it to integers.
+#define PHASE_RATE_MAX 0x1p32
+
+static double pitch_ratio(double semitones) {
+    if (isnan(semitones)) semitones = 0.0;
+    semitones = fmax(-PITCH_SEMITONES_MAX, fmin(PITCH_SEMITONES_MAX, semitones));
+    return pow(2.0, semitones / 12.0);
+}
+
+static PhaseAcc phase_increment(double rate) {
+    PhaseAcc inc;
+    if (!(rate >= 0.0)) rate = 0.0;
+    if (rate > PHASE_RATE_MAX) rate = PHASE_RATE_MAX;
+    double whole = floor(rate);
+    inc.t = (uint64_t)whole;
+    inc.frac = (uint64_t)ldexp(rate - whole, 64);  // < 2^64: rate - whole <= 1 - 2^-53
+    return inc;
+}
+
+static inline void phase_advance(PhaseAcc *p, PhaseAcc inc) {
+    uint64_t frac = p->frac + inc.frac;
+    p->t += inc.t + (frac < p->frac);
+    p->frac = frac;
+}
+
+// One step of the tempo/pitch slew. Snaps onto the target once the remaining
+// distance is below double resolution so the increment can stop being recomputed.
+static inline double smooth_toward(double cur, double target) {
+    cur += (target - cur) * SMOOTHING_COEFF;
+    if (fabs(target - cur) <= target * 1e-12) cur = target;
+    return cur;
+}
+
+// Advances the slews and the phase by one sample and returns the new t.
+static inline uint64_t synth_next_t(Synth *s, double tempo_target, double pitch_target) {
+    if (!s->rate_steady) {
+        s->smooth_tempo = smooth_toward(s->smooth_tempo, tempo_target);
+        s->smooth_pitch = smooth_toward(s->smooth_pitch, pitch_target);
+        s->phase_inc = phase_increment(s->smooth_tempo * s->smooth_pitch);
+        s->rate_steady = s->smooth_tempo == tempo_target && s->smooth_pitch == pitch_target;
+    }
+    phase_advance(&s->phase, s->phase_inc);
+    return s->phase.t;
+}
+
+// n * inc, wrapping exactly as n calls to phase_advance would.
+static PhaseAcc phase_multiply(PhaseAcc inc, uint64_t n) {
+    uint64_t f_lo = inc.frac & 0xFFFFFFFFu, f_hi = inc.frac >> 32;
+    uint64_t n_lo = n & 0xFFFFFFFFu, n_hi = n >> 32;
+    uint64_t lo_lo = f_lo * n_lo, hi_lo = f_hi * n_lo, lo_hi = f_lo * n_hi;
+    uint64_t mid = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFu) + (lo_hi & 0xFFFFFFFFu);
+    PhaseAcc out;
+    out.frac = (mid << 32) | (lo_lo & 0xFFFFFFFFu);
+    out.t = inc.t * n + f_hi * n_hi + (hi_lo >> 32) + (lo_hi >> 32) + (mid >> 32);
+    return out;
+}
+
+// Snaps the tempo and pitch slews onto the rates synth_render is heading for.
+static void synth_settle(Synth *s) {
+    s->smooth_tempo = fmax(s->live.tempo, 0.05);
+    s->smooth_pitch = fmax(s->live.pitch, 0.125);
+    s->phase_inc = phase_increment(s->smooth_tempo * s->smooth_pitch);
+    s->rate_steady = true;
+}
+
+// Moves the phase n samples on, bit for bit where rendering them would leave
+// it: while the slews move they are stepped one sample at a time (under a
+// second's worth), and the steady remainder is a single multiply.
+static void synth_skip(Synth *s, uint64_t n) {
+    const double tempo_target = fmax(s->live.tempo, 0.05);
+    const double pitch_target = fmax(s->live.pitch, 0.125);
+    for (; n > 0 && !s->rate_steady; --n) synth_next_t(s, tempo_target, pitch_target);
+    phase_advance(&s->phase, phase_multiply(s->phase_inc, n));
+}
+
+// Audio thread. CTL_SEEK puts the timeline where `seconds` of playback from
+// t = 0 at the target rate would have; CTL_SCRUB moves it by `seconds` from
+// here, forward through the slews as rendered, backward at the target rate.
+// Program state and effects memory are left as they are.
+static void synth_seek(Synth *s, ControlId id, double seconds) {
+    uint64_t n = (uint64_t)llround(fabs(seconds) * SAMPLE_RATE);
+    if (id == CTL_SEEK) {
+        synth_settle(s);
+        s->phase = phase_multiply(s->phase_inc, n);
+    } else if (seconds >= 0.0) {
+        synth_skip(s, n);
+    } else {
+        synth_settle(s);
+        PhaseAcc back = phase_multiply(s->phase_inc, n);
+        if (back.t > s->phase.t || (back.t == s->phase.t && back.frac > s->phase.frac)) {
+            s->phase.t = 0;
+            s->phase.frac = 0;
+        } else {
+            uint64_t frac = s->phase.frac - back.frac;
+            s->phase.t -= back.t + (frac > s->phase.frac);
+            s->phase.frac = frac;
+        }
+    }
+    s->seeks++;
+}
+
+static void apply_control(Synth *s, const ControlEvent *ev) {
+    switch (ev->id) {
+        case CTL_A:
+            s->live.a = ev->value;
+            break;
+        case CTL_B:
+            s->live.b = ev->value;
+            break;
+        case CTL_C:
+            s->live.c = ev->value;
+            break;
+        case CTL_D:
+            s->live.d = ev->value;
+            break;
+        case CTL_SHIFT:
+            s->live.sh = ev->value;
+            break;
+        case CTL_MASK:
+            s->live.mask = ev->value;
+            break;
+        case CTL_PITCH:
+            s->live.pitch = ev->value;
+            s->rate_steady = false;
+            break;
+        case CTL_TEMPO:
+            s->live.tempo = ev->value;
+            s->rate_steady = false;
+            break;
+        case CTL_DECIMATE:
+            s->gov.admitted = ev->value;
+            governor_apply(s);
+            break;
+        case CTL_SEEK:
+        case CTL_SCRUB:
+            synth_seek(s, ev->id, ev->value);
+            break;
+        case CTL_FX:
+        case CTL_FX_LAST:
+        case CTL_PING:
+            break;
+    }
+    if (ev->id >= CTL_FX && ev->id <= CTL_FX_LAST) {
+        s->live.fx[ev->id - CTL_FX] = ev->value;
+        s->fx.dirty = true;
+    }
+}
+
+// Applies one event taken off the control queue at time now, keeping the
+// latency statistics. A ping is only answered.
+static void apply_queued_control(Synth *s, const ControlEvent *ev, uint64_t now) {
+    if (ev->id == CTL_PING) {
+        atomic_store_explicit(&s->stats.ping_send_ns, ev->stamp_ns, memory_order_relaxed);
+        atomic_store_explicit(&s->stats.ping_render_ns, now, memory_order_relaxed);
+        atomic_store_explicit(&s->stats.ping_seq, (uint64_t)ev->value, memory_order_release);
+        return;
+    }
+    apply_control(s, ev);
+    uint64_t lat = now > ev->stamp_ns ? now - ev->stamp_ns : 0;
+    atomic_fetch_add_explicit(&s->stats.ctl_latency_sum_ns, lat, memory_order_relaxed);
+    if (lat > atomic_load_explicit(&s->stats.ctl_latency_max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&s->stats.ctl_latency_max_ns, lat, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&s->stats.ctl_events, 1, memory_order_relaxed);
+}
+
+static void controls_resync_if_asked(Synth *s) {
+    if (atomic_exchange_explicit(&s->controls_resync, false, memory_order_acquire)) {
+        controls_load_targets(s);
+        s->rate_steady = false;
+    }
+}
+
+// Audio thread: apply every queued control before rendering the next buffer.
+static void drain_controls(Synth *s) {
+    ControlQueue *q = &s->controls;
+    uint32_t r = atomic_load_explicit(&q->read_pos, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&q->write_pos, memory_order_acquire);
+    if (r != w) {
+        uint64_t now = now_ns();
+        for (; r != w; ++r) apply_queued_control(s, &q->events[r & (CONTROL_QUEUE_SIZE - 1)], now);
+        atomic_store_explicit(&q->read_pos, r, memory_order_release);
+    }
+    controls_resync_if_asked(s);
+}
+
+static SynthState synth_get_state(const Synth *s) {
+    SynthState st;
+    memset(&st, 0, sizeof(st));
+    st.phase = s->phase;
+    st.phase_inc = s->phase_inc;
+    st.smooth_tempo = s->smooth_tempo;
+    st.smooth_pitch = s->smooth_pitch;
+    st.rate_steady = s->rate_steady;
+    st.live = s->live;
+    return st;
+}
+
+// The phase and slews alone, as a replayed seek restores them.
+static void synth_set_timeline(Synth *s, const SynthState *st) {
+    s->phase = st->phase;
+    s->phase_inc = st->phase_inc;
+    s->smooth_tempo = st->smooth_tempo;
+    s->smooth_pitch = st->smooth_pitch;
+    s->rate_steady = st->rate_steady;
+}
+
+static void synth_set_state(Synth *s, const SynthState *st) {
+    synth_set_timeline(s, st);
+    s->live = st->live;
+    s->fx.dirty = true;
+}
+
+static bool synth_state_equal(const SynthState *x, const SynthState *y) {
+    return x->phase.t == y->phase.t && x->phase.frac == y->phase.frac && x->phase_inc.t == y->phase_inc.t &&
+           x->phase_inc.frac == y->phase_inc.frac && !memcmp(&x->smooth_tempo, &y->smooth_tempo, sizeof(double)) &&
+           !memcmp(&x->smooth_pitch, &y->smooth_pitch, sizeof(double)) && x->rate_steady == y->rate_steady &&
+           !memcmp(&x->live, &y->live, sizeof(SynthControls));
+}
+
+static double *controls_field(SynthControls *c, ControlId id) {
+    switch (id) {
+        case CTL_A:
+            return &c->a;
+        case CTL_B:
+            return &c->b;
+        case CTL_C:
+            return &c->c;
+        case CTL_D:
+            return &c->d;
+        case CTL_SHIFT:
+            return &c->sh;
+        case CTL_MASK:
+            return &c->mask;
+        case CTL_PITCH:
+            return &c->pitch;
+        case CTL_TEMPO:
+            return &c->tempo;
+        case CTL_DECIMATE:
+            return &c->decimate;
+        case CTL_FX:
+        case CTL_FX_LAST:
+        case CTL_SEEK:
+        case CTL_SCRUB:
+        case CTL_PING:
+            break;
+    }
+    if (id >= CTL_FX && id <= CTL_FX_LAST) return &c->fx[id - CTL_FX];
+    return NULL;
+}
+
+static bool session_push(SessionRecorder *rec, const SessionRecord *r) {
+    uint32_t w = atomic_load_explicit(&rec->write_pos, memory_order_relaxed);
+    uint32_t rd = atomic_load_explicit(&rec->read_pos, memory_order_acquire);
+    if (w - rd >= SESSION_RING_SIZE) return false;
+    rec->ring[w & (SESSION_RING_SIZE - 1)] = *r;
+    atomic_store_explicit(&rec->write_pos, w + 1, memory_order_release);
+    return true;
+}
+
+// Audio thread, under expr_lock, after the controls for this buffer have been
+// applied: logs every applied value and equation that differs from what was
+// logged last, the state after any seek, plus a full-state checkpoint every
+// SESSION_CHECKPOINT_FRAMES.
+// Anything that does not fit in the ring is retried at the next buffer and
+// counted, since the session is no longer exact from that point.
+static void session_log_buffer(Synth *s) {
+    SessionRecorder *rec = s->recorder;
+    int state = atomic_load_explicit(&rec->state, memory_order_acquire);
+    if (state == SESSION_DONE) return;
+    if (state == SESSION_STARTING) {
+        SessionRecord eq = {.kind = SES_EQ, .sample = 0, .gen = s->expr_gen};
+        SessionRecord ck = {.kind = SES_CHECKPOINT, .sample = 0, .state = synth_get_state(s)};
+        if (!session_push(rec, &eq) || !session_push(rec, &ck)) return;  // the ring starts empty
+        rec->start_frame = s->frames;
+        rec->last_checkpoint = s->frames;
+        rec->logged = s->live;
+        rec->logged_gen = s->expr_gen;
+        rec->logged_seeks = s->seeks;
+        atomic_store_explicit(&rec->state, SESSION_ACTIVE, memory_order_release);
+        return;
+    }
+    uint64_t sample = s->frames - rec->start_frame;
+    for (int id = CTL_A; id <= CTL_DECIMATE; ++id) {
+        double *now = controls_field(&s->live, (ControlId)id);
+        double *was = controls_field(&rec->logged, (ControlId)id);
+        if (!memcmp(now, was, sizeof(double))) continue;
+        SessionRecord r = {.kind = SES_CONTROL, .id = (uint8_t)id, .sample = sample, .value = *now};
+        if (session_push(rec, &r)) {
+            *was = *now;
+        } else {
+            rec->dropped++;
+        }
+    }
+    // A seek is logged as the state it left, after the controls applied with it.
+    if (s->seeks != rec->logged_seeks) {
+        SessionRecord r = {.kind = SES_SEEK, .sample = sample, .state = synth_get_state(s)};
+        if (session_push(rec, &r)) {
+            rec->logged_seeks = s->seeks;
+        } else {
+            rec->dropped++;
+        }
+    }
+    if (s->expr_gen != rec->logged_gen) {
+        SessionRecord r = {.kind = SES_EQ, .sample = sample, .gen = s->expr_gen};
+        if (s->seq_note && s->seq_note_gen == s->expr_gen) r.src = s->seq_note;
+        if (session_push(rec, &r)) {
+            rec->logged_gen = s->expr_gen;
+            if (r.src) s->seq_note = NULL;
+        } else {
+            rec->dropped++;
+        }
+    }
+    if (s->frames - rec->last_checkpoint >= SESSION_CHECKPOINT_FRAMES) {
+        SessionRecord r = {.kind = SES_CHECKPOINT, .sample = sample, .state = synth_get_state(s)};
+        if (session_push(rec, &r)) {
+            rec->last_checkpoint = s->frames;
+        } else {
+            rec->dropped++;
+        }
+    }
+}
+
+static void loop_cache_key(double key[6], double a, double b, double c, double d, double sh, double mask) {
+    key[0] = a;
+    key[1] = b;
+    key[2] = c;
+    key[3] = d;
+    key[4] = floor(sh + 0.5);
+    key[5] = floor(mask + 0.5);
+}
+
+// The evaluation context synth_render builds for the macros in key.
+static void loop_cache_context(EvalContext *ctx, const double key[6]) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->a = key[0];
+    ctx->b = key[1];
+    ctx->c = key[2];
+    ctx->d = key[3];
+    ctx->sh = key[4];
+    ctx->mask = key[5];
+}
+
+// Audio thread: derives the chain's coefficients from the fx controls. A stage
+// that was off starts again from silence rather than from stale memory.
+static void fx_update(FxChain *fx, const double *p) {
+    fx->dirty = false;
+    bool on = p[FX_ON] != 0.0;
+    bool dc_on = on && p[FX_DC] != 0.0;
+    if (dc_on && !fx->dc_on) fx->dc_x1 = fx->dc_y1 = 0.0f;
+    fx->dc_on = dc_on;
+
+    int mode = on ? (int)llround(p[FX_FILTER]) : FX_FILTER_OFF;
+    bool filter_on = mode >= FX_FILTER_LP && mode <= FX_FILTER_BP;
+    if (filter_on && !fx->filter_on) fx->svf_ic1 = fx->svf_ic2 = 0.0f;
+    fx->filter_on = filter_on;
+    if (filter_on) {
+        double cutoff = fmin(fmax(p[FX_CUTOFF], 20.0), SAMPLE_RATE * 0.45);
+        double k = 1.0 / fmin(fmax(p[FX_Q], 0.5), 20.0);
+        double g = tan(M_PI * cutoff / SAMPLE_RATE);
+        double a1 = 1.0 / (1.0 + g * (g + k));
+        fx->svf_a1 = (float)a1;
+        fx->svf_a2 = (float)(g * a1);
+        fx->svf_a3 = (float)(g * g * a1);
+        // out = m0 * in + m1 * band + m2 * low
+        const float mixes[3][3] = {{0.0f, 0.0f, 1.0f}, {1.0f, (float)-k, -1.0f}, {0.0f, 1.0f, 0.0f}};
+        memcpy(fx->svf_mix, mixes[mode - FX_FILTER_LP], sizeof(fx->svf_mix));
+    }
+
+    double bits = on ? p[FX_BITS] : 0.0;
+    fx->crush_levels = bits >= 1.0 ? (float)exp2(fmin(floor(bits), 16.0) - 1.0) : 0.0f;
+    double hold = on ? floor(p[FX_DOWNSAMPLE]) : 1.0;
+    uint32_t crush_hold = hold > 1.0 ? (uint32_t)fmin(hold, 64.0) : 1u;
+    // Keep the sample-and-hold phase across unrelated updates, such as the ones
+    // a replayed checkpoint triggers, so they don't shift where samples are held.
+    if (crush_hold != fx->crush_hold) fx->crush_count = 0;
+    fx->crush_hold = crush_hold;
+
+    fx->drive = on && p[FX_DRIVE] > 0.0 ? (float)fmin(fmax(p[FX_DRIVE], 0.1), 20.0) : 0.0f;
+
+    double frames = floor(p[FX_DELAY_MS] * SAMPLE_RATE / 1000.0);
+    bool delay_on = on && fx->delay && frames >= 1.0;
+    if (delay_on && !fx->delay_on) memset(fx->delay, 0, FX_DELAY_FRAMES * sizeof(float));
+    fx->delay_on = delay_on;
+    fx->delay_frames = delay_on ? (uint32_t)fmin(frames, FX_DELAY_FRAMES - EVAL_BLOCK) : 0u;
+    fx->feedback = (float)fmin(fmax(p[FX_FEEDBACK], 0.0), 0.95);
+    fx->mix = (float)fmin(fmax(p[FX_MIX], 0.0), 1.0);
+}
+
+// Flush-to-zero and denormals-are-zero for the effects. Filter, DC blocker and
+// delay memory decay towards zero after the input goes quiet and would otherwise
+// spend thousands of samples in denormals, which are many times slower on most
+// FPUs. Only the float post-path runs in this mode; equations keep IEEE semantics.
+#if defined(__SSE__)
+typedef unsigned int FpMode;
+static inline FpMode fp_flush_denormals(void) {
+    FpMode saved = _mm_getcsr();
+    _mm_setcsr(saved | 0x8040u);  // FTZ | DAZ
+    return saved;
+}
+static inline void fp_restore(FpMode saved) { _mm_setcsr(saved); }
+#elif defined(__aarch64__)
+typedef uint64_t FpMode;
+static inline FpMode fp_flush_denormals(void) {
+    FpMode saved;
+    __asm__ volatile("mrs %0, fpcr" : "=r"(saved));
+    __asm__ volatile("msr fpcr, %0" : : "r"(saved | (1ull << 24)));  // FZ
+    return saved;
+}
+static inline void fp_restore(FpMode saved) { __asm__ volatile("msr fpcr, %0" : : "r"(saved)); }
+#else
+typedef int FpMode;
+static inline FpMode fp_flush_denormals(void) { return 0; }
+static inline void fp_restore(FpMode saved) { (void)saved; }
+#endif
+
+// Clamps to [-limit, limit] without compares: fminf/fmaxf are calls and float
+// selects are not if-converted under trapping math, either of which keeps a
+// loop scalar, while fabsf is a mask.
+static inline float fx_clamp(float v, float limit) { return 0.5f * (fabsf(v + limit) - fabsf(v - limit)); }
+
+// Runs one block through DC blocker, bitcrusher, filter, delay and limiter, in
+// place. The crusher, delay and limiter are branch-free loops over contiguous
+// floats so the compiler vectorizes them; the DC blocker and filter are
+// recursive and stay scalar.
+static void fx_process(FxChain *fx, float *restrict x, int n) {
+    if (fx->dc_on) {
+        float x1 = fx->dc_x1, y1 = fx->dc_y1;
+        for (int i = 0; i < n; ++i) {
+            float y = x[i] - x1 + FX_DC_POLE * y1;
+            x1 = x[i];
+            x[i] = y1 = y;
+        }
+        fx->dc_x1 = x1;
+        fx->dc_y1 = y1;
+    }
+    if (fx->crush_hold > 1) {
+        uint32_t count = fx->crush_count, hold = fx->crush_hold;
+        float held = fx->crush_last;
+        for (int i = 0; i < n; ++i) {
+            if (count == 0) held = x[i];
+            x[i] = held;
+            if (++count == hold) count = 0;
+        }
+        fx->crush_count = count;
+        fx->crush_last = held;
+    }
+    if (fx->crush_levels > 0.0f) {
+        // Offset so the truncating conversion rounds; floorf is a library call
+        // unless the target has SSE4.1 or NEON.
+        const float levels = fx->crush_levels, step = 1.0f / levels;
+        for (int i = 0; i < n; ++i) {
+            float v = fx_clamp(x[i], 1.0f) * levels + levels + 0.5f;
+            x[i] = ((float)(int32_t)v - levels) * step;
+        }
+    }
+    if (fx->filter_on) {
+        const float a1 = fx->svf_a1, a2 = fx->svf_a2, a3 = fx->svf_a3;
+        const float m0 = fx->svf_mix[0], m1 = fx->svf_mix[1], m2 = fx->svf_mix[2];
+        float ic1 = fx->svf_ic1, ic2 = fx->svf_ic2;
+        for (int i = 0; i < n; ++i) {
+            float v3 = x[i] - ic2;
+            float v1 = a1 * ic1 + a2 * v3;
+            float v2 = ic2 + a2 * ic1 + a3 * v3;
+            ic1 = 2.0f * v1 - ic1;
+            ic2 = 2.0f * v2 - ic2;
+            x[i] = m0 * x[i] + m1 * v1 + m2 * v2;
+        }
+        fx->svf_ic1 = ic1;
+        fx->svf_ic2 = ic2;
+    }
+    if (fx->delay_on) {
+        // Spans never cross the ring's end and the read and write windows never
+        // overlap, so each inner loop is a plain streaming kernel.
+        const uint32_t d = fx->delay_frames;
+        const float fb = fx->feedback, mix = fx->mix;
+        float *ring = fx->delay;
+        uint32_t pos = fx->delay_pos;
+        for (int i = 0; i < n;) {
+            uint32_t r = pos >= d ? pos - d : pos + FX_DELAY_FRAMES - d;
+            uint32_t span = (uint32_t)(n - i);
+            if (span > FX_DELAY_FRAMES - pos) span = FX_DELAY_FRAMES - pos;
+            if (span > FX_DELAY_FRAMES - r) span = FX_DELAY_FRAMES - r;
+            if (span > d) span = d;
+            if (span > FX_DELAY_FRAMES - d) span = FX_DELAY_FRAMES - d;
+            const float *restrict wet = ring + r;
+            float *restrict w = ring + pos;
+            float *restrict io = x + i;
+            for (uint32_t j = 0; j < span; ++j) {
+                float dry = io[j];
+                w[j] = dry + fb * wet[j];
+                io[j] = dry + mix * wet[j];
+            }
+            pos += span;
+            if (pos == FX_DELAY_FRAMES) pos = 0;
+            i += (int)span;
+        }
+        fx->delay_pos = pos;
+    }
+    if (fx->drive > 0.0f) {
+        // Pade approximation of tanh, exact at the +-3 clamp where it reaches +-1.
+        const float drive = fx->drive;
+        for (int i = 0; i < n; ++i) {
+            float v = fx_clamp(x[i] * drive, 3.0f);
+            x[i] = v * (27.0f + v * v) / (27.0f + 9.0f * v * v);
+        }
+    }
+}
+
+// Real-time checks. synth_render marks its thread for the length of a buffer.
+// Built with -DNORA_RT_ALLOC_CHECK on glibc, the allocator entry points are
+// wrapped to count every call made while the mark is set. Nothing in the render
+// path should allocate: a nonzero count is a bug. The wrappers replace the
+// process allocator and get in the way of ASan and valgrind, so they are opt-in.
+// Waits for expr_lock are counted per synth (see synth_render).
+static _Thread_local bool t_in_render;
+static _Atomic uint64_t g_render_allocs;
+
+#if defined(__GLIBC__) && defined(NORA_RT_ALLOC_CHECK)
+#define RENDER_ALLOC_CHECK 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static inline void render_alloc_note(void) {
+    if (t_in_render) atomic_fetch_add_explicit(&g_render_allocs, 1, memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+    render_alloc_note();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    render_alloc_note();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    render_alloc_note();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) render_alloc_note();
+    __libc_free(ptr);
+}
+#else
+#define RENDER_ALLOC_CHECK 0
+#endif
+
+// Audio thread, after each buffer: feeds its render time to the governor. Only
+// real-time voices (those with an admission budget) are governed.
+static void governor_update(Synth *s, uint64_t render_ns, int n) {
+    Governor *g = &s->gov;
+    double load = (double)render_ns / (n * s->cost_budget_ns / ADMIT_SHARE);
+    g->load += (load - g->load) * GOV_SMOOTHING;
+    SynthStats *st = &s->stats;
+    atomic_store_explicit(&st->gov_load, g->load, memory_order_relaxed);
+    if (load > atomic_load_explicit(&st->gov_peak, memory_order_relaxed)) {
+        atomic_store_explicit(&st->gov_peak, load, memory_order_relaxed);
+    }
+    if (load > 1.0) atomic_fetch_add_explicit(&st->gov_overruns, 1, memory_order_relaxed);
+    // A lone slow buffer is usually preemption, which shedding cannot help.
+    bool panic = load > GOV_PANIC_LOAD && g->hot;
+    g->hot = load > GOV_PANIC_LOAD;
+    g->buffers++;
+    if (g->settle > 0) {
+        g->settle--;
+        return;
+    }
+    const uint64_t calm_needed = (uint64_t)GOV_CALM_BUFFERS << g->backoff;
+    if (g->backoff > 0 && g->restored_at && g->buffers - g->restored_at > 4 * calm_needed) {
+        g->backoff--;  // the last restore has held
+        g->restored_at = g->buffers;
+    }
+    bool can_shed = fmax(g->admitted, 1.0) * (double)(2 << g->step) <= ADMIT_MAX_DIVIDE;
+    if ((g->load > GOV_SHED_LOAD || panic) && can_shed) {
+        if (g->restored_at && g->buffers - g->restored_at < calm_needed && g->backoff < GOV_MAX_BACKOFF) {
+            g->backoff++;
+        }
+        g->step++;
+        atomic_fetch_add_explicit(&st->gov_sheds, 1, memory_order_relaxed);
+    } else if (g->step > 0 && g->load < GOV_RESTORE_LOAD) {
+        if ((uint64_t)++g->calm < calm_needed) return;
+        g->step--;
+        g->restored_at = g->buffers;
+        atomic_fetch_add_explicit(&st->gov_restores, 1, memory_order_relaxed);
+    } else {
+        g->calm = 0;
+        return;
+    }
+    g->calm = 0;
+    g->settle = GOV_SETTLE_BUFFERS;
+    governor_apply(s);
+    atomic_store_explicit(&st->gov_step, (uint64_t)g->step, memory_order_relaxed);
+}
+
+// Audio thread, under expr_lock: swaps in a compiled step. The slot takes the
+// replaced program, so nothing is allocated or freed here.
+static void sequencer_switch(Synth *s, Sequencer *seq, SeqSlot *slot) {
+    if (slot->expr) {
+        Expr *expr = s->expr;
+        char *src = s->expr_src;
+        ExprFrame frame = s->expr_frame;
+        s->expr = slot->expr;
+        s->expr_src = slot->src;
+        s->expr_frame = slot->frame;
+        s->native = slot->native;
+        slot->expr = expr;
+        slot->src = src;
+        slot->frame = frame;
+        slot->native_handle = s->native_handle;
+        s->native_handle = NULL;
+        s->expr_gen++;
+        if (s->recorder) {
+            char *note = s->seq_note;
+            s->seq_note = slot->note;
+            s->seq_note_gen = s->expr_gen;
+            slot->note = note;
+        }
+        s->gov.admitted = (double)slot->divide;
+        governor_apply(s);
+        atomic_store_explicit(&s->target_decimate, (double)slot->divide, memory_order_relaxed);
+        atomic_store_explicit(&s->expr_cost_ns, slot->cost_ns, memory_order_relaxed);
+    }
+    for (int i = 0; i < 6; ++i) {
+        if (!(slot->macro_set & (1u << i))) continue;
+        *controls_field(&s->live, (ControlId)(CTL_A + i)) = slot->macros[i];
+        atomic_store_explicit(control_target(s, (ControlId)(CTL_A + i)), slot->macros[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&seq->playing, slot->step, memory_order_relaxed);
+    atomic_fetch_add_explicit(&seq->switches, 1, memory_order_relaxed);
+}
+
+// Audio thread: makes every switch that is due and publishes the frame of the
+// next one. A step that is not compiled yet is switched in as soon as it is.
+static void sequencer_run_due(Synth *s) {
+    if (pthread_mutex_trylock(&s->expr_lock) != 0) {
+        atomic_fetch_add_explicit(&s->stats.render_lock_waits, 1, memory_order_relaxed);
+        pthread_mutex_lock(&s->expr_lock);
+    }
+    Sequencer *seq = s->seq;
+    uint64_t due = UINT64_MAX;
+    if (seq) {
+        if (!seq->started) {
+            seq->origin = s->frames;
+            seq->started = true;
+        }
+        uint32_t r = atomic_load_explicit(&seq->read_pos, memory_order_relaxed);
+        uint32_t w = atomic_load_explicit(&seq->write_pos, memory_order_acquire);
+        due = s->frames;  // behind: look again at the next buffer
+        for (; r != w; ++r) {
+            SeqSlot *slot = &seq->slots[r & (SEQ_AHEAD - 1)];
+            uint64_t at = seq->origin + slot->at;
+            if (at > s->frames) {
+                due = at;
+                break;
+            }
+            if (at < s->frames) {
+                atomic_fetch_add_explicit(&seq->late, 1, memory_order_relaxed);
+                if (s->frames - at > atomic_load_explicit(&seq->late_max_frames, memory_order_relaxed)) {
+                    atomic_store_explicit(&seq->late_max_frames, s->frames - at, memory_order_relaxed);
+                }
+            }
+            sequencer_switch(s, seq, slot);
+        }
+        atomic_store_explicit(&seq->read_pos, r, memory_order_release);
+    }
+    atomic_store_explicit(&s->seq_due, due, memory_order_relaxed);
+    pthread_mutex_unlock(&s->expr_lock);
+}
+
+// Renders n mono frames, as int16 into pcm or, when pcm is NULL, as unsigned
+// 8-bit into u8.
+static void synth_render_into(Synth *s, int16_t *pcm, uint8_t *u8, int n) {
+    // A sequencer switch lands on its frame: the buffer is rendered in two parts
+    // and the switch is made between them.
+    const uint64_t seq_due = atomic_load_explicit(&s->seq_due, memory_order_relaxed);
+    if (seq_due > s->frames && seq_due - s->frames < (uint64_t)n) {
+        int k = (int)(seq_due - s->frames);
+        synth_render_into(s, pcm, u8, k);
+        synth_render_into(s, pcm ? pcm + k : NULL, pcm ? NULL : u8 + k, n - k);
+        return;
+    }
+    const bool governed =
+        s->cost_budget_ns > 0.0 && atomic_load_explicit(&s->governor_enabled, memory_order_relaxed);
+    const uint64_t start_ns = governed ? now_ns() : 0;
+    t_in_render = true;
+    if (!s->ahead) drain_controls(s);  // the lookahead thread applies them on their frame
+    if (seq_due <= s->frames) sequencer_run_due(s);
+    if (!governed && s->gov.step) {
+        s->gov.step = 0;
+        governor_apply(s);
+        atomic_store_explicit(&s->stats.gov_step, 0, memory_order_relaxed);
+    }
+    const SynthControls *ctl = &s->live;
+    if (s->fx.dirty) fx_update(&s->fx, ctl->fx);
+    const bool fx_on = ctl->fx[FX_ON] != 0.0;
+    EvalContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.a = ctl->a;
+    ctx.b = ctl->b;
+    ctx.c = ctl->c;
+    ctx.d = ctl->d;
+    ctx.sh = floor(ctl->sh + 0.5);
+    ctx.mask = floor(ctl->mask + 0.5);
+    ctx.seed = s->seed;
+
+    // The render path keeps this lock rather than a lock-free handoff: every
+    // writer holds it only for a pointer swap or a short copy, and compiling,
+    // calibrating and freeing happen outside it. The lock inherits priority (see
+    // synth_init), so under --rt a holder runs at the render thread's priority.
+    // Any wait here is time the deadline does not budget for, so it is counted.
+    if (pthread_mutex_trylock(&s->expr_lock) != 0) {
+        atomic_fetch_add_explicit(&s->stats.render_lock_waits, 1, memory_order_relaxed);
+        pthread_mutex_lock(&s->expr_lock);
+    }
+    if (s->recorder) session_log_buffer(s);
+    if (atomic_load_explicit(&s->stats.render_gen, memory_order_relaxed) != s->expr_gen) {
+        atomic_store_explicit(&s->stats.render_gen_ns, now_ns(), memory_order_relaxed);
+        atomic_store_explicit(&s->stats.render_gen, s->expr_gen, memory_order_release);
+    }
+    Expr *expr = s->expr;
+    AotFn native = s->native;
+    // Native code takes the seed's bits after the macros.
+    double macros[7] = {ctx.a, ctx.b, ctx.c, ctx.d, ctx.sh, ctx.mask, 0.0};
+    memcpy(&macros[6], &ctx.seed, sizeof(ctx.seed));
+    const LoopCache *cache = s->loop_cache;
+    if (cache) {
+        double key[6];
+        loop_cache_key(key, ctl->a, ctl->b, ctl->c, ctl->d, ctl->sh, ctl->mask);
+        if (cache->gen != s->expr_gen || memcmp(key, cache->key, sizeof(key)) != 0 ||
+            !atomic_load_explicit(&s->loop_cache_enabled, memory_order_relaxed)) {
+            cache = NULL;
+        }
+    }
+    if (cache) atomic_fetch_add_explicit(&s->stats.loop_cache_buffers, 1, memory_order_relaxed);
+    ExprFrame *frame = &s->expr_frame;
+    // The program specialized for these exact macros, if the worker has one;
+    // any other setting falls straight back to the generic program.
+    SpecProgram *spec = cache || native ? NULL : s->spec;
+    if (spec && spec->gen == s->expr_gen && memcmp(macros, spec->key, sizeof(spec->key)) == 0 &&
+        atomic_load_explicit(&s->spec_enabled, memory_order_relaxed)) {
+        expr = spec->expr;
+        frame = &spec->frame;
+        atomic_fetch_add_explicit(&s->stats.spec_buffers, 1, memory_order_relaxed);
+    }
+    const double tempo_target = fmax(ctl->tempo, 0.05);
+    const double pitch_target = fmax(ctl->pitch, 0.125);
+    // Without a frame only a program with no locals or state can be evaluated.
+    bool bare = expr && !frame->locals && !frame->state;
+    // At a reduced internal rate the equation sees the t of the first of every
+    // 2^shift frames, counted from the start of the call, and its output is held.
+    const int shift = ctl->decimate >= 8.0 ? 3 : ctl->decimate >= 4.0 ? 2 : ctl->decimate >= 2.0 ? 1 : 0;
+    const int hold = (1 << shift) - 1;
+    for (int base = 0; base < n; base += EVAL_BLOCK) {
+        int m = n - base < EVAL_BLOCK ? n - base : EVAL_BLOCK;
+        uint8_t bytes[EVAL_BLOCK];
+        if (cache) {
+            for (int i = 0; i < m; ++i) {
+                bytes[i] = cache->bytes[synth_next_t(s, tempo_target, pitch_target) & (cache->period - 1)];
+            }
+        } else if (expr && frame->scratch) {
+            double *t = frame->scratch;
+            double *out = frame->scratch + EVAL_BLOCK;
+            int k = 0;
+            for (int i = 0; i < m; ++i) {
+                double ti = (double)synth_next_t(s, tempo_target, pitch_target);
+                if (!(i & hold)) t[k++] = ti;
+            }
+            if (native) {
+                native(macros, t, out, k, frame->vars + frame->locals);
+            } else {
+                expr_eval_frame(expr, frame, &ctx, t, out, k);
+            }
+            for (int i = 0; i < m; ++i) bytes[i] = (uint8_t)(block_i32(out[i >> shift]) & 0xFF);
+        } else {
+            for (int i = 0; i < m; ++i) {
+                ctx.t = (double)synth_next_t(s, tempo_target, pitch_target);
+                bytes[i] = bytebeat_to_byte(bare ? expr_eval(expr, &ctx) : 0.0);
+            }
+        }
+        if (fx_on) {
+            float samples[EVAL_BLOCK];
+            for (int i = 0; i < m; ++i) samples[i] = g_byte_float[bytes[i]];
+            FpMode fp = fp_flush_denormals();
+            fx_process(&s->fx, samples, m);
+            fp_restore(fp);
+            if (pcm) {
+                for (int i = 0; i < m; ++i) pcm[base + i] = sample_to_pcm(samples[i]);
+            } else {
+                for (int i = 0; i < m; ++i) u8[base + i] = sample_to_u8(samples[i]);
+            }
+        } else if (pcm) {
+            for (int i = 0; i < m; ++i) pcm[base + i] = g_byte_pcm[bytes[i]];
+        } else {
+            memcpy(u8 + base, bytes, (size_t)m);
+        }
+    }
+    s->frames += (uint64_t)n;
+    pthread_mutex_unlock(&s->expr_lock);
+    atomic_store_explicit(&s->position, s->phase.t, memory_order_relaxed);
+    t_in_render = false;
+    if (governed && n > 0) governor_update(s, now_ns() - start_ns, n);
+}
+
+// Renders n mono int16 frames. Shared by the AudioQueue callback and by the
+// headless renderers (daemon streams, benchmarks).
+static void synth_render(Synth *s, int16_t *pcm, int n) { synth_render_into(s, pcm, NULL, n); }
+
+// The same frames as unsigned 8-bit: without effects, the equation's own bytes.
+static void synth_render_u8(Synth *s, uint8_t *u8, int n) { synth_render_into(s, NULL, u8, n); }
+
+// Publishes the playback position for the lookahead scheduler. Single writer;
+// readers retry while the sequence is odd or changes under them.
+static void lookahead_mark(Lookahead *la, uint64_t frames, uint64_t ns) {
+    uint32_t seq = atomic_load_explicit(&la->anchor_seq, memory_order_relaxed);
+    atomic_store(&la->anchor_seq, seq + 1);
+    atomic_store(&la->anchor_frames, frames);
+    atomic_store(&la->anchor_ns, ns);
+    atomic_store(&la->anchor_seq, seq + 2);
+}
+
+static void lookahead_anchor(Lookahead *la, uint64_t *frames, uint64_t *ns) {
+    for (;;) {
+        uint32_t seq = atomic_load(&la->anchor_seq);
+        *frames = atomic_load(&la->anchor_frames);
+        *ns = atomic_load(&la->anchor_ns);
+        if (!(seq & 1) && seq == atomic_load(&la->anchor_seq)) return;
+    }
+}
+
+// Audio callback side: copies n frames out of the ring, or as many as are queued
+// followed by silence, and marks where playback has got to.
+static void lookahead_read(Lookahead *la, int16_t *pcm, int n) {
+    uint64_t r = atomic_load_explicit(&la->read_frames, memory_order_relaxed);
+    uint64_t w = atomic_load_explicit(&la->write_frames, memory_order_acquire);
+    int got = w - r < (uint64_t)n ? (int)(w - r) : n;
+    for (int i = 0; i < got; ++i) pcm[i] = la->pcm[(r + (uint64_t)i) & (la->capacity - 1)];
+    if (got < n) {
+        memset(pcm + got, 0, (size_t)(n - got) * sizeof(int16_t));
+        atomic_fetch_add_explicit(&la->underruns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&la->underrun_frames, (uint64_t)(n - got), memory_order_relaxed);
+    }
+    r += (uint64_t)got;
+    atomic_store_explicit(&la->read_frames, r, memory_order_release);
+    lookahead_mark(la, r, now_ns());
+    if (w - r < atomic_load_explicit(&la->low_fill, memory_order_relaxed)) {
+        atomic_store_explicit(&la->low_fill, w - r, memory_order_relaxed);
+    }
+}
+
+static void fill_buffer(Synth *s, AudioQueueBufferRef buf) {
+    if (s->ahead) {
+        lookahead_read(s->ahead, (int16_t *)buf->mAudioData, BUFFER_FRAMES);
+    } else {
+        synth_render(s, (int16_t *)buf->mAudioData, BUFFER_FRAMES);
+    }
+    buf->mAudioDataByteSize = (UInt32)(BUFFER_FRAMES * (int)sizeof(int16_t));
+}
+
+// Renders bytes[i] = output byte at t = t0 + i, starting from zeroed state.
+static bool expr_render_bytes(const Expr *e, const EvalContext *ctx, uint64_t t0, uint8_t *bytes, uint64_t count) {
+    ExprFrame frame;
+    if (!expr_frame_init(&frame, e)) return false;
+    EvalContext run = *ctx;
+    double *t = frame.scratch;
+    double *out = frame.scratch + EVAL_BLOCK;
+    for (uint64_t base = 0; base < count; base += EVAL_BLOCK) {
+        int n = count - base < EVAL_BLOCK ? (int)(count - base) : EVAL_BLOCK;
+        for (int i = 0; i < n; ++i) t[i] = (double)(t0 + base + (uint64_t)i);
+        expr_eval_frame(e, &frame, &run, t, out, n);
+        for (int i = 0; i < n; ++i) bytes[base + (uint64_t)i] = (uint8_t)(block_i32(out[i]) & 0xFF);
+    }
+    expr_frame_free(&frame);
+    return true;
+}
+
+static void loop_cache_free(LoopCache *cache) {
+    if (!cache) return;
+    free(cache->bytes);
+    free(cache);
+}
+
+static void loop_cache_publish(Synth *s, LoopCache *cache) {
+    pthread_mutex_lock(&s->expr_lock);
+    LoopCache *old = s->loop_cache;
+    s->loop_cache = cache;
+    pthread_mutex_unlock(&s->expr_lock);
+    loop_cache_free(old);
+}
+
+// Worker thread: proves the period of the current equation at the current macros
+// and, if it is short enough, renders one period for fill_buffer to play back.
+static void loop_cache_build(Synth *s, const char *src, uint64_t gen, const double key[6]) {
+    char err[256];
+    Expr *expr = compile_expr(src, err, sizeof(err));
+    if (!expr) return;
+    EvalContext ctx;
+    loop_cache_context(&ctx, key);
+    ctx.seed = s->seed;
+
+    uint64_t period = expr_output_period(expr, &ctx);
+    atomic_store_explicit(&s->loop_period, period, memory_order_relaxed);
+    LoopCache *cache = NULL;
+    // Every proven period is a power of two; playback indexes with a mask.
+    if (period && period <= LOOP_CACHE_MAX_PERIOD && !(period & (period - 1))) {
+        cache = (LoopCache *)calloc(1, sizeof(LoopCache));
+        uint8_t *bytes = (uint8_t *)malloc((size_t)period);
+        if (!cache || !bytes || !expr_render_bytes(expr, &ctx, 0, bytes, period)) {
+            free(cache);
+            free(bytes);
+            cache = NULL;
+        } else {
+            cache->gen = gen;
+            memcpy(cache->key, key, sizeof(cache->key));
+            cache->period = period;
+            cache->bytes = bytes;
+        }
+    }
+    expr_free(expr);
+    loop_cache_publish(s, cache);
+}
+
+static void spec_free(SpecProgram *spec) {
+    if (!spec) return;
+    expr_free(spec->expr);
+    expr_frame_free(&spec->frame);
+    free(spec);
+}
+
+static void spec_publish(Synth *s, SpecProgram *spec) {
+    pthread_mutex_lock(&s->expr_lock);
+    SpecProgram *old = s->spec;
+    s->spec = spec;
+    pthread_mutex_unlock(&s->expr_lock);
+    spec_free(old);
+}
+
+static int profile_count(const Expr *e);
+
+// Specializes a compiled program for the macros in key, or returns NULL if it
+// keeps persistent state or memory runs out.
+static SpecProgram *spec_create(const Expr *expr, const double key[6]) {
+    uint32_t locals = 0;
+    uint32_t state = 0;
+    expr_frame_size(expr, &locals, &state);
+    if (state) return NULL;
+    SpecProgram *spec = (SpecProgram *)calloc(1, sizeof(SpecProgram));
+    if (!spec) return NULL;
+    EvalContext ctx;
+    loop_cache_context(&ctx, key);
+    spec->expr = expr_specialize(expr, &ctx);
+    if (!spec->expr || !expr_frame_init(&spec->frame, spec->expr)) {
+        spec_free(spec);
+        return NULL;
+    }
+    memcpy(spec->key, key, sizeof(spec->key));
+    spec->nodes = profile_count(spec->expr);
+    spec->generic_nodes = profile_count(expr);
+    return spec;
+}
+
+// Worker thread: rebuilds the current equation specialized for the current
+// macros, for synth_render to run while they stay where they are.
+static void spec_build(Synth *s, const char *src, uint64_t gen, const double key[6]) {
+    char err[256];
+    Expr *expr = compile_expr(src, err, sizeof(err));
+    if (!expr) return;
+    SpecProgram *spec = spec_create(expr, key);
+    if (spec) spec->gen = gen;
+    expr_free(expr);
+    spec_publish(s, spec);
+}
+
+static void *synth_worker_main(void *user) {
+    Synth *s = (Synth *)user;
+    uint64_t seen_gen = 0;
+    double seen_key[6] = {0};
+    char *src = NULL;
+    int stable_polls = 0;
+    bool built = false;
+    while (atomic_load_explicit(&s->worker_running, memory_order_relaxed)) {
+        struct timespec pause = {0, LOOP_CACHE_POLL_NS};
+        nanosleep(&pause, NULL);
+        const bool loop = atomic_load_explicit(&s->loop_cache_enabled, memory_order_relaxed);
+        const bool spec = atomic_load_explicit(&s->spec_enabled, memory_order_relaxed);
+        if (!loop && !spec) continue;
+
+        double key[6];
+        loop_cache_key(key, atomic_load_explicit(&s->macro_a, memory_order_relaxed),
+                       atomic_load_explicit(&s->macro_b, memory_order_relaxed),
+                       atomic_load_explicit(&s->macro_c, memory_order_relaxed),
+                       atomic_load_explicit(&s->macro_d, memory_order_relaxed),
+                       atomic_load_explicit(&s->macro_shift, memory_order_relaxed),
+                       atomic_load_explicit(&s->macro_mask, memory_order_relaxed));
+        pthread_mutex_lock(&s->expr_lock);
+        uint64_t gen = s->expr_gen;
+        if (gen != seen_gen) {
+            free(src);
+            src = s->expr_src ? strdup(s->expr_src) : NULL;
+        }
+        pthread_mutex_unlock(&s->expr_lock);
+
+        // Wait for the equation and macros to settle so slider drags don't
+        // trigger a render per step.
+        if (gen != seen_gen || memcmp(key, seen_key, sizeof(key)) != 0) {
+            seen_gen = gen;
+            memcpy(seen_key, key, sizeof(key));
+            stable_polls = 0;
+            built = false;
+            continue;
+        }
+        if (built || !src || ++stable_polls < LOOP_CACHE_STABLE_POLLS) continue;
+        built = true;
+        if (loop) loop_cache_build(s, src, gen, key);
+        if (spec) spec_build(s, src, gen, key);
+    }
+    free(src);
+    return NULL;
+}
+
+static void worker_start(Synth *s) {
+    if (atomic_load_explicit(&s->worker_running, memory_order_relaxed)) return;
+    atomic_store_explicit(&s->worker_running, true, memory_order_relaxed);
+    if (pthread_create(&s->worker, NULL, synth_worker_main, s) != 0) {
+        atomic_store_explicit(&s->worker_running, false, memory_order_relaxed);
+    }
+}
+
+static void worker_stop(Synth *s) {
+    if (!atomic_load_explicit(&s->worker_running, memory_order_relaxed)) return;
+    atomic_store_explicit(&s->worker_running, false, memory_order_relaxed);
+    pthread_join(s->worker, NULL);
+}
+
+static void audio_cb(void *user, AudioQueueRef q, AudioQueueBufferRef buf) {
+    (void)q;
+    Synth *s = (Synth *)user;
+    if (!atomic_load_explicit(&s->running, memory_order_relaxed)) return;
+    fill_buffer(s, buf);
+    AudioQueueEnqueueBuffer(s->queue, buf, 0, NULL);
+}
+
+static bool audio_start(Synth *s) {
+    AudioStreamBasicDescription fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.mSampleRate = SAMPLE_RATE;
+    fmt.mFormatID = kAudioFormatLinearPCM;
+    fmt.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
+    fmt.mBitsPerChannel = 16;
+    fmt.mChannelsPerFrame = CHANNELS;
+    fmt.mBytesPerFrame = CHANNELS * 2;
+    fmt.mFramesPerPacket = 1;
+    fmt.mBytesPerPacket = fmt.mBytesPerFrame;
+
+    OSStatus st = AudioQueueNewOutput(&fmt, audio_cb, s, NULL, NULL, 0, &s->queue);
+    if (st != noErr) {
+        fprintf(stderr, "AudioQueueNewOutput failed: %d\n", (int)st);
+        return false;
+    }
+
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        st = AudioQueueAllocateBuffer(s->queue, BUFFER_FRAMES * sizeof(int16_t), &s->buffers[i]);
+        if (st != noErr) {
+            fprintf(stderr, "AudioQueueAllocateBuffer failed: %d\n", (int)st);
+            return false;
+        }
+        fill_buffer(s, s->buffers[i]);
+        AudioQueueEnqueueBuffer(s->queue, s->buffers[i], 0, NULL);
+    }
+
+    st = AudioQueueStart(s->queue, NULL);
+    if (st != noErr) {
+        fprintf(stderr, "AudioQueueStart failed: %d\n", (int)st);
+        return false;
+    }
+    worker_start(s);
+    return true;
+}
+
+static void audio_stop(Synth *s) {
+    worker_stop(s);
+    if (s->queue) {
+        AudioQueueStop(s->queue, true);
+        AudioQueueDispose(s->queue, true);
+        s->queue = NULL;
+    }
+}
+
+static int preset_count(void);
+
+static void print_help(void) {
+    printf("Commands:\n");
+    printf("  eq <js_expr_or_js_return_program>  Set bytebeat equation\n");
+    printf("  a <value>                          Set macro a (float)\n");
+    printf("  b <value>                          Set macro b (float)\n");
+    printf("  c <value>                          Set macro c (float)\n");
+    printf("  d <value>                          Set macro d (float)\n");
+    printf("  sh <value>                         Set bit-shift macro (integer-ish)\n");
+    printf("  mask <value>                       Set bitmask macro (integer-ish)\n");
+    printf("  pl                                 List all presets (built-in or bank)\n");
+    printf("  ps <index>                         Switch to preset index (1..%d)\n", preset_count());
+    printf("  pn                                 Next preset\n");
+    printf("  pp                                 Previous preset\n");
+    printf("  p <semitones>                      Set pitch shift in semitones (-36..+36, e.g. -12, +7)\n");
+    printf("  tm <multiplier>                    Set tempo multiplier (0.05..8.0)\n");
+    printf("  seek <seconds>                     Jump to a time at the target tempo and pitch\n");
+    printf("  scrub <+/-seconds>                 Move the timeline forward or back from here\n");
+    printf("  bank <file>|off                    Load a preset bank / return to built-in presets\n");
+    printf("  rec <file>|off                     Record a replayable session / stop recording\n");
+    printf("  watch <file>|off                   Live-code: reload the equation file on every save\n");
+    printf("  seq [<file>|off]                   Play a pattern file on a beat grid / stop / show status\n");
+    printf("  osc <port>                         Listen for OSC/UDP control on 127.0.0.1:<port>\n");
+    printf("  osc off                            Stop the OSC listener\n");
+    printf("  fx [on|off]                        Show the effects chain / bypass it\n");
+    printf("  fx dc on|off                       DC blocker\n");
+    printf("  fx lp|hp|bp <hz> [q] | filter off  State-variable filter\n");
+    printf("  fx crush <bits> [hold]|off         Bitcrusher with optional sample-and-hold\n");
+    printf("  fx limit <drive>|off               Soft limiter\n");
+    printf("  fx delay <ms> [fb] [mix]|off       Feedback delay (up to 2 s)\n");
+    printf("  loop on|off                        Play provably periodic equations from a rendered loop\n");
+    printf("  spec on|off                        Run the equation specialized for idle macro values\n");
+    printf("  gov on|off                         Lower the internal rate under CPU load, restore it after\n");
+    printf("  aot [on|off]                       Build the equation to native code now / for every new one\n");
+    printf("  stats                              Show control, loop cache and OSC statistics\n");
+    printf("  prof [seconds] [out.json]          Profile the current equation per subexpression\n");
+    printf("  s                                  Show current controls\n");
+    printf("  h                                  Help\n");
+    printf("  q                                  Quit\n");
+}
+
+static void session_note_source(SessionRecorder *rec, SessionSource *note) {
+    pthread_mutex_lock(&rec->src_lock);
+    *rec->sources_tail = note;
+    rec->sources_tail = &note->next;
+    pthread_mutex_unlock(&rec->src_lock);
+}
+
+// Static cost model. An equation's cost per evaluated sample is estimated from
+// its tree before it is installed: a bare `t` costs `base` (the frame and loop
+// overhead), and every other node adds what one node of its kind was measured to
+// add on this machine. Leaves are priced into their parents, because an operator
+// probe `t op t` pays for its extra operand. Ternaries count both branches for
+// the block evaluator, which runs them, and the dearer one sample by sample.
+typedef struct {
+    double base;
+    double node[EX_SEQ + 1];   // EX_TERNARY, EX_INDEX and EX_ASSIGN
+    double op[OP_ASSIGN + 1];  // unary and binary operators
+    double fn[FN_NOISE + 1];   // built-in functions
+} CostTable;
+
+#define COST_PROBE_SAMPLES 4096
+#define COST_PROBE_ROUNDS 5
+
+static CostTable g_cost[2];  // [0] sample by sample, [1] block evaluator
+static pthread_once_t g_cost_once = PTHREAD_ONCE_INIT;
+
+static double expr_cost(const Expr *e, const CostTable *c, bool block) {
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+        case EX_LOCAL:
+        case EX_STATE:
+            return 0.0;
+        case EX_UNARY:
+            return c->op[e->as.unary.op] + expr_cost(e->as.unary.a, c, block);
+        case EX_BINARY:
+            return c->op[e->as.binary.op] + expr_cost(e->as.binary.a, c, block) + expr_cost(e->as.binary.b, c, block);
+        case EX_TERNARY: {
+            double yes = expr_cost(e->as.ternary.yes, c, block);
+            double no = expr_cost(e->as.ternary.no, c, block);
+            return c->node[EX_TERNARY] + expr_cost(e->as.ternary.cond, c, block) + (block ? yes + no : fmax(yes, no));
+        }
+        case EX_FUNC: {
+            double sum = c->fn[fn_lookup(e->as.func.name, e->as.func.argc)];
+            for (int i = 0; i < e->as.func.argc; ++i) sum += expr_cost(e->as.func.args[i], c, block);
+            return sum;
+        }
+        case EX_INDEX:
+            return c->node[EX_INDEX] + expr_cost(e->as.ref.index, c, block);
+        case EX_ASSIGN: {
+            double sum = c->node[EX_ASSIGN] + expr_cost(e->as.assign.value, c, block);
+            if (e->as.assign.op != OP_ASSIGN) sum += c->op[e->as.assign.op];
+            if (e->as.assign.target->type == EX_INDEX) sum += expr_cost(e->as.assign.target, c, block);
+            return sum;
+        }
+        case EX_SEQ:
+            return expr_cost(e->as.seq.first, c, block) + expr_cost(e->as.seq.rest, c, block);
+    }
+    return 0.0;
+}
+
+// Best of COST_PROBE_ROUNDS, in ns per sample, for running e with the chosen
+// evaluator; -1 if e cannot run that way.
+static double cost_probe_time(const Expr *e, bool block) {
+    ExprFrame frame;
+    if (!expr_frame_init(&frame, e)) return -1.0;
+    if (block && !frame.block) {
+        expr_frame_free(&frame);
+        return -1.0;
+    }
+    frame.block = block;
+    EvalContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.a = 5.0;
+    ctx.b = 3.0;
+    ctx.c = 7.0;
+    ctx.d = 10.0;
+    ctx.sh = 8.0;
+    ctx.mask = 127.0;
+    double *t = frame.scratch;
+    double *out = frame.scratch + EVAL_BLOCK;
+    double best = -1.0;
+    for (int round = 0; round < COST_PROBE_ROUNDS; ++round) {
+        uint64_t start = now_ns();
+        for (int base = 0; base < COST_PROBE_SAMPLES; base += EVAL_BLOCK) {
+            for (int i = 0; i < EVAL_BLOCK; ++i) t[i] = (double)((1u << 20) + base + i);
+            expr_eval_frame(e, &frame, &ctx, t, out, EVAL_BLOCK);
+        }
+        double ns = (double)(now_ns() - start) / COST_PROBE_SAMPLES;
+        if (best < 0.0 || ns < best) best = ns;
+    }
+    expr_frame_free(&frame);
+    return best;
+}
+
+typedef enum { COST_NODE, COST_OP, COST_FN } CostKind;
+
+static double *cost_entry(CostTable *c, CostKind kind, int index) {
+    return kind == COST_NODE ? &c->node[index] : kind == COST_OP ? &c->op[index] : &c->fn[index];
+}
+
+// Times src and credits whatever it costs beyond the entries already measured to
+// one entry. Probes run in an order where every other node in them is known.
+static void cost_probe(const char *src, CostKind kind, int index) {
+    char err[256];
+    Expr *e = compile_expr(src, err, sizeof(err));
+    if (!e) return;
+    for (int block = 0; block < 2; ++block) {
+        CostTable *c = &g_cost[block];
+        double *slot = cost_entry(c, kind, index);
+        double ns = cost_probe_time(e, block);
+        if (ns < 0.0) continue;
+        *slot = 0.0;
+        *slot = fmax(0.0, ns - c->base - expr_cost(e, c, block));
+    }
+    expr_free(e);
+}
+
+static void cost_calibrate(void) {
+    char err[256];
+    Expr *bare = compile_expr("t", err, sizeof(err));
+    for (int block = 0; block < 2 && bare; ++block) g_cost[block].base = fmax(0.0, cost_probe_time(bare, block));
+    expr_free(bare);
+    char src[64];
+    for (int op = OP_NEG; op < OP_ASSIGN; ++op) {
+        if (op <= OP_LNOT) {
+            snprintf(src, sizeof(src), "%st", op_symbol((Op)op));
+        } else {
+            snprintf(src, sizeof(src), "t %s t", op_symbol((Op)op));
+        }
+        cost_probe(src, COST_OP, op);
+    }
+    for (int i = 0; i < FUNCTION_COUNT; ++i) {
+        // Extra arguments are constants so pow and clamp see ordinary values.
+        snprintf(src, sizeof(src), "%s(%s)", kFunctions[i].name,
+                 kFunctions[i].argc == 3   ? "t, 0.5, 0.5"
+                 : kFunctions[i].argc == 2 ? "t, 0.5"
+                 : kFunctions[i].argc == 1 ? "t"
+                                           : "");
+        cost_probe(src, COST_FN, kFunctions[i].id);
+    }
+    cost_probe("t ? t : t", COST_NODE, EX_TERNARY);
+    cost_probe("let x = t; x", COST_NODE, EX_ASSIGN);
+    cost_probe("let buf = new Array(256); buf[t & 255]", COST_NODE, EX_INDEX);
+}
+
+static double admit_budget_ns(int voices) { return ADMIT_SHARE * 1e9 / SAMPLE_RATE / (voices > 0 ? voices : 1); }
+
+// Estimates e's cost per evaluated sample into *cost_ns and returns the smallest
+// internal rate divisor that fits budget_ns, or 0 if none does. A budget of 0
+// admits everything at full rate without estimating.
+static int expr_admit(const Expr *e, double budget_ns, double *cost_ns) {
+    *cost_ns = 0.0;
+    if (!(budget_ns > 0.0)) return 1;
+    pthread_once(&g_cost_once, cost_calibrate);
+    bool block = expr_block_ok(e);
+    *cost_ns = g_cost[block].base + expr_cost(e, &g_cost[block], block);
+    for (int divide = 1; divide <= ADMIT_MAX_DIVIDE; divide *= 2) {
+        if (*cost_ns / divide <= budget_ns) return divide;
+    }
+    return 0;
+}
+
+static void format_admission(char *buf, size_t size, double cost_ns, double budget_ns, int divide) {
+    double ms = BUFFER_FRAMES / 1e6;
+    int n = snprintf(buf, size, "est. %.2f ms per %d-frame buffer, budget %.2f ms", cost_ns * ms, BUFFER_FRAMES,
+                     budget_ns * ms);
+    if (n < 0 || (size_t)n >= size) return;
+    if (!divide) {
+        snprintf(buf + n, size - (size_t)n, ", too expensive even at 1/%d rate", ADMIT_MAX_DIVIDE);
+    } else if (divide > 1) {
+        snprintf(buf + n, size - (size_t)n, ": running at 1/%d internal rate (%d Hz)", divide, SAMPLE_RATE / divide);
+    } else {
+        snprintf(buf + n, size - (size_t)n, ": full rate");
+    }
+}
+
+// Ahead-of-time compilation. An equation's tree is emitted as C that computes
+// exactly what expr_eval computes: the same integer conversions and guards,
+// operands evaluated in the same order, and no floating-point contraction, so a
+// native voice renders bit for bit what the interpreter (and a session replay)
+// renders. The system compiler builds it into a shared object, which is
+// dlopen'd. A module exports a table of entries keyed by the C source the synth
+// keeps as expr_src: installing an equation with an entry in a loaded preset
+// library runs it natively from the first buffer.
+#define AOT_ABI 2
+#define AOT_MAX_LIBS 8
+
+#if defined(__aarch64__)
+#define AOT_ARCH_FLAG "-mcpu=native"
+#else
+#define AOT_ARCH_FLAG "-march=native"
+#endif
+
+// Target flag for generated code: the build machine's own CPU, unless
+// $NORA_AOT_ARCH is set. Set it empty for the compiler's portable default, as
+// the Makefile does for the preset library it ships.
+static const char *aot_arch_flag(void) {
+    const char *arch = getenv("NORA_AOT_ARCH");
+    return arch ? arch : AOT_ARCH_FLAG;
+}
+
+typedef struct {
+    const char *src;
+    AotFn fn;
+} AotEntry;
+
+typedef struct {
+    void *handle;
+    const AotEntry *entries;
+    int count;
+} AotModule;
+
+static AotModule g_aot_libs[AOT_MAX_LIBS];  // preset libraries: loaded at startup, never closed
+static int g_aot_lib_count;
+static _Atomic bool g_aot_auto;
+
+// Helpers every module starts with. nora_i32 is block_i32, which equals to_i32
+// wherever either is defined; shifts go through uint32_t so they are defined for
+// negative operands and do what the interpreter's shifts do on every target.
+static const char kAotPrelude[] =
+    "#include <math.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "typedef void (*AotFn)(const double *, const double *, double *, int, double *);\n"
+    "typedef struct {\n"
+    "    const char *src;\n"
+    "    AotFn fn;\n"
+    "} AotEntry;\n"
+    "\n"
+    "static inline int32_t nora_i32(double v) { return (int32_t)(int64_t)floor(v); }\n"
+    "static inline uint32_t nora_u32(double v) { return (uint32_t)nora_i32(v); }\n"
+    "static inline double nora_div(double a, double b) { return fabs(b) < 1e-12 ? 0.0 : a / b; }\n"
+    "static inline double nora_mod(double a, double b) {\n"
+    "    int32_t ib = nora_i32(b);\n"
+    "    return ib == 0 ? 0.0 : (double)(nora_i32(a) % ib);\n"
+    "}\n"
+    "static inline uint32_t nora_wrap(int32_t i, uint32_t length) {\n"
+    "    int64_t r = (int64_t)i % (int64_t)length;\n"
+    "    return (uint32_t)(r < 0 ? r + (int64_t)length : r);\n"
+    "}\n"
+    "static inline uint64_t nora_mix(uint64_t z) {\n"
+    "    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;\n"
+    "    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;\n"
+    "    return z ^ (z >> 31);\n"
+    "}\n"
+    "static inline uint64_t nora_counter(double v) { return fabs(v) < 0x1p63 ? (uint64_t)(int64_t)v : 0; }\n"
+    "static inline double nora_unit(uint64_t key, uint64_t counter) {\n"
+    "    return (double)(nora_mix(key + counter * 0x9e3779b97f4a7c15ull) >> 11) * 0x1p-53;\n"
+    "}\n"
+    "static inline double nora_noise(uint64_t key, double x) {\n"
+    "    const double cell = floor(x);\n"
+    "    const double f = fabs(cell) < 0x1p63 ? x - cell : 0.0;\n"
+    "    const uint64_t i = nora_counter(cell);\n"
+    "    const double lo = nora_unit(key, i);\n"
+    "    const double hi = nora_unit(key, i + 1);\n"
+    "    return lo + (hi - lo) * (f * f * (3.0 - 2.0 * f));\n"
+    "}\n";
+
+typedef struct {
+    FILE *out;
+    int next;   // next temporary
+    int depth;  // block nesting, for indentation
+} AotEmitter;
+
+static void aot_line(AotEmitter *em, const char *fmt, ...) {
+    fprintf(em->out, "%*s", 4 * (em->depth + 2), "");
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(em->out, fmt, ap);
+    va_end(ap);
+    fputc('\n', em->out);
+}
+
+// C text of a non-short-circuit binary operator, matching binary_apply.
+static void aot_binary_text(char *buf, size_t size, Op op, const char *a, const char *b) {
+    switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            snprintf(buf, size, "%s %s %s", a, op_symbol(op), b);
+            return;
+        case OP_DIV:
+            snprintf(buf, size, "nora_div(%s, %s)", a, b);
+            return;
+        case OP_MOD:
+            snprintf(buf, size, "nora_mod(%s, %s)", a, b);
+            return;
+        case OP_LT:
+        case OP_GT:
+        case OP_LE:
+        case OP_GE:
+            snprintf(buf, size, "%s %s %s ? 1.0 : 0.0", a, op_symbol(op), b);
+            return;
+        case OP_EQ:
+            snprintf(buf, size, "fabs(%s - %s) < 1e-12 ? 1.0 : 0.0", a, b);
+            return;
+        case OP_NE:
+            snprintf(buf, size, "fabs(%s - %s) >= 1e-12 ? 1.0 : 0.0", a, b);
+            return;
+        case OP_BAND:
+        case OP_BOR:
+        case OP_BXOR:
+            snprintf(buf, size, "(double)(nora_i32(%s) %s nora_i32(%s))", a, op_symbol(op), b);
+            return;
+        case OP_SHL:
+            snprintf(buf, size, "(double)(int32_t)((uint32_t)nora_i32(%s) << (nora_i32(%s) & 31))", a, b);
+            return;
+        case OP_SHR:
+            snprintf(buf, size, "(double)(nora_i32(%s) >> (nora_i32(%s) & 31))", a, b);
+            return;
+        case OP_USHR:
+            snprintf(buf, size, "(double)(nora_u32(%s) >> (nora_i32(%s) & 31))", a, b);
+            return;
+        default:
+            snprintf(buf, size, "0.0");
+            return;
+    }
+}
+
+static int aot_emit(AotEmitter *em, const Expr *e);
+
+// Emits the address of an assignment target into p<id> (evaluating an index).
+static void aot_emit_lvalue(AotEmitter *em, const Expr *target, int id) {
+    switch (target->type) {
+        case EX_LOCAL:
+            aot_line(em, "double *p%d = &L[%u];", id, target->as.ref.slot);
+            return;
+        case EX_STATE:
+            aot_line(em, "double *p%d = &S[%u];", id, target->as.ref.slot);
+            return;
+        default: {
+            int i = aot_emit(em, target->as.ref.index);
+            aot_line(em, "double *p%d = &S[%uu + nora_wrap(nora_i32(v%d), %uu)];", id, target->as.ref.slot, i,
+                     target->as.ref.length);
+            return;
+        }
+    }
+}
+
+// Emits the statements for e and returns the temporary v<id> holding its value.
+static int aot_emit(AotEmitter *em, const Expr *e) {
+    static const char *const kVars[] = {"t[i]", "m_a", "m_b", "m_c", "m_d", "m_sh", "m_mask"};
+    char a[32], b[32], text[160];
+    switch (e->type) {
+        case EX_NUM: {
+            int id = em->next++;
+            if (isnan(e->as.num)) {
+                aot_line(em, "const double v%d = NAN;", id);
+            } else if (isinf(e->as.num)) {
+                aot_line(em, "const double v%d = %sHUGE_VAL;", id, e->as.num < 0 ? "-" : "");
+            } else {
+                aot_line(em, "const double v%d = %a;", id, e->as.num);
+            }
+            return id;
+        }
+        case EX_VAR: {
+            int id = em->next++;
+            aot_line(em, "const double v%d = %s;", id, kVars[e->as.var]);
+            return id;
+        }
+        case EX_UNARY: {
+            int x = aot_emit(em, e->as.unary.a);
+            int id = em->next++;
+            switch (e->as.unary.op) {
+                case OP_NEG:
+                    aot_line(em, "const double v%d = -v%d;", id, x);
+                    break;
+                case OP_BNOT:
+                    aot_line(em, "const double v%d = (double)(~nora_i32(v%d));", id, x);
+                    break;
+                case OP_LNOT:
+                    aot_line(em, "const double v%d = !v%d ? 1.0 : 0.0;", id, x);
+                    break;
+                default:
+                    aot_line(em, "const double v%d = 0.0;", id);
+                    break;
+            }
+            return id;
+        }
+        case EX_BINARY: {
+            Op op = e->as.binary.op;
+            if (op == OP_LAND || op == OP_LOR) {
+                int left = aot_emit(em, e->as.binary.a);
+                int id = em->next++;
+                aot_line(em, "double v%d = %s;", id, op == OP_LAND ? "0.0" : "1.0");
+                aot_line(em, "if (%sv%d) {", op == OP_LAND ? "" : "!", left);
+                em->depth++;
+                int right = aot_emit(em, e->as.binary.b);
+                aot_line(em, "v%d = v%d ? 1.0 : 0.0;", id, right);
+                em->depth--;
+                aot_line(em, "}");
+                return id;
+            }
+            int x = aot_emit(em, e->as.binary.a);
+            int y = aot_emit(em, e->as.binary.b);
+            int id = em->next++;
+            snprintf(a, sizeof(a), "v%d", x);
+            snprintf(b, sizeof(b), "v%d", y);
+            aot_binary_text(text, sizeof(text), op, a, b);
+            aot_line(em, "const double v%d = %s;", id, text);
+            return id;
+        }
+        case EX_TERNARY: {
+            int cond = aot_emit(em, e->as.ternary.cond);
+            int id = em->next++;
+            aot_line(em, "double v%d;", id);
+            aot_line(em, "if (v%d) {", cond);
+            em->depth++;
+            aot_line(em, "v%d = v%d;", id, aot_emit(em, e->as.ternary.yes));
+            em->depth--;
+            aot_line(em, "} else {");
+            em->depth++;
+            aot_line(em, "v%d = v%d;", id, aot_emit(em, e->as.ternary.no));
+            em->depth--;
+            aot_line(em, "}");
+            return id;
+        }
+        case EX_FUNC: {
+            int args[8];
+            int argc = e->as.func.argc > 8 ? 8 : e->as.func.argc;
+            for (int i = 0; i < argc; ++i) args[i] = aot_emit(em, e->as.func.args[i]);
+            int id = em->next++;
+            switch (fn_lookup(e->as.func.name, argc)) {
+                case FN_SIN:
+                case FN_COS:
+                case FN_TAN:
+                case FN_FLOOR:
+                case FN_CEIL:
+                    aot_line(em, "const double v%d = %s(v%d);", id, e->as.func.name, args[0]);
+                    break;
+                case FN_ABS:
+                    aot_line(em, "const double v%d = fabs(v%d);", id, args[0]);
+                    break;
+                case FN_SQRT:
+                    aot_line(em, "const double v%d = sqrt(fabs(v%d));", id, args[0]);
+                    break;
+                case FN_POW:
+                    aot_line(em, "const double v%d = pow(v%d, v%d);", id, args[0], args[1]);
+                    break;
+                case FN_MIN:
+                    aot_line(em, "const double v%d = fmin(v%d, v%d);", id, args[0], args[1]);
+                    break;
+                case FN_MAX:
+                    aot_line(em, "const double v%d = fmax(v%d, v%d);", id, args[0], args[1]);
+                    break;
+                case FN_CLAMP:
+                    aot_line(em, "const double v%d = fmax(v%d, fmin(v%d, v%d));", id, args[1], args[2], args[0]);
+                    break;
+                case FN_RANDOM:
+                    aot_line(em, "const double v%d = nora_unit(nora_mix(seed ^ %lluull * 0x9e3779b97f4a7c15ull), "
+                             "nora_counter(t[i]));", id, (unsigned long long)e->as.func.site + 1);
+                    break;
+                case FN_NOISE:
+                    aot_line(em, "const double v%d = nora_noise(nora_mix(seed ^ 0x6e6f697365ull), v%d);", id, args[0]);
+                    break;
+                case FN_NONE:
+                    aot_line(em, "const double v%d = 0.0;", id);
+                    break;
+            }
+            return id;
+        }
+        case EX_LOCAL: {
+            int id = em->next++;
+            aot_line(em, "const double v%d = L[%u];", id, e->as.ref.slot);
+            return id;
+        }
+        case EX_STATE: {
+            int id = em->next++;
+            aot_line(em, "const double v%d = S[%u];", id, e->as.ref.slot);
+            return id;
+        }
+        case EX_INDEX: {
+            int x = aot_emit(em, e->as.ref.index);
+            int id = em->next++;
+            aot_line(em, "const double v%d = S[%uu + nora_wrap(nora_i32(v%d), %uu)];", id, e->as.ref.slot, x,
+                     e->as.ref.length);
+            return id;
+        }
+        case EX_ASSIGN: {
+            int value = aot_emit(em, e->as.assign.value);
+            int id = em->next++;
+            aot_emit_lvalue(em, e->as.assign.target, id);
+            snprintf(a, sizeof(a), "*p%d", id);
+            snprintf(b, sizeof(b), "v%d", value);
+            if (e->as.assign.op == OP_ASSIGN) {
+                snprintf(text, sizeof(text), "%s", b);
+            } else {
+                aot_binary_text(text, sizeof(text), e->as.assign.op, a, b);
+            }
+            aot_line(em, "const double v%d = %s;", id, text);
+            aot_line(em, "*p%d = v%d;", id, id);
+            return id;
+        }
+        case EX_SEQ:
+            aot_emit(em, e->as.seq.first);
+            return aot_emit(em, e->as.seq.rest);
+    }
+    int id = em->next++;
+    aot_line(em, "const double v%d = 0.0;", id);
+    return id;
+}
+
+// Writes s as a C string literal.
+static void aot_write_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7F || c == '?') {
+            fprintf(out, "\\%03o", c);  // '?' too, so no trigraph can form
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Writes the C source of a module holding count equations.
+static void aot_write_module(FILE *out, const char *const *srcs, Expr *const *exprs, int count) {
+    fprintf(out, "// Generated by NORA; do not edit.\n%s", kAotPrelude);
+    for (int k = 0; k < count; ++k) {
+        uint32_t locals = 0, state = 0;
+        expr_frame_size(exprs[k], &locals, &state);
+        fprintf(out, "\nstatic void nora_eq_%d(const double *m, const double *t, double *out, int n, double *S) {\n",
+                k);
+        fprintf(out, "    const double m_a = m[0], m_b = m[1], m_c = m[2], m_d = m[3], m_sh = m[4], m_mask = m[5];\n");
+        fprintf(out, "    uint64_t seed;\n");
+        fprintf(out, "    memcpy(&seed, &m[6], sizeof(seed));\n");
+        fprintf(out, "    (void)S;\n    (void)seed;\n");
+        fprintf(out, "    for (int i = 0; i < n; ++i) {\n");
+        if (locals) fprintf(out, "        double L[%u] = {0};\n", locals);
+        AotEmitter em = {out, 0, 0};
+        int result = aot_emit(&em, exprs[k]);
+        fprintf(out, "        out[i] = v%d;\n    }\n}\n", result);
+    }
+    fprintf(out, "\nconst int nora_aot_abi = %d;\nconst int nora_aot_count = %d;\n", AOT_ABI, count);
+    fprintf(out, "const AotEntry nora_aot_entries[] = {\n");
+    for (int k = 0; k < count; ++k) {
+        fprintf(out, "    {");
+        aot_write_string(out, srcs[k]);
+        fprintf(out, ", nora_eq_%d},\n", k);
+    }
+    fprintf(out, "    {0, 0}};\n");
+}
+
+// Runs the system compiler ($NORA_CC, default cc) on c_path. On failure err holds
+// the first line the compiler printed.
+static bool aot_build(const char *c_path, const char *so_path, const char *log_path, char *err, size_t err_sz) {
+    const char *cc = getenv("NORA_CC");
+    if (!cc || !*cc) cc = "cc";
+    pid_t pid = fork();
+    if (pid < 0) {
+        snprintf(err, err_sz, "fork failed: %s", strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        const char *arch = aot_arch_flag();
+        const char *args[] = {cc,     "-std=c11", "-O3", "-ffp-contract=off", "-fPIC", "-shared", "-o",
+                              so_path, c_path,    "-lm", *arch ? arch : NULL,  NULL};  // an empty flag ends the list
+        execvp(cc, (char *const *)args);
+        fprintf(stderr, "cannot run %s: %s\n", cc, strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return true;
+    char first[200] = "";
+    FILE *log = fopen(log_path, "r");
+    if (log) {
+        if (!fgets(first, sizeof(first), log)) first[0] = '\0';
+        fclose(log);
+    }
+    first[strcspn(first, "\r\n")] = '\0';
+    snprintf(err, err_sz, "%s failed%s%s", cc, first[0] ? ": " : "", first);
+    return false;
+}
+
+static bool aot_open(AotModule *m, const char *path, char *err, size_t err_sz) {
+    memset(m, 0, sizeof(*m));
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        snprintf(err, err_sz, "Cannot load %s: %s", path, dlerror());
+        return false;
+    }
+    const int *abi = (const int *)dlsym(handle, "nora_aot_abi");
+    const int *count = (const int *)dlsym(handle, "nora_aot_count");
+    const AotEntry *entries = (const AotEntry *)dlsym(handle, "nora_aot_entries");
+    if (!abi || !count || !entries || *abi != AOT_ABI) {
+        snprintf(err, err_sz, "%s is not a NORA module for this version", path);
+        dlclose(handle);
+        return false;
+    }
+    m->handle = handle;
+    m->entries = entries;
+    m->count = *count;
+    return true;
+}
+
+// Emits and builds a module for count equations into so_path, or, with so_path
+// NULL, into a temporary directory that is removed again once the module is
+// loaded into m.
+static bool aot_compile(const char *const *srcs, Expr *const *exprs, int count, const char *so_path, AotModule *m,
+                        char *err, size_t err_sz) {
+    const char *tmp = getenv("TMPDIR");
+    char dir[200];
+    snprintf(dir, sizeof(dir), "%s/nora-aot-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        snprintf(err, err_sz, "Cannot create a build directory: %s", strerror(errno));
+        return false;
+    }
+    char c_path[216], tmp_so[216], log_path[216];
+    snprintf(c_path, sizeof(c_path), "%s/eq.c", dir);
+    snprintf(tmp_so, sizeof(tmp_so), "%s/eq.so", dir);
+    snprintf(log_path, sizeof(log_path), "%s/cc.log", dir);
+    bool ok = false;
+    FILE *out = fopen(c_path, "w");
+    if (!out) {
+        snprintf(err, err_sz, "Cannot write the generated source: %s", strerror(errno));
+    } else {
+        aot_write_module(out, srcs, exprs, count);
+        if (fclose(out) != 0) {
+            snprintf(err, err_sz, "Cannot write the generated source");
+        } else {
+            const char *target = so_path ? so_path : tmp_so;
+            ok = aot_build(c_path, target, log_path, err, err_sz) && (!m || aot_open(m, target, err, err_sz));
+        }
+    }
+    unlink(c_path);
+    unlink(tmp_so);
+    unlink(log_path);
+    rmdir(dir);
+    return ok;
+}
+
+// Native code for an equation from the loaded preset libraries, if any.
+static AotFn aot_lookup(const char *src) {
+    for (int l = 0; l < g_aot_lib_count; ++l) {
+        for (int i = 0; i < g_aot_libs[l].count; ++i) {
+            if (!strcmp(g_aot_libs[l].entries[i].src, src)) return g_aot_libs[l].entries[i].fn;
+        }
+    }
+    return NULL;
+}
+
+static bool aot_load_library(const char *path, char *err, size_t err_sz) {
+    if (g_aot_lib_count == AOT_MAX_LIBS) {
+        snprintf(err, err_sz, "Too many native libraries (max %d)", AOT_MAX_LIBS);
+        return false;
+    }
+    if (!aot_open(&g_aot_libs[g_aot_lib_count], path, err, err_sz)) return false;
+    g_aot_lib_count++;
+    return true;
+}
+
+// Swaps in a compiled equation and its C source; the synth takes ownership of both.
+static void synth_install_expr(Synth *s, Expr *root, char *c_src) {
+    // The frame is allocated here, never on the audio thread. Installing a
+    // program always starts its persistent state from zero.
+    ExprFrame frame;
+    expr_frame_init(&frame, root);
+    AotFn native = c_src ? aot_lookup(c_src) : NULL;
+    SessionSource *note = (SessionSource *)calloc(1, sizeof(SessionSource));
+    if (note) note->src = strdup(c_src);
+    pthread_mutex_lock(&s->expr_lock);
+    Expr *old = s->expr;
+    char *old_src = s->expr_src;
+    ExprFrame old_frame = s->expr_frame;
+    void *old_native = s->native_handle;
+    s->expr = root;
+    s->expr_src = c_src;
+    s->expr_frame = frame;
+    s->native = native;
+    s->native_handle = NULL;
+    s->expr_gen++;
+    if (s->recorder && note && note->src) {
+        note->gen = s->expr_gen;
+        session_note_source(s->recorder, note);
+        note = NULL;
+    }
+    pthread_mutex_unlock(&s->expr_lock);
+    if (note) free(note->src);
+    free(note);
+    expr_free(old);
+    free(old_src);
+    expr_frame_free(&old_frame);
+    if (old_native) dlclose(old_native);
+}
+
+// Builds the installed equation to native code and hot-swaps it in. The
+// interpreter keeps playing while the compiler runs; the swap is dropped if the
+// equation changed meanwhile. *ms is the build time, 0 if it was native already.
+static bool synth_compile_native(Synth *s, double *ms, char *err, size_t err_sz) {
+    *ms = 0.0;
+    if (g_math_mode == MATH_FAST) {
+        snprintf(err, err_sz, "Native code calls libm, so it is not used with --math fast");
+        return false;
+    }
+    pthread_mutex_lock(&s->expr_lock);
+    uint64_t gen = s->expr_gen;
+    bool native = s->native != NULL;
+    char *src = s->expr_src && !native ? strdup(s->expr_src) : NULL;
+    pthread_mutex_unlock(&s->expr_lock);
+    if (native) return true;
+    if (!src) {
+        snprintf(err, err_sz, "No equation to compile");
+        return false;
+    }
+    uint64_t start = now_ns();
+    char cerr[256];
+    Expr *e = compile_expr(src, cerr, sizeof(cerr));
+    AotModule m;
+    bool ok = e && aot_compile((const char *const *)&src, &e, 1, NULL, &m, err, err_sz);
+    if (!e) snprintf(err, err_sz, "Compile error: %s", cerr);
+    expr_free(e);
+    free(src);
+    if (!ok) return false;
+    *ms = (double)(now_ns() - start) / 1e6;
+    pthread_mutex_lock(&s->expr_lock);
+    bool current = s->expr_gen == gen;
+    void *old = s->native_handle;
+    if (current) {
+        s->native = m.entries[0].fn;
+        s->native_handle = m.handle;
+    }
+    pthread_mutex_unlock(&s->expr_lock);
+    if (!current) {
+        dlclose(m.handle);
+        snprintf(err, err_sz, "Equation changed while compiling");
+        return false;
+    }
+    if (old) dlclose(old);
+    return true;
+}
+
+// `aot on` builds run on their own thread, so the REPL, the OSC main loop and the
+// file watcher never wait for the compiler. A request made while a build runs
+// is picked up when it finishes; the superseded build's swap is dropped by
+// synth_compile_native and not reported.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool started;
+    bool pending;
+    bool stopping;
+    Synth *synth;
+} AotWorker;
+
+static AotWorker g_aot_worker = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+static void *aot_worker_main(void *user) {
+    AotWorker *w = (AotWorker *)user;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->pending && !w->stopping) pthread_cond_wait(&w->wake, &w->lock);
+        if (w->stopping) break;
+        w->pending = false;
+        Synth *s = w->synth;
+        pthread_mutex_unlock(&w->lock);
+        char err[300];
+        double ms = 0.0;
+        bool ok = synth_compile_native(s, &ms, err, sizeof(err));
+        pthread_mutex_lock(&w->lock);
+        if (w->pending) continue;
+        if (!ok) {
+            printf("\nNative build: %s\n", err);
+        } else if (ms > 0.0) {
+            printf("\nNative build: %.0f ms, now running compiled code\n", ms);
+        }
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// With `aot on`, queues a native build of the newly installed equation.
+static void queue_native_build(Synth *s) {
+    if (!atomic_load_explicit(&g_aot_auto, memory_order_relaxed)) return;
+    AotWorker *w = &g_aot_worker;
+    pthread_mutex_lock(&w->lock);
+    if (!w->started) w->started = pthread_create(&w->thread, NULL, aot_worker_main, w) == 0;
+    if (w->started) {
+        w->synth = s;
+        w->pending = true;
+        pthread_cond_signal(&w->wake);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (!w->started) puts("Native build: cannot start the build thread");
+}
+
+// Waits for a running build and stops the thread, before the synth goes away.
+static void aot_worker_stop(void) {
+    AotWorker *w = &g_aot_worker;
+    pthread_mutex_lock(&w->lock);
+    bool started = w->started;
+    w->stopping = true;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    if (started) pthread_join(w->thread, NULL);
+    w->started = w->stopping = w->pending = false;
+}
+
+// Sets the internal rate an admitted equation runs at and records its estimate.
+static void synth_set_decimate(Synth *s, int divide, double cost_ns) {
+    atomic_store_explicit(&s->expr_cost_ns, cost_ns, memory_order_relaxed);
+    if (atomic_load_explicit(&s->target_decimate, memory_order_relaxed) != (double)divide) {
+        synth_set_control(s, CTL_DECIMATE, (double)divide);
+    }
+}
+
+// Admits a compiled equation against s->cost_budget_ns and installs it, taking
+// ownership of root and c_src either way. The internal rate is lowered before the
+// swap and raised after it, so no buffer runs an equation faster than admitted.
+static bool synth_admit_install(Synth *s, Expr *root, char *c_src, char *err, size_t err_sz) {
+    double cost_ns = 0.0;
+    int divide = expr_admit(root, s->cost_budget_ns, &cost_ns);
+    if (!divide) {
+        char why[160];
+        format_admission(why, sizeof(why), cost_ns, s->cost_budget_ns, 0);
+        snprintf(err, err_sz, "Equation rejected: %s", why);
+        expr_free(root);
+        free(c_src);
+        return false;
+    }
+    bool slower = (double)divide > atomic_load_explicit(&s->target_decimate, memory_order_relaxed);
+    if (slower) synth_set_decimate(s, divide, cost_ns);
+    synth_install_expr(s, root, c_src);
+    if (!slower) synth_set_decimate(s, divide, cost_ns);
+    return true;
+}
+
+// Re-runs admission for the installed equation, e.g. after the budget changed.
+static bool synth_readmit(Synth *s, char *err, size_t err_sz) {
+    // The first estimate calibrates the cost table, which takes tens of ms, so
+    // that happens before taking the lock the renderer needs. The estimate itself
+    // is a tree walk; it is published under the lock so it always belongs to the
+    // installed equation.
+    if (s->cost_budget_ns > 0.0) pthread_once(&g_cost_once, cost_calibrate);
+    double cost_ns = 0.0;
+    pthread_mutex_lock(&s->expr_lock);
+    int divide = s->expr ? expr_admit(s->expr, s->cost_budget_ns, &cost_ns) : 1;
+    if (divide) synth_set_decimate(s, divide, cost_ns);
+    pthread_mutex_unlock(&s->expr_lock);
+    if (!divide) {
+        char why[160];
+        format_admission(why, sizeof(why), cost_ns, s->cost_budget_ns, 0);
+        snprintf(err, err_sz, "Equation rejected: %s", why);
+        return false;
+    }
+    return true;
+}
+
+// Reports a reduced internal rate; says nothing for an equation at full rate.
+static void print_admission(const Synth *s) {
+    double divide = atomic_load_explicit(&s->target_decimate, memory_order_relaxed);
+    if (divide <= 1.0) return;
+    char why[160];
+    format_admission(why, sizeof(why), atomic_load_explicit(&s->expr_cost_ns, memory_order_relaxed),
+                     s->cost_budget_ns, (int)divide);
+    printf("Too expensive for full rate: %s\n", why);
+}
+
+// Transpiles, compiles, admits and installs an equation without printing. On
+// failure err holds the reason and the current equation is left in place.
+static bool synth_load_expr(Synth *s, const char *js, char *err, size_t err_sz) {
+    char *c_expr = transpile_js_to_c(js);
+    if (!c_expr) {
+        snprintf(err, err_sz, "Failed to transpile equation");
+        return false;
+    }
+
+    char cerr[256];
+    Expr *root = compile_expr(c_expr, cerr, sizeof(cerr));
+    if (!root) {
+        snprintf(err, err_sz, "Compile error: %s", cerr);
+        free(c_expr);
+        return false;
+    }
+    return synth_admit_install(s, root, c_expr, err, err_sz);
+}
+
+// Re-transpiles for display rather than reading expr_src, so stdout is never
+// written while holding expr_lock.
+static void print_transpiled(const char *js) {
+    char *c_expr = transpile_js_to_c(js);
+    printf("JS -> C: %s\n", c_expr ? c_expr : "?");
+    free(c_expr);
+}
+
+static bool set_expr(Synth *s, const char *js) {
+    char err[300];
+    if (!synth_load_expr(s, js, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return false;
+    }
+    print_transpiled(js);
+    print_admission(s);
+    queue_native_build(s);
+    return true;
+}
+
+// Preset banks: a read-only file that is mmap'd whole. It holds each preset's
+// name, JS source, transpiled C source, default macros and its compiled tree as
+// flat post-order nodes, so selecting a preset rebuilds the Expr from the nodes
+// without lexing or parsing. All integers are host-endian; the loader rejects a
+// file written with a different byte order.
+#define BANK_MAGIC "NORABNK1"
+#define BANK_VERSION 1u
+#define BANK_BYTE_ORDER 0x01020304u
+#define BANK_MAX_NODES 65536
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t preset_count;
+    uint32_t node_count;
+    uint32_t child_count;
+    uint32_t reserved;
+    uint64_t entries_offset;
+    uint64_t nodes_offset;
+    uint64_t children_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t file_size;
+} BankHeader;
+
+typedef struct {
+    uint32_t name_offset;  // NUL-terminated strings in the string table
+    uint32_t js_offset;
+    uint32_t src_offset;
+    uint32_t node_first;  // nodes [node_first, node_first + node_count), root last
+    uint32_t node_count;
+    uint32_t macro_set;  // bit i: macros[i] is a default (a, b, c, d, sh, mask)
+    double macros[6];
+} BankEntry;
+
+typedef struct {
+    uint8_t type;          // ExprType
+    uint8_t op;            // Op (unary/binary/assign), VarId or FnId
+    uint16_t argc;         // number of children
+    uint32_t child_first;  // children[child_first .. + argc): node indices
+    double num;            // constant, variable slot, random() call site, or slot * 2^32 + length for arrays
+} BankNode;
+
+#define BANK_ARRAY_SCALE 4294967296.0
+
+typedef struct {
+    void *map;
+    size_t size;
+    const BankHeader *hdr;
+    const BankEntry *entries;
+    const BankNode *nodes;
+    const uint32_t *children;
+    const char *strings;
+} PresetBank;
+
+static PresetBank g_bank;
+static pthread_mutex_t g_bank_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool bank_range_ok(uint64_t offset, uint64_t count, uint64_t elem, uint64_t file_size) {
+    return offset % 8 == 0 && offset <= file_size && count <= (file_size - offset) / elem;
+}
+
+// Maps and checks a bank file. Entry ranges and string offsets are validated
+// here; node contents are validated when a preset is selected.
+static bool bank_open(PresetBank *bank, const char *path, char *err, size_t err_sz) {
+    memset(bank, 0, sizeof(*bank));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, err_sz, "Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BankHeader)) {
+        snprintf(err, err_sz, "%s is not a preset bank", path);
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        snprintf(err, err_sz, "mmap %s failed: %s", path, strerror(errno));
+        return false;
+    }
+    const uint8_t *base = (const uint8_t *)map;
+    const BankHeader *h = (const BankHeader *)map;
+    const char *why = NULL;
+    if (memcmp(h->magic, BANK_MAGIC, 8) != 0) {
+        why = "bad magic";
+    } else if (h->byte_order != BANK_BYTE_ORDER) {
+        why = "written on a host with a different byte order";
+    } else if (h->version != BANK_VERSION) {
+        why = "unsupported version";
+    } else if (h->file_size != size) {
+        why = "truncated";
+    } else if (h->preset_count == 0) {
+        why = "no presets";
+    } else if (!bank_range_ok(h->entries_offset, h->preset_count, sizeof(BankEntry), size) ||
+               !bank_range_ok(h->nodes_offset, h->node_count, sizeof(BankNode), size) ||
+               !bank_range_ok(h->children_offset, h->child_count, sizeof(uint32_t), size) ||
+               !bank_range_ok(h->strings_offset, h->strings_size, 1, size) || h->strings_size == 0 ||
+               base[h->strings_offset + h->strings_size - 1] != '\0') {
+        why = "section out of bounds";
+    }
+    const BankEntry *entries = (const BankEntry *)(base + h->entries_offset);
+    for (uint32_t i = 0; !why && i < h->preset_count; ++i) {
+        const BankEntry *be = &entries[i];
+        if (be->name_offset >= h->strings_size || be->js_offset >= h->strings_size ||
+            be->src_offset >= h->strings_size || be->node_count == 0 || be->node_count > BANK_MAX_NODES ||
+            be->node_first > h->node_count || be->node_count > h->node_count - be->node_first) {
+            why = "bad preset entry";
+        }
+    }
+    if (why) {
+        snprintf(err, err_sz, "%s: %s", path, why);
+        munmap(map, size);
+        return false;
+    }
+    bank->map = map;
+    bank->size = size;
+    bank->hdr = h;
+    bank->entries = entries;
+    bank->nodes = (const BankNode *)(base + h->nodes_offset);
+    bank->children = (const uint32_t *)(base + h->children_offset);
+    bank->strings = (const char *)(base + h->strings_offset);
+    return true;
+}
+
+static void bank_close(PresetBank *bank) {
+    if (bank->map) munmap(bank->map, bank->size);
+    memset(bank, 0, sizeof(*bank));
+}
+
+// Rebuilds the Expr tree of one preset from its flat nodes. Every node must be a
+// valid operator whose children come earlier in the preset's range and are used
+// by exactly one parent, so the result is always a tree.
+static Expr *bank_entry_expr(const PresetBank *bank, const BankEntry *be) {
+    uint32_t first = be->node_first;
+    uint32_t count = be->node_count;
+    Expr **built = (Expr **)calloc(count, sizeof(Expr *));
+    if (!built) return NULL;
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        const BankNode *bn = &bank->nodes[first + i];
+        int argc = bn->argc;
+        static const int kArity[] = {[EX_NUM] = 0,   [EX_VAR] = 0,   [EX_UNARY] = 1, [EX_BINARY] = 2,
+                                     [EX_TERNARY] = 3, [EX_LOCAL] = 0, [EX_STATE] = 0, [EX_INDEX] = 1,
+                                     [EX_ASSIGN] = 2,  [EX_SEQ] = 2};
+        if (bn->type > EX_SEQ || (bn->type == EX_FUNC ? argc > 8 : argc != kArity[bn->type]) ||
+            bn->child_first > bank->hdr->child_count || (uint32_t)argc > bank->hdr->child_count - bn->child_first) {
+            ok = false;
+            break;
+        }
+        Expr *kids[8] = {NULL};
+        for (int k = 0; k < argc; ++k) {
+            uint32_t c = bank->children[bn->child_first + (uint32_t)k];
+            if (c < first || c - first >= i || !built[c - first]) {
+                ok = false;
+                break;
+            }
+            kids[k] = built[c - first];
+            built[c - first] = NULL;
+        }
+        if (!ok) {
+            for (int k = 0; k < argc; ++k) expr_free(kids[k]);
+            break;
+        }
+        Expr *e = expr_new((ExprType)bn->type);
+        if (!e) {
+            for (int k = 0; k < argc; ++k) expr_free(kids[k]);
+            ok = false;
+            break;
+        }
+        switch (bn->type) {
+            case EX_NUM:
+                e->as.num = bn->num;
+                break;
+            case EX_VAR:
+                ok = bn->op <= VAR_MASK;
+                e->as.var = (VarId)bn->op;
+                break;
+            case EX_UNARY:
+                ok = bn->op <= OP_LNOT;
+                e->as.unary.op = (Op)bn->op;
+                e->as.unary.a = kids[0];
+                break;
+            case EX_BINARY:
+                ok = bn->op >= OP_ADD && bn->op <= OP_USHR;
+                e->as.binary.op = (Op)bn->op;
+                e->as.binary.a = kids[0];
+                e->as.binary.b = kids[1];
+                break;
+            case EX_TERNARY:
+                e->as.ternary.cond = kids[0];
+                e->as.ternary.yes = kids[1];
+                e->as.ternary.no = kids[2];
+                break;
+            case EX_FUNC:
+                // A known function id with its own argument count.
+                ok = bn->op != FN_NONE && fn_lookup(fn_name((FnId)bn->op), argc) == (FnId)bn->op &&
+                     bn->num >= 0 && bn->num < 4294967296.0;
+                snprintf(e->as.func.name, sizeof(e->as.func.name), "%s", fn_name((FnId)bn->op));
+                e->as.func.site = ok ? (uint32_t)bn->num : 0;
+                e->as.func.args = argc ? (Expr **)calloc((size_t)argc, sizeof(Expr *)) : NULL;
+                if (argc && !e->as.func.args) {
+                    for (int k = 0; k < argc; ++k) expr_free(kids[k]);
+                    ok = false;
+                    break;
+                }
+                e->as.func.argc = argc;
+                for (int k = 0; k < argc; ++k) e->as.func.args[k] = kids[k];
+                break;
+            case EX_LOCAL:
+            case EX_STATE:
+                ok = bn->num >= 0 && bn->num == floor(bn->num) &&
+                     bn->num < (bn->type == EX_LOCAL ? PROGRAM_MAX_NAMES : PROGRAM_MAX_STATE);
+                e->as.ref.slot = ok ? (uint32_t)bn->num : 0;
+                break;
+            case EX_INDEX: {
+                double slot = floor(bn->num / BANK_ARRAY_SCALE);
+                double length = bn->num - slot * BANK_ARRAY_SCALE;
+                ok = bn->num == floor(bn->num) && slot >= 0 && length >= 1 && slot + length <= PROGRAM_MAX_STATE;
+                e->as.ref.slot = ok ? (uint32_t)slot : 0;
+                e->as.ref.length = ok ? (uint32_t)length : 1;
+                e->as.ref.index = kids[0];
+                break;
+            }
+            case EX_ASSIGN:
+                ok = (bn->op == OP_ASSIGN || (bn->op >= OP_ADD && bn->op <= OP_USHR)) &&
+                     (kids[0]->type == EX_LOCAL || kids[0]->type == EX_STATE || kids[0]->type == EX_INDEX);
+                e->as.assign.op = (Op)bn->op;
+                e->as.assign.target = kids[0];
+                e->as.assign.value = kids[1];
+                break;
+            case EX_SEQ:
+                e->as.seq.first = kids[0];
+                e->as.seq.rest = kids[1];
+                break;
+        }
+        built[i] = e;
+    }
+    Expr *root = NULL;
+    if (ok) {
+        root = built[count - 1];
+        built[count - 1] = NULL;
+        for (uint32_t i = 0; i + 1 < count; ++i) ok = ok && !built[i];  // every node reachable from the root
+        if (!ok) {
+            expr_free(root);
+            root = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) expr_free(built[i]);
+    free(built);
+    return root;
+}
+
+static int preset_count(void) { return g_bank.hdr ? (int)g_bank.hdr->preset_count : PRESET_COUNT; }
+
+static const char *preset_name(int idx) {
+    return g_bank.hdr ? g_bank.strings + g_bank.entries[idx].name_offset : kPresets[idx].name;
+}
+
+static const char *preset_js(int idx) {
+    return g_bank.hdr ? g_bank.strings + g_bank.entries[idx].js_offset : kPresets[idx].js;
+}
+
+// Installs preset idx without printing. Bank presets are installed from their
+// precompiled nodes and apply their default macros.
+static bool synth_load_preset(Synth *s, int idx, char *err, size_t err_sz) {
+    pthread_mutex_lock(&g_bank_lock);
+    if (idx < 0 || idx >= preset_count()) {
+        snprintf(err, err_sz, "Preset index out of range (1..%d)", preset_count());
+        pthread_mutex_unlock(&g_bank_lock);
+        return false;
+    }
+    if (!g_bank.hdr) {
+        pthread_mutex_unlock(&g_bank_lock);
+        return synth_load_expr(s, kPresets[idx].js, err, err_sz);
+    }
+    const BankEntry *be = &g_bank.entries[idx];
+    Expr *root = bank_entry_expr(&g_bank, be);
+    char *src = root ? strdup(g_bank.strings + be->src_offset) : NULL;
+    ControlEvent events[6];
+    int n = 0;
+    uint64_t stamp = now_ns();
+    for (int i = 0; i < 6; ++i) {
+        if (be->macro_set & (1u << i)) events[n++] = (ControlEvent){(ControlId)(CTL_A + i), be->macros[i], stamp};
+    }
+    pthread_mutex_unlock(&g_bank_lock);
+    if (!root || !src) {
+        expr_free(root);
+        free(src);
+        snprintf(err, err_sz, "Preset %d is corrupt in the bank", idx + 1);
+        return false;
+    }
+    if (!synth_admit_install(s, root, src, err, err_sz)) return false;
+    if (n) synth_post_controls(s, events, n);
+    return true;
+}
+
+// Replaces the preset list with a bank file, or restores the built-ins for NULL.
+static bool preset_bank_load(const char *path, char *err, size_t err_sz) {
+    PresetBank bank;
+    memset(&bank, 0, sizeof(bank));
+    if (path && !bank_open(&bank, path, err, err_sz)) return false;
+    pthread_mutex_lock(&g_bank_lock);
+    PresetBank old = g_bank;
+    g_bank = bank;
+    pthread_mutex_unlock(&g_bank_lock);
+    bank_close(&old);
+    return true;
+}
+
+// Bank strings live in the mapping, so they are read under g_bank_lock: another
+// thread may swap the bank and unmap it.
+static void print_presets(const Synth *s) {
+    const int current = atomic_load_explicit(&s->current_preset, memory_order_relaxed);
+    pthread_mutex_lock(&g_bank_lock);
+    puts(g_bank.hdr ? "Bank presets:" : "Built-in bytebeat presets:");
+    for (int i = 0; i < preset_count(); ++i) {
+        const char *marker = (i == current) ? "*" : " ";
+        printf(" %s %2d. %s\n", marker, i + 1, preset_name(i));
+    }
+    pthread_mutex_unlock(&g_bank_lock);
+}
+
+static void set_preset(Synth *s, int idx) {
+    char err[300];
+    if (!synth_load_preset(s, idx, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return;
+    }
+    atomic_store_explicit(&s->current_preset, idx, memory_order_relaxed);
+    char *name = NULL, *js = NULL;
+    pthread_mutex_lock(&g_bank_lock);
+    if (idx < preset_count()) {
+        name = strdup(preset_name(idx));
+        js = strdup(preset_js(idx));
+    }
+    pthread_mutex_unlock(&g_bank_lock);
+    if (js) print_transpiled(js);
+    printf("Preset %d selected: %s\n", idx + 1, name ? name : "?");
+    free(name);
+    free(js);
+    print_admission(s);
+    queue_native_build(s);
+}
+
+// Session files: header (magic "NORASES1", u32 version, u32 byte-order mark,
+// u32 sample rate, u32 checkpoint interval in frames, u64 voice seed), then records of
+// u8 kind + varint sample delta + payload, host byte order:
+//   SES_CONTROL     u8 ControlId, f64 value
+//   SES_EQ          varint length, C source bytes
+//   SES_CHECKPOINT  u64 phase t/frac, u64 increment t/frac, f64 smooth tempo/pitch,
+//                   u8 rate_steady, f64 tempo pitch a b c d sh mask, f64 fx[FX_PARAM_COUNT],
+//                   f64 decimate
+//   SES_END         varint records dropped while recording
+//   SES_SEEK        the state left by a seek or scrub, laid out as SES_CHECKPOINT
+// Version 1 sessions predate the effects chain: no fx controls or checkpoint fields.
+// Version 2 sessions predate admission control: no decimate control or field.
+// Version 3 sessions predate seeking: no SES_SEEK records.
+// Version 4 sessions predate random() and noise(): no seed, which replays as 0.
+#define SESSION_MAGIC "NORASES1"
+#define SESSION_VERSION 5u
+
+static void session_put_varint(FILE *f, uint64_t v) {
+    uint8_t buf[10];
+    int n = 0;
+    do {
+        buf[n] = (uint8_t)(v & 0x7F);
+        v >>= 7;
+        if (v) buf[n] |= 0x80;
+        n++;
+    } while (v);
+    fwrite(buf, 1, (size_t)n, f);
+}
+
+static void session_put_u64(FILE *f, uint64_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+static void session_put_f64(FILE *f, double v) { fwrite(&v, sizeof(v), 1, f); }
+
+static void session_put_state(FILE *f, const SynthState *st) {
+    session_put_u64(f, st->phase.t);
+    session_put_u64(f, st->phase.frac);
+    session_put_u64(f, st->phase_inc.t);
+    session_put_u64(f, st->phase_inc.frac);
+    session_put_f64(f, st->smooth_tempo);
+    session_put_f64(f, st->smooth_pitch);
+    fputc(st->rate_steady ? 1 : 0, f);
+    for (int id = CTL_A; id <= CTL_DECIMATE; ++id) {
+        session_put_f64(f, *controls_field((SynthControls *)&st->live, (ControlId)id));
+    }
+}
+
+static char *session_take_source(SessionRecorder *rec, uint64_t gen) {
+    char *src = NULL;
+    pthread_mutex_lock(&rec->src_lock);
+    while (rec->sources && rec->sources->gen <= gen) {
+        SessionSource *head = rec->sources;
+        rec->sources = head->next;
+        if (head->gen == gen) {
+            free(src);
+            src = head->src;
+        } else {
+            free(head->src);
+        }
+        free(head);
+    }
+    if (!rec->sources) rec->sources_tail = &rec->sources;
+    pthread_mutex_unlock(&rec->src_lock);
+    return src;
+}
+
+static void session_write_record(SessionRecorder *rec, const SessionRecord *r, uint64_t *prev_sample) {
+    FILE *f = rec->file;
+    fputc(r->kind, f);
+    session_put_varint(f, r->sample - *prev_sample);
+    *prev_sample = r->sample;
+    switch ((SessionRecordKind)r->kind) {
+        case SES_CONTROL:
+            fputc(r->id, f);
+            session_put_f64(f, r->value);
+            break;
+        case SES_EQ: {
+            char *src = r->src ? r->src : session_take_source(rec, r->gen);
+            const char *text = src ? src : "0";
+            session_put_varint(f, strlen(text));
+            fwrite(text, 1, strlen(text), f);
+            free(src);
+            break;
+        }
+        case SES_CHECKPOINT:
+        case SES_SEEK:
+            session_put_state(f, &r->state);
+            break;
+        case SES_END:
+            session_put_varint(f, r->gen);
+            break;
+    }
+}
+
+static void *session_writer_main(void *user) {
+    SessionRecorder *rec = (SessionRecorder *)user;
+    uint64_t prev_sample = 0;
+    bool done = false;
+    while (!done) {
+        uint32_t r = atomic_load_explicit(&rec->read_pos, memory_order_relaxed);
+        uint32_t w = atomic_load_explicit(&rec->write_pos, memory_order_acquire);
+        for (; r != w && !done; ++r) {
+            const SessionRecord *rr = &rec->ring[r & (SESSION_RING_SIZE - 1)];
+            session_write_record(rec, rr, &prev_sample);
+            done = rr->kind == SES_END;
+        }
+        atomic_store_explicit(&rec->read_pos, r, memory_order_release);
+        fflush(rec->file);
+        if (!done) {
+            struct timespec pause = {0, 10000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Starts recording at the next buffer boundary.
+static bool session_start(Synth *s, const char *path, char *err, size_t err_sz) {
+    pthread_mutex_lock(&s->expr_lock);
+    bool busy = s->recorder != NULL;
+    pthread_mutex_unlock(&s->expr_lock);
+    if (busy) {
+        snprintf(err, err_sz, "Already recording (rec off to stop)");
+        return false;
+    }
+    SessionRecorder *rec = (SessionRecorder *)calloc(1, sizeof(SessionRecorder));
+    if (!rec) {
+        snprintf(err, err_sz, "Out of memory");
+        return false;
+    }
+    rec->file = fopen(path, "wb");
+    if (!rec->file) {
+        snprintf(err, err_sz, "Cannot open %s: %s", path, strerror(errno));
+        free(rec);
+        return false;
+    }
+    fwrite(SESSION_MAGIC, 1, 8, rec->file);
+    uint32_t head[4] = {SESSION_VERSION, BANK_BYTE_ORDER, SAMPLE_RATE, SESSION_CHECKPOINT_FRAMES};
+    fwrite(head, sizeof(head), 1, rec->file);
+    fwrite(&s->seed, sizeof(s->seed), 1, rec->file);
+    pthread_mutex_init(&rec->src_lock, NULL);
+    rec->sources_tail = &rec->sources;
+    atomic_init(&rec->write_pos, 0);
+    atomic_init(&rec->read_pos, 0);
+    atomic_init(&rec->state, SESSION_STARTING);
+
+    SessionSource *note = (SessionSource *)calloc(1, sizeof(SessionSource));
+    pthread_mutex_lock(&s->expr_lock);
+    if (note) {
+        note->gen = s->expr_gen;
+        note->src = strdup(s->expr_src ? s->expr_src : "0");
+        session_note_source(rec, note);
+    }
+    s->recorder = rec;
+    pthread_mutex_unlock(&s->expr_lock);
+    if (pthread_create(&rec->thread, NULL, session_writer_main, rec) != 0) {
+        atomic_store_explicit(&rec->state, SESSION_DONE, memory_order_release);
+        pthread_mutex_lock(&s->expr_lock);
+        s->recorder = NULL;
+        pthread_mutex_unlock(&s->expr_lock);
+        fclose(rec->file);
+        session_take_source(rec, UINT64_MAX);
+        pthread_mutex_destroy(&rec->src_lock);
+        free(rec);
+        snprintf(err, err_sz, "Failed to start session writer");
+        return false;
+    }
+    return true;
+}
+
+// Ends the session after the last rendered buffer. Runs under expr_lock, where
+// the renderer is between buffers, so it works whether or not audio is running.
+static void session_stop(Synth *s) {
+    SessionRecorder *rec = NULL;
+    SessionRecord end = {.kind = SES_END};
+    for (;;) {
+        pthread_mutex_lock(&s->expr_lock);
+        rec = s->recorder;
+        if (!rec) break;
+        if (atomic_load_explicit(&rec->state, memory_order_acquire) == SESSION_STARTING) {
+            end.sample = 0;
+        } else {
+            end.sample = s->frames - rec->start_frame;
+        }
+        end.gen = rec->dropped;
+        if (session_push(rec, &end)) {
+            atomic_store_explicit(&rec->state, SESSION_DONE, memory_order_release);
+            s->recorder = NULL;
+            break;
+        }
+        pthread_mutex_unlock(&s->expr_lock);  // ring full: let the writer catch up
+        struct timespec pause = {0, 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    pthread_mutex_unlock(&s->expr_lock);
+    if (!rec) return;
+    pthread_join(rec->thread, NULL);
+
+    long bytes = ftell(rec->file);
+    fclose(rec->file);
+    printf("Session stopped: %.1f s recorded, %ld bytes", (double)end.sample / SAMPLE_RATE, bytes);
+    if (end.gen) printf(", %llu records dropped (replay will not be exact)", (unsigned long long)end.gen);
+    printf("\n");
+    session_take_source(rec, UINT64_MAX);
+    pthread_mutex_destroy(&rec->src_lock);
+    free(rec);
+}
+
+typedef struct {
+    Synth *synth;
+    pthread_t thread;
+    int fd;
+    int port;
+    _Atomic bool running;
+    struct sockaddr_storage ping_addr;
+    socklen_t ping_addr_len;
+    uint64_t ping_pending;
+    uint64_t ping_pending_since_ns;
+    _Atomic uint64_t packets;
+    _Atomic uint64_t messages;
+    _Atomic uint64_t errors;
+    // /nora/eq and /nora/preset compile too slowly for the network thread, so a
+    // packet carrying one is parked here with its macro changes and the main
+    // loop, woken through wake_fd, applies it whole. Packets arriving while
+    // anything is parked queue behind it so changes still land in order.
+    pthread_mutex_t pending_lock;
+    ControlEvent pending[OSC_BATCH_MAX];
+    int pending_count;
+    bool parked;
+    bool pending_program;
+    char *pending_expr;  // NULL: pending_preset is the program
+    int pending_preset;
+    int wake_fd[2];
+} OscServer;
+
+static OscServer g_osc = {.fd = -1, .pending_lock = PTHREAD_MUTEX_INITIALIZER, .wake_fd = {-1, -1}};
+
+typedef struct {
+    char type;
+    double num;
+    int64_t i64;
+    const char *str;
+} OscArg;
+
+typedef struct {
+    ControlEvent events[OSC_BATCH_MAX];
+    int count;
+    bool program;      // packet sets the equation or preset; the last one wins
+    const char *expr;  // points into the packet; NULL selects preset
+    int preset;
+} OscBatch;
+
+static uint32_t osc_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t osc_be64(const uint8_t *p) { return ((uint64_t)osc_be32(p) << 32) | osc_be32(p + 4); }
+
+static void osc_put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void osc_put_be64(uint8_t *p, uint64_t v) {
+    osc_put_be32(p, (uint32_t)(v >> 32));
+    osc_put_be32(p + 4, (uint32_t)v);
+}
+
+// Reads a NUL-terminated, 4-byte padded OSC string. Returns NULL if malformed.
+static const char *osc_read_string(const uint8_t *buf, size_t len, size_t *pos) {
+    size_t start = *pos;
+    size_t end = start;
+    while (end < len && buf[end]) end++;
+    if (end >= len) return NULL;
+    *pos = (end + 4) & ~(size_t)3;
+    if (*pos > len) return NULL;
+    return (const char *)buf + start;
+}
+
+static int osc_parse_args(const uint8_t *buf, size_t len, size_t pos, const char *tags, OscArg *args, int max_args) {
+    int argc = 0;
+    for (const char *tag = tags + 1; *tag && argc < max_args; ++tag) {
+        OscArg *arg = &args[argc];
+        memset(arg, 0, sizeof(*arg));
+        arg->type = *tag;
+        switch (*tag) {
+            case 'i':
+                if (pos + 4 > len) return -1;
+                arg->i64 = (int32_t)osc_be32(buf + pos);
+                arg->num = (double)arg->i64;
+                pos += 4;
+                break;
+            case 'f': {
+                if (pos + 4 > len) return -1;
+                uint32_t bits = osc_be32(buf + pos);
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                arg->num = f;
+                arg->i64 = (int64_t)f;
+                pos += 4;
+                break;
+            }
+            case 'h':
+                if (pos + 8 > len) return -1;
+                arg->i64 = (int64_t)osc_be64(buf + pos);
+                arg->num = (double)arg->i64;
+                pos += 8;
+                break;
+            case 'd': {
+                if (pos + 8 > len) return -1;
+                uint64_t bits = osc_be64(buf + pos);
+                memcpy(&arg->num, &bits, sizeof(arg->num));
+                arg->i64 = (int64_t)arg->num;
+                pos += 8;
+                break;
+            }
+            case 's':
+                arg->str = osc_read_string(buf, len, &pos);
+                if (!arg->str) return -1;
+                break;
+            case 'T':
+                arg->num = 1.0;
+                arg->i64 = 1;
+                break;
+            case 'F':
+                break;
+            default:
+                return -1;
+        }
+        argc++;
+    }
+    return argc;
+}
+
+static void osc_batch_add(OscBatch *batch, ControlId id, double value, uint64_t stamp_ns) {
+    if (batch->count >= OSC_BATCH_MAX) return;
+    ControlEvent *ev = &batch->events[batch->count++];
+    ev->id = id;
+    ev->value = value;
+    ev->stamp_ns = stamp_ns;
+}
+
+static bool osc_handle_message(OscServer *srv, const uint8_t *buf, size_t len, OscBatch *batch,
+                               uint64_t recv_ns, const struct sockaddr_storage *from, socklen_t from_len) {
+    size_t pos = 0;
+    const char *addr = osc_read_string(buf, len, &pos);
+    if (!addr) return false;
+    const char *tags = ",";
+    if (pos < len && buf[pos] == ',') {
+        tags = osc_read_string(buf, len, &pos);
+        if (!tags) return false;
+    }
+    OscArg args[8];
+    int argc = osc_parse_args(buf, len, pos, tags, args, 8);
+    if (argc < 0) return false;
+    if (strncmp(addr, "/nora/", 6) != 0) return false;
+    const char *name = addr + 6;
+    atomic_fetch_add_explicit(&srv->messages, 1, memory_order_relaxed);
+
+    static const struct {
+        const char *name;
+        ControlId id;
+    } kMacroAddrs[] = {{"a", CTL_A}, {"b", CTL_B},      {"c", CTL_C},       {"d", CTL_D},
+                       {"sh", CTL_SHIFT}, {"mask", CTL_MASK}, {"tempo", CTL_TEMPO}};
+    for (size_t i = 0; i < sizeof(kMacroAddrs) / sizeof(kMacroAddrs[0]); ++i) {
+        if (strcmp(name, kMacroAddrs[i].name) != 0) continue;
+        if (argc < 1 || args[0].str) return false;
+        double v = args[0].num;
+        if (kMacroAddrs[i].id == CTL_TEMPO) v = fmax(0.05, fmin(8.0, v));
+        osc_batch_add(batch, kMacroAddrs[i].id, v, recv_ns);
+        return true;
+    }
+    if (!strcmp(name, "pitch")) {
+        if (argc < 1 || args[0].str) return false;
+        osc_batch_add(batch, CTL_PITCH, pitch_ratio(args[0].num), recv_ns);
+        return true;
+    }
+    if (!strcmp(name, "eq")) {
+        if (argc < 1 || !args[0].str) return false;
+        batch->program = true;
+        batch->expr = args[0].str;
+        return true;
+    }
+    if (!strcmp(name, "preset")) {
+        if (argc < 1 || args[0].str) return false;
+        batch->program = true;
+        batch->expr = NULL;
+        batch->preset = (int)args[0].i64 - 1;
+        return true;
+    }
+    if (!strcmp(name, "ping")) {
+        if (argc < 1 || args[0].str || args[0].i64 <= 0) return false;
+        uint64_t sent_ns = (argc >= 2 && !args[1].str) ? (uint64_t)args[1].i64 : recv_ns;
+        osc_batch_add(batch, CTL_PING, (double)args[0].i64, sent_ns);
+        memcpy(&srv->ping_addr, from, sizeof(srv->ping_addr));
+        srv->ping_addr_len = from_len;
+        srv->ping_pending = (uint64_t)args[0].i64;
+        srv->ping_pending_since_ns = recv_ns;
+        return true;
+    }
+    return false;
+}
+
+static bool osc_handle_element(OscServer *srv, const uint8_t *buf, size_t len, OscBatch *batch, uint64_t recv_ns,
+                               const struct sockaddr_storage *from, socklen_t from_len, int depth) {
+    if (len >= 16 && !memcmp(buf, "#bundle", 8)) {
+        if (depth > 8) return false;
+        bool ok = true;
+        size_t pos = 16;  // "#bundle\0" + 64-bit time tag (ignored: applied immediately)
+        while (pos + 4 <= len) {
+            uint32_t sz = osc_be32(buf + pos);
+            pos += 4;
+            if (sz > len - pos || (sz & 3)) return false;
+            ok &= osc_handle_element(srv, buf + pos, sz, batch, recv_ns, from, from_len, depth + 1);
+            pos += sz;
+        }
+        return ok;
+    }
+    return osc_handle_message(srv, buf, len, batch, recv_ns, from, from_len);
+}
+
+// Network thread: hands a decoded packet to the audio thread, or parks it for
+// the main loop if it changes the program or something is parked already.
+static void osc_dispatch(OscServer *srv, const OscBatch *batch) {
+    char *expr = NULL;
+    if (batch->program && batch->expr && !(expr = strdup(batch->expr))) {
+        atomic_fetch_add_explicit(&srv->errors, 1, memory_order_relaxed);
+        return;
+    }
+    pthread_mutex_lock(&srv->pending_lock);
+    if (!batch->program && !srv->parked) {
+        synth_post_controls(srv->synth, batch->events, batch->count);
+        pthread_mutex_unlock(&srv->pending_lock);
+        return;
+    }
+    if (batch->program) {
+        free(srv->pending_expr);  // a newer program replaces one not yet applied
+        srv->pending_expr = expr;
+        srv->pending_preset = batch->preset;
+        srv->pending_program = true;
+    }
+    int n = batch->count;
+    if (n > OSC_BATCH_MAX - srv->pending_count) n = OSC_BATCH_MAX - srv->pending_count;
+    memcpy(srv->pending + srv->pending_count, batch->events, (size_t)n * sizeof(ControlEvent));
+    srv->pending_count += n;
+    const bool wake = !srv->parked;
+    srv->parked = true;
+    pthread_mutex_unlock(&srv->pending_lock);
+    if (wake) {
+        ssize_t rc = write(srv->wake_fd[1], "", 1);  // only fails if a wakeup is pending already
+        (void)rc;
+    }
+}
+
+// Main loop: compiles a parked equation or preset, then releases the macro
+// changes that arrived with it. Changes queued while it compiled follow.
+static void osc_apply_pending(OscServer *srv) {
+    if (srv->wake_fd[0] < 0) return;
+    char drain[64];
+    while (read(srv->wake_fd[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&srv->pending_lock);
+    while (srv->pending_program) {
+        char *expr = srv->pending_expr;
+        const int preset = srv->pending_preset;
+        const int count = srv->pending_count;
+        srv->pending_expr = NULL;
+        srv->pending_program = false;
+        pthread_mutex_unlock(&srv->pending_lock);
+        if (!expr) {
+            set_preset(srv->synth, preset);
+        } else if (set_expr(srv->synth, expr)) {
+            atomic_store_explicit(&srv->synth->current_preset, -1, memory_order_relaxed);
+        }
+        free(expr);
+        pthread_mutex_lock(&srv->pending_lock);
+        synth_post_controls(srv->synth, srv->pending, count);
+        srv->pending_count -= count;
+        memmove(srv->pending, srv->pending + count, (size_t)srv->pending_count * sizeof(ControlEvent));
+    }
+    synth_post_controls(srv->synth, srv->pending, srv->pending_count);
+    srv->pending_count = 0;
+    srv->parked = false;
+    pthread_mutex_unlock(&srv->pending_lock);
+}
+
+static void osc_send_pong(OscServer *srv, uint64_t seq, uint64_t sent_ns, uint64_t render_ns) {
+    uint8_t pkt[48];
+    memset(pkt, 0, sizeof(pkt));
+    memcpy(pkt, "/nora/pong", 10);  // padded to 12
+    memcpy(pkt + 12, ",hhh", 4);    // padded to 8
+    osc_put_be64(pkt + 20, seq);
+    osc_put_be64(pkt + 28, sent_ns);
+    osc_put_be64(pkt + 36, render_ns);
+    sendto(srv->fd, pkt, 44, 0, (const struct sockaddr *)&srv->ping_addr, srv->ping_addr_len);
+}
+
+static void *osc_thread_main(void *user) {
+    OscServer *srv = (OscServer *)user;
+    uint8_t buf[OSC_PACKET_MAX];
+    while (atomic_load_explicit(&srv->running, memory_order_relaxed)) {
+        struct pollfd pfd = {.fd = srv->fd, .events = POLLIN, .revents = 0};
+        int rc = poll(&pfd, 1, srv->ping_pending ? 1 : 100);
+        if (rc > 0 && (pfd.revents & POLLIN)) {
+            for (;;) {
+                struct sockaddr_storage from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(srv->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    break;  // EAGAIN: socket drained
+                }
+                uint64_t recv_ns = now_ns();
+                OscBatch batch;
+                batch.count = 0;
+                batch.program = false;
+                atomic_fetch_add_explicit(&srv->packets, 1, memory_order_relaxed);
+                if (!osc_handle_element(srv, buf, (size_t)n, &batch, recv_ns, &from, from_len, 0)) {
+                    atomic_fetch_add_explicit(&srv->errors, 1, memory_order_relaxed);
+                }
+                osc_dispatch(srv, &batch);
+            }
+        }
+        if (srv->ping_pending) {
+            uint64_t acked = atomic_load_explicit(&srv->synth->stats.ping_seq, memory_order_acquire);
+            if (acked == srv->ping_pending) {
+                osc_send_pong(srv, acked, atomic_load_explicit(&srv->synth->stats.ping_send_ns, memory_order_relaxed),
+                              atomic_load_explicit(&srv->synth->stats.ping_render_ns, memory_order_relaxed));
+                srv->ping_pending = 0;
+            } else if (now_ns() - srv->ping_pending_since_ns > 1000000000ull) {
+                srv->ping_pending = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void osc_stop(OscServer *srv) {
+    if (!atomic_load_explicit(&srv->running, memory_order_relaxed)) return;
+    atomic_store_explicit(&srv->running, false, memory_order_relaxed);
+    pthread_join(srv->thread, NULL);
+    osc_apply_pending(srv);
+    close(srv->fd);
+    close(srv->wake_fd[0]);
+    close(srv->wake_fd[1]);
+    srv->fd = -1;
+    srv->wake_fd[0] = srv->wake_fd[1] = -1;
+    printf("OSC server on port %d stopped\n", srv->port);
+}
+
+static bool osc_start(OscServer *srv, Synth *s, int port) {
+    osc_stop(srv);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "OSC socket failed: %s\n", strerror(errno));
+        return false;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int rcvbuf = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "OSC bind to 127.0.0.1:%d failed: %s\n", port, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (pipe(srv->wake_fd) != 0) {
+        fprintf(stderr, "OSC wake pipe failed: %s\n", strerror(errno));
+        close(fd);
+        srv->wake_fd[0] = srv->wake_fd[1] = -1;
+        return false;
+    }
+    for (int i = 0; i < 2; ++i) fcntl(srv->wake_fd[i], F_SETFL, fcntl(srv->wake_fd[i], F_GETFL, 0) | O_NONBLOCK);
+
+    srv->synth = s;
+    srv->fd = fd;
+    srv->port = port;
+    srv->ping_pending = 0;
+    atomic_store_explicit(&srv->running, true, memory_order_relaxed);
+    if (pthread_create(&srv->thread, NULL, osc_thread_main, srv) != 0) {
+        atomic_store_explicit(&srv->running, false, memory_order_relaxed);
+        close(fd);
+        close(srv->wake_fd[0]);
+        close(srv->wake_fd[1]);
+        srv->fd = -1;
+        srv->wake_fd[0] = srv->wake_fd[1] = -1;
+        fprintf(stderr, "OSC thread start failed\n");
+        return false;
+    }
+    printf("OSC server listening on 127.0.0.1:%d\n", port);
+    return true;
+}
+
+// REPL input: waits for a line on stdin and applies parked OSC program changes
+// while it waits. stdin is unbuffered in the REPL so that poll() never misses
+// a line already read into a stdio buffer.
+static bool repl_read_line(char *line, int size) {
+    printf("> ");
+    fflush(stdout);
+    for (;;) {
+        struct pollfd pfd[2] = {{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0},
+                                {.fd = g_osc.wake_fd[0], .events = POLLIN, .revents = 0}};
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR && atomic_load_explicit(&g_synth.running, memory_order_relaxed)) continue;
+            return false;
+        }
+        if (pfd[1].revents) {
+            osc_apply_pending(&g_osc);
+            if (!pfd[0].revents) {
+                printf("> ");
+                fflush(stdout);
+            }
+        }
+        if (pfd[0].revents) return fgets(line, size, stdin) != NULL;
+    }
+}
+
+// Live-coding file watcher. Editors save either in place or by renaming a new
+// file over the old one, so the containing directory is watched and a reload
+// happens whenever the file's mtime or size changes. Reading and compiling run
+// on the watcher thread; the audio thread only picks up the finished equation
+// at its next buffer boundary.
+#define WATCH_FILE_MAX (1 << 20)
+
+typedef struct {
+    Synth *synth;
+    pthread_t thread;
+    _Atomic bool running;
+    char path[PATH_MAX];
+    char name[NAME_MAX + 1];
+    int fd;       // inotify instance (Linux) or kqueue (macOS)
+    int dir_fd;   // kqueue: watched directory
+    int file_fd;  // kqueue: watched file, reopened after a rename-save
+    struct timespec loaded_mtime;
+    off_t loaded_size;
+    bool loaded;
+} LiveWatch;
+
+static LiveWatch g_watch = {.fd = -1, .dir_fd = -1, .file_fd = -1};
+
+static struct timespec stat_mtime(const struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec;
+#else
+    return st->st_mtim;
+#endif
+}
+
+#ifdef __APPLE__
+static void watch_arm_file(LiveWatch *w) {
+    if (w->file_fd >= 0) close(w->file_fd);
+    w->file_fd = open(w->path, O_EVTONLY);
+    if (w->file_fd < 0) return;
+    struct kevent ev;
+    EV_SET(&ev, w->file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    kevent(w->fd, &ev, 1, NULL, 0, NULL);
+}
+#endif
+
+static bool watch_open(LiveWatch *w, char *err, size_t err_sz) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", w->path);
+    char *slash = strrchr(dir, '/');
+    if (snprintf(w->name, sizeof(w->name), "%s", slash ? slash + 1 : dir) >= (int)sizeof(w->name)) {
+        snprintf(err, err_sz, "File name too long: %s", w->path);
+        return false;
+    }
+    if (slash) {
+        if (slash == dir) slash++;
+        *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+#if defined(__linux__)
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0 || inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        snprintf(err, err_sz, "inotify on %s failed: %s", dir, strerror(errno));
+        if (w->fd >= 0) close(w->fd);
+        w->fd = -1;
+        return false;
+    }
+#elif defined(__APPLE__)
+    w->fd = kqueue();
+    w->dir_fd = w->fd >= 0 ? open(dir, O_EVTONLY) : -1;
+    if (w->dir_fd < 0) {
+        snprintf(err, err_sz, "kqueue on %s failed: %s", dir, strerror(errno));
+        if (w->fd >= 0) close(w->fd);
+        w->fd = -1;
+        return false;
+    }
+    struct kevent ev;
+    EV_SET(&ev, w->dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+    kevent(w->fd, &ev, 1, NULL, 0, NULL);
+    watch_arm_file(w);
+#else
+    (void)err;
+    (void)err_sz;
+#endif
+    return true;
+}
+
+static void watch_close(LiveWatch *w) {
+    if (w->file_fd >= 0) close(w->file_fd);
+    if (w->dir_fd >= 0) close(w->dir_fd);
+    if (w->fd >= 0) close(w->fd);
+    w->fd = w->dir_fd = w->file_fd = -1;
+}
+
+// Blocks up to 100 ms for a change notification that may concern the file.
+// Without inotify/kqueue it simply polls every 10 ms.
+static bool watch_wait(LiveWatch *w) {
+#if defined(__linux__)
+    struct pollfd pfd = {.fd = w->fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, 100) <= 0) return false;
+    bool hit = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, w->name)) hit = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return hit;
+#elif defined(__APPLE__)
+    struct kevent evs[4];
+    struct timespec timeout = {0, 100000000L};
+    int n = kevent(w->fd, NULL, 0, evs, 4, &timeout);
+    if (n <= 0) return false;
+    for (int i = 0; i < n; ++i) {
+        if ((int)evs[i].ident == w->dir_fd || (evs[i].fflags & (NOTE_DELETE | NOTE_RENAME))) watch_arm_file(w);
+    }
+    return true;
+#else
+    (void)w;
+    struct timespec pause = {0, 10000000L};
+    nanosleep(&pause, NULL);
+    return true;
+#endif
+}
+
+static char *watch_read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    char *text = (char *)malloc(WATCH_FILE_MAX + 1);
+    size_t n = text ? fread(text, 1, WATCH_FILE_MAX, f) : 0;
+    fclose(f);
+    if (text) text[n] = '\0';
+    return text;
+}
+
+// Loads the file if it changed and reports save -> swap -> first render times.
+static void watch_reload(LiveWatch *w, uint64_t event_ns) {
+    struct stat st;
+    if (stat(w->path, &st) != 0) return;
+    struct timespec mtime = stat_mtime(&st);
+    if (w->loaded && mtime.tv_sec == w->loaded_mtime.tv_sec && mtime.tv_nsec == w->loaded_mtime.tv_nsec &&
+        st.st_size == w->loaded_size) {
+        return;
+    }
+    // mtime is wall-clock; map it onto the monotonic clock used everywhere else.
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t age_ns = (int64_t)(real.tv_sec - mtime.tv_sec) * 1000000000ll + (real.tv_nsec - mtime.tv_nsec);
+    uint64_t now = now_ns();
+    uint64_t save_ns = (age_ns >= 0 && (uint64_t)age_ns < now - event_ns + 1000000000ull) ? now - (uint64_t)age_ns
+                                                                                         : event_ns;
+    if (save_ns > event_ns) save_ns = event_ns;
+
+    char *text = watch_read_file(w->path);
+    if (!text) return;
+    w->loaded = true;
+    w->loaded_mtime = mtime;
+    w->loaded_size = st.st_size;
+    char err[300];
+    Synth *s = w->synth;
+    bool ok = synth_load_expr(s, text, err, sizeof(err));
+    free(text);
+    if (!ok) {
+        printf("\n[watch] %s: %s (still playing the previous equation)\n", w->name, err);
+        fflush(stdout);
+        return;
+    }
+    uint64_t swap_ns = now_ns();
+    atomic_store_explicit(&s->current_preset, -1, memory_order_relaxed);
+    pthread_mutex_lock(&s->expr_lock);
+    uint64_t gen = s->expr_gen;
+    pthread_mutex_unlock(&s->expr_lock);
+
+    // Wait (bounded) for the audio thread to render the new generation.
+    uint64_t render_ns = 0;
+    for (int i = 0; i < 500 && atomic_load_explicit(&w->running, memory_order_relaxed); ++i) {
+        if (atomic_load_explicit(&s->stats.render_gen, memory_order_acquire) >= gen) {
+            render_ns = atomic_load_explicit(&s->stats.render_gen_ns, memory_order_relaxed);
+            break;
+        }
+        struct timespec pause = {0, 500000L};
+        nanosleep(&pause, NULL);
+    }
+    double ms = 1e-6;
+    printf("\n[watch] %s reloaded: save->event %.2f ms, ->compiled %.2f ms", w->name, (event_ns - save_ns) * ms,
+           (swap_ns - save_ns) * ms);
+    if (render_ns >= swap_ns) {
+        double queued = 1000.0 * (BUFFER_COUNT - 1) * BUFFER_FRAMES / SAMPLE_RATE;
+        printf(", ->first rendered %.2f ms, ->audible ~%.1f ms (+%.1f ms queued)", (render_ns - save_ns) * ms,
+               (render_ns - save_ns) * ms + queued, queued);
+    }
+    printf("\n");
+    print_admission(s);
+    queue_native_build(s);
+    fflush(stdout);
+}
+
+static void *watch_thread_main(void *user) {
+    LiveWatch *w = (LiveWatch *)user;
+    while (atomic_load_explicit(&w->running, memory_order_relaxed)) {
+        if (watch_wait(w)) watch_reload(w, now_ns());
+    }
+    return NULL;
+}
+
+static void watch_stop(LiveWatch *w) {
+    if (!atomic_load_explicit(&w->running, memory_order_relaxed)) return;
+    atomic_store_explicit(&w->running, false, memory_order_relaxed);
+    pthread_join(w->thread, NULL);
+    watch_close(w);
+    printf("Stopped watching %s\n", w->path);
+}
+
+static bool watch_start(LiveWatch *w, Synth *s, const char *path) {
+    watch_stop(w);
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    w->synth = s;
+    w->loaded = false;
+    char err[PATH_MAX + 64];  // quotes the watched directory
+    if (!watch_open(w, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return false;
+    }
+    printf("Watching %s (reloads on save)\n", w->path);
+    // The first load runs here, before the thread exists, so two reloads never overlap.
+    atomic_store_explicit(&w->running, true, memory_order_relaxed);
+    watch_reload(w, now_ns());
+    if (pthread_create(&w->thread, NULL, watch_thread_main, w) != 0) {
+        atomic_store_explicit(&w->running, false, memory_order_relaxed);
+        watch_close(w);
+        fprintf(stderr, "Failed to start watcher thread\n");
+        return false;
+    }
+    return true;
+}
+
+static void print_stats(Synth *s) {
+    uint64_t events = atomic_load_explicit(&s->stats.ctl_events, memory_order_relaxed);
+    uint64_t sum_ns = atomic_load_explicit(&s->stats.ctl_latency_sum_ns, memory_order_relaxed);
+    uint64_t max_ns = atomic_load_explicit(&s->stats.ctl_latency_max_ns, memory_order_relaxed);
+    printf("Controls: %llu applied, %llu dropped, latency to render avg %.3f ms max %.3f ms\n",
+           (unsigned long long)events,
+           (unsigned long long)atomic_load_explicit(&s->stats.ctl_dropped, memory_order_relaxed),
+           events ? (double)sum_ns / (double)events / 1e6 : 0.0, (double)max_ns / 1e6);
+    uint64_t period = atomic_load_explicit(&s->loop_period, memory_order_relaxed);
+    if (!atomic_load_explicit(&s->loop_cache_enabled, memory_order_relaxed)) {
+        puts("Loop cache: off");
+    } else if (period) {
+        printf("Loop cache: period %llu samples (%.2f s at x1)%s, %llu buffers served from cache\n",
+               (unsigned long long)period, (double)period / SAMPLE_RATE,
+               period <= LOOP_CACHE_MAX_PERIOD ? "" : " too long to cache",
+               (unsigned long long)atomic_load_explicit(&s->stats.loop_cache_buffers, memory_order_relaxed));
+    } else {
+        puts("Loop cache: no period proven for current equation");
+    }
+    if (!atomic_load_explicit(&s->spec_enabled, memory_order_relaxed)) {
+        puts("Specialization: off");
+    } else {
+        pthread_mutex_lock(&s->expr_lock);
+        const SpecProgram *spec = s->spec;
+        if (spec && spec->gen == s->expr_gen) {
+            uint64_t buffers = atomic_load_explicit(&s->stats.spec_buffers, memory_order_relaxed);
+            printf("Specialization: %d of %d nodes at a=%g b=%g c=%g d=%g sh=%g mask=%g, %llu buffers\n", spec->nodes,
+                   spec->generic_nodes, spec->key[0], spec->key[1], spec->key[2], spec->key[3], spec->key[4],
+                   spec->key[5], (unsigned long long)buffers);
+        } else {
+            puts("Specialization: none for current equation");
+        }
+        pthread_mutex_unlock(&s->expr_lock);
+    }
+    if (s->cost_budget_ns > 0.0) {
+        char why[160];
+        format_admission(why, sizeof(why), atomic_load_explicit(&s->expr_cost_ns, memory_order_relaxed),
+                         s->cost_budget_ns, (int)atomic_load_explicit(&s->target_decimate, memory_order_relaxed));
+        printf("Admission: %s\n", why);
+        SynthStats *st = &s->stats;
+        if (atomic_load_explicit(&s->governor_enabled, memory_order_relaxed)) {
+            uint64_t step = atomic_load_explicit(&st->gov_step, memory_order_relaxed);
+            char state[64] = "full quality";
+            if (step) {
+                double rate = atomic_load_explicit(&s->target_decimate, memory_order_relaxed) * (double)(1u << step);
+                snprintf(state, sizeof(state), "shedding %d step%s (1/%d rate)", (int)step, step > 1 ? "s" : "",
+                         (int)fmin(rate, ADMIT_MAX_DIVIDE));
+            }
+            printf("Governor: load %.0f%% of the deadline (peak %.0f%% since last stats), %s, %llu sheds, "
+                   "%llu restores, %llu overruns\n",
+                   100.0 * atomic_load_explicit(&st->gov_load, memory_order_relaxed),
+                   100.0 * atomic_exchange_explicit(&st->gov_peak, 0.0, memory_order_relaxed), state,
+                   (unsigned long long)atomic_load_explicit(&st->gov_sheds, memory_order_relaxed),
+                   (unsigned long long)atomic_load_explicit(&st->gov_restores, memory_order_relaxed),
+                   (unsigned long long)atomic_load_explicit(&st->gov_overruns, memory_order_relaxed));
+        } else {
+            puts("Governor: off");
+        }
+    }
+    pthread_mutex_lock(&s->expr_lock);
+    bool native = s->native != NULL, own = s->native_handle != NULL;
+    pthread_mutex_unlock(&s->expr_lock);
+    printf("Native code: %s, automatic builds %s\n",
+           !native ? "no, interpreting" : own ? "yes, built for this equation" : "yes, from a preset library",
+           atomic_load_explicit(&g_aot_auto, memory_order_relaxed) ? "on" : "off");
+    printf("Render thread: %llu waits for the equation lock",
+           (unsigned long long)atomic_load_explicit(&s->stats.render_lock_waits, memory_order_relaxed));
+    if (RENDER_ALLOC_CHECK) {
+        printf(", %llu allocations", (unsigned long long)atomic_load_explicit(&g_render_allocs, memory_order_relaxed));
+    }
+    putchar('\n');
+    if (atomic_load_explicit(&g_osc.running, memory_order_relaxed)) {
+        printf("OSC: port %d, %llu packets, %llu messages, %llu errors\n", g_osc.port,
+               (unsigned long long)atomic_load_explicit(&g_osc.packets, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&g_osc.messages, memory_order_relaxed),
+               (unsigned long long)atomic_load_explicit(&g_osc.errors, memory_order_relaxed));
+    } else {
+        puts("OSC: off");
+    }
+}
+
+// Lists the stages in the order fx_process runs them.
+static void print_fx(const Synth *s) {
+    double p[FX_PARAM_COUNT];
+    for (int i = 0; i < FX_PARAM_COUNT; ++i) p[i] = atomic_load_explicit(&s->fx_target[i], memory_order_relaxed);
+    static const char *const kModes[] = {"off", "low-pass", "high-pass", "band-pass"};
+    int mode = (int)llround(p[FX_FILTER]);
+    printf("Effects: %s\n", p[FX_ON] != 0.0 ? "on" : "bypassed");
+    printf("  dc blocker: %s\n", p[FX_DC] != 0.0 ? "on" : "off");
+    if (p[FX_BITS] >= 1.0 || p[FX_DOWNSAMPLE] > 1.0) {
+        printf("  crush: %d bits, hold x%d\n", p[FX_BITS] >= 1.0 ? (int)p[FX_BITS] : 0,
+               (int)fmax(p[FX_DOWNSAMPLE], 1.0));
+    } else {
+        puts("  crush: off");
+    }
+    if (mode > FX_FILTER_OFF && mode <= FX_FILTER_BP) {
+        printf("  filter: %s %.0f Hz q %.2f\n", kModes[mode], p[FX_CUTOFF], p[FX_Q]);
+    } else {
+        puts("  filter: off");
+    }
+    if (p[FX_DELAY_MS] > 0.0) {
+        printf("  delay: %.1f ms feedback %.2f mix %.2f\n", p[FX_DELAY_MS], p[FX_FEEDBACK], p[FX_MIX]);
+    } else {
+        puts("  delay: off");
+    }
+    if (p[FX_DRIVE] > 0.0) {
+        printf("  limiter: drive %.2f\n", p[FX_DRIVE]);
+    } else {
+        puts("  limiter: off");
+    }
+}
+
+// Parses up to max numbers separated by spaces; returns how many were read.
+static int parse_numbers(const char *text, double *out, int max) {
+    int count = 0;
+    while (count < max) {
+        char *end = NULL;
+        double v = strtod(text, &end);
+        if (end == text) break;
+        out[count++] = v;
+        text = end;
+    }
+    return count;
+}
+
+static void fx_batch_add(ControlEvent *batch, int *count, uint64_t stamp, FxParam param, double value) {
+    batch[*count] = (ControlEvent){(ControlId)(CTL_FX + (int)param), value, stamp};
+    (*count)++;
+}
+
+// REPL `fx ...`: every change is one control batch, applied by the audio thread
+// at its next buffer boundary. Configuring a stage also takes the chain off bypass.
+static void fx_command(Synth *s, const char *arg) {
+    ControlEvent batch[4];
+    int count = 0;
+    uint64_t stamp = now_ns();
+    double v[3] = {0};
+    int got = 0;
+    if (!*arg) {
+        print_fx(s);
+        return;
+    } else if (!strcmp(arg, "on") || !strcmp(arg, "off")) {
+        fx_batch_add(batch, &count, stamp, FX_ON, !strcmp(arg, "on") ? 1.0 : 0.0);
+    } else if (!strcmp(arg, "dc on") || !strcmp(arg, "dc off")) {
+        fx_batch_add(batch, &count, stamp, FX_DC, !strcmp(arg, "dc on") ? 1.0 : 0.0);
+    } else if (!strcmp(arg, "filter off")) {
+        fx_batch_add(batch, &count, stamp, FX_FILTER, FX_FILTER_OFF);
+    } else if ((!strncmp(arg, "lp ", 3) || !strncmp(arg, "hp ", 3) || !strncmp(arg, "bp ", 3)) &&
+               (got = parse_numbers(arg + 3, v, 2)) >= 1) {
+        FxFilterMode mode = arg[0] == 'l' ? FX_FILTER_LP : arg[0] == 'h' ? FX_FILTER_HP : FX_FILTER_BP;
+        fx_batch_add(batch, &count, stamp, FX_FILTER, mode);
+        fx_batch_add(batch, &count, stamp, FX_CUTOFF, fmin(fmax(v[0], 20.0), SAMPLE_RATE * 0.45));
+        if (got > 1) fx_batch_add(batch, &count, stamp, FX_Q, fmin(fmax(v[1], 0.5), 20.0));
+    } else if (!strcmp(arg, "crush off")) {
+        fx_batch_add(batch, &count, stamp, FX_BITS, 0.0);
+        fx_batch_add(batch, &count, stamp, FX_DOWNSAMPLE, 1.0);
+    } else if (!strncmp(arg, "crush ", 6) && (got = parse_numbers(arg + 6, v, 2)) >= 1) {
+        fx_batch_add(batch, &count, stamp, FX_BITS, fmin(fmax(floor(v[0]), 1.0), 16.0));
+        fx_batch_add(batch, &count, stamp, FX_DOWNSAMPLE, got > 1 ? fmin(fmax(floor(v[1]), 1.0), 64.0) : 1.0);
+    } else if (!strcmp(arg, "limit off")) {
+        fx_batch_add(batch, &count, stamp, FX_DRIVE, 0.0);
+    } else if (!strncmp(arg, "limit ", 6) && parse_numbers(arg + 6, v, 1) == 1) {
+        fx_batch_add(batch, &count, stamp, FX_DRIVE, fmin(fmax(v[0], 0.1), 20.0));
+    } else if (!strcmp(arg, "delay off")) {
+        fx_batch_add(batch, &count, stamp, FX_DELAY_MS, 0.0);
+    } else if (!strncmp(arg, "delay ", 6) && (got = parse_numbers(arg + 6, v, 3)) >= 1) {
+        double max_ms = (FX_DELAY_FRAMES - EVAL_BLOCK) * 1000.0 / SAMPLE_RATE;
+        fx_batch_add(batch, &count, stamp, FX_DELAY_MS, fmin(fmax(v[0], 1.0), max_ms));
+        if (got > 1) fx_batch_add(batch, &count, stamp, FX_FEEDBACK, fmin(fmax(v[1], 0.0), 0.95));
+        if (got > 2) fx_batch_add(batch, &count, stamp, FX_MIX, fmin(fmax(v[2], 0.0), 1.0));
+    } else {
+        puts("Usage: fx [on|off | dc on|off | lp|hp|bp <hz> [q] | filter off | crush <bits> [hold]|off |"
+             " limit <drive>|off | delay <ms> [feedback] [mix]|off]");
+        return;
+    }
+    if (strcmp(arg, "off") != 0 && strcmp(arg, "on") != 0) fx_batch_add(batch, &count, stamp, FX_ON, 1.0);
+    synth_post_controls(s, batch, count);
+    print_fx(s);
+}
+
+// REPL `seek <seconds>` / `scrub <seconds>`: the audio thread moves the
+// timeline at its next buffer boundary, so nothing is rendered to get there.
+static void seek_command(Synth *s, ControlId id, const char *arg) {
+    char *end = NULL;
+    double seconds = strtod(arg, &end);
+    if (end == arg || !isfinite(seconds) || fabs(seconds) > SEEK_MAX_SECONDS || (id == CTL_SEEK && seconds < 0.0)) {
+        puts(id == CTL_SEEK ? "Usage: seek <seconds>" : "Usage: scrub <+/-seconds>");
+        return;
+    }
+    synth_set_control(s, id, seconds);
+    if (id == CTL_SCRUB) {
+        printf("Scrub %+.3f s\n", seconds);
+        return;
+    }
+    double tempo = fmax(atomic_load_explicit(&s->target_tempo, memory_order_relaxed), 0.05);
+    double pitch = fmax(atomic_load_explicit(&s->target_pitch, memory_order_relaxed), 0.125);
+    PhaseAcc at = phase_multiply(phase_increment(tempo * pitch), (uint64_t)llround(seconds * SAMPLE_RATE));
+    printf("Seek to %.3f s: t=%llu\n", seconds, (unsigned long long)at.t);
+}
+
+static void synth_init(Synth *s) {
+    pthread_once(&g_byte_tables_once, byte_tables_init);
+    memset(s, 0, sizeof(*s));
+    // The render thread takes expr_lock every buffer while normal-priority
+    // threads (REPL, watcher, AOT worker, OSC, stats) also hold it. Priority
+    // inheritance lifts a holder to the render thread's SCHED_FIFO priority, so
+    // a preempted holder cannot stall the callback behind unrelated work.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&s->expr_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&s->controls.producer_lock, NULL);
+    atomic_store_explicit(&s->target_tempo, 1.0, memory_order_relaxed);
+    atomic_store_explicit(&s->target_pitch, 1.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_a, 5.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_b, 3.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_c, 7.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_d, 10.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_shift, 8.0, memory_order_relaxed);
+    atomic_store_explicit(&s->macro_mask, 127.0, memory_order_relaxed);
+    atomic_store_explicit(&s->fx_target[FX_CUTOFF], 2000.0, memory_order_relaxed);
+    atomic_store_explicit(&s->fx_target[FX_Q], 0.707, memory_order_relaxed);
+    atomic_store_explicit(&s->fx_target[FX_DOWNSAMPLE], 1.0, memory_order_relaxed);
+    atomic_store_explicit(&s->fx_target[FX_MIX], 0.35, memory_order_relaxed);
+    atomic_store_explicit(&s->fx_target[FX_FEEDBACK], 0.4, memory_order_relaxed);
+    atomic_store_explicit(&s->target_decimate, 1.0, memory_order_relaxed);
+    s->fx.delay = (float *)calloc(FX_DELAY_FRAMES, sizeof(float));  // NULL: delay stage unavailable
+    if (s->fx.delay) memset(s->fx.delay, 0, FX_DELAY_FRAMES * sizeof(float));  // prefault: calloc may map lazily
+    controls_load_targets(s);
+    atomic_store_explicit(&s->loop_cache_enabled, true, memory_order_relaxed);
+    atomic_store_explicit(&s->spec_enabled, true, memory_order_relaxed);
+    s->seed = g_seed;
+    atomic_store_explicit(&s->governor_enabled, true, memory_order_relaxed);
+    s->smooth_tempo = 1.0;
+    s->smooth_pitch = 1.0;
+    s->phase_inc = phase_increment(1.0);
+    atomic_store_explicit(&s->seq_due, UINT64_MAX, memory_order_relaxed);
+    atomic_store_explicit(&s->running, true, memory_order_relaxed);
+}
+
+static void synth_destroy(Synth *s) {
+    pthread_mutex_lock(&s->expr_lock);
+    Expr *final_expr = s->expr;
+    s->expr = NULL;
+    LoopCache *final_cache = s->loop_cache;
+    s->loop_cache = NULL;
+    SpecProgram *final_spec = s->spec;
+    s->spec = NULL;
+    void *final_native = s->native_handle;
+    s->native = NULL;
+    s->native_handle = NULL;
+    pthread_mutex_unlock(&s->expr_lock);
+    if (final_native) dlclose(final_native);
+    expr_free(final_expr);
+    loop_cache_free(final_cache);
+    spec_free(final_spec);
+    free(s->expr_src);
+    s->expr_src = NULL;
+    expr_frame_free(&s->expr_frame);
+    free(s->fx.delay);
+    s->fx.delay = NULL;
+    free(s->seq_note);
+    s->seq_note = NULL;
+
+    pthread_mutex_destroy(&s->controls.producer_lock);
+    pthread_mutex_destroy(&s->expr_lock);
+}
+
+static void on_sigint(int sig) {
+    (void)sig;
+    atomic_store_explicit(&g_synth.running, false, memory_order_relaxed);
+}
+
+// Shared-memory PCM ring written by daemon streams and by --shm output. The
+// 64-byte header is followed by capacity_frames int16 mono samples. The writer
+// renders each block of up to block_frames straight into the ring, then publishes
+// write_frames (every frame ever written) with release semantics; it never waits.
+// A reader maps the ring and reads samples in place: frames [r, write_frames) are
+// readable, and a frame f read in place is intact if, loaded again afterwards,
+// f >= write_frames + block_frames - capacity_frames. One primary reader may set
+// SHM_READER and publish read_frames, so the writer can count the frames it
+// overwrote unread. Version 1 rings had no fields after write_frames.
+#define SHM_RING_VERSION 2
+#define SHM_WRITER 1u  // state: a writer has the ring open
+#define SHM_READER 2u  // state: a primary reader publishes read_frames
+
+typedef struct {
+    char magic[8];  // "NORASHM1"
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bytes_per_sample;
+    uint64_t capacity_frames;
+    _Atomic uint64_t write_frames;
+    _Atomic uint64_t read_frames;
+    uint32_t block_frames;
+    _Atomic uint32_t state;
+    _Atomic uint64_t overruns;  // frames overwritten before the primary reader read them
+} ShmRingHeader;
+
+typedef struct {
+    ShmRingHeader *hdr;
+    int16_t *data;
+    size_t map_size;
+} ShmRing;
+
+static bool shm_ring_open(ShmRing *ring, const char *name, uint64_t capacity_frames) {
+    char shm_name[128];
+    snprintf(shm_name, sizeof(shm_name), "/%s", name[0] == '/' ? name + 1 : name);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "shm_open %s failed: %s\n", shm_name, strerror(errno));
+        return false;
+    }
+    size_t size = sizeof(ShmRingHeader) + (size_t)capacity_frames * sizeof(int16_t);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "ftruncate %s failed: %s\n", shm_name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "mmap %s failed: %s\n", shm_name, strerror(errno));
+        return false;
+    }
+    ring->hdr = (ShmRingHeader *)map;
+    ring->data = (int16_t *)((uint8_t *)map + sizeof(ShmRingHeader));
+    ring->map_size = size;
+    memcpy(ring->hdr->magic, "NORASHM1", 8);
+    ring->hdr->version = 1;
+    ring->hdr->sample_rate = SAMPLE_RATE;
+    ring->hdr->channels = CHANNELS;
+    ring->hdr->bytes_per_sample = sizeof(int16_t);
+    ring->hdr->capacity_frames = capacity_frames;
+    ring->hdr->block_frames = BUFFER_FRAMES;
+    atomic_store_explicit(&ring->hdr->write_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->hdr->read_frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->hdr->overruns, 0, memory_order_relaxed);
+    // A reader left attached from an earlier run keeps its flag; its position
+    // restarts with the ring.
+    atomic_fetch_or_explicit(&ring->hdr->state, SHM_WRITER, memory_order_relaxed);
+    ring->hdr->version = SHM_RING_VERSION;  // last: readers check it before anything else
+    memset(ring->data, 0, (size_t)capacity_frames * sizeof(int16_t));  // prefault
+    return true;
+}
+
+// Where the next n frames (n <= block_frames, and capacity a multiple of n) are
+// rendered in place. Counts what this overwrites before the primary reader got it.
+static int16_t *shm_ring_reserve(ShmRing *ring, int n) {
+    ShmRingHeader *h = ring->hdr;
+    uint64_t w = atomic_load_explicit(&h->write_frames, memory_order_relaxed);
+    if (atomic_load_explicit(&h->state, memory_order_relaxed) & SHM_READER) {
+        uint64_t r = atomic_load_explicit(&h->read_frames, memory_order_acquire);
+        if (r <= w && w - r + (uint64_t)n > h->capacity_frames) {
+            uint64_t lost = w - r + (uint64_t)n - h->capacity_frames;
+            atomic_fetch_add_explicit(&h->overruns, lost < (uint64_t)n ? lost : (uint64_t)n, memory_order_relaxed);
+        }
+    }
+    return ring->data + (w & (h->capacity_frames - 1));
+}
+
+static void shm_ring_commit(ShmRing *ring, int n) {
+    uint64_t w = atomic_load_explicit(&ring->hdr->write_frames, memory_order_relaxed);
+    atomic_store_explicit(&ring->hdr->write_frames, w + (uint64_t)n, memory_order_release);
+}
+
+static void shm_ring_close(ShmRing *ring) {
+    if (ring->hdr) {
+        atomic_fetch_and_explicit(&ring->hdr->state, ~SHM_WRITER, memory_order_release);
+        munmap(ring->hdr, ring->map_size);
+    }
+    ring->hdr = NULL;
+}
+
+static bool wav_write_header(FILE *f, uint32_t sample_rate, uint16_t bits, uint32_t data_bytes) {
+    const uint16_t audio_format = 1;
+    const uint16_t channels = CHANNELS;
+    const uint16_t block_align = (uint16_t)(channels * (bits / 8));
+    const uint32_t byte_rate = sample_rate * block_align;
+    const uint32_t chunk_size = 36 + data_bytes;
+    const uint32_t fmt_size = 16;
+    bool ok = fwrite("RIFF", 1, 4, f) == 4;
+    ok &= fwrite(&chunk_size, sizeof(chunk_size), 1, f) == 1;
+    ok &= fwrite("WAVEfmt ", 1, 8, f) == 8;
+    ok &= fwrite(&fmt_size, sizeof(fmt_size), 1, f) == 1;
+    ok &= fwrite(&audio_format, sizeof(audio_format), 1, f) == 1;
+    ok &= fwrite(&channels, sizeof(channels), 1, f) == 1;
+    ok &= fwrite(&sample_rate, sizeof(sample_rate), 1, f) == 1;
+    ok &= fwrite(&byte_rate, sizeof(byte_rate), 1, f) == 1;
+    ok &= fwrite(&block_align, sizeof(block_align), 1, f) == 1;
+    ok &= fwrite(&bits, sizeof(bits), 1, f) == 1;
+    ok &= fwrite("data", 1, 4, f) == 4;
+    ok &= fwrite(&data_bytes, sizeof(data_bytes), 1, f) == 1;
+    return ok;
+}
+
+
+// FLAC export: a streaming encoder for this engine's 16-bit mono output, no
+// library needed. Blocks of FLAC_BLOCK samples are encoded independently, on
+// worker threads when the writer has any, and written to the file in order.
+// Each subframe is the smallest of constant, verbatim, fixed predictors of
+// order 0..4 and quantized LPC of order 1..FLAC_MAX_LPC_ORDER, with
+// partitioned Rice residuals.
+#define FLAC_BLOCK 4096
+#define FLAC_MAX_LPC_ORDER 12
+#define FLAC_LPC_PRECISION 12  // bits per quantized coefficient; keeps decoders in 32-bit sums
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_FRAME_MAX (2 * FLAC_BLOCK + 64)  // verbatim plus headers: Rice is only chosen below that
+
+typedef struct {
+    uint32_t h[4];
+    uint64_t length;
+    uint8_t block[64];
+    uint32_t used;
+} Md5;
+
+static void md5_init(Md5 *m) {
+    m->h[0] = 0x67452301u;
+    m->h[1] = 0xefcdab89u;
+    m->h[2] = 0x98badcfeu;
+    m->h[3] = 0x10325476u;
+    m->length = 0;
+    m->used = 0;
+}
+
+static void md5_block(Md5 *m, const uint8_t *p) {
+    static const uint32_t kK[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const uint8_t kR[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t w[16];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t)p[4 * i] | (uint32_t)p[4 * i + 1] << 8 | (uint32_t)p[4 * i + 2] << 16 |
+               (uint32_t)p[4 * i + 3] << 24;
+    }
+    uint32_t a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t rot = a + f + kK[i] + w[g];
+        int r = kR[(i >> 4) * 4 + (i & 3)];
+        a = d;
+        d = c;
+        c = b;
+        b += (rot << r) | (rot >> (32 - r));
+    }
+    m->h[0] += a;
+    m->h[1] += b;
+    m->h[2] += c;
+    m->h[3] += d;
+}
+
+static void md5_update(Md5 *m, const uint8_t *p, size_t n) {
+    m->length += n;
+    while (n) {
+        size_t take = 64 - m->used < n ? 64 - m->used : n;
+        memcpy(m->block + m->used, p, take);
+        m->used += (uint32_t)take;
+        p += take;
+        n -= take;
+        if (m->used == 64) {
+            md5_block(m, m->block);
+            m->used = 0;
+        }
+    }
+}
+
+static void md5_final(Md5 *m, uint8_t out[16]) {
+    uint64_t bits = m->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t padlen = (m->used < 56 ? 56 : 120) - m->used;
+    for (int i = 0; i < 8; ++i) pad[padlen + (size_t)i] = (uint8_t)(bits >> (8 * i));
+    md5_update(m, pad, padlen + 8);
+    for (int i = 0; i < 16; ++i) out[i] = (uint8_t)(m->h[i >> 2] >> (8 * (i & 3)));
+}
+
+static uint8_t g_flac_crc8[256];
+static uint16_t g_flac_crc16[256];
+static pthread_once_t g_flac_crc_once = PTHREAD_ONCE_INIT;
+
+static void flac_crc_tables(void) {
+    for (int i = 0; i < 256; ++i) {
+        uint8_t c8 = (uint8_t)i;
+        uint16_t c16 = (uint16_t)(i << 8);
+        for (int b = 0; b < 8; ++b) {
+            c8 = (uint8_t)((c8 << 1) ^ (c8 & 0x80 ? 0x07 : 0));
+            c16 = (uint16_t)((c16 << 1) ^ (c16 & 0x8000 ? 0x8005 : 0));
+        }
+        g_flac_crc8[i] = c8;
+        g_flac_crc16[i] = c16;
+    }
+}
+
+// MSB-first bit writer into a buffer the caller sized for the worst case.
+typedef struct {
+    uint8_t *p;
+    size_t len;
+    uint64_t acc;
+    int bits;
+} FlacBits;
+
+static inline void flac_put(FlacBits *b, uint32_t v, int n) {
+    b->acc = (b->acc << n) | ((uint64_t)v & ((1ull << n) - 1));
+    b->bits += n;
+    while (b->bits >= 8) {
+        b->bits -= 8;
+        b->p[b->len++] = (uint8_t)(b->acc >> b->bits);
+    }
+}
+
+static inline void flac_put_rice(FlacBits *b, int32_t r, int k) {
+    uint32_t u = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+    uint32_t q = u >> k;
+    for (; q >= 31; q -= 31) flac_put(b, 0, 31);
+    flac_put(b, 1, (int)q + 1);
+    if (k) flac_put(b, u, k);
+}
+
+static void flac_put_utf8(FlacBits *b, uint32_t v) {
+    if (v < 0x80) {
+        flac_put(b, v, 8);
+        return;
+    }
+    int n = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : 6;
+    flac_put(b, ((0xFF00u >> n) & 0xFF) | (v >> (6 * (n - 1))), 8);
+    for (int i = n - 2; i >= 0; --i) flac_put(b, 0x80 | ((v >> (6 * i)) & 0x3F), 8);
+}
+
+// One candidate subframe: how it predicts and its residual coding.
+typedef struct {
+    int type;  // 0 constant, 1 verbatim, 2 fixed, 3 LPC
+    int order;
+    int shift;
+    int32_t qlp[FLAC_MAX_LPC_ORDER];
+    int partition_order;
+    uint8_t params[1 << FLAC_MAX_PARTITION_ORDER];
+    uint64_t bits;
+} FlacChoice;
+
+// Per-encoder working memory.
+typedef struct {
+    int32_t samples[FLAC_BLOCK];
+    int32_t residual[2][FLAC_BLOCK];
+    double window[FLAC_BLOCK];
+    uint32_t window_n;
+    uint64_t sums[FLAC_MAX_PARTITION_ORDER + 1][1 << FLAC_MAX_PARTITION_ORDER];
+} FlacScratch;
+
+// Picks the partition order and Rice parameters for a residual, from the sum
+// of the folded residuals in each partition. Returns the estimated bits.
+static uint64_t flac_rice_plan(FlacScratch *sc, const int32_t *res, uint32_t n, int order, FlacChoice *ch) {
+    int max_p = 0;
+    while (max_p < FLAC_MAX_PARTITION_ORDER && !(n & (1u << max_p)) && (n >> (max_p + 1)) > (uint32_t)order) max_p++;
+    uint32_t len = n >> max_p;
+    for (uint32_t part = 0, i = (uint32_t)order; part < (1u << max_p); ++part) {
+        uint64_t sum = 0;
+        for (uint32_t end = (part + 1) * len; i < end; ++i) sum += ((uint32_t)res[i] << 1) ^ (uint32_t)(res[i] >> 31);
+        sc->sums[max_p][part] = sum;
+    }
+    for (int p = max_p - 1; p >= 0; --p) {
+        for (uint32_t part = 0; part < (1u << p); ++part) {
+            sc->sums[p][part] = sc->sums[p + 1][2 * part] + sc->sums[p + 1][2 * part + 1];
+        }
+    }
+    uint64_t best = UINT64_MAX;
+    for (int p = 0; p <= max_p; ++p) {
+        uint64_t bits = 0;
+        bool wide = false;
+        uint8_t params[1 << FLAC_MAX_PARTITION_ORDER];
+        for (uint32_t part = 0; part < (1u << p); ++part) {
+            uint64_t count = (n >> p) - (part == 0 ? (uint32_t)order : 0);
+            uint64_t sum = sc->sums[p][part];
+            int k = 0;
+            while (k < 30 && (count << (k + 1)) < sum) k++;
+            params[part] = (uint8_t)k;
+            wide |= k > 14;
+            bits += count * (uint64_t)(k + 1) + (sum >> k);
+        }
+        bits += (uint64_t)(wide ? 5 : 4) << p;
+        if (bits < best) {
+            best = bits;
+            ch->partition_order = p;
+            memcpy(ch->params, params, (size_t)1 << p);
+        }
+    }
+    return best + 2 + 4;  // coding method and partition order fields
+}
+
+static void flac_fixed_residual(const int32_t *x, uint32_t n, int order, int32_t *res) {
+    for (uint32_t i = (uint32_t)order; i < n; ++i) {
+        switch (order) {
+            case 0:
+                res[i] = x[i];
+                break;
+            case 1:
+                res[i] = x[i] - x[i - 1];
+                break;
+            case 2:
+                res[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+                break;
+            case 3:
+                res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+                break;
+            default:
+                res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+                break;
+        }
+    }
+}
+
+static bool flac_lpc_residual(const int32_t *x, uint32_t n, const FlacChoice *ch, int32_t *res) {
+    for (uint32_t i = (uint32_t)ch->order; i < n; ++i) {
+        int64_t sum = 0;
+        for (int j = 0; j < ch->order; ++j) sum += (int64_t)ch->qlp[j] * x[i - 1 - (uint32_t)j];
+        int64_t r = (int64_t)x[i] - (sum >> ch->shift);
+        if (r > INT32_MAX / 2 || r < INT32_MIN / 2) return false;
+        res[i] = (int32_t)r;
+    }
+    return true;
+}
+
+// Quantizes predictor coefficients to FLAC_LPC_PRECISION bits, carrying the
+// rounding error into the next coefficient. False if they cannot be represented.
+static bool flac_quantize(const double *coef, int order, FlacChoice *ch) {
+    double cmax = 0.0;
+    for (int i = 0; i < order; ++i) cmax = fmax(cmax, fabs(coef[i]));
+    if (!(cmax > 0.0) || !isfinite(cmax)) return false;
+    int log2cmax;
+    frexp(cmax, &log2cmax);
+    int shift = FLAC_LPC_PRECISION - 1 - log2cmax;
+    if (shift < 0) return false;
+    if (shift > 15) shift = 15;
+    const int32_t qmax = (1 << (FLAC_LPC_PRECISION - 1)) - 1, qmin = -(1 << (FLAC_LPC_PRECISION - 1));
+    double error = 0.0;
+    for (int i = 0; i < order; ++i) {
+        error += coef[i] * (double)(1 << shift);
+        long q = lround(error);
+        if (q > qmax) q = qmax;
+        if (q < qmin) q = qmin;
+        error -= (double)q;
+        ch->qlp[i] = (int32_t)q;
+    }
+    ch->order = order;
+    ch->shift = shift;
+    return true;
+}
+
+// Linear-prediction coefficients for every order up to max_order from the
+// autocorrelation (Levinson-Durbin). Returns the highest order it could solve.
+static int flac_levinson(const double *autoc, int max_order, double coef[][FLAC_MAX_LPC_ORDER]) {
+    double lpc[FLAC_MAX_LPC_ORDER];
+    double err = autoc[0];
+    for (int i = 0; i < max_order; ++i) {
+        double r = -autoc[i + 1];
+        for (int j = 0; j < i; ++j) r -= lpc[j] * autoc[i - j];
+        r /= err;
+        lpc[i] = r;
+        for (int j = 0; j < (i >> 1); ++j) {
+            double tmp = lpc[j];
+            lpc[j] += r * lpc[i - 1 - j];
+            lpc[i - 1 - j] += r * tmp;
+        }
+        if (i & 1) lpc[i >> 1] += lpc[i >> 1] * r;
+        err *= 1.0 - r * r;
+        for (int j = 0; j <= i; ++j) coef[i][j] = -lpc[j];
+        if (!(err > 0.0)) return i + 1;
+    }
+    return max_order;
+}
+
+// Encodes x[0..n) as one subframe into b.
+static void flac_subframe(FlacScratch *sc, const int32_t *x, uint32_t n, FlacBits *b) {
+    FlacChoice best, cand;
+    memset(&best, 0, sizeof(best));
+    best.type = 1;
+    best.bits = 16ull * n;
+    int32_t *res = sc->residual[0], *best_res = sc->residual[1];
+    bool constant = true;
+    for (uint32_t i = 1; i < n && constant; ++i) constant = x[i] == x[0];
+    if (constant) {
+        flac_put(b, 0x00, 8);
+        flac_put(b, (uint32_t)x[0], 16);
+        return;
+    }
+    for (int order = 0; order <= 4 && (uint32_t)order < n; ++order) {
+        memset(&cand, 0, sizeof(cand));
+        cand.type = 2;
+        cand.order = order;
+        flac_fixed_residual(x, n, order, res);
+        cand.bits = 16ull * (uint64_t)order + flac_rice_plan(sc, res, n, order, &cand);
+        if (cand.bits < best.bits) {
+            best = cand;
+            int32_t *t = res;
+            res = best_res;
+            best_res = t;
+        }
+    }
+    if (n > 2 * FLAC_MAX_LPC_ORDER) {
+        if (sc->window_n != n) {
+            // Tukey(0.5): flat in the middle half, cosine tapers at the ends.
+            uint32_t taper = n / 4;
+            for (uint32_t i = 0; i < n; ++i) {
+                double w = 1.0;
+                if (i < taper) w = 0.5 - 0.5 * cos(M_PI * (double)i / (double)taper);
+                if (i >= n - taper) w = 0.5 - 0.5 * cos(M_PI * (double)(n - 1 - i) / (double)taper);
+                sc->window[i] = w;
+            }
+            sc->window_n = n;
+        }
+        double autoc[FLAC_MAX_LPC_ORDER + 1] = {0};
+        for (int lag = 0; lag <= FLAC_MAX_LPC_ORDER; ++lag) {
+            double sum = 0.0;
+            for (uint32_t i = (uint32_t)lag; i < n; ++i) {
+                sum += (double)x[i] * sc->window[i] * (double)x[i - (uint32_t)lag] * sc->window[i - (uint32_t)lag];
+            }
+            autoc[lag] = sum;
+        }
+        double coef[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+        int orders = autoc[0] > 0.0 ? flac_levinson(autoc, FLAC_MAX_LPC_ORDER, coef) : 0;
+        for (int order = 1; order <= orders; ++order) {
+            memset(&cand, 0, sizeof(cand));
+            cand.type = 3;
+            if (!flac_quantize(coef[order - 1], order, &cand) || !flac_lpc_residual(x, n, &cand, res)) continue;
+            cand.bits = (uint64_t)order * (16 + FLAC_LPC_PRECISION) + 4 + 5 + flac_rice_plan(sc, res, n, order, &cand);
+            if (cand.bits < best.bits) {
+                best = cand;
+                int32_t *t = res;
+                res = best_res;
+                best_res = t;
+            }
+        }
+    }
+    if (best.type == 1) {
+        flac_put(b, 0x02, 8);
+        for (uint32_t i = 0; i < n; ++i) flac_put(b, (uint32_t)x[i], 16);
+        return;
+    }
+    if (best.type == 2) {
+        flac_put(b, (uint32_t)(0x08 | best.order) << 1, 8);
+    } else {
+        flac_put(b, (uint32_t)(0x20 | (best.order - 1)) << 1, 8);
+    }
+    for (int i = 0; i < best.order; ++i) flac_put(b, (uint32_t)x[i], 16);
+    if (best.type == 3) {
+        flac_put(b, FLAC_LPC_PRECISION - 1, 4);
+        flac_put(b, (uint32_t)best.shift, 5);
+        for (int i = 0; i < best.order; ++i) flac_put(b, (uint32_t)best.qlp[i], FLAC_LPC_PRECISION);
+    }
+    bool wide = false;
+    for (uint32_t part = 0; part < (1u << best.partition_order); ++part) wide |= best.params[part] > 14;
+    flac_put(b, wide ? 1 : 0, 2);
+    flac_put(b, (uint32_t)best.partition_order, 4);
+    uint32_t len = n >> best.partition_order;
+    for (uint32_t part = 0, i = (uint32_t)best.order; part < (1u << best.partition_order); ++part) {
+        int k = best.params[part];
+        flac_put(b, (uint32_t)k, wide ? 5 : 4);
+        for (uint32_t end = (part + 1) * len; i < end; ++i) flac_put_rice(b, best_res[i], k);
+    }
+}
+
+// Encodes one frame (block `number` of the stream) into out; returns its size.
+static size_t flac_encode_frame(FlacScratch *sc, const int16_t *pcm, uint32_t n, uint32_t number, uint8_t *out) {
+    pthread_once(&g_flac_crc_once, flac_crc_tables);
+    int32_t *x = sc->samples;
+    for (uint32_t i = 0; i < n; ++i) x[i] = pcm[i];
+    FlacBits b = {out, 0, 0, 0};
+    flac_put(&b, 0xFFF8, 16);  // sync code, fixed block size
+    flac_put(&b, n == FLAC_BLOCK ? 12 : 7, 4);
+    flac_put(&b, SAMPLE_RATE == 48000 ? 10 : SAMPLE_RATE == 44100 ? 9 : 0, 4);
+    flac_put(&b, 0, 4);  // one channel
+    flac_put(&b, 4, 3);  // 16 bits per sample
+    flac_put(&b, 0, 1);
+    flac_put_utf8(&b, number);
+    if (n != FLAC_BLOCK) flac_put(&b, n - 1, 16);
+    uint8_t crc8 = 0;
+    for (size_t i = 0; i < b.len; ++i) crc8 = g_flac_crc8[crc8 ^ out[i]];
+    flac_put(&b, crc8, 8);
+    flac_subframe(sc, x, n, &b);
+    if (b.bits) flac_put(&b, 0, 8 - b.bits);
+    uint16_t crc16 = 0;
+    for (size_t i = 0; i < b.len; ++i) crc16 = (uint16_t)((crc16 << 8) ^ g_flac_crc16[(crc16 >> 8) ^ out[i]]);
+    flac_put(&b, crc16, 16);
+    return b.len;
+}
+
+typedef enum { FLAC_JOB_FREE, FLAC_JOB_QUEUED, FLAC_JOB_DONE } FlacJobState;
+
+typedef struct {
+    int16_t pcm[FLAC_BLOCK];
+    uint32_t n;
+    uint32_t number;
+    FlacJobState state;  // QUEUED -> DONE under the writer's lock
+    size_t bytes;
+    uint8_t out[FLAC_FRAME_MAX];
+} FlacJob;
+
+// Streaming writer. The caller's thread fills blocks and writes finished frames
+// in order; encoder threads, if any, take the queued blocks in between. Without
+// threads each block is encoded on the caller's thread as it fills.
+typedef struct {
+    FILE *file;
+    FlacJob *jobs;
+    uint32_t job_count;
+    uint32_t filling;      // samples in block next_block
+    uint32_t next_block;   // being filled; blocks below it are queued or done
+    uint32_t next_encode;  // next queued block for an encoder thread
+    uint32_t next_write;   // next block to write to the file
+    pthread_t *threads;
+    int thread_count;
+    FlacScratch *scratch;  // one per thread, or one for the caller
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    bool quit;
+    Md5 md5;
+    uint64_t samples;
+    uint32_t min_frame;
+    uint32_t max_frame;
+    uint64_t bytes;
+    bool failed;
+} FlacWriter;
+
+typedef struct {
+    FlacWriter *fw;
+    FlacScratch *scratch;
+} FlacWorker;
+
+static void *flac_worker_main(void *user) {
+    FlacWriter *fw = ((FlacWorker *)user)->fw;
+    FlacScratch *sc = ((FlacWorker *)user)->scratch;
+    free(user);
+    pthread_mutex_lock(&fw->lock);
+    for (;;) {
+        while (!fw->quit && fw->next_encode == fw->next_block) pthread_cond_wait(&fw->work_cv, &fw->lock);
+        if (fw->next_encode == fw->next_block) break;
+        FlacJob *job = &fw->jobs[fw->next_encode++ % fw->job_count];
+        pthread_mutex_unlock(&fw->lock);
+        job->bytes = flac_encode_frame(sc, job->pcm, job->n, job->number, job->out);
+        pthread_mutex_lock(&fw->lock);
+        job->state = FLAC_JOB_DONE;
+        pthread_cond_broadcast(&fw->done_cv);
+    }
+    pthread_mutex_unlock(&fw->lock);
+    return NULL;
+}
+
+// "fLaC" and the STREAMINFO block. Sizes, length and MD5 are zero ("unknown")
+// until flac_close rewrites them.
+static bool flac_write_streaminfo(FlacWriter *fw, const uint8_t md5[16]) {
+    uint8_t head[42];
+    FlacBits b = {head, 0, 0, 0};
+    flac_put(&b, 0x664C6143, 32);  // "fLaC"
+    flac_put(&b, 0x80, 8);         // last metadata block, STREAMINFO
+    flac_put(&b, 34, 24);
+    flac_put(&b, FLAC_BLOCK, 16);
+    flac_put(&b, FLAC_BLOCK, 16);
+    flac_put(&b, fw->min_frame, 24);
+    flac_put(&b, fw->max_frame, 24);
+    flac_put(&b, SAMPLE_RATE, 20);
+    flac_put(&b, CHANNELS - 1, 3);
+    flac_put(&b, 15, 5);  // 16 bits per sample
+    flac_put(&b, (uint32_t)(fw->samples >> 32), 4);
+    flac_put(&b, (uint32_t)fw->samples, 32);
+    for (int i = 0; i < 16; ++i) flac_put(&b, md5[i], 8);
+    return fwrite(head, 1, sizeof(head), fw->file) == sizeof(head);
+}
+
+// Starts a FLAC stream on f (which stays the caller's) with `threads` encoder
+// threads; 0 encodes on the caller's thread.
+static bool flac_open(FlacWriter *fw, FILE *f, int threads) {
+    memset(fw, 0, sizeof(*fw));
+    fw->file = f;
+    fw->thread_count = threads > 0 ? threads : 0;
+    fw->job_count = threads > 0 ? 4 * (uint32_t)threads : 1;
+    fw->jobs = (FlacJob *)calloc(fw->job_count, sizeof(FlacJob));
+    fw->scratch = (FlacScratch *)calloc(threads > 0 ? (size_t)threads : 1, sizeof(FlacScratch));
+    fw->threads = threads > 0 ? (pthread_t *)calloc((size_t)threads, sizeof(pthread_t)) : NULL;
+    md5_init(&fw->md5);
+    const uint8_t unknown[16] = {0};
+    if (!fw->jobs || !fw->scratch || (threads > 0 && !fw->threads) || !flac_write_streaminfo(fw, unknown)) {
+        free(fw->jobs);
+        free(fw->scratch);
+        free(fw->threads);
+        return false;
+    }
+    fw->bytes = 42;
+    pthread_mutex_init(&fw->lock, NULL);
+    pthread_cond_init(&fw->work_cv, NULL);
+    pthread_cond_init(&fw->done_cv, NULL);
+    int started = 0;
+    for (; started < fw->thread_count; ++started) {
+        FlacWorker *w = (FlacWorker *)malloc(sizeof(FlacWorker));
+        if (!w) break;
+        *w = (FlacWorker){fw, &fw->scratch[started]};
+        if (pthread_create(&fw->threads[started], NULL, flac_worker_main, w) != 0) {
+            free(w);
+            break;
+        }
+    }
+    fw->thread_count = started;  // fewer threads only means slower encoding
+    if (!started) fw->job_count = 1;
+    return true;
+}
+
+// Writes finished frames in order until block `until`, waiting for encoders.
+static void flac_write_until(FlacWriter *fw, uint32_t until) {
+    while (fw->next_write < until) {
+        FlacJob *job = &fw->jobs[fw->next_write % fw->job_count];
+        if (fw->thread_count) {
+            pthread_mutex_lock(&fw->lock);
+            while (job->state != FLAC_JOB_DONE) pthread_cond_wait(&fw->done_cv, &fw->lock);
+            pthread_mutex_unlock(&fw->lock);
+        }
+        if (fwrite(job->out, 1, job->bytes, fw->file) != job->bytes) fw->failed = true;
+        fw->bytes += job->bytes;
+        if (!fw->min_frame || job->bytes < fw->min_frame) fw->min_frame = (uint32_t)job->bytes;
+        if (job->bytes > fw->max_frame) fw->max_frame = (uint32_t)job->bytes;
+        job->state = FLAC_JOB_FREE;
+        fw->next_write++;
+    }
+}
+
+static void flac_submit(FlacWriter *fw) {
+    FlacJob *job = &fw->jobs[fw->next_block % fw->job_count];
+    job->n = fw->filling;
+    job->number = fw->next_block;
+    fw->filling = 0;
+    if (!fw->thread_count) {
+        job->bytes = flac_encode_frame(fw->scratch, job->pcm, job->n, job->number, job->out);
+        job->state = FLAC_JOB_DONE;
+        fw->next_block++;
+        flac_write_until(fw, fw->next_block);
+        return;
+    }
+    pthread_mutex_lock(&fw->lock);
+    job->state = FLAC_JOB_QUEUED;
+    fw->next_block++;
+    pthread_cond_signal(&fw->work_cv);
+    // Write whatever is already finished, without waiting.
+    uint32_t ready = fw->next_write;
+    while (ready < fw->next_block && fw->jobs[ready % fw->job_count].state == FLAC_JOB_DONE) ready++;
+    pthread_mutex_unlock(&fw->lock);
+    flac_write_until(fw, ready);
+}
+
+// Appends samples; false once any write has failed.
+static bool flac_write(FlacWriter *fw, const int16_t *pcm, size_t n) {
+    while (n) {
+        if (fw->next_block - fw->next_write == fw->job_count) {
+            flac_write_until(fw, fw->next_block - fw->job_count + 1);  // the slot to fill is still busy
+        }
+        FlacJob *job = &fw->jobs[fw->next_block % fw->job_count];
+        uint32_t take = FLAC_BLOCK - fw->filling < n ? FLAC_BLOCK - fw->filling : (uint32_t)n;
+        memcpy(job->pcm + fw->filling, pcm, take * sizeof(int16_t));
+        uint8_t le[2 * FLAC_BLOCK];
+        for (uint32_t i = 0; i < take; ++i) {
+            le[2 * i] = (uint8_t)((uint16_t)pcm[i] & 0xFF);
+            le[2 * i + 1] = (uint8_t)((uint16_t)pcm[i] >> 8);
+        }
+        md5_update(&fw->md5, le, 2 * (size_t)take);
+        fw->filling += take;
+        fw->samples += take;
+        pcm += take;
+        n -= take;
+        if (fw->filling == FLAC_BLOCK) flac_submit(fw);
+    }
+    return !fw->failed;
+}
+
+// Encodes the last partial block, writes every frame and, when the file can
+// seek, fills in STREAMINFO. False if any write failed.
+static bool flac_close(FlacWriter *fw) {
+    if (fw->filling) {
+        if (fw->next_block - fw->next_write == fw->job_count) flac_write_until(fw, fw->next_block - fw->job_count + 1);
+        flac_submit(fw);
+    }
+    flac_write_until(fw, fw->next_block);
+    pthread_mutex_lock(&fw->lock);
+    fw->quit = true;
+    pthread_cond_broadcast(&fw->work_cv);
+    pthread_mutex_unlock(&fw->lock);
+    for (int i = 0; i < fw->thread_count; ++i) pthread_join(fw->threads[i], NULL);
+    uint8_t md5[16];
+    md5_final(&fw->md5, md5);
+    long end = ftell(fw->file);
+    if (end >= 0 && fseek(fw->file, end - (long)fw->bytes, SEEK_SET) == 0) {
+        fw->failed |= !flac_write_streaminfo(fw, md5);
+        fseek(fw->file, end, SEEK_SET);
+    }
+    fw->failed |= fflush(fw->file) != 0;
+    pthread_cond_destroy(&fw->done_cv);
+    pthread_cond_destroy(&fw->work_cv);
+    pthread_mutex_destroy(&fw->lock);
+    free(fw->jobs);
+    free(fw->scratch);
+    free(fw->threads);
+    return !fw->failed;
+}
+
+typedef enum { SINK_NONE, SINK_FILE, SINK_WAV, SINK_FIFO, SINK_SHM, SINK_FLAC } SinkKind;
+
+// --bits 8: raw, WAV and pipe output carry one unsigned byte per sample instead
+// of int16. FLAC and shared-memory output stay 16-bit.
+static int g_output_bits = 16;
+
+typedef struct {
+    Synth synth;
+    SinkKind sink;
+    char path[256];
+    FILE *file;
+    int fd;
+    ShmRing shm;
+    FlacWriter *flac;
+    bool u8;  // sink takes 8-bit samples (--bits 8)
+    uint64_t frames;
+    uint64_t dropped_blocks;
+    int16_t pcm[BUFFER_FRAMES];
+    uint8_t pcm_u8[BUFFER_FRAMES];
+} DaemonStream;
+
+// Real-time setup (--rt), Linux only. The process locks its pages and stops the
+// allocator from trimming or mmapping, so memory touched once stays resident;
+// render threads then run SCHED_FIFO, pinned round-robin to the online CPUs,
+// with their stacks faulted in. On macOS the audio thread belongs to Core Audio,
+// which already schedules it as real-time.
+#define RT_DEFAULT_PRIORITY 70
+#define RT_HEAP_PREFAULT (16u << 20)
+#define RT_STACK_PREFAULT (256u << 10)
+#define RT_THREAD_STACK (1u << 20)
+
+typedef struct {
+    bool enabled;
+    int priority;
+} RtConfig;
+
+static RtConfig g_rt = {false, RT_DEFAULT_PRIORITY};
+static _Atomic int g_rt_next_cpu;
+
+static void rt_process_setup(void) {
+#if defined(__linux__)
+    // MCL_FUTURE under a finite memlock limit makes later allocations fail once
+    // the limit is reached, so only lock when the whole process will fit.
+    struct rlimit lim;
+    bool unlimited = getrlimit(RLIMIT_MEMLOCK, &lim) == 0 && lim.rlim_cur == RLIM_INFINITY;
+    if (!unlimited && geteuid() != 0) {
+        printf("RT: memlock limit is %llu KB, not locking memory (raise it with ulimit -l unlimited)\n",
+               (unsigned long long)lim.rlim_cur / 1024);
+    } else if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        printf("RT: mlockall failed: %s\n", strerror(errno));
+    } else {
+        puts("RT: memory locked");
+    }
+#if defined(__GLIBC__)
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    volatile char *heap = (volatile char *)malloc(RT_HEAP_PREFAULT);
+    if (heap) {
+        for (size_t i = 0; i < RT_HEAP_PREFAULT; i += 4096) heap[i] = 0;
+        free((void *)heap);
+    }
+#endif
+#else
+    puts("RT: --rt is only supported on Linux");
+#endif
+}
+
+#if defined(__linux__)
+static __attribute__((noinline)) void rt_prefault_stack(void) {
+    volatile char stack[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+#endif
+
+// Called by a render thread on itself. Falls back to the RLIMIT_RTPRIO ceiling
+// when the requested priority is not permitted; reports and carries on when
+// SCHED_FIFO is not available at all.
+static void rt_thread_setup(int priority) {
+#if defined(__linux__)
+    struct sched_param param = {0};
+    int max = sched_get_priority_max(SCHED_FIFO);
+    param.sched_priority = priority < 1 ? 1 : priority > max ? max : priority;
+    int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    struct rlimit lim;
+    if (rc == EPERM && getrlimit(RLIMIT_RTPRIO, &lim) == 0 && lim.rlim_cur > 0) {
+        if ((rlim_t)param.sched_priority > lim.rlim_cur) param.sched_priority = (int)lim.rlim_cur;
+        rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = atomic_fetch_add_explicit(&g_rt_next_cpu, 1, memory_order_relaxed) % (int)(cpus > 0 ? cpus : 1);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int arc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    rt_prefault_stack();
+    if (rc != 0) {
+        printf("RT: SCHED_FIFO refused (%s), thread stays on CPU %d at normal priority\n", strerror(rc), cpu);
+    } else {
+        printf("RT: thread SCHED_FIFO %d%s\n", param.sched_priority, arc == 0 ? "" : ", not pinned");
+    }
+    fflush(stdout);
+#else
+    (void)priority;
+#endif
+}
+
+// Fixed pool of render threads. Every tick renders one buffer for every stream;
+// threads claim streams through an atomic cursor so load balances itself.
+typedef struct {
+    DaemonStream *streams;
+    int stream_count;
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cv;
+    pthread_cond_t done_cv;
+    uint64_t generation;
+    int done;
+    bool quit;
+    _Atomic int next;
+} DaemonPool;
+
+static _Atomic bool g_daemon_running = true;
+
+static void on_daemon_signal(int sig) {
+    (void)sig;
+    atomic_store_explicit(&g_daemon_running, false, memory_order_relaxed);
+}
+
+static void daemon_sink_write(DaemonStream *st, uint64_t tick) {
+    const void *data = st->u8 ? (const void *)st->pcm_u8 : (const void *)st->pcm;
+    size_t bytes = st->u8 ? sizeof(st->pcm_u8) : sizeof(st->pcm);
+    switch (st->sink) {
+        case SINK_NONE:
+            break;
+        case SINK_FILE:
+        case SINK_WAV:
+            if (fwrite(data, 1, bytes, st->file) != bytes) st->dropped_blocks++;
+            break;
+        case SINK_FLAC:
+            // Encoded on this render thread: the pool already spreads streams
+            // across cores, so each stream's encoder needs no threads of its own.
+            if (!flac_write(st->flac, st->pcm, BUFFER_FRAMES)) st->dropped_blocks++;
+            break;
+        case SINK_FIFO:
+            // No reader yet (or it went away): retry the open about once a second
+            // and drop audio meanwhile rather than stall the other streams.
+            if (st->fd < 0 && tick % (SAMPLE_RATE / BUFFER_FRAMES) == 0) {
+                st->fd = open(st->path, O_WRONLY | O_NONBLOCK);
+            }
+            if (st->fd < 0) {
+                st->dropped_blocks++;
+                break;
+            }
+            if (write(st->fd, data, bytes) != (ssize_t)bytes) {
+                st->dropped_blocks++;
+                if (errno == EPIPE) {
+                    close(st->fd);
+                    st->fd = -1;
+                }
+            }
+            break;
+        case SINK_SHM:
+            shm_ring_commit(&st->shm, BUFFER_FRAMES);  // rendered in place
+            break;
+    }
+    st->frames += BUFFER_FRAMES;
+}
+
+static void *daemon_thread_main(void *user) {
+    DaemonPool *pool = (DaemonPool *)user;
+    uint64_t seen = 0;
+    if (g_rt.enabled) rt_thread_setup(g_rt.priority);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->quit) pthread_cond_wait(&pool->start_cv, &pool->lock);
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        for (;;) {
+            int i = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+            if (i >= pool->stream_count) break;
+            DaemonStream *st = &pool->streams[i];
+            if (st->u8) {
+                synth_render_u8(&st->synth, st->pcm_u8, BUFFER_FRAMES);
+            } else {
+                int16_t *pcm = st->sink == SINK_SHM ? shm_ring_reserve(&st->shm, BUFFER_FRAMES) : st->pcm;
+                synth_render(&st->synth, pcm, BUFFER_FRAMES);
+            }
+            daemon_sink_write(st, seen);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->done == pool->thread_count) pthread_cond_signal(&pool->done_cv);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static bool daemon_pool_start(DaemonPool *pool, DaemonStream *streams, int count, int threads) {
+    memset(pool, 0, sizeof(*pool));
+    pool->streams = streams;
+    pool->stream_count = count;
+    pool->thread_count = threads;
+    pool->threads = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    if (!pool->threads) return false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    // Real-time threads get a fixed stack, locked and faulted in by
+    // rt_thread_setup, rather than the 8 MB default.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (g_rt.enabled) pthread_attr_setstacksize(&attr, RT_THREAD_STACK);
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&pool->threads[i], &attr, daemon_thread_main, pool) != 0) {
+            pthread_attr_destroy(&attr);
+            pool->thread_count = i;
+            return i > 0;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return true;
+}
+
+// Renders one buffer of every stream and waits for the pool to finish.
+static void daemon_pool_tick(DaemonPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+    pool->done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cv);
+    while (pool->done < pool->thread_count) pthread_cond_wait(&pool->done_cv, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void daemon_pool_stop(DaemonPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start_cv);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; ++i) pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->start_cv);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+}
+
+static int default_thread_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Static streams never change controls, so their loop caches and specialized
+// programs are built once up front instead of by a per-stream worker thread.
+static void daemon_stream_prepare(DaemonStream *st) {
+    Synth *s = &st->synth;
+    if (!s->expr_src) return;
+    double key[6];
+    loop_cache_key(key, s->live.a, s->live.b, s->live.c, s->live.d, s->live.sh, s->live.mask);
+    if (atomic_load_explicit(&s->loop_cache_enabled, memory_order_relaxed)) {
+        loop_cache_build(s, s->expr_src, s->expr_gen, key);
+    }
+    if (atomic_load_explicit(&s->spec_enabled, memory_order_relaxed)) spec_build(s, s->expr_src, s->expr_gen, key);
+}
+
+// Stream line: <sink> [a=.. b=.. c=.. d=.. sh=.. mask=.. tm=.. p=.. seed=..] preset:<n> | eq:<equation>
+// Sinks: file:<path> (raw s16le, or WAV/FLAC if it ends in .wav/.flac), fifo:<path>, shm:<name>, null.
+// With --bits 8, raw, WAV and fifo sinks take unsigned 8-bit samples.
+static bool daemon_parse_stream(DaemonStream *st, char *line) {
+    char *save = NULL;
+    char *sink = strtok_r(line, " \t", &save);
+    if (!sink) return false;
+
+    synth_init(&st->synth);
+    st->fd = -1;
+    if (!strncmp(sink, "file:", 5)) {
+        snprintf(st->path, sizeof(st->path), "%s", sink + 5);
+        size_t len = strlen(st->path);
+        st->sink = (len > 4 && !strcmp(st->path + len - 4, ".wav"))    ? SINK_WAV
+                   : (len > 5 && !strcmp(st->path + len - 5, ".flac")) ? SINK_FLAC
+                                                                        : SINK_FILE;
+    } else if (!strncmp(sink, "fifo:", 5)) {
+        snprintf(st->path, sizeof(st->path), "%s", sink + 5);
+        st->sink = SINK_FIFO;
+    } else if (!strncmp(sink, "shm:", 4)) {
+        snprintf(st->path, sizeof(st->path), "%s", sink + 4);
+        st->sink = SINK_SHM;
+    } else if (!strcmp(sink, "null")) {
+        st->sink = SINK_NONE;
+    } else {
+        fprintf(stderr, "Unknown sink '%s'\n", sink);
+        return false;
+    }
+    st->u8 = g_output_bits == 8 && (st->sink == SINK_FILE || st->sink == SINK_WAV || st->sink == SINK_FIFO);
+
+    bool have_program = false;
+    char err[300] = "";
+    char *tok;
+    // Applied after the program so they override a bank preset's default macros.
+    ControlEvent overrides[32];
+    int override_count = 0;
+    while (!have_program && (tok = strtok_r(NULL, " \t", &save)) != NULL) {
+        static const struct {
+            const char *key;
+            ControlId id;
+        } kKeys[] = {{"a=", CTL_A},         {"b=", CTL_B},       {"c=", CTL_C},      {"d=", CTL_D},
+                     {"sh=", CTL_SHIFT},    {"mask=", CTL_MASK}, {"tm=", CTL_TEMPO}, {"p=", CTL_PITCH}};
+        bool matched = false;
+        for (size_t k = 0; k < sizeof(kKeys) / sizeof(kKeys[0]); ++k) {
+            size_t klen = strlen(kKeys[k].key);
+            if (strncmp(tok, kKeys[k].key, klen) != 0) continue;
+            double v = strtod(tok + klen, NULL);
+            if (kKeys[k].id == CTL_PITCH) v = pitch_ratio(v);
+            if (kKeys[k].id == CTL_TEMPO) v = fmax(0.05, fmin(8.0, v));
+            if (override_count < 32) overrides[override_count++] = (ControlEvent){kKeys[k].id, v, now_ns()};
+            matched = true;
+        }
+        if (matched) continue;
+        if (!strncmp(tok, "seed=", 5)) {
+            st->synth.seed = strtoull(tok + 5, NULL, 0);
+        } else if (!strncmp(tok, "preset:", 7)) {
+            int idx = (int)strtol(tok + 7, NULL, 10) - 1;
+            have_program = synth_load_preset(&st->synth, idx, err, sizeof(err));
+        } else if (!strncmp(tok, "eq:", 3)) {
+            // The equation is the rest of the line.
+            char *rest = tok + 3;
+            if (save && *save) rest[strlen(rest)] = ' ';
+            have_program = synth_load_expr(&st->synth, rest, err, sizeof(err));
+        } else {
+            fprintf(stderr, "Unknown stream option '%s'\n", tok);
+            return false;
+        }
+    }
+    if (!have_program) {
+        fprintf(stderr, "Stream '%s' has no valid preset:/eq: program%s%s\n", sink, err[0] ? ": " : "", err);
+        return false;
+    }
+    synth_post_controls(&st->synth, overrides, override_count);
+    drain_controls(&st->synth);
+    return true;
+}
+
+static bool daemon_open_sink(DaemonStream *st) {
+    switch (st->sink) {
+        case SINK_NONE:
+            return true;
+        case SINK_FILE:
+        case SINK_WAV:
+            st->file = fopen(st->path, "wb");
+            if (!st->file) {
+                fprintf(stderr, "Cannot open %s: %s\n", st->path, strerror(errno));
+                return false;
+            }
+            return st->sink == SINK_FILE || wav_write_header(st->file, SAMPLE_RATE, st->u8 ? 8 : 16, 0);
+        case SINK_FLAC:
+            st->file = fopen(st->path, "wb");
+            st->flac = st->file ? (FlacWriter *)malloc(sizeof(FlacWriter)) : NULL;
+            if (!st->flac || !flac_open(st->flac, st->file, 0)) {
+                fprintf(stderr, "Cannot open %s: %s\n", st->path, st->file ? "out of memory" : strerror(errno));
+                free(st->flac);
+                st->flac = NULL;
+                return false;
+            }
+            return true;
+        case SINK_FIFO:
+            if (mkfifo(st->path, 0644) != 0 && errno != EEXIST) {
+                fprintf(stderr, "mkfifo %s failed: %s\n", st->path, strerror(errno));
+                return false;
+            }
+            st->fd = open(st->path, O_WRONLY | O_NONBLOCK);
+            return true;
+        case SINK_SHM:
+            return shm_ring_open(&st->shm, st->path, SHM_RING_FRAMES);
+    }
+    return false;
+}
+
+static void daemon_close_sink(DaemonStream *st) {
+    switch (st->sink) {
+        case SINK_NONE:
+            break;
+        case SINK_FILE:
+        case SINK_WAV:
+            if (!st->file) break;
+            if (st->sink == SINK_WAV) {
+                uint64_t bytes = st->frames * (st->u8 ? 1 : sizeof(int16_t));
+                fseek(st->file, 0, SEEK_SET);
+                wav_write_header(st->file, SAMPLE_RATE, st->u8 ? 8 : 16,
+                                 bytes > 0xFFFFFFDBull ? 0xFFFFFFDBu : (uint32_t)bytes);
+            }
+            fclose(st->file);
+            st->file = NULL;
+            break;
+        case SINK_FLAC:
+            if (st->flac) {
+                if (!flac_close(st->flac)) fprintf(stderr, "Write to %s failed\n", st->path);
+                free(st->flac);
+                st->flac = NULL;
+            }
+            if (st->file) fclose(st->file);
+            st->file = NULL;
+            break;
+        case SINK_FIFO:
+            if (st->fd >= 0) close(st->fd);
+            st->fd = -1;
+            break;
+        case SINK_SHM:
+            shm_ring_close(&st->shm);
+            break;
+    }
+}
+
+static void daemon_streams_free(DaemonStream *streams, int count) {
+    for (int i = 0; i < count; ++i) {
+        daemon_close_sink(&streams[i]);
+        synth_destroy(&streams[i].synth);
+    }
+    free(streams);
+}
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+    uint64_t total = (uint64_t)ts->tv_nsec + ns;
+    ts->tv_sec += (time_t)(total / 1000000000ull);
+    ts->tv_nsec = (long)(total % 1000000000ull);
+}
+
+static void sleep_until(const struct timespec *deadline) {
+#if defined(__linux__)
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR) {
+    }
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ns = ((int64_t)deadline->tv_sec - (int64_t)now.tv_sec) * 1000000000ll + (deadline->tv_nsec - now.tv_nsec);
+    if (ns <= 0) return;
+    struct timespec pause = {(time_t)(ns / 1000000000ll), (long)(ns % 1000000000ll)};
+    nanosleep(&pause, NULL);
+#endif
+}
+
+// --shm <name>: the interactive synth plays into a shared-memory ring instead of
+// the audio device. A thread paces blocks in real time and renders each one in
+// place, so a reader sees it as soon as it is rendered, with no mixer copy,
+// resampling or device queue in between.
+typedef struct {
+    const char *name;  // NULL: play through the audio device
+    Synth *synth;
+    ShmRing ring;
+    pthread_t thread;
+    _Atomic bool running;
+    _Atomic uint64_t late;
+} ShmOutput;
+
+static ShmOutput g_shm_out;
+
+static void *shm_output_main(void *user) {
+    ShmOutput *out = (ShmOutput *)user;
+    if (g_rt.enabled) rt_thread_setup(g_rt.priority);
+    const uint64_t tick_ns = (uint64_t)BUFFER_FRAMES * 1000000000ull / SAMPLE_RATE;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (atomic_load_explicit(&out->running, memory_order_relaxed)) {
+        synth_render(out->synth, shm_ring_reserve(&out->ring, BUFFER_FRAMES), BUFFER_FRAMES);
+        shm_ring_commit(&out->ring, BUFFER_FRAMES);
+        timespec_add_ns(&deadline, tick_ns);
+        if (now_ns() > (uint64_t)deadline.tv_sec * 1000000000ull + (uint64_t)deadline.tv_nsec) {
+            atomic_fetch_add_explicit(&out->late, 1, memory_order_relaxed);
+            clock_gettime(CLOCK_MONOTONIC, &deadline);  // don't try to catch up a backlog
+        } else {
+            sleep_until(&deadline);
+        }
+    }
+    return NULL;
+}
+
+static bool shm_output_start(ShmOutput *out, Synth *s) {
+    out->synth = s;
+    if (!shm_ring_open(&out->ring, out->name, SHM_RING_FRAMES)) return false;
+    atomic_store_explicit(&out->running, true, memory_order_relaxed);
+    if (pthread_create(&out->thread, NULL, shm_output_main, out) != 0) {
+        fprintf(stderr, "Cannot start the shm output thread\n");
+        shm_ring_close(&out->ring);
+        return false;
+    }
+    worker_start(s);
+    printf("Output: shared-memory ring %s (%u frames), no audio device\n", out->name, SHM_RING_FRAMES);
+    return true;
+}
+
+static void shm_output_stop(ShmOutput *out) {
+    if (!out->ring.hdr) return;
+    worker_stop(out->synth);
+    atomic_store_explicit(&out->running, false, memory_order_relaxed);
+    pthread_join(out->thread, NULL);
+    shm_ring_close(&out->ring);
+}
+
+static void print_shm_output(const ShmOutput *out) {
+    const ShmRingHeader *h = out->ring.hdr;
+    uint32_t state = atomic_load_explicit(&h->state, memory_order_relaxed);
+    uint64_t written = atomic_load_explicit(&h->write_frames, memory_order_relaxed);
+    uint64_t read = atomic_load_explicit(&h->read_frames, memory_order_relaxed);
+    printf("Shm output: %s, %llu frames written, %llu late blocks, ", out->name, (unsigned long long)written,
+           (unsigned long long)atomic_load_explicit(&out->late, memory_order_relaxed));
+    if ((state & SHM_READER) && read > written) {
+        // Left over from an earlier writer of this ring: it hasn't caught up with the restart.
+        printf("reader stale (at frame %llu)\n", (unsigned long long)read);
+    } else if (state & SHM_READER) {
+        printf("reader %llu frames behind, %llu frames overwritten unread\n", (unsigned long long)(written - read),
+               (unsigned long long)atomic_load_explicit(&h->overruns, memory_order_relaxed));
+    } else {
+        printf("no primary reader attached\n");
+    }
+}
+
+#define LOOKAHEAD_CHUNK 256
+#define LOOKAHEAD_MAX_MS 2000
+
+static double g_lookahead_ms;  // --lookahead, 0: render in the audio callback
+
+// Takes newly posted controls off the queue and gives each the ring frame it is
+// due at: where playback was at its timestamp, plus the lookahead. Posting order
+// is kept, so a batch still lands on one frame.
+static void lookahead_schedule(Lookahead *la, Synth *s) {
+    ControlQueue *q = &s->controls;
+    uint32_t r = atomic_load_explicit(&q->read_pos, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&q->write_pos, memory_order_acquire);
+    if (r == w) return;
+    uint64_t anchor_frames, anchor_ns;
+    lookahead_anchor(la, &anchor_frames, &anchor_ns);
+    for (; r != w && la->pending_tail - la->pending_head < CONTROL_QUEUE_SIZE; ++r) {
+        const ControlEvent *ev = &q->events[r & (CONTROL_QUEUE_SIZE - 1)];
+        double since = (double)(int64_t)(ev->stamp_ns - anchor_ns) * SAMPLE_RATE / 1e9;
+        double at = (double)anchor_frames + (double)la->target + since;
+        uint64_t due = at > 0.0 ? (uint64_t)at : 0;
+        if (due < la->last_due) due = la->last_due;
+        la->last_due = due;
+        uint32_t slot = la->pending_tail++ & (CONTROL_QUEUE_SIZE - 1);
+        la->pending[slot] = *ev;
+        la->pending_due[slot] = due;
+        atomic_fetch_add_explicit(&la->scheduled, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->read_pos, r, memory_order_release);
+}
+
+// Renders up to n frames at the write position. Controls due by then are applied
+// first, and the chunk stops short of the next one so it lands on its frame.
+static void lookahead_render(Lookahead *la, Synth *s, uint32_t n) {
+    uint64_t w = atomic_load_explicit(&la->write_frames, memory_order_relaxed);
+    uint64_t now = now_ns();
+    while (la->pending_head != la->pending_tail) {
+        uint32_t slot = la->pending_head & (CONTROL_QUEUE_SIZE - 1);
+        uint64_t due = la->pending_due[slot];
+        if (due > w) {
+            if (due - w < n) n = (uint32_t)(due - w);
+            break;
+        }
+        if (due < w) {
+            atomic_fetch_add_explicit(&la->late, 1, memory_order_relaxed);
+            if (w - due > atomic_load_explicit(&la->late_max_frames, memory_order_relaxed)) {
+                atomic_store_explicit(&la->late_max_frames, w - due, memory_order_relaxed);
+            }
+        }
+        apply_queued_control(s, &la->pending[slot], now);
+        la->pending_head++;
+    }
+    controls_resync_if_asked(s);
+    uint32_t at = (uint32_t)(w & (la->capacity - 1));
+    if (la->capacity - at < n) n = la->capacity - at;
+    synth_render(s, la->pcm + at, (int)n);
+    uint64_t took = now_ns() - now;
+    if (took > atomic_load_explicit(&la->chunk_max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&la->chunk_max_ns, took, memory_order_relaxed);
+    }
+    atomic_store_explicit(&la->write_frames, w + n, memory_order_release);
+}
+
+static void lookahead_fill(Lookahead *la, Synth *s, uint64_t goal) {
+    for (;;) {
+        uint64_t queued = atomic_load_explicit(&la->write_frames, memory_order_relaxed) -
+                          atomic_load_explicit(&la->read_frames, memory_order_acquire);
+        if (queued >= goal) return;
+        lookahead_schedule(la, s);
+        lookahead_render(la, s, goal - queued < LOOKAHEAD_CHUNK ? (uint32_t)(goal - queued) : LOOKAHEAD_CHUNK);
+    }
+}
+
+static void *lookahead_main(void *user) {
+    Synth *s = (Synth *)user;
+    Lookahead *la = s->ahead;
+    if (g_rt.enabled) rt_thread_setup(g_rt.priority);
+    while (atomic_load_explicit(&la->running, memory_order_relaxed)) {
+        uint64_t queued = atomic_load_explicit(&la->write_frames, memory_order_relaxed) -
+                          atomic_load_explicit(&la->read_frames, memory_order_acquire);
+        if (queued + LOOKAHEAD_CHUNK <= la->target) {
+            lookahead_fill(la, s, la->target);
+        } else {
+            struct timespec pause = {0, 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Sets up the ring before the audio queue starts. It is filled with the lookahead
+// plus the buffers the queue is primed with, so playback starts `ms` ahead.
+static bool lookahead_start(Synth *s, double ms) {
+    Lookahead *la = (Lookahead *)calloc(1, sizeof(Lookahead));
+    if (!la) return false;
+    la->target = (uint32_t)fmax(ms * SAMPLE_RATE / 1000.0, BUFFER_FRAMES);
+    uint32_t need = la->target + BUFFER_COUNT * BUFFER_FRAMES + LOOKAHEAD_CHUNK;
+    la->capacity = BUFFER_FRAMES;
+    while (la->capacity < need) la->capacity <<= 1;
+    la->pcm = (int16_t *)calloc(la->capacity, sizeof(int16_t));
+    if (!la->pcm) {
+        free(la);
+        return false;
+    }
+    memset(la->pcm, 0, la->capacity * sizeof(int16_t));  // prefault: calloc may map lazily
+    atomic_store_explicit(&la->low_fill, UINT64_MAX, memory_order_relaxed);
+    lookahead_mark(la, 0, now_ns());
+    s->ahead = la;
+    lookahead_fill(la, s, la->target + BUFFER_COUNT * BUFFER_FRAMES);
+    atomic_store_explicit(&la->running, true, memory_order_relaxed);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (g_rt.enabled) pthread_attr_setstacksize(&attr, RT_THREAD_STACK);
+    bool ok = pthread_create(&la->thread, &attr, lookahead_main, s) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) {
+        fprintf(stderr, "Cannot start the lookahead render thread\n");
+        s->ahead = NULL;
+        free(la->pcm);
+        free(la);
+        return false;
+    }
+    printf("Output: rendering %.0f ms ahead of the audio device (%u frames)\n", ms, la->target);
+    return true;
+}
+
+// After audio_stop, once the callback no longer reads the ring.
+static void lookahead_stop(Synth *s) {
+    Lookahead *la = s->ahead;
+    if (!la) return;
+    atomic_store_explicit(&la->running, false, memory_order_relaxed);
+    pthread_join(la->thread, NULL);
+    s->ahead = NULL;
+    free(la->pcm);
+    free(la);
+}
+
+static void print_lookahead(Lookahead *la) {
+    const double ms_per_frame = 1000.0 / SAMPLE_RATE;
+    uint64_t queued = atomic_load_explicit(&la->write_frames, memory_order_relaxed) -
+                      atomic_load_explicit(&la->read_frames, memory_order_relaxed);
+    uint64_t low = atomic_exchange_explicit(&la->low_fill, UINT64_MAX, memory_order_relaxed);
+    printf("Lookahead: %.1f ms queued of %.1f ms (lowest %.1f ms, slowest render %.2f ms since last stats), "
+           "%llu underruns (%llu frames of silence)\n",
+           (double)queued * ms_per_frame, (double)la->target * ms_per_frame,
+           (double)(low == UINT64_MAX ? queued : low) * ms_per_frame,
+           (double)atomic_exchange_explicit(&la->chunk_max_ns, 0, memory_order_relaxed) / 1e6,
+           (unsigned long long)atomic_load_explicit(&la->underruns, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&la->underrun_frames, memory_order_relaxed));
+    printf("Scheduled controls: %llu, %llu applied late (worst %.2f ms)\n",
+           (unsigned long long)atomic_load_explicit(&la->scheduled, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&la->late, memory_order_relaxed),
+           (double)atomic_load_explicit(&la->late_max_frames, memory_order_relaxed) * ms_per_frame);
+}
+
+// Parses `a=5 b=3 sh=4 ...` (space separated) into macros and a mask of the
+// ones given. Shared by text banks and pattern files.
+static bool parse_macro_field(char *field, uint32_t *set, double macros[6], char *err, size_t err_sz) {
+    static const char *kKeys[6] = {"a=", "b=", "c=", "d=", "sh=", "mask="};
+    char *save = NULL;
+    for (char *tok = strtok_r(field, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        bool matched = false;
+        for (int k = 0; k < 6 && !matched; ++k) {
+            size_t klen = strlen(kKeys[k]);
+            if (strncmp(tok, kKeys[k], klen) != 0) continue;
+            macros[k] = strtod(tok + klen, NULL);
+            *set |= 1u << k;
+            matched = true;
+        }
+        if (!matched) {
+            snprintf(err, err_sz, "unknown macro '%s'", tok);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void seq_slot_clear(SeqSlot *slot) {
+    expr_free(slot->expr);
+    free(slot->src);
+    free(slot->note);
+    expr_frame_free(&slot->frame);
+    if (slot->native_handle) dlclose(slot->native_handle);
+    memset(slot, 0, sizeof(*slot));
+}
+
+static void sequencer_free(Sequencer *seq) {
+    for (uint32_t i = 0; i < seq->step_count; ++i) free(seq->steps[i].src);
+    free(seq->steps);
+    for (int i = 0; i < SEQ_AHEAD; ++i) seq_slot_clear(&seq->slots[i]);
+    free(seq->path);
+    free(seq);
+}
+
+// Parses one pattern line: `length<TAB>equation` or `length<TAB>a=5 b=3 ...<TAB>equation`,
+// length in grid steps. The equation `-` keeps the playing one; `@N` is preset N,
+// with its default macros when it comes from a bank. The step is compiled and
+// admitted once here so a bad line is reported at load time.
+static bool sequencer_add_line(Sequencer *seq, double budget_ns, char *line, char *err, size_t err_sz) {
+    char *fields[3] = {NULL, NULL, NULL};
+    int nf = 0;
+    for (char *p = line; nf < 3;) {
+        fields[nf++] = p;
+        char *tab = strchr(p, '\t');
+        if (!tab) break;
+        *tab = '\0';
+        p = tab + 1;
+    }
+    char *end = NULL;
+    long length = strtol(fields[0], &end, 10);
+    if (nf < 2 || end == fields[0] || *end || length < 1 || length > 65536) {
+        snprintf(err, err_sz, "expected <length><TAB>[macros<TAB>]<equation>");
+        return false;
+    }
+    SeqStep step;
+    memset(&step, 0, sizeof(step));
+    step.length = (uint32_t)length;
+    const char *js = fields[nf - 1];
+    char *preset_copy = NULL;
+    if (js[0] == '@') {
+        int idx = atoi(js + 1) - 1;
+        pthread_mutex_lock(&g_bank_lock);
+        if (idx >= 0 && idx < preset_count()) {
+            preset_copy = strdup(preset_js(idx));
+            if (g_bank.hdr) {
+                const BankEntry *be = &g_bank.entries[idx];
+                step.macro_set = be->macro_set;
+                memcpy(step.macros, be->macros, sizeof(step.macros));
+            }
+        }
+        pthread_mutex_unlock(&g_bank_lock);
+        if (!preset_copy) {
+            snprintf(err, err_sz, "no preset %s", js + 1);
+            return false;
+        }
+        js = preset_copy;
+    }
+    if (nf == 3 && !parse_macro_field(fields[1], &step.macro_set, step.macros, err, err_sz)) {
+        free(preset_copy);
+        return false;
+    }
+    if (strcmp(js, "-") != 0) {
+        step.src = transpile_js_to_c(js);
+        char cerr[256];
+        Expr *root = step.src ? compile_expr(step.src, cerr, sizeof(cerr)) : NULL;
+        double cost_ns = 0.0;
+        int divide = root ? expr_admit(root, budget_ns, &cost_ns) : 0;
+        if (!root) {
+            snprintf(err, err_sz, "%s", step.src ? cerr : "failed to transpile");
+        } else if (!divide) {
+            char why[160];
+            format_admission(why, sizeof(why), cost_ns, budget_ns, 0);
+            snprintf(err, err_sz, "equation rejected: %s", why);
+        }
+        expr_free(root);
+        if (!divide) {
+            free(step.src);
+            free(preset_copy);
+            return false;
+        }
+    }
+    free(preset_copy);
+    SeqStep *steps = (SeqStep *)realloc(seq->steps, (seq->step_count + 1) * sizeof(SeqStep));
+    if (!steps) {
+        free(step.src);
+        snprintf(err, err_sz, "out of memory");
+        return false;
+    }
+    seq->steps = steps;
+    seq->steps[seq->step_count++] = step;
+    return true;
+}
+
+// Loads a pattern file: `bpm <n>`, `grid <steps per bar>` and `beats <per bar>`
+// lines (defaults 120, 16 and 4), then one step per line. `#` starts a comment line.
+static Sequencer *sequencer_load(const char *path, double budget_ns, char *err, size_t err_sz) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        snprintf(err, err_sz, "Cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    Sequencer *seq = (Sequencer *)calloc(1, sizeof(Sequencer));
+    if (!seq || !(seq->path = strdup(path))) {
+        fclose(in);
+        free(seq);
+        snprintf(err, err_sz, "Out of memory");
+        return NULL;
+    }
+    seq->budget_ns = budget_ns;
+    seq->bpm = 120.0;
+    seq->grid = 16;
+    seq->beats = 4;
+    char line[INPUT_LINE_MAX];
+    char why[300] = "";
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), in)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line;
+        while (*p == ' ') p++;
+        if (!*p || *p == '#') continue;
+        if (!strncmp(p, "bpm ", 4)) {
+            seq->bpm = strtod(p + 4, NULL);
+            ok = seq->bpm >= 20.0 && seq->bpm <= 999.0;
+            if (!ok) snprintf(why, sizeof(why), "bpm out of range (20..999)");
+        } else if (!strncmp(p, "grid ", 5)) {
+            seq->grid = (uint32_t)strtoul(p + 5, NULL, 10);
+            ok = seq->grid >= 1 && seq->grid <= 64;
+            if (!ok) snprintf(why, sizeof(why), "grid out of range (1..64 steps per bar)");
+        } else if (!strncmp(p, "beats ", 6)) {
+            seq->beats = (uint32_t)strtoul(p + 6, NULL, 10);
+            ok = seq->beats >= 1 && seq->beats <= 16;
+            if (!ok) snprintf(why, sizeof(why), "beats out of range (1..16 per bar)");
+        } else if (seq->step_count == SEQ_MAX_STEPS) {
+            snprintf(why, sizeof(why), "too many steps (max %d)", SEQ_MAX_STEPS);
+            ok = false;
+        } else {
+            ok = sequencer_add_line(seq, budget_ns, p, why, sizeof(why));
+        }
+    }
+    fclose(in);
+    if (ok && !seq->step_count) {
+        snprintf(err, err_sz, "%s has no steps", path);
+        sequencer_free(seq);
+        return NULL;
+    }
+    if (!ok) {
+        snprintf(err, err_sz, "%s:%d: %s", path, lineno, why);
+        sequencer_free(seq);
+        return NULL;
+    }
+    seq->grid_frames = SAMPLE_RATE * 60.0 * seq->beats / (seq->bpm * seq->grid);
+    return seq;
+}
+
+// Sequencer thread: compiles the next step into a slot. Step frames are
+// computed from the grid position, so rounding never accumulates.
+static void sequencer_prepare(Sequencer *seq, SeqSlot *slot) {
+    const SeqStep *step = &seq->steps[seq->next_step];
+    slot->at = (uint64_t)llround((double)seq->next_grid * seq->grid_frames);
+    slot->step = seq->next_step;
+    slot->macro_set = step->macro_set;
+    memcpy(slot->macros, step->macros, sizeof(slot->macros));
+    if (step->src) {
+        char err[256];
+        Expr *root = compile_expr(step->src, err, sizeof(err));
+        int divide = root ? expr_admit(root, seq->budget_ns, &slot->cost_ns) : 0;
+        slot->src = strdup(step->src);
+        slot->note = strdup(step->src);
+        // A step that fails here (out of memory) keeps the playing equation.
+        if (divide && slot->src && slot->note && expr_frame_init(&slot->frame, root)) {
+            slot->expr = root;
+            slot->divide = divide;
+            slot->native = aot_lookup(slot->src);
+        } else {
+            expr_free(root);
+            free(slot->src);
+            free(slot->note);
+            slot->src = slot->note = NULL;
+        }
+    }
+    seq->next_grid += step->length;
+    seq->next_step = (seq->next_step + 1) % seq->step_count;
+}
+
+// Frees what the audio thread has handed back and refills the ring.
+static void sequencer_fill(Sequencer *seq) {
+    uint32_t r = atomic_load_explicit(&seq->read_pos, memory_order_acquire);
+    for (; seq->clean_pos != r; ++seq->clean_pos) seq_slot_clear(&seq->slots[seq->clean_pos & (SEQ_AHEAD - 1)]);
+    uint32_t w = atomic_load_explicit(&seq->write_pos, memory_order_relaxed);
+    for (; w - seq->clean_pos < SEQ_AHEAD; ++w) {
+        sequencer_prepare(seq, &seq->slots[w & (SEQ_AHEAD - 1)]);
+        atomic_store_explicit(&seq->write_pos, w + 1, memory_order_release);
+    }
+}
+
+static void *sequencer_main(void *user) {
+    Sequencer *seq = (Sequencer *)user;
+    while (atomic_load_explicit(&seq->running, memory_order_relaxed)) {
+        sequencer_fill(seq);
+        struct timespec pause = {0, SEQ_POLL_NS};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Stops and frees the playing pattern, if any. The audio thread only touches
+// s->seq under expr_lock, so once it is unhooked the slots can be freed.
+static bool sequencer_stop(Synth *s) {
+    pthread_mutex_lock(&s->expr_lock);
+    Sequencer *seq = s->seq;
+    s->seq = NULL;
+    atomic_store_explicit(&s->seq_due, UINT64_MAX, memory_order_relaxed);
+    pthread_mutex_unlock(&s->expr_lock);
+    if (!seq) return false;
+    atomic_store_explicit(&seq->running, false, memory_order_relaxed);
+    pthread_join(seq->thread, NULL);
+    sequencer_free(seq);
+    return true;
+}
+
+// Compiles the first SEQ_AHEAD steps, then hands the pattern to the audio
+// thread, which starts it at its next buffer. A playing pattern is replaced.
+static bool sequencer_start(Synth *s, Sequencer *seq, char *err, size_t err_sz) {
+    sequencer_fill(seq);
+    atomic_store_explicit(&seq->running, true, memory_order_relaxed);
+    if (pthread_create(&seq->thread, NULL, sequencer_main, seq) != 0) {
+        snprintf(err, err_sz, "Failed to start sequencer thread");
+        sequencer_free(seq);
+        return false;
+    }
+    sequencer_stop(s);
+    pthread_mutex_lock(&s->expr_lock);
+    s->seq = seq;
+    atomic_store_explicit(&s->seq_due, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&s->expr_lock);
+    return true;
+}
+
+static void print_sequencer(const Sequencer *seq) {
+    printf("Sequencer: %s, %u steps at %.1f bpm (%u per bar of %u beats), playing step %u\n", seq->path,
+           seq->step_count, seq->bpm, seq->grid, seq->beats,
+           atomic_load_explicit(&seq->playing, memory_order_relaxed) + 1);
+    printf("Switches: %llu, %llu late (worst %.2f ms)\n",
+           (unsigned long long)atomic_load_explicit(&seq->switches, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&seq->late, memory_order_relaxed),
+           (double)atomic_load_explicit(&seq->late_max_frames, memory_order_relaxed) * 1000.0 / SAMPLE_RATE);
+}
+
+// REPL `seq <file>|off`, and `seq` alone for the status.
+static void sequencer_command(Synth *s, const char *arg) {
+    if (!*arg) {
+        if (s->seq) {
+            print_sequencer(s->seq);
+        } else {
+            puts("No pattern playing (seq <file> starts one)");
+        }
+        return;
+    }
+    if (!strcmp(arg, "off")) {
+        puts(sequencer_stop(s) ? "Sequencer stopped" : "No pattern playing");
+        return;
+    }
+    char err[600];
+    Sequencer *seq = sequencer_load(arg, s->cost_budget_ns, err, sizeof(err));
+    if (!seq || !sequencer_start(s, seq, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return;
+    }
+    atomic_store_explicit(&s->current_preset, -1, memory_order_relaxed);
+    printf("Playing %s: %u steps at %.1f bpm, %u steps per bar\n", arg, seq->step_count, seq->bpm, seq->grid);
+}
+
+static int run_daemon(const char *config_path, int threads) {
+    signal(SIGINT, on_daemon_signal);
+    signal(SIGTERM, on_daemon_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *cfg = fopen(config_path, "r");
+    if (!cfg) {
+        fprintf(stderr, "Cannot open %s: %s\n", config_path, strerror(errno));
+        return 1;
+    }
+    DaemonStream *streams = (DaemonStream *)calloc(DAEMON_MAX_STREAMS, sizeof(DaemonStream));
+    if (!streams) {
+        fclose(cfg);
+        return 1;
+    }
+    int count = 0;
+    bool ok = true;
+    char line[INPUT_LINE_MAX];
+    while (ok && fgets(line, sizeof(line), cfg)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p || *p == '#') continue;
+        if (count == DAEMON_MAX_STREAMS) {
+            fprintf(stderr, "Too many streams (max %d)\n", DAEMON_MAX_STREAMS);
+            ok = false;
+            break;
+        }
+        ok = daemon_parse_stream(&streams[count], p);
+        count++;
+        ok = ok && daemon_open_sink(&streams[count - 1]);
+    }
+    fclose(cfg);
+    if (!ok || count == 0) {
+        if (ok) fprintf(stderr, "No streams in %s\n", config_path);
+        daemon_streams_free(streams, count);
+        return 1;
+    }
+    // Streams are spread evenly over the render threads, which share one tick
+    // deadline, so each stream is admitted against its share of a thread.
+    int voices = (count + (threads > 0 ? threads : 1) - 1) / (threads > 0 ? threads : 1);
+    for (int i = 0; i < count; ++i) {
+        char err[300];
+        streams[i].synth.cost_budget_ns = admit_budget_ns(voices);
+        if (!synth_readmit(&streams[i].synth, err, sizeof(err))) {
+            fprintf(stderr, "Stream %d: %s\n", i + 1, err);
+            daemon_streams_free(streams, count);
+            return 1;
+        }
+        double divide = atomic_load_explicit(&streams[i].synth.target_decimate, memory_order_relaxed);
+        if (divide > 1.0) printf("Stream %d: running at 1/%d internal rate\n", i + 1, (int)divide);
+    }
+    for (int i = 0; i < count && atomic_load_explicit(&g_daemon_running, memory_order_relaxed); ++i) {
+        daemon_stream_prepare(&streams[i]);
+    }
+
+    DaemonPool pool;
+    if (!daemon_pool_start(&pool, streams, count, threads)) {
+        daemon_streams_free(streams, count);
+        return 1;
+    }
+    printf("Daemon: %d streams on %d render threads, %d-frame ticks\n", count, pool.thread_count, BUFFER_FRAMES);
+    // The pacing thread wakes the pool, so it must not be preempted by it.
+    if (g_rt.enabled) rt_thread_setup(g_rt.priority + 1);
+
+    const uint64_t tick_ns = (uint64_t)BUFFER_FRAMES * 1000000000ull / SAMPLE_RATE;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t ticks = 0, late = 0, worst_ns = 0;
+    while (atomic_load_explicit(&g_daemon_running, memory_order_relaxed)) {
+        uint64_t start = now_ns();
+        daemon_pool_tick(&pool);
+        uint64_t took = now_ns() - start;
+        if (took > worst_ns) worst_ns = took;
+        ticks++;
+        timespec_add_ns(&deadline, tick_ns);
+        uint64_t deadline_ns = (uint64_t)deadline.tv_sec * 1000000000ull + (uint64_t)deadline.tv_nsec;
+        if (now_ns() > deadline_ns) {
+            late++;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);  // don't try to catch up a backlog
+        } else {
+            sleep_until(&deadline);
+        }
+        if (ticks % (10 * SAMPLE_RATE / BUFFER_FRAMES) == 0) {
+            int shedding = 0;
+            uint64_t waits = 0;
+            for (int i = 0; i < count; ++i) {
+                shedding += atomic_load_explicit(&streams[i].synth.stats.gov_step, memory_order_relaxed) > 0;
+                waits += atomic_load_explicit(&streams[i].synth.stats.render_lock_waits, memory_order_relaxed);
+            }
+            printf("Daemon: %.0f s rendered, %llu late ticks, worst tick %.2f ms of %.2f ms budget, "
+                   "%d streams shedding, %llu render lock waits",
+                   (double)ticks * BUFFER_FRAMES / SAMPLE_RATE, (unsigned long long)late, worst_ns / 1e6,
+                   tick_ns / 1e6, shedding, (unsigned long long)waits);
+            if (RENDER_ALLOC_CHECK) {
+                printf(", %llu render allocations",
+                       (unsigned long long)atomic_load_explicit(&g_render_allocs, memory_order_relaxed));
+            }
+            putchar('\n');
+            fflush(stdout);
+            worst_ns = 0;
+        }
+    }
+
+    daemon_pool_stop(&pool);
+    uint64_t dropped = 0;
+    for (int i = 0; i < count; ++i) dropped += streams[i].dropped_blocks;
+    printf("Daemon stopped after %llu ticks (%llu late, %llu sink blocks dropped)\n", (unsigned long long)ticks,
+           (unsigned long long)late, (unsigned long long)dropped);
+    daemon_streams_free(streams, count);
+    return 0;
+}
+
+// Renders `count` streams (cycling through the presets) as fast as possible and
+// reports how many real-time streams that throughput would sustain.
+static int run_daemon_bench(int count, double seconds, int threads) {
+    if (count < 1 || count > DAEMON_MAX_STREAMS || !(seconds > 0.0)) {
+        fprintf(stderr, "Bench needs 1..%d streams and a positive duration\n", DAEMON_MAX_STREAMS);
+        return 1;
+    }
+    const uint64_t ticks = (uint64_t)ceil(seconds * SAMPLE_RATE / BUFFER_FRAMES);
+    const double audio_seconds = (double)ticks * BUFFER_FRAMES / SAMPLE_RATE;
+    printf("Benchmark: %d streams x %.1f s, %d threads\n", count, audio_seconds, threads);
+    for (int pass = 0; pass < 2; ++pass) {
+        bool loop = pass == 1;
+        DaemonStream *streams = (DaemonStream *)calloc((size_t)count, sizeof(DaemonStream));
+        if (!streams) return 1;
+        for (int i = 0; i < count; ++i) {
+            synth_init(&streams[i].synth);
+            streams[i].fd = -1;
+            streams[i].sink = SINK_NONE;
+            atomic_store_explicit(&streams[i].synth.loop_cache_enabled, loop, memory_order_relaxed);
+            char err[300];
+            synth_load_expr(&streams[i].synth, kPresets[i % PRESET_COUNT].js, err, sizeof(err));
+        }
+        uint64_t prep_start = now_ns();
+        for (int i = 0; i < count; ++i) daemon_stream_prepare(&streams[i]);
+        double prep_s = (double)(now_ns() - prep_start) / 1e9;
+
+        DaemonPool pool;
+        if (!daemon_pool_start(&pool, streams, count, threads)) {
+            daemon_streams_free(streams, count);
+            return 1;
+        }
+        uint64_t start = now_ns();
+        for (uint64_t t = 0; t < ticks; ++t) daemon_pool_tick(&pool);
+        double wall = (double)(now_ns() - start) / 1e9;
+        daemon_pool_stop(&pool);
+
+        double realtime = audio_seconds * count / wall;
+        printf("  %-12s %.3f s wall, %.1fx real time in total -> ~%.0f concurrent 48 kHz streams",
+               loop ? "loop cache:" : g_aot_lib_count ? "native:" : "interpreter:", wall, realtime, floor(realtime));
+        if (loop) printf(" (+%.2f s one-off loop rendering)", prep_s);
+        printf("\n");
+        daemon_streams_free(streams, count);
+    }
+    return 0;
+}
+
+// Cheap descriptors of a run of output bytes, accumulated as they are rendered.
+typedef struct {
+    double entropy;      // bits per output byte, 0..8
+    double centroid_hz;  // sqrt(E[dx^2] / var(x)) * fs / 2pi estimate of the mean frequency
+    double dc;           // mean of the float output, -1..1
+    double rms;          // AC RMS of the float output
+    double score;
+} ByteDescriptors;
+
+typedef struct {
+    uint32_t hist[256];
+    double sum;
+    double sum_sq;
+    double diff_sq;
+    double prev;
+    uint64_t count;
+} ByteStats;
+
+static void byte_stats_add(ByteStats *st, const uint8_t *bytes, int n) {
+    for (int i = 0; i < n; ++i) {
+        double x = byte_to_float(bytes[i]);
+        st->hist[bytes[i]]++;
+        st->sum += x;
+        st->sum_sq += x * x;
+        if (st->count + (uint64_t)i > 0) st->diff_sq += (x - st->prev) * (x - st->prev);
+        st->prev = x;
+    }
+    st->count += (uint64_t)n;
+}
+
+static void byte_stats_describe(const ByteStats *st, ByteDescriptors *d) {
+    double n = (double)st->count;
+    double entropy = 0.0;
+    for (int i = 0; i < 256; ++i) {
+        if (!st->hist[i]) continue;
+        double p = st->hist[i] / n;
+        entropy -= p * log2(p);
+    }
+    double mean = st->sum / n;
+    double var = fmax(st->sum_sq / n - mean * mean, 0.0);
+    d->entropy = entropy;
+    d->dc = mean;
+    d->rms = sqrt(var);
+    d->centroid_hz = var > 1e-12 ? sqrt(st->diff_sq / fmax(n - 1.0, 1.0) / var) * SAMPLE_RATE / (2.0 * M_PI) : 0.0;
+    if (d->centroid_hz > SAMPLE_RATE / 2.0) d->centroid_hz = SAMPLE_RATE / 2.0;
+    // Favour busy, centred output with most energy in the audible midrange.
+    double band = (d->centroid_hz >= 100.0 && d->centroid_hz <= 8000.0) ? 1.0 : 0.5;
+    d->score = (entropy / 8.0) * band * (1.0 - fabs(mean)) * fmin(d->rms * 4.0, 1.0);
+}
+
+// Corpus scoring: compile a list of equations once, render each for a fixed number
+// of samples on a pool of threads with the block evaluator, and compute cheap
+// descriptors of the output bytes in the same pass.
+typedef struct {
+    int line;
+    char *src;
+    Expr *expr;
+    char err[256];
+    ByteDescriptors desc;
+} CorpusEntry;
+
+typedef struct {
+    CorpusEntry *entries;
+    int count;
+    uint64_t samples;
+    _Atomic int next;
+} CorpusJob;
+
+static void *corpus_thread_main(void *user) {
+    CorpusJob *job = (CorpusJob *)user;
+    for (;;) {
+        int idx = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (idx >= job->count) break;
+        CorpusEntry *ce = &job->entries[idx];
+        ExprFrame frame;
+        if (!ce->expr || !expr_frame_init(&frame, ce->expr)) continue;
+        double *t = frame.scratch;
+        double *out = frame.scratch + EVAL_BLOCK;
+        EvalContext ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.a = 5.0;
+        ctx.b = 3.0;
+        ctx.c = 7.0;
+        ctx.d = 10.0;
+        ctx.sh = 8.0;
+        ctx.mask = 127.0;
+        ctx.seed = g_seed;
+        ByteStats stats;
+        memset(&stats, 0, sizeof(stats));
+        for (uint64_t base = 0; base < job->samples; base += EVAL_BLOCK) {
+            int n = job->samples - base < EVAL_BLOCK ? (int)(job->samples - base) : EVAL_BLOCK;
+            for (int i = 0; i < n; ++i) t[i] = (double)(base + (uint64_t)i);
+            expr_eval_frame(ce->expr, &frame, &ctx, t, out, n);
+            uint8_t bytes[EVAL_BLOCK];
+            for (int i = 0; i < n; ++i) bytes[i] = (uint8_t)(block_i32(out[i]) & 0xFF);
+            byte_stats_add(&stats, bytes, n);
+        }
+        byte_stats_describe(&stats, &ce->desc);
+        expr_frame_free(&frame);
+    }
+    return NULL;
+}
+
+static int corpus_cmp(const void *pa, const void *pb) {
+    const CorpusEntry *a = (const CorpusEntry *)pa;
+    const CorpusEntry *b = (const CorpusEntry *)pb;
+    if (!a->expr != !b->expr) return a->expr ? -1 : 1;
+    if (a->desc.score != b->desc.score) return a->desc.score > b->desc.score ? -1 : 1;
+    return a->line - b->line;
+}
+
+// Scores every equation in `list_path` (one per line, `#` comments) over `samples`
+// samples at the default macros and writes a TSV report ranked by score.
+static int run_corpus(const char *list_path, uint64_t samples, int threads, const char *report_path) {
+    FILE *in = fopen(list_path, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open %s: %s\n", list_path, strerror(errno));
+        return 1;
+    }
+    int cap = 256, count = 0, lineno = 0;
+    CorpusEntry *entries = (CorpusEntry *)calloc((size_t)cap, sizeof(CorpusEntry));
+    char line[INPUT_LINE_MAX];
+    uint64_t compile_start = now_ns();
+    while (entries && fgets(line, sizeof(line), in)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p || *p == '#') continue;
+        if (count == cap) {
+            CorpusEntry *grown = (CorpusEntry *)realloc(entries, (size_t)cap * 2 * sizeof(CorpusEntry));
+            if (!grown) break;
+            memset(grown + cap, 0, (size_t)cap * sizeof(CorpusEntry));
+            entries = grown;
+            cap *= 2;
+        }
+        CorpusEntry *ce = &entries[count++];
+        ce->line = lineno;
+        ce->src = strdup(p);
+        char *c_expr = transpile_js_to_c(p);
+        if (!c_expr) {
+            snprintf(ce->err, sizeof(ce->err), "Failed to transpile equation");
+        } else {
+            ce->expr = compile_expr(c_expr, ce->err, sizeof(ce->err));
+            free(c_expr);
+        }
+    }
+    fclose(in);
+    if (!entries) return 1;
+    double compile_s = (double)(now_ns() - compile_start) / 1e9;
+
+    CorpusJob job = {.entries = entries, .count = count, .samples = samples};
+    atomic_init(&job.next, 0);
+    int failed = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!entries[i].expr) failed++;
+    }
+    if (threads > count) threads = count > 0 ? count : 1;
+    pthread_t *tids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    uint64_t render_start = now_ns();
+    int started = 0;
+    for (int i = 0; tids && i < threads; ++i) {
+        if (pthread_create(&tids[i], NULL, corpus_thread_main, &job) != 0) break;
+        started++;
+    }
+    if (started == 0) corpus_thread_main(&job);
+    for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+    double render_s = (double)(now_ns() - render_start) / 1e9;
+
+    qsort(entries, (size_t)count, sizeof(CorpusEntry), corpus_cmp);
+    FILE *out = fopen(report_path, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write %s: %s\n", report_path, strerror(errno));
+    } else {
+        fprintf(out, "rank\tscore\tentropy_bits\tcentroid_hz\tdc\trms\tline\tequation\n");
+        for (int i = 0; i < count; ++i) {
+            const CorpusEntry *ce = &entries[i];
+            if (ce->expr) {
+                fprintf(out, "%d\t%.4f\t%.3f\t%.0f\t%.4f\t%.4f\t%d\t%s\n", i + 1, ce->desc.score, ce->desc.entropy,
+                        ce->desc.centroid_hz, ce->desc.dc, ce->desc.rms, ce->line, ce->src);
+            } else {
+                fprintf(out, "-\terror\t\t\t\t\t%d\t%s\t%s\n", ce->line, ce->src ? ce->src : "", ce->err);
+            }
+        }
+        fclose(out);
+    }
+
+    double total = (double)(count - failed) * (double)samples;
+    printf("Corpus: %d equations (%d failed to compile) in %.3f s\n", count, failed, compile_s);
+    printf("Rendered %llu samples each on %d threads in %.3f s (%.1f Msamples/s, %.0fx real time)\n",
+           (unsigned long long)samples, started > 0 ? started : 1, render_s, total / render_s / 1e6,
+           total / SAMPLE_RATE / render_s);
+    if (out) printf("Ranked report written to %s\n", report_path);
+    for (int i = 0; i < count; ++i) {
+        free(entries[i].src);
+        expr_free(entries[i].expr);
+    }
+    free(entries);
+    return out ? 0 : 1;
+}
+
+// Macro sweeps: one equation rendered at every point of a grid of macro
+// settings, for preset previews. SWEEP_LANES cells are evaluated together in one
+// block: the lanes of every node hold the same samples of different cells, so
+// the cells share one pass over the tree and the per-node loops vectorize across
+// them. Programs with persistent state are rendered one cell at a time.
+#define SWEEP_LANES 16
+#define SWEEP_STRIDE (EVAL_BLOCK / SWEEP_LANES)  // samples of each cell per block
+#define SWEEP_MAX_CELLS 4096
+#define SWEEP_IMAGE_W 256
+#define SWEEP_IMAGE_H 64
+
+typedef struct {
+    double macros[6];  // a, b, c, d, sh, mask
+    ByteDescriptors desc;
+} SweepCell;
+
+typedef struct {
+    const Expr *expr;
+    SweepCell *cells;
+    int count;
+    uint64_t samples;
+    const char *dir;
+    _Atomic int next;
+    _Atomic int failed;
+} SweepJob;
+
+// Renders `count` (at most SWEEP_LANES) macro settings of e, each for t = 0 up to
+// `samples`, into out: one run of `samples` bytes per cell. frame is e's frame.
+static void expr_sweep_render(const Expr *e, ExprFrame *frame, const double (*macros)[6], int count,
+                              uint64_t samples, uint8_t *out) {
+    EvalContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.seed = g_seed;
+    double *t = frame->scratch;
+    double *y = frame->scratch + EVAL_BLOCK;
+    if (frame->block) {
+        double rows[6 * EVAL_BLOCK];
+        for (int k = 0; k < 6; ++k) {
+            for (int c = 0; c < count; ++c) {
+                for (int i = 0; i < SWEEP_STRIDE; ++i) rows[k * EVAL_BLOCK + c * SWEEP_STRIDE + i] = macros[c][k];
+            }
+        }
+        ctx.lane_macros = rows;
+        // A short last block still evaluates whole strides; the extra samples are
+        // dropped, which is safe because block programs keep no state.
+        for (uint64_t base = 0; base < samples; base += SWEEP_STRIDE) {
+            int m = samples - base < SWEEP_STRIDE ? (int)(samples - base) : SWEEP_STRIDE;
+            for (int c = 0; c < count; ++c) {
+                for (int i = 0; i < SWEEP_STRIDE; ++i) t[c * SWEEP_STRIDE + i] = (double)(base + (uint64_t)i);
+            }
+            expr_eval_frame(e, frame, &ctx, t, y, count * SWEEP_STRIDE);
+            for (int c = 0; c < count; ++c) {
+                uint8_t *dst = out + (size_t)c * samples + base;
+                for (int i = 0; i < m; ++i) dst[i] = (uint8_t)(block_i32(y[c * SWEEP_STRIDE + i]) & 0xFF);
+            }
+        }
+        return;
+    }
+    for (int c = 0; c < count; ++c) {
+        ctx.a = macros[c][0];
+        ctx.b = macros[c][1];
+        ctx.c = macros[c][2];
+        ctx.d = macros[c][3];
+        ctx.sh = macros[c][4];
+        ctx.mask = macros[c][5];
+        memset(frame->vars, 0, ((size_t)frame->locals + frame->state) * sizeof(double));
+        for (uint64_t base = 0; base < samples; base += EVAL_BLOCK) {
+            int n = samples - base < EVAL_BLOCK ? (int)(samples - base) : EVAL_BLOCK;
+            for (int i = 0; i < n; ++i) t[i] = (double)(base + (uint64_t)i);
+            expr_eval_frame(e, frame, &ctx, t, y, n);
+            uint8_t *dst = out + (size_t)c * samples + base;
+            for (int i = 0; i < n; ++i) dst[i] = (uint8_t)(block_i32(y[i]) & 0xFF);
+        }
+    }
+}
+
+// Waveform thumbnail (binary PPM): each column covers an equal share of the
+// samples, and each row is shaded by how many of them fall in its byte range.
+static bool sweep_write_image(const char *path, const uint8_t *bytes, uint64_t samples) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    static const uint8_t kBackground[3] = {18, 18, 22};
+    uint8_t *rgb = (uint8_t *)malloc(SWEEP_IMAGE_W * SWEEP_IMAGE_H * 3);
+    bool ok = rgb != NULL;
+    for (int x = 0; ok && x < SWEEP_IMAGE_W; ++x) {
+        uint64_t from = samples * (uint64_t)x / SWEEP_IMAGE_W;
+        uint64_t to = samples * (uint64_t)(x + 1) / SWEEP_IMAGE_W;
+        uint32_t hist[SWEEP_IMAGE_H] = {0};
+        for (uint64_t i = from; i < to; ++i) hist[bytes[i] * SWEEP_IMAGE_H / 256]++;
+        for (int y = 0; y < SWEEP_IMAGE_H; ++y) {
+            // An even spread over all rows comes out at half brightness.
+            double share = (double)hist[SWEEP_IMAGE_H - 1 - y] * SWEEP_IMAGE_H / (4.0 * (double)(to - from));
+            double v = to > from ? sqrt(fmin(share, 1.0)) : 0.0;
+            uint8_t *px = rgb + ((size_t)y * SWEEP_IMAGE_W + (size_t)x) * 3;
+            px[0] = (uint8_t)lrint(kBackground[0] + v * (255 - kBackground[0]));
+            px[1] = (uint8_t)lrint(kBackground[1] + v * (190 - kBackground[1]));
+            px[2] = (uint8_t)lrint(kBackground[2] + v * (70 - kBackground[2]));
+        }
+    }
+    ok = ok && fprintf(f, "P6\n%d %d\n255\n", SWEEP_IMAGE_W, SWEEP_IMAGE_H) > 0;
+    ok = ok && fwrite(rgb, 3, SWEEP_IMAGE_W * SWEEP_IMAGE_H, f) == SWEEP_IMAGE_W * SWEEP_IMAGE_H;
+    free(rgb);
+    return (fclose(f) == 0) && ok;
+}
+
+// 8-bit WAV preview: the output bytes as they are.
+static bool sweep_write_audio(const char *path, const uint8_t *bytes, uint64_t samples) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = wav_write_header(f, SAMPLE_RATE, 8, (uint32_t)samples) && fwrite(bytes, 1, samples, f) == samples;
+    return (fclose(f) == 0) && ok;
+}
+
+static void *sweep_thread_main(void *user) {
+    SweepJob *job = (SweepJob *)user;
+    ExprFrame frame;
+    uint8_t *bytes = (uint8_t *)malloc((size_t)SWEEP_LANES * job->samples);
+    if (!bytes || !expr_frame_init(&frame, job->expr)) {
+        free(bytes);
+        atomic_fetch_add(&job->failed, 1);
+        return NULL;
+    }
+    for (;;) {
+        int first = atomic_fetch_add_explicit(&job->next, SWEEP_LANES, memory_order_relaxed);
+        if (first >= job->count) break;
+        int count = job->count - first < SWEEP_LANES ? job->count - first : SWEEP_LANES;
+        double macros[SWEEP_LANES][6];
+        for (int c = 0; c < count; ++c) memcpy(macros[c], job->cells[first + c].macros, sizeof(macros[c]));
+        expr_sweep_render(job->expr, &frame, (const double(*)[6])macros, count, job->samples, bytes);
+        for (int c = 0; c < count; ++c) {
+            const uint8_t *cell = bytes + (size_t)c * job->samples;
+            ByteStats stats;
+            memset(&stats, 0, sizeof(stats));
+            for (uint64_t base = 0; base < job->samples; base += EVAL_BLOCK) {
+                int n = job->samples - base < EVAL_BLOCK ? (int)(job->samples - base) : EVAL_BLOCK;
+                byte_stats_add(&stats, cell + base, n);
+            }
+            byte_stats_describe(&stats, &job->cells[first + c].desc);
+            if (!job->dir) continue;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/cell-%04d.ppm", job->dir, first + c);
+            bool ok = sweep_write_image(path, cell, job->samples);
+            snprintf(path, sizeof(path), "%s/cell-%04d.wav", job->dir, first + c);
+            ok = sweep_write_audio(path, cell, job->samples) && ok;
+            if (!ok) atomic_fetch_add(&job->failed, 1);
+        }
+    }
+    expr_frame_free(&frame);
+    free(bytes);
+    return NULL;
+}
+
+// Parses a grid such as "a=1:16,sh=4:12:2" (inclusive integer ranges with an
+// optional step) into cells, the first axis varying slowest. Macros not on the
+// grid keep the synth's defaults.
+static int sweep_parse_grid(const char *spec, SweepCell **cells_out, char *err, size_t err_sz) {
+    static const char *const kNames[6] = {"a", "b", "c", "d", "sh", "mask"};
+    double lo[6], step[6];
+    int axis[6], steps[6], axes = 0;
+    char *copy = strdup(spec);
+    if (!copy) {
+        snprintf(err, err_sz, "Out of memory");
+        return -1;
+    }
+    char *save = NULL;
+    long cells = 1;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int k = 0;
+        if (eq) *eq = '\0';
+        while (k < 6 && strcmp(tok, kNames[k]) != 0) k++;
+        double from = 0.0, to = 0.0, by = 1.0;
+        int got = eq ? sscanf(eq + 1, "%lf:%lf:%lf", &from, &to, &by) : 0;
+        if (k == 6 || got < 2 || !isfinite(from) || !isfinite(to) || !(by > 0.0) || to < from || axes == 6) {
+            snprintf(err, err_sz, "Bad sweep axis '%s': expected <macro>=<from>:<to>[:<step>]", tok);
+            free(copy);
+            return -1;
+        }
+        // Counted in double and checked before the cast: a tiny step or a huge
+        // range must not overflow int or the running product.
+        double n = floor((to - from) / by + 1e-9) + 1.0;
+        if (!(n <= SWEEP_MAX_CELLS) || (double)cells * n > SWEEP_MAX_CELLS) {
+            snprintf(err, err_sz, "Sweep grid has more than %d cells", SWEEP_MAX_CELLS);
+            free(copy);
+            return -1;
+        }
+        axis[axes] = k;
+        lo[axes] = from;
+        step[axes] = by;
+        steps[axes] = (int)n;
+        cells *= steps[axes];
+        axes++;
+    }
+    free(copy);
+    if (!axes) {
+        snprintf(err, err_sz, "Sweep grid is empty");
+        return -1;
+    }
+    SweepCell *out = (SweepCell *)calloc((size_t)cells, sizeof(SweepCell));
+    if (!out) {
+        snprintf(err, err_sz, "Out of memory");
+        return -1;
+    }
+    for (long i = 0; i < cells; ++i) {
+        const double defaults[6] = {5.0, 3.0, 7.0, 10.0, 8.0, 127.0};
+        memcpy(out[i].macros, defaults, sizeof(defaults));
+        long rest = i;
+        for (int k = axes - 1; k >= 0; --k) {
+            out[i].macros[axis[k]] = lo[k] + step[k] * (double)(rest % steps[k]);
+            rest /= steps[k];
+        }
+        // The synth rounds sh and mask before the equation sees them.
+        out[i].macros[4] = floor(out[i].macros[4] + 0.5);
+        out[i].macros[5] = floor(out[i].macros[5] + 0.5);
+    }
+    *cells_out = out;
+    return (int)cells;
+}
+
+// Renders equation `js` over a macro grid. With an output directory, every cell
+// gets a waveform thumbnail and an 8-bit WAV preview, and index.tsv lists the
+// cells with their settings and descriptors.
+static int run_sweep(const char *js, const char *grid, const char *dir, double seconds, int threads) {
+    char err[300];
+    char *src = transpile_js_to_c(js);
+    if (!src) {
+        fprintf(stderr, "Failed to transpile equation\n");
+        return 1;
+    }
+    Expr *e = compile_expr(src, err, sizeof(err));
+    free(src);
+    if (!e) {
+        fprintf(stderr, "Compile error: %s\n", err);
+        return 1;
+    }
+    SweepCell *cells = NULL;
+    int count = sweep_parse_grid(grid, &cells, err, sizeof(err));
+    if (count < 0) {
+        fprintf(stderr, "%s\n", err);
+        expr_free(e);
+        return 2;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", dir, strerror(errno));
+        free(cells);
+        expr_free(e);
+        return 1;
+    }
+    SweepJob job = {.expr = e, .cells = cells, .count = count, .dir = dir};
+    job.samples = (uint64_t)(seconds * SAMPLE_RATE);
+    if (job.samples == 0) job.samples = 1;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    int groups = (count + SWEEP_LANES - 1) / SWEEP_LANES;
+    if (threads > groups) threads = groups;
+    pthread_t *tids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    uint64_t start = now_ns();
+    int started = 0;
+    for (int i = 0; tids && i < threads; ++i) {
+        if (pthread_create(&tids[i], NULL, sweep_thread_main, &job) != 0) break;
+        started++;
+    }
+    if (started == 0) sweep_thread_main(&job);
+    for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+    double wall = (double)(now_ns() - start) / 1e9;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index.tsv", dir);
+    FILE *out = fopen(path, "w");
+    if (out) {
+        fprintf(out, "cell\ta\tb\tc\td\tsh\tmask\tscore\tentropy_bits\tcentroid_hz\tdc\trms\timage\taudio\n");
+        for (int i = 0; i < count; ++i) {
+            const SweepCell *cell = &cells[i];
+            fprintf(out, "%d\t%g\t%g\t%g\t%g\t%g\t%g\t%.4f\t%.3f\t%.0f\t%.4f\t%.4f\tcell-%04d.ppm\tcell-%04d.wav\n", i,
+                    cell->macros[0], cell->macros[1], cell->macros[2], cell->macros[3], cell->macros[4],
+                    cell->macros[5], cell->desc.score, cell->desc.entropy, cell->desc.centroid_hz, cell->desc.dc,
+                    cell->desc.rms, i, i);
+        }
+        if (fclose(out) != 0) out = NULL;
+    }
+    if (!out) fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+
+    double total = (double)count * (double)job.samples;
+    printf("Sweep: %d cells x %llu samples on %d threads in %.3f s (%.1f Msamples/s, %.0fx real time)\n", count,
+           (unsigned long long)job.samples, started > 0 ? started : 1, wall, total / wall / 1e6,
+           total / SAMPLE_RATE / wall);
+    if (expr_block_ok(e)) {
+        printf("%d cells per block evaluation\n", SWEEP_LANES);
+    } else {
+        printf("The program keeps state, so cells were rendered one at a time\n");
+    }
+    int failed = atomic_load(&job.failed);
+    if (failed) fprintf(stderr, "%d cells could not be rendered or written\n", failed);
+    if (out) printf("Index written to %s\n", path);
+    free(cells);
+    expr_free(e);
+    return failed || !out ? 1 : 0;
+}
+
+// Per-node profiler. A counting mirror of expr_eval records how often every node
+// runs over the window. Then every subtree is timed on its own, uninstrumented,
+// over a sample of the window's t values, so a node's inclusive cost per run is
+// measured without a timer around each node (a timer read costs more than most
+// nodes). Nodes are numbered in pre-order, so a node's children follow it and
+// only subtree sizes are needed to find them.
+#define PROFILE_TIMED_MAX 4096         // t values each subtree is timed on
+#define PROFILE_ROUND_EVALS 20000000.0 // node evaluations per timing round
+#define PROFILE_ROUNDS 3               // the fastest round counts
+#define PROFILE_TEXT_MAX 1024
+
+typedef struct {
+    const Expr *e;
+    int parent;
+    int depth;
+    int size;            // nodes in the subtree, this one included
+    uint64_t evals;      // over the whole window
+    double ns_per_eval;  // inclusive
+    double total_ns;     // ns_per_eval * evals
+    double child_ns;     // total_ns of the direct children
+    double self_ns;
+} ProfileNode;
+
+typedef struct {
+    ProfileNode *nodes;
+    int count;
+    uint64_t samples;
+    uint64_t timed_samples;
+    double scalar_ns;  // expr_eval per sample
+    double render_ns;  // expr_eval_frame as the synth renders, per sample
+} Profiler;
+
+static int profile_count(const Expr *e) {
+    int n = 1;
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+        case EX_LOCAL:
+        case EX_STATE:
+            break;
+        case EX_UNARY:
+            n += profile_count(e->as.unary.a);
+            break;
+        case EX_BINARY:
+            n += profile_count(e->as.binary.a) + profile_count(e->as.binary.b);
+            break;
+        case EX_TERNARY:
+            n += profile_count(e->as.ternary.cond) + profile_count(e->as.ternary.yes) +
+                 profile_count(e->as.ternary.no);
+            break;
+        case EX_FUNC:
+            for (int i = 0; i < e->as.func.argc; ++i) n += profile_count(e->as.func.args[i]);
+            break;
+        case EX_INDEX:
+            n += profile_count(e->as.ref.index);
+            break;
+        case EX_ASSIGN:
+            n += profile_count(e->as.assign.target) + profile_count(e->as.assign.value);
+            break;
+        case EX_SEQ:
+            n += profile_count(e->as.seq.first) + profile_count(e->as.seq.rest);
+            break;
+    }
+    return n;
+}
+
+// Numbers the subtree rooted at e from idx on; returns the next free index.
+static int profile_number(Profiler *p, const Expr *e, int idx, int parent, int depth) {
+    ProfileNode *node = &p->nodes[idx];
+    node->e = e;
+    node->parent = parent;
+    node->depth = depth;
+    int next = idx + 1;
+    switch (e->type) {
+        case EX_NUM:
+        case EX_VAR:
+        case EX_LOCAL:
+        case EX_STATE:
+            break;
+        case EX_UNARY:
+            next = profile_number(p, e->as.unary.a, next, idx, depth + 1);
+            break;
+        case EX_BINARY:
+            next = profile_number(p, e->as.binary.a, next, idx, depth + 1);
+            next = profile_number(p, e->as.binary.b, next, idx, depth + 1);
+            break;
+        case EX_TERNARY:
+            next = profile_number(p, e->as.ternary.cond, next, idx, depth + 1);
+            next = profile_number(p, e->as.ternary.yes, next, idx, depth + 1);
+            next = profile_number(p, e->as.ternary.no, next, idx, depth + 1);
+            break;
+        case EX_FUNC:
+            for (int i = 0; i < e->as.func.argc; ++i) next = profile_number(p, e->as.func.args[i], next, idx, depth + 1);
+            break;
+        case EX_INDEX:
+            next = profile_number(p, e->as.ref.index, next, idx, depth + 1);
+            break;
+        case EX_ASSIGN:
+            next = profile_number(p, e->as.assign.target, next, idx, depth + 1);
+            next = profile_number(p, e->as.assign.value, next, idx, depth + 1);
+            break;
+        case EX_SEQ:
+            // Statements are listed as siblings rather than as an ever deeper chain.
+            next = profile_number(p, e->as.seq.first, next, idx, depth);
+            next = profile_number(p, e->as.seq.rest, next, idx, depth);
+            break;
+    }
+    node->size = next - idx;
+    return next;
+}
+
+static double profile_eval(Profiler *p, int idx, EvalContext *ctx);
+
+// Index of the k-th child of node idx.
+static int profile_child(const Profiler *p, int idx, int k) {
+    int c = idx + 1;
+    while (k-- > 0) c += p->nodes[c].size;
+    return c;
+}
+
+static double *profile_lvalue(Profiler *p, int idx, EvalContext *ctx) {
+    const Expr *target = p->nodes[idx].e;
+    p->nodes[idx].evals++;
+    switch (target->type) {
+        case EX_LOCAL:
+            return &ctx->locals[target->as.ref.slot];
+        case EX_STATE:
+            return &ctx->state[target->as.ref.slot];
+        default: {
+            double i = profile_eval(p, idx + 1, ctx);
+            return &ctx->state[target->as.ref.slot + ref_wrap(to_i32(i), target->as.ref.length)];
+        }
+    }
+}
+
+// expr_eval, with children evaluated through profile_eval.
+static double profile_node(Profiler *p, int idx, EvalContext *ctx) {
+    const Expr *e = p->nodes[idx].e;
+    switch (e->type) {
+        case EX_NUM:
+            return e->as.num;
+        case EX_VAR:
+            return eval_var(ctx, e->as.var);
+        case EX_UNARY: {
+            double a = profile_eval(p, idx + 1, ctx);
+            switch (e->as.unary.op) {
+                case OP_NEG:
+                    return -a;
+                case OP_BNOT:
+                    return (double)(~to_i32(a));
+                case OP_LNOT:
+                    return !a ? 1.0 : 0.0;
+                default:
+                    return 0.0;
+            }
+        }
+        case EX_BINARY: {
+            double a = profile_eval(p, idx + 1, ctx);
+            int right = profile_child(p, idx, 1);
+            if (e->as.binary.op == OP_LAND) return a ? (profile_eval(p, right, ctx) ? 1.0 : 0.0) : 0.0;
+            if (e->as.binary.op == OP_LOR) return a ? 1.0 : (profile_eval(p, right, ctx) ? 1.0 : 0.0);
+            return binary_apply(e->as.binary.op, a, profile_eval(p, right, ctx));
+        }
+        case EX_TERNARY:
+            return profile_eval(p, idx + 1, ctx) ? profile_eval(p, profile_child(p, idx, 1), ctx)
+                                                 : profile_eval(p, profile_child(p, idx, 2), ctx);
+        case EX_FUNC: {
+            double vals[8] = {0};
+            int argc = e->as.func.argc;
+            if (argc > 8) argc = 8;
+            for (int i = 0, c = idx + 1; i < argc; c += p->nodes[c].size, ++i) vals[i] = profile_eval(p, c, ctx);
+            return fn_eval(e, vals, argc, ctx);
+        }
+        case EX_LOCAL:
+            return ctx->locals[e->as.ref.slot];
+        case EX_STATE:
+            return ctx->state[e->as.ref.slot];
+        case EX_INDEX: {
+            double i = profile_eval(p, idx + 1, ctx);
+            return ctx->state[e->as.ref.slot + ref_wrap(to_i32(i), e->as.ref.length)];
+        }
+        case EX_ASSIGN: {
+            double v = profile_eval(p, profile_child(p, idx, 1), ctx);
+            double *dst = profile_lvalue(p, idx + 1, ctx);
+            if (e->as.assign.op != OP_ASSIGN) v = binary_apply(e->as.assign.op, *dst, v);
+            *dst = v;
+            return v;
+        }
+        case EX_SEQ:
+            profile_eval(p, idx + 1, ctx);
+            return profile_eval(p, profile_child(p, idx, 1), ctx);
+    }
+    return 0.0;
+}
+
+static double profile_eval(Profiler *p, int idx, EvalContext *ctx) {
+    p->nodes[idx].evals++;
+    return profile_node(p, idx, ctx);
+}
+
+// Times e at ts[0..n) with locals from snap (n rows of `locals`); ns per run.
+static double profile_time(const Expr *e, EvalContext *ctx, const double *ts, const double *snap, uint32_t locals,
+                           uint32_t n) {
+    volatile double sink = 0.0;
+    uint64_t start = now_ns();
+    for (uint32_t k = 0; k < n; ++k) {
+        memcpy(ctx->locals, snap + (size_t)k * locals, locals * sizeof(double));
+        ctx->t = ts[k];
+        sink = expr_eval(e, ctx);
+    }
+    (void)sink;
+    return (double)(now_ns() - start) / (double)n;
+}
+
+// Profiles `samples` samples of e from t0. Also times the plain scalar evaluator
+// and the renderer's path over the same window for reference.
+static bool profile_run(Profiler *p, const Expr *e, const EvalContext *base, uint64_t t0, uint64_t samples) {
+    memset(p, 0, sizeof(*p));
+    p->count = profile_count(e);
+    p->nodes = (ProfileNode *)calloc((size_t)p->count, sizeof(ProfileNode));
+    ExprFrame frame;
+    if (!p->nodes || !expr_frame_init(&frame, e)) {
+        free(p->nodes);
+        p->nodes = NULL;
+        return false;
+    }
+    profile_number(p, e, 0, -1, 0);
+    p->samples = samples;
+    double work = 0.0;
+    for (int i = 0; i < p->count; ++i) work += p->nodes[i].size;
+    uint64_t timed = (uint64_t)(PROFILE_ROUND_EVALS / work);
+    if (timed > PROFILE_TIMED_MAX) timed = PROFILE_TIMED_MAX;
+    if (timed < 16) timed = 16;
+    if (timed > samples) timed = samples;
+    p->timed_samples = timed;
+    uint64_t stride = samples / timed;
+    uint32_t locals = frame.locals;
+    double *ts = (double *)malloc(timed * sizeof(double));
+    double *snap = (double *)calloc(timed * (locals ? locals : 1), sizeof(double));
+    if (!ts || !snap) {
+        free(ts);
+        free(snap);
+        free(p->nodes);
+        p->nodes = NULL;
+        expr_frame_free(&frame);
+        return false;
+    }
+
+    EvalContext ctx = *base;
+    double *t = frame.scratch;
+    double *out = frame.scratch + EVAL_BLOCK;
+    uint64_t start = now_ns();
+    for (uint64_t b = 0; b < samples; b += EVAL_BLOCK) {
+        int n = samples - b < EVAL_BLOCK ? (int)(samples - b) : EVAL_BLOCK;
+        for (int i = 0; i < n; ++i) t[i] = (double)(t0 + b + (uint64_t)i);
+        expr_eval_frame(e, &frame, &ctx, t, out, n);
+    }
+    p->render_ns = (double)(now_ns() - start) / (double)samples;
+
+    // Each pass starts from the zeroed state the equation is installed with.
+    memset(frame.vars, 0, (size_t)(frame.locals + frame.state) * sizeof(double));
+    ctx = *base;
+    ctx.locals = frame.vars;
+    ctx.state = frame.vars + frame.locals;
+    volatile double sink = 0.0;
+    start = now_ns();
+    for (uint64_t i = 0; i < samples; ++i) {
+        memset(ctx.locals, 0, locals * sizeof(double));
+        ctx.t = (double)(t0 + i);
+        sink = expr_eval(e, &ctx);
+    }
+    (void)sink;
+    p->scalar_ns = (double)(now_ns() - start) / (double)samples;
+
+    // Counting pass. The timed samples keep their t and the locals they ended
+    // with, so subtrees are later timed on the values they actually saw.
+    memset(frame.vars, 0, (size_t)(frame.locals + frame.state) * sizeof(double));
+    for (uint64_t i = 0, k = 0; i < samples; ++i) {
+        memset(ctx.locals, 0, locals * sizeof(double));
+        ctx.t = (double)(t0 + i);
+        profile_eval(p, 0, &ctx);
+        if (k < timed && i == k * stride) {
+            ts[k] = ctx.t;
+            memcpy(snap + k * locals, ctx.locals, locals * sizeof(double));
+            k++;
+        }
+    }
+
+    // Timing passes. Assignments inside a timed subtree only touch this frame,
+    // which nothing reads afterwards. The loop's own cost is measured on a
+    // constant and taken off every node.
+    Expr leaf = {.type = EX_NUM, .as.num = 0.0};
+    double loop_ns = INFINITY;
+    for (int i = 0; i < p->count; ++i) p->nodes[i].ns_per_eval = INFINITY;
+    for (int round = 0; round < PROFILE_ROUNDS; ++round) {
+        loop_ns = fmin(loop_ns, profile_time(&leaf, &ctx, ts, snap, locals, (uint32_t)timed));
+        for (int i = 0; i < p->count; ++i) {
+            ProfileNode *node = &p->nodes[i];
+            node->ns_per_eval = fmin(node->ns_per_eval, profile_time(node->e, &ctx, ts, snap, locals, (uint32_t)timed));
+        }
+    }
+    free(ts);
+    free(snap);
+    expr_frame_free(&frame);
+
+    // Children follow their parent, so a backward pass sees every subtree whole.
+    for (int i = p->count - 1; i >= 0; --i) {
+        ProfileNode *node = &p->nodes[i];
+        node->ns_per_eval = fmax(node->ns_per_eval - loop_ns, 0.0);
+        node->total_ns = node->ns_per_eval * (double)node->evals;
+        node->self_ns = fmax(node->total_ns - node->child_ns, 0.0);
+        if (node->parent >= 0) p->nodes[node->parent].child_ns += node->total_ns;
+    }
+    return true;
+}
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} TextBuf;
+
+static void text_put(TextBuf *tb, const char *fmt, ...) {
+    if (tb->len + 1 >= tb->cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tb->buf + tb->len, tb->cap - tb->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) tb->len += (size_t)n < tb->cap - tb->len ? (size_t)n : tb->cap - tb->len - 1;
+}
+
+// Writes e back as source. Names are gone after compilation, so locals and state
+// appear by slot.
+static void expr_format(TextBuf *tb, const Expr *e, bool nested) {
+    bool paren = nested && (e->type == EX_BINARY || e->type == EX_TERNARY || e->type == EX_ASSIGN);
+    if (paren) text_put(tb, "(");
+    switch (e->type) {
+        case EX_NUM:
+            text_put(tb, "%.10g", e->as.num);
+            break;
+        case EX_VAR: {
+            static const char *const kVars[] = {"t", "a", "b", "c", "d", "sh", "mask"};
+            text_put(tb, "%s", kVars[e->as.var]);
+            break;
+        }
+        case EX_UNARY:
+            text_put(tb, "%s", op_symbol(e->as.unary.op));
+            expr_format(tb, e->as.unary.a, true);
+            break;
+        case EX_BINARY:
+            expr_format(tb, e->as.binary.a, true);
+            text_put(tb, " %s ", op_symbol(e->as.binary.op));
+            expr_format(tb, e->as.binary.b, true);
+            break;
+        case EX_TERNARY:
+            expr_format(tb, e->as.ternary.cond, true);
+            text_put(tb, " ? ");
+            expr_format(tb, e->as.ternary.yes, true);
+            text_put(tb, " : ");
+            expr_format(tb, e->as.ternary.no, true);
+            break;
+        case EX_FUNC:
+            text_put(tb, "%s(", e->as.func.name);
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                if (i) text_put(tb, ", ");
+                expr_format(tb, e->as.func.args[i], false);
+            }
+            text_put(tb, ")");
+            break;
+        case EX_LOCAL:
+            text_put(tb, "local%u", e->as.ref.slot);
+            break;
+        case EX_STATE:
+            text_put(tb, "state%u", e->as.ref.slot);
+            break;
+        case EX_INDEX:
+            text_put(tb, "array%u[", e->as.ref.slot);
+            expr_format(tb, e->as.ref.index, false);
+            text_put(tb, "]");
+            break;
+        case EX_ASSIGN:
+            expr_format(tb, e->as.assign.target, false);
+            text_put(tb, e->as.assign.op == OP_ASSIGN ? " = " : " %s= ", op_symbol(e->as.assign.op));
+            expr_format(tb, e->as.assign.value, false);
+            break;
+        case EX_SEQ:
+            expr_format(tb, e->as.seq.first, false);
+            text_put(tb, "; ");
+            expr_format(tb, e->as.seq.rest, false);
+            break;
+    }
+    if (paren) text_put(tb, ")");
+}
+
+static void profile_node_text(const ProfileNode *node, char *buf, size_t cap) {
+    TextBuf tb = {buf, cap, 0};
+    buf[0] = '\0';
+    expr_format(&tb, node->e, false);
+    if (tb.len + 1 >= cap && cap > 4) memcpy(buf + cap - 4, "...", 4);
+}
+
+static const char *profile_kind(const Expr *e) {
+    static const char *const kKinds[] = {"num",   "var",   "unary", "binary", "ternary", "func",
+                                         "local", "state", "index", "assign", "seq"};
+    return kKinds[e->type];
+}
+
+// Prints the equation as an indented tree, one subexpression per line with its
+// share of the evaluation time (including and excluding its children), how often
+// it runs per sample and its cost per run. Subtrees under min_pct are folded.
+static void profile_print(const Profiler *p, uint64_t t0, double min_pct) {
+    double total = p->nodes[0].total_ns > 0.0 ? p->nodes[0].total_ns : 1.0;
+    printf("Profile: %llu samples from t=%llu, %d nodes, each subtree timed on %llu of them\n",
+           (unsigned long long)p->samples, (unsigned long long)t0, p->count, (unsigned long long)p->timed_samples);
+    printf("Cost: %.1f ns/sample as rendered, %.1f ns/sample sample by sample (%.1f attributed to the tree)\n",
+           p->render_ns, p->scalar_ns, p->nodes[0].ns_per_eval);
+    printf("  total    self  evals/sample   ns/eval  expression\n");
+    char text[PROFILE_TEXT_MAX];
+    int folded = 0;
+    for (int i = 0; i < p->count;) {
+        const ProfileNode *node = &p->nodes[i];
+        double pct = 100.0 * node->total_ns / total;
+        if (i > 0 && pct < min_pct) {
+            folded += node->size;
+            i += node->size;
+            continue;
+        }
+        // Statement-list nodes only group their statements; skip to the first.
+        if (node->e->type == EX_SEQ) {
+            i++;
+            continue;
+        }
+        profile_node_text(node, text, 88 - 2 * (size_t)(node->depth < 20 ? node->depth : 20));
+        printf("%6.1f%% %6.1f%% %13.2f %9.1f  %*s%s\n", pct, 100.0 * node->self_ns / total,
+               (double)node->evals / (double)p->samples, node->ns_per_eval, 2 * (node->depth < 20 ? node->depth : 20),
+               "", text);
+        i++;
+    }
+    if (folded) printf("  (%d nodes under %.1f%% not shown)\n", folded, min_pct);
+
+    // The three most expensive nodes by their own cost.
+    int top[3] = {-1, -1, -1};
+    for (int i = 0; i < p->count; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            if (top[k] < 0 || p->nodes[i].self_ns > p->nodes[top[k]].self_ns) {
+                for (int j = 2; j > k; --j) top[j] = top[j - 1];
+                top[k] = i;
+                break;
+            }
+        }
+    }
+    printf("Hottest:");
+    for (int k = 0; k < 3 && top[k] >= 0; ++k) {
+        profile_node_text(&p->nodes[top[k]], text, 48);
+        printf("%s %s %.1f%%", k ? "," : "", text, 100.0 * p->nodes[top[k]].self_ns / total);
+    }
+    printf("\n");
+}
+
+static void json_put_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// The whole profile, every node included, for dashboards.
+static bool profile_write_json(const Profiler *p, const char *src, uint64_t t0, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    double total = p->nodes[0].total_ns > 0.0 ? p->nodes[0].total_ns : 1.0;
+    fprintf(f, "{\n  \"equation\": ");
+    json_put_string(f, src);
+    fprintf(f,
+            ",\n  \"t0\": %llu,\n  \"samples\": %llu,\n  \"timed_samples\": %llu,\n  \"render_ns_per_sample\": %.3f,\n"
+            "  \"scalar_ns_per_sample\": %.3f,\n  \"attributed_ns_per_sample\": %.3f,\n  \"nodes\": [",
+            (unsigned long long)t0, (unsigned long long)p->samples, (unsigned long long)p->timed_samples,
+            p->render_ns, p->scalar_ns, p->nodes[0].ns_per_eval);
+    char text[PROFILE_TEXT_MAX];
+    for (int i = 0; i < p->count; ++i) {
+        const ProfileNode *node = &p->nodes[i];
+        const Expr *e = node->e;
+        const char *op = e->type == EX_UNARY    ? op_symbol(e->as.unary.op)
+                         : e->type == EX_BINARY ? op_symbol(e->as.binary.op)
+                         : e->type == EX_ASSIGN ? op_symbol(e->as.assign.op)
+                         : e->type == EX_FUNC   ? e->as.func.name
+                                                : "";
+        profile_node_text(node, text, sizeof(text));
+        fprintf(f, "%s\n    {\"id\": %d, \"parent\": %d, \"depth\": %d, \"kind\": \"%s\", \"op\": ", i ? "," : "", i,
+                node->parent, node->depth, profile_kind(e));
+        json_put_string(f, op);
+        fprintf(f, ", \"text\": ");
+        json_put_string(f, text);
+        fprintf(f, ", \"evals\": %llu, \"evals_per_sample\": %.4f, \"total_pct\": %.3f, \"self_pct\": %.3f, \"ns_per_eval\": %.3f}",
+                (unsigned long long)node->evals, (double)node->evals / (double)p->samples,
+                100.0 * node->total_ns / total, 100.0 * node->self_ns / total, node->ns_per_eval);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// Shared by `--profile` and the REPL's `prof`: profiles src (transpiled C) for
+// `seconds` of samples from t0 at the given macros, prints the annotated tree and
+// optionally writes the JSON export.
+static int profile_equation(const char *src, const EvalContext *ctx, uint64_t t0, double seconds,
+                            const char *json_path) {
+    char err[256];
+    Expr *e = compile_expr(src, err, sizeof(err));
+    if (!e) {
+        fprintf(stderr, "Compile error: %s\n", err);
+        return 1;
+    }
+    uint64_t samples = (uint64_t)(fmin(fmax(seconds, 0.01), 600.0) * SAMPLE_RATE);
+    Profiler p;
+    if (!profile_run(&p, e, ctx, t0, samples)) {
+        fprintf(stderr, "Out of memory\n");
+        expr_free(e);
+        return 1;
+    }
+    profile_print(&p, t0, 1.0);
+    int rc = 0;
+    if (json_path) {
+        if (profile_write_json(&p, src, t0, json_path)) {
+            printf("Profile written to %s\n", json_path);
+        } else {
+            fprintf(stderr, "Cannot write %s: %s\n", json_path, strerror(errno));
+            rc = 1;
+        }
+    }
+    free(p.nodes);
+    expr_free(e);
+    return rc;
+}
+
+// REPL `prof [seconds] [out.json]`: profiles the playing equation at the current
+// macros from the current position, off the audio thread.
+static void profile_current(Synth *s, const char *args) {
+    char *end = NULL;
+    double seconds = strtod(args, &end);
+    if (end == args) seconds = 2.0;
+    while (*end == ' ') end++;
+    pthread_mutex_lock(&s->expr_lock);
+    char *src = s->expr_src ? strdup(s->expr_src) : NULL;
+    pthread_mutex_unlock(&s->expr_lock);
+    if (!src) {
+        puts("No equation installed");
+        return;
+    }
+    EvalContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.a = atomic_load_explicit(&s->macro_a, memory_order_relaxed);
+    ctx.b = atomic_load_explicit(&s->macro_b, memory_order_relaxed);
+    ctx.c = atomic_load_explicit(&s->macro_c, memory_order_relaxed);
+    ctx.d = atomic_load_explicit(&s->macro_d, memory_order_relaxed);
+    ctx.sh = floor(atomic_load_explicit(&s->macro_shift, memory_order_relaxed) + 0.5);
+    ctx.mask = floor(atomic_load_explicit(&s->macro_mask, memory_order_relaxed) + 0.5);
+    ctx.seed = s->seed;
+    profile_equation(src, &ctx, atomic_load_explicit(&s->position, memory_order_relaxed), seconds,
+                     *end ? end : NULL);
+    free(src);
+}
+
+typedef struct {
+    BankEntry *entries;
+    BankNode *nodes;
+    uint32_t *children;
+    char *strings;
+    size_t entry_count, entry_cap;
+    size_t node_count, node_cap;
+    size_t child_count, child_cap;
+    size_t strings_size, strings_cap;
+} BankWriter;
+
+static bool bank_grow(void **buf, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return true;
+    size_t cap2 = *cap ? *cap : 256;
+    while (cap2 < need) cap2 *= 2;
+    void *grown = realloc(*buf, cap2 * elem);
+    if (!grown) return false;
+    *buf = grown;
+    *cap = cap2;
+    return true;
+}
+
+static bool bank_add_string(BankWriter *w, const char *str, uint32_t *offset) {
+    size_t len = strlen(str) + 1;
+    if (w->strings_size + len > UINT32_MAX ||
+        !bank_grow((void **)&w->strings, &w->strings_cap, w->strings_size + len, 1)) {
+        return false;
+    }
+    memcpy(w->strings + w->strings_size, str, len);
+    *offset = (uint32_t)w->strings_size;
+    w->strings_size += len;
+    return true;
+}
+
+// Appends e in post order and returns its node index, or -1.
+static int64_t bank_add_expr(BankWriter *w, const Expr *e) {
+    const Expr *kids[8];
+    int argc = 0;
+    BankNode bn;
+    memset(&bn, 0, sizeof(bn));
+    bn.type = (uint8_t)e->type;
+    switch (e->type) {
+        case EX_NUM:
+            bn.num = e->as.num;
+            break;
+        case EX_VAR:
+            bn.op = (uint8_t)e->as.var;
+            break;
+        case EX_UNARY:
+            bn.op = (uint8_t)e->as.unary.op;
+            kids[argc++] = e->as.unary.a;
+            break;
+        case EX_BINARY:
+            bn.op = (uint8_t)e->as.binary.op;
+            kids[argc++] = e->as.binary.a;
+            kids[argc++] = e->as.binary.b;
+            break;
+        case EX_TERNARY:
+            kids[argc++] = e->as.ternary.cond;
+            kids[argc++] = e->as.ternary.yes;
+            kids[argc++] = e->as.ternary.no;
+            break;
+        case EX_FUNC:
+            argc = e->as.func.argc > 8 ? 8 : e->as.func.argc;
+            bn.op = (uint8_t)fn_lookup(e->as.func.name, argc);
+            bn.num = (double)e->as.func.site;
+            for (int k = 0; k < argc; ++k) kids[k] = e->as.func.args[k];
+            break;
+        case EX_LOCAL:
+        case EX_STATE:
+            bn.num = (double)e->as.ref.slot;
+            break;
+        case EX_INDEX:
+            bn.num = (double)e->as.ref.slot * BANK_ARRAY_SCALE + (double)e->as.ref.length;
+            kids[argc++] = e->as.ref.index;
+            break;
+        case EX_ASSIGN:
+            bn.op = (uint8_t)e->as.assign.op;
+            kids[argc++] = e->as.assign.target;
+            kids[argc++] = e->as.assign.value;
+            break;
+        case EX_SEQ:
+            kids[argc++] = e->as.seq.first;
+            kids[argc++] = e->as.seq.rest;
+            break;
+    }
+    uint32_t idx[8];
+    for (int k = 0; k < argc; ++k) {
+        int64_t c = bank_add_expr(w, kids[k]);
+        if (c < 0) return -1;
+        idx[k] = (uint32_t)c;
+    }
+    if (!bank_grow((void **)&w->children, &w->child_cap, w->child_count + (size_t)argc, sizeof(uint32_t)) ||
+        !bank_grow((void **)&w->nodes, &w->node_cap, w->node_count + 1, sizeof(BankNode))) {
+        return -1;
+    }
+    bn.argc = (uint16_t)argc;
+    bn.child_first = (uint32_t)w->child_count;
+    if (argc) memcpy(w->children + w->child_count, idx, (size_t)argc * sizeof(uint32_t));
+    w->child_count += (size_t)argc;
+    w->nodes[w->node_count] = bn;
+    return (int64_t)w->node_count++;
+}
+
+// Parses one text-bank line: `equation`, `name<TAB>equation` or
+// `name<TAB>a=5 b=3 ...<TAB>equation`.
+static bool bank_add_line(BankWriter *w, char *line, int lineno, char *err, size_t err_sz) {
+    char *fields[3] = {NULL, NULL, NULL};
+    int nf = 0;
+    for (char *p = line; nf < 3;) {
+        fields[nf++] = p;
+        char *tab = strchr(p, '\t');
+        if (!tab) break;
+        *tab = '\0';
+        p = tab + 1;
+    }
+    char auto_name[32];
+    const char *name = nf >= 2 ? fields[0] : (snprintf(auto_name, sizeof(auto_name), "Preset %d", lineno), auto_name);
+    const char *js = fields[nf - 1];
+    BankEntry be;
+    memset(&be, 0, sizeof(be));
+    if (nf == 3 && !parse_macro_field(fields[1], &be.macro_set, be.macros, err, err_sz)) return false;
+    char *c_expr = transpile_js_to_c(js);
+    char cerr[256];
+    Expr *root = c_expr ? compile_expr(c_expr, cerr, sizeof(cerr)) : NULL;
+    if (!root) {
+        snprintf(err, err_sz, "%s", c_expr ? cerr : "failed to transpile");
+        free(c_expr);
+        return false;
+    }
+    size_t first = w->node_count;
+    bool ok = bank_add_expr(w, root) >= 0 && w->node_count - first <= BANK_MAX_NODES &&
+              bank_add_string(w, name, &be.name_offset) && bank_add_string(w, js, &be.js_offset) &&
+              bank_add_string(w, c_expr, &be.src_offset) &&
+              bank_grow((void **)&w->entries, &w->entry_cap, w->entry_count + 1, sizeof(BankEntry));
+    expr_free(root);
+    free(c_expr);
+    if (!ok) {
+        snprintf(err, err_sz, "equation too large");
+        return false;
+    }
+    be.node_first = (uint32_t)first;
+    be.node_count = (uint32_t)(w->node_count - first);
+    w->entries[w->entry_count++] = be;
+    return true;
+}
+
+static uint64_t bank_align(uint64_t v) { return (v + 7) & ~(uint64_t)7; }
+
+// Text -> bank converter. Lines that fail to compile are reported and skipped.
+static int run_bank_build(const char *text_path, const char *bank_path) {
+    FILE *in = fopen(text_path, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open %s: %s\n", text_path, strerror(errno));
+        return 1;
+    }
+    BankWriter w;
+    memset(&w, 0, sizeof(w));
+    char line[INPUT_LINE_MAX];
+    int lineno = 0, skipped = 0;
+    while (fgets(line, sizeof(line), in)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line;
+        while (*p == ' ') p++;
+        if (!*p || *p == '#') continue;
+        char err[300];
+        if (!bank_add_line(&w, p, lineno, err, sizeof(err))) {
+            fprintf(stderr, "%s:%d: %s\n", text_path, lineno, err);
+            skipped++;
+        }
+    }
+    fclose(in);
+
+    BankHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BANK_MAGIC, 8);
+    h.version = BANK_VERSION;
+    h.byte_order = BANK_BYTE_ORDER;
+    h.preset_count = (uint32_t)w.entry_count;
+    h.node_count = (uint32_t)w.node_count;
+    h.child_count = (uint32_t)w.child_count;
+    h.entries_offset = bank_align(sizeof(h));
+    h.nodes_offset = bank_align(h.entries_offset + w.entry_count * sizeof(BankEntry));
+    h.children_offset = bank_align(h.nodes_offset + w.node_count * sizeof(BankNode));
+    h.strings_offset = bank_align(h.children_offset + w.child_count * sizeof(uint32_t));
+    h.strings_size = w.strings_size ? w.strings_size : 1;
+    h.file_size = h.strings_offset + h.strings_size;
+
+    FILE *out = fopen(bank_path, "wb");
+    bool ok = out != NULL;
+    if (ok) {
+        static const uint8_t kZero[8] = {0};
+        struct {
+            const void *data;
+            size_t bytes;
+            uint64_t offset;
+        } sections[] = {{&h, sizeof(h), 0},
+                        {w.entries, w.entry_count * sizeof(BankEntry), h.entries_offset},
+                        {w.nodes, w.node_count * sizeof(BankNode), h.nodes_offset},
+                        {w.children, w.child_count * sizeof(uint32_t), h.children_offset},
+                        {w.strings_size ? (const void *)w.strings : kZero, h.strings_size, h.strings_offset}};
+        uint64_t pos = 0;
+        for (size_t i = 0; ok && i < sizeof(sections) / sizeof(sections[0]); ++i) {
+            ok = fwrite(kZero, 1, sections[i].offset - pos, out) == sections[i].offset - pos &&
+                 (sections[i].bytes == 0 || fwrite(sections[i].data, 1, sections[i].bytes, out) == sections[i].bytes);
+            pos = sections[i].offset + sections[i].bytes;
+        }
+        ok = (fclose(out) == 0) && ok;
+    }
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s: %s\n", bank_path, strerror(errno));
+    } else {
+        printf("Wrote %s: %zu presets, %zu nodes, %llu bytes (%d lines skipped)\n", bank_path, w.entry_count,
+               w.node_count, (unsigned long long)h.file_size, skipped);
+    }
+    free(w.entries);
+    free(w.nodes);
+    free(w.children);
+    free(w.strings);
+    return ok ? 0 : 1;
+}
+
+// Startup benchmark: opening the bank and selecting every preset from it versus
+// transpiling and compiling every preset's source as the text path does.
+static int run_bank_bench(const char *bank_path) {
+    char err[300];
+    uint64_t t0 = now_ns();
+    if (!preset_bank_load(bank_path, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    double open_us = (double)(now_ns() - t0) / 1e3;
+    int count = preset_count();
+    uint64_t nodes = 0;
+
+    t0 = now_ns();
+    for (int i = 0; i < count; ++i) {
+        Expr *e = bank_entry_expr(&g_bank, &g_bank.entries[i]);
+        if (!e) {
+            fprintf(stderr, "Preset %d is corrupt in the bank\n", i + 1);
+            return 1;
+        }
+        nodes += g_bank.entries[i].node_count;
+        expr_free(e);
+    }
+    double bank_us = (double)(now_ns() - t0) / 1e3;
+
+    t0 = now_ns();
+    for (int i = 0; i < count; ++i) {
+        char *c_expr = transpile_js_to_c(preset_js(i));
+        char cerr[256];
+        Expr *e = c_expr ? compile_expr(c_expr, cerr, sizeof(cerr)) : NULL;
+        expr_free(e);
+        free(c_expr);
+    }
+    double text_us = (double)(now_ns() - t0) / 1e3;
+
+    printf("Bank %s: %d presets, %llu nodes, %zu bytes\n", bank_path, count, (unsigned long long)nodes, g_bank.size);
+    printf("  open + validate:      %10.1f us\n", open_us);
+    printf("  select all (bank):    %10.1f us  (%.2f us/preset)\n", bank_us, bank_us / count);
+    printf("  select all (parse):   %10.1f us  (%.2f us/preset)\n", text_us, text_us / count);
+    preset_bank_load(NULL, err, sizeof(err));
+    return 0;
+}
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok;
+} SessionReader;
+
+static uint64_t session_get_varint(SessionReader *rd) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (rd->p >= rd->end) break;
+        uint8_t b = *rd->p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    rd->ok = false;
+    return 0;
+}
+
+static void session_get_bytes(SessionReader *rd, void *out, size_t n) {
+    if ((size_t)(rd->end - rd->p) < n) {
+        rd->ok = false;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, rd->p, n);
+    rd->p += n;
+}
+
+static uint64_t session_get_u64(SessionReader *rd) {
+    uint64_t v;
+    session_get_bytes(rd, &v, sizeof(v));
+    return v;
+}
+
+static double session_get_f64(SessionReader *rd) {
+    double v;
+    session_get_bytes(rd, &v, sizeof(v));
+    return v;
+}
+
+static void session_get_state(SessionReader *rd, SynthState *st, int last_control) {
+    st->phase.t = session_get_u64(rd);
+    st->phase.frac = session_get_u64(rd);
+    st->phase_inc.t = session_get_u64(rd);
+    st->phase_inc.frac = session_get_u64(rd);
+    st->smooth_tempo = session_get_f64(rd);
+    st->smooth_pitch = session_get_f64(rd);
+    uint8_t steady = 0;
+    session_get_bytes(rd, &steady, 1);
+    st->rate_steady = steady != 0;
+    for (int id = CTL_A; id <= last_control; ++id) {
+        *controls_field(&st->live, (ControlId)id) = session_get_f64(rd);
+    }
+}
+
+// A decoded session: records in file order (SES_EQ records carry an index into
+// sources in `gen`) and the record index of every checkpoint.
+typedef struct {
+    SessionRecord *records;
+    size_t count;
+    char **sources;
+    size_t source_count;
+    size_t *checkpoints;      // record indices
+    size_t *checkpoint_eq;    // source index in effect at each checkpoint
+    size_t checkpoint_count;
+    uint64_t length;          // samples
+    uint64_t dropped;
+    uint64_t seed;
+} Session;
+
+static void session_free(Session *ses) {
+    for (size_t i = 0; i < ses->source_count; ++i) free(ses->sources[i]);
+    free(ses->sources);
+    free(ses->records);
+    free(ses->checkpoints);
+    free(ses->checkpoint_eq);
+    memset(ses, 0, sizeof(*ses));
+}
+
+static bool session_load(Session *ses, const char *path, char *err, size_t err_sz) {
+    memset(ses, 0, sizeof(*ses));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        snprintf(err, err_sz, "Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = size > 0 ? (uint8_t *)malloc((size_t)size) : NULL;
+    bool read_ok = data && fread(data, 1, (size_t)size, f) == (size_t)size;
+    fclose(f);
+    uint32_t head[4] = {0};
+    if (read_ok && size >= 8 + (long)sizeof(head)) memcpy(head, data + 8, sizeof(head));
+    if (!read_ok || size < 8 + (long)sizeof(head) || memcmp(data, SESSION_MAGIC, 8) != 0 ||
+        head[0] < 1 || head[0] > SESSION_VERSION || head[1] != BANK_BYTE_ORDER || head[2] != SAMPLE_RATE) {
+        snprintf(err, err_sz, "%s is not a session file for this build", path);
+        free(data);
+        return false;
+    }
+    const int last_control = head[0] >= 3 ? CTL_DECIMATE : head[0] >= 2 ? CTL_FX_LAST : CTL_TEMPO;
+
+    SessionReader rd = {data + 8 + sizeof(head), data + size, true};
+    if (head[0] >= 5) ses->seed = session_get_u64(&rd);
+    size_t cap = 0, src_cap = 0, ck_cap = 0;
+    uint64_t sample = 0;
+    size_t current_eq = SIZE_MAX;  // set by the first SES_EQ, which precedes the first checkpoint
+    bool ended = false;
+    while (rd.ok && !ended && rd.p < rd.end) {
+        SessionRecord r;
+        memset(&r, 0, sizeof(r));
+        r.kind = *rd.p++;
+        sample += session_get_varint(&rd);
+        r.sample = sample;
+        switch ((SessionRecordKind)r.kind) {
+            case SES_CONTROL:
+                session_get_bytes(&rd, &r.id, 1);
+                r.value = session_get_f64(&rd);
+                rd.ok = rd.ok && r.id <= last_control;
+                break;
+            case SES_EQ: {
+                uint64_t len = session_get_varint(&rd);
+                if (!rd.ok || len > (uint64_t)(rd.end - rd.p) ||
+                    !bank_grow((void **)&ses->sources, &src_cap, ses->source_count + 1, sizeof(char *))) {
+                    rd.ok = false;
+                    break;
+                }
+                char *src = (char *)malloc((size_t)len + 1);
+                if (!src) {
+                    rd.ok = false;
+                    break;
+                }
+                session_get_bytes(&rd, src, (size_t)len);
+                src[len] = '\0';
+                current_eq = ses->source_count;
+                r.gen = current_eq;
+                ses->sources[ses->source_count++] = src;
+                break;
+            }
+            case SES_SEEK:
+                session_get_state(&rd, &r.state, last_control);
+                break;
+            case SES_CHECKPOINT: {
+                session_get_state(&rd, &r.state, last_control);
+                if (current_eq == SIZE_MAX ||
+                    !bank_grow((void **)&ses->checkpoints, &ck_cap, ses->checkpoint_count + 1, sizeof(size_t))) {
+                    rd.ok = false;
+                    break;
+                }
+                size_t *eqs = (size_t *)realloc(ses->checkpoint_eq, ck_cap * sizeof(size_t));
+                if (!eqs) {
+                    rd.ok = false;
+                    break;
+                }
+                ses->checkpoint_eq = eqs;
+                ses->checkpoints[ses->checkpoint_count] = ses->count;
+                ses->checkpoint_eq[ses->checkpoint_count++] = current_eq;
+                break;
+            }
+            case SES_END:
+                ses->dropped = session_get_varint(&rd);
+                ended = true;
+                break;
+            default:
+                rd.ok = false;
+                break;
+        }
+        if (rd.ok && !bank_grow((void **)&ses->records, &cap, ses->count + 1, sizeof(SessionRecord))) rd.ok = false;
+        if (rd.ok) ses->records[ses->count++] = r;
+    }
+    bool cut_off = rd.p >= rd.end && !ended;
+    free(data);
+    if ((!rd.ok && !cut_off) || ses->checkpoint_count == 0) {
+        snprintf(err, err_sz, "%s is corrupt", path);
+        session_free(ses);
+        return false;
+    }
+    // A session cut off without SES_END (crash, kill) replays up to its last whole record.
+    ses->length = ses->records[ses->count - 1].sample;
+    if (cut_off) {
+        fprintf(stderr, "%s has no end record; replaying the first %.1f s\n", path, (double)ses->length / SAMPLE_RATE);
+    }
+    return true;
+}
+
+typedef struct {
+    const Session *ses;
+    int fd;
+    uint64_t data_offset;
+    size_t sample_bytes;  // 2, or 1 for --bits 8
+    _Atomic size_t next;
+    _Atomic size_t verified;
+    _Atomic size_t mismatched;
+    _Atomic bool failed;
+    bool chained;  // a program or the effects chain keeps state across checkpoints: one thread, in order
+} ReplayJob;
+
+static bool replay_install(Synth *s, const char *src) {
+    char err[256];
+    Expr *root = compile_expr(src, err, sizeof(err));
+    char *copy = root ? strdup(src) : NULL;
+    if (!root || !copy) {
+        expr_free(root);
+        return false;
+    }
+    synth_install_expr(s, root, copy);
+    return true;
+}
+
+static bool replay_render(Synth *s, const ReplayJob *job, uint64_t *pos, uint64_t until) {
+    int16_t pcm[4096];
+    uint8_t *u8 = (uint8_t *)pcm;
+    while (*pos < until) {
+        int n = until - *pos < 4096 ? (int)(until - *pos) : 4096;
+        if (job->sample_bytes == 1) {
+            synth_render_u8(s, u8, n);
+        } else {
+            synth_render(s, pcm, n);
+        }
+        size_t bytes = (size_t)n * job->sample_bytes;
+        if (pwrite(job->fd, pcm, bytes, (off_t)(job->data_offset + *pos * job->sample_bytes)) != (ssize_t)bytes) {
+            return false;
+        }
+        *pos += (uint64_t)n;
+    }
+    return true;
+}
+
+// Renders the segments between consecutive checkpoints. Each starts from its
+// checkpoint's exact state, so segments are independent; the state reached at
+// the end of a segment is compared with the next checkpoint. Checkpoints do not
+// hold program variables or effects memory, so a chained job carries them over
+// from the previous segment instead of reinstalling the program.
+static void *replay_thread_main(void *user) {
+    ReplayJob *job = (ReplayJob *)user;
+    const Session *ses = job->ses;
+    Synth *s = (Synth *)malloc(sizeof(Synth));
+    if (!s) {
+        atomic_store(&job->failed, true);
+        return NULL;
+    }
+    synth_init(s);
+    atomic_store_explicit(&s->loop_cache_enabled, false, memory_order_relaxed);
+    s->seed = ses->seed;
+    for (;;) {
+        size_t k = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (k >= ses->checkpoint_count) break;
+        size_t first = ses->checkpoints[k];
+        size_t last = k + 1 < ses->checkpoint_count ? ses->checkpoints[k + 1] : ses->count;
+        const SessionRecord *ck = &ses->records[first];
+        uint64_t end = k + 1 < ses->checkpoint_count ? ses->records[last].sample : ses->length;
+        if (!(job->chained && k > 0) && !replay_install(s, ses->sources[ses->checkpoint_eq[k]])) {
+            atomic_store(&job->failed, true);
+            break;
         }
-        if (expr[i] == '|' && i + 1 < in_len && expr[i + 1] == '|') {
-            out[o++] = '|';
-            out[o++] = '|';
-            i += 2;
-            continue;
+        synth_set_state(s, &ck->state);
+        uint64_t pos = ck->sample;
+        bool ok = true;
+        for (size_t i = first + 1; ok && i < last; ++i) {
+            const SessionRecord *r = &ses->records[i];
+            ok = replay_render(s, job, &pos, r->sample);
+            if (r->kind == SES_CONTROL) {
+                ControlEvent ev = {(ControlId)r->id, r->value, 0};
+                apply_control(s, &ev);
+            } else if (r->kind == SES_EQ) {
+                ok = ok && replay_install(s, ses->sources[r->gen]);
+            } else if (r->kind == SES_SEEK) {
+                synth_set_timeline(s, &r->state);
+            }
         }
-        if (expr[i] == '&' && i + 1 < in_len && expr[i + 1] == '&') {
-            out[o++] = '&';
-            out[o++] = '&';
-            i += 2;
-            continue;
+        ok = ok && replay_render(s, job, &pos, end);
+        if (!ok) {
+            atomic_store(&job->failed, true);
+            break;
+        }
+        if (k + 1 < ses->checkpoint_count) {
+            SynthState reached = synth_get_state(s);
+            bool same = synth_state_equal(&reached, &ses->records[last].state);
+            atomic_fetch_add(same ? &job->verified : &job->mismatched, 1);
         }
-        out[o++] = expr[i++];
     }
-    out[o] = '\0';
-    free(expr);
-    return out;
+    synth_destroy(s);
+    free(s);
+    return NULL;
 }
 
-static Expr *compile_expr(const char *src, char *err, size_t err_sz) {
-    Parser p;
-    memset(&p, 0, sizeof(p));
-    p.lx.src = src;
-    lexer_next(&p.lx);
-
-    Expr *root = parse_expr(&p);
-    if (!root) {
-        snprintf(err, err_sz, "%s", p.lx.err[0] ? p.lx.err : "Parse error");
-        return NULL;
+// Encodes the raw samples a replay rendered into `raw` as the FLAC file path.
+static bool replay_encode_flac(FILE *raw, uint64_t samples, const char *path, int threads, uint64_t *bytes) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return false;
     }
-    if (p.lx.tok.type != TOK_EOF) {
-        snprintf(err, err_sz, "Unexpected trailing tokens");
-        expr_free(root);
-        return NULL;
+    FlacWriter fw;
+    bool ok = flac_open(&fw, f, threads);
+    if (ok) {
+        rewind(raw);
+        int16_t pcm[FLAC_BLOCK];
+        while (ok && samples) {
+            size_t want = samples < FLAC_BLOCK ? (size_t)samples : FLAC_BLOCK;
+            ok = fread(pcm, sizeof(int16_t), want, raw) == want && flac_write(&fw, pcm, want);
+            samples -= want;
+        }
+        ok &= flac_close(&fw);
+        *bytes = fw.bytes;
     }
-    err[0] = '\0';
-    return root;
+    ok &= fclose(f) == 0;
+    return ok;
 }
 
-static inline float bytebeat_to_float(double v) {
-    uint8_t b = (uint8_t)(to_i32(v) & 0xFF);
-    return ((float)b - 128.0f) / 128.0f;
+// Offline re-render of a recorded session, as fast as the CPU allows.
+static int run_replay(const char *session_path, const char *out_path, int threads) {
+    Session ses;
+    char err[300];
+    if (!session_load(&ses, session_path, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    size_t len = strlen(out_path);
+    bool wav = len > 4 && !strcmp(out_path + len - 4, ".wav");
+    // FLAC frames are variable-sized, so segments cannot be written in place:
+    // they render to a raw scratch file that is encoded afterwards.
+    bool flac = len > 5 && !strcmp(out_path + len - 5, ".flac");
+    FILE *out = flac ? tmpfile() : fopen(out_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s: %s\n", flac ? "scratch file" : out_path, strerror(errno));
+        session_free(&ses);
+        return 1;
+    }
+    const size_t sample_bytes = g_output_bits == 8 && !flac ? 1 : sizeof(int16_t);
+    uint64_t data_bytes = ses.length * sample_bytes;
+    if (wav) {
+        wav_write_header(out, SAMPLE_RATE, (uint16_t)(8 * sample_bytes),
+                         data_bytes > 0xFFFFFFDBull ? 0xFFFFFFDBu : (uint32_t)data_bytes);
+    }
+    fflush(out);
+    ReplayJob job = {.ses = &ses, .fd = fileno(out), .data_offset = wav ? 44u : 0u, .sample_bytes = sample_bytes};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.verified, 0);
+    atomic_init(&job.mismatched, 0);
+    atomic_init(&job.failed, false);
+    for (size_t i = 0; i < ses.source_count && !job.chained; ++i) {
+        Expr *e = compile_expr(ses.sources[i], err, sizeof(err));
+        uint32_t locals = 0, state = 0;
+        if (e) expr_frame_size(e, &locals, &state);
+        job.chained = state > 0;
+        expr_free(e);
+    }
+    // Filter and delay memory is not checkpointed either.
+    for (size_t i = 0; i < ses.count && !job.chained; ++i) {
+        const SessionRecord *r = &ses.records[i];
+        job.chained = (r->kind == SES_CHECKPOINT && r->state.live.fx[FX_ON] != 0.0) ||
+                      (r->kind == SES_CONTROL && r->id == CTL_FX + FX_ON && r->value != 0.0);
+    }
+    int flac_threads = threads;
+    if (job.chained) threads = 1;
+    if (ftruncate(job.fd, (off_t)(job.data_offset + data_bytes)) != 0) {
+        fprintf(stderr, "Cannot size %s: %s\n", out_path, strerror(errno));
+        fclose(out);
+        session_free(&ses);
+        return 1;
+    }
+
+    if ((size_t)threads > ses.checkpoint_count) threads = (int)ses.checkpoint_count;
+    pthread_t tids[64];
+    if (threads > 64) threads = 64;
+    uint64_t start = now_ns();
+    int started = 0;
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&tids[i], NULL, replay_thread_main, &job) != 0) break;
+        started++;
+    }
+    if (started == 0) replay_thread_main(&job);
+    for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    double wall = (double)(now_ns() - start) / 1e9;
+    bool failed = atomic_load(&job.failed);
+    double encode_wall = 0.0;
+    uint64_t flac_bytes = 0;
+    if (flac && !failed) {
+        failed = !replay_encode_flac(out, ses.length, out_path, flac_threads, &flac_bytes);
+        encode_wall = (double)(now_ns() - start) / 1e9 - wall;
+    }
+    fclose(out);
+
+    double audio_s = (double)ses.length / SAMPLE_RATE;
+    size_t verified = atomic_load(&job.verified);
+    size_t mismatched = atomic_load(&job.mismatched);
+    printf("Replayed %s -> %s: %.1f s of audio in %zu segments on %d threads, %.3f s (%.0fx real time)\n",
+           session_path, out_path, audio_s, ses.checkpoint_count, started > 0 ? started : 1, wall,
+           wall > 0.0 ? audio_s / wall : 0.0);
+    if (flac && !failed) {
+        printf("FLAC: %.1f%% of the raw size, encoded on %d threads in %.3f s (%.0fx real time)\n",
+               ses.length ? 100.0 * (double)flac_bytes / (double)data_bytes : 0.0, flac_threads, encode_wall,
+               encode_wall > 0.0 ? audio_s / encode_wall : 0.0);
+    }
+    if (job.chained) printf("Equations or effects keep state across checkpoints, so segments were rendered in order\n");
+    printf("Checkpoints: %zu/%zu reproduced bit-exactly", verified, verified + mismatched);
+    if (ses.dropped) printf("; %llu records were dropped while recording", (unsigned long long)ses.dropped);
+    printf("\n");
+    if (failed) fprintf(stderr, "Replay failed (write error or invalid equation in session)\n");
+    session_free(&ses);
+    return failed || mismatched ? 1 : 0;
 }
 
-static void fill_buffer(Synth *s, AudioQueueBufferRef buf) {
-    int16_t *pcm = (int16_t *)buf->mAudioData;
-    const int n = BUFFER_FRAMES;
+// Builds every preset (built-in, or the bank given with --bank) into one native
+// library, then loads it and checks each entry against the interpreter.
+#define AOT_CHECK_SAMPLES (1 << 16)
 
-    pthread_mutex_lock(&s->expr_lock);
-    Expr *expr = s->expr;
-    for (int i = 0; i < n; ++i) {
-        double targetTempo = atomic_load_explicit(&s->target_tempo, memory_order_relaxed);
-        double targetPitch = atomic_load_explicit(&s->target_pitch, memory_order_relaxed);
-        double macroA = atomic_load_explicit(&s->macro_a, memory_order_relaxed);
-        double macroB = atomic_load_explicit(&s->macro_b, memory_order_relaxed);
-        double macroC = atomic_load_explicit(&s->macro_c, memory_order_relaxed);
-        double macroD = atomic_load_explicit(&s->macro_d, memory_order_relaxed);
-        double macroShift = atomic_load_explicit(&s->macro_shift, memory_order_relaxed);
-        double macroMask = atomic_load_explicit(&s->macro_mask, memory_order_relaxed);
-        s->smooth_tempo += (targetTempo - s->smooth_tempo) * SMOOTHING_COEFF;
-        s->smooth_pitch += (targetPitch - s->smooth_pitch) * SMOOTHING_COEFF;
-
-        if (s->smooth_tempo < 0.05) s->smooth_tempo = 0.05;
-        if (s->smooth_pitch < 0.125) s->smooth_pitch = 0.125;
-
-        s->timeline += s->smooth_tempo;
-        EvalContext ctx;
-        memset(&ctx, 0, sizeof(ctx));
-        ctx.t = floor(s->timeline * s->smooth_pitch);
-        ctx.a = macroA;
-        ctx.b = macroB;
-        ctx.c = macroC;
-        ctx.d = macroD;
-        ctx.sh = floor(macroShift + 0.5);
-        ctx.mask = floor(macroMask + 0.5);
-
-        double y = expr ? expr_eval(expr, &ctx) : 0.0;
-        float sample = bytebeat_to_float(y) * 0.6f;
-        int16_t s16 = (int16_t)fmaxf(-32768.0f, fminf(32767.0f, sample * 32767.0f));
-        pcm[i] = s16;
+static int run_aot_build(const char *so_path) {
+    g_math_mode = MATH_EXACT;  // native code calls libm; check it against the same
+    int count = preset_count();
+    char **srcs = (char **)calloc((size_t)count, sizeof(char *));
+    Expr **exprs = (Expr **)calloc((size_t)count, sizeof(Expr *));
+    if (!srcs || !exprs) {
+        free(srcs);
+        free(exprs);
+        return 1;
+    }
+    int built = 0;
+    for (int i = 0; i < count; ++i) {
+        char err[256];
+        char *src =
+            g_bank.hdr ? strdup(g_bank.strings + g_bank.entries[i].src_offset) : transpile_js_to_c(preset_js(i));
+        Expr *e = src ? compile_expr(src, err, sizeof(err)) : NULL;
+        if (!e) {
+            fprintf(stderr, "Preset %d (%s): %s\n", i + 1, preset_name(i), src ? err : "transpile failed");
+            free(src);
+            continue;
+        }
+        srcs[built] = src;
+        exprs[built] = e;
+        built++;
     }
-    pthread_mutex_unlock(&s->expr_lock);
 
-    buf->mAudioDataByteSize = (UInt32)(n * (int)sizeof(int16_t));
+    char err[300];
+    AotModule m;
+    uint64_t start = now_ns();
+    bool ok = built > 0 && aot_compile((const char *const *)srcs, exprs, built, so_path, NULL, err, sizeof(err)) &&
+              aot_open(&m, so_path, err, sizeof(err));
+    if (!ok) {
+        fprintf(stderr, "%s\n", built ? err : "No presets to build");
+    } else {
+        const char *arch = aot_arch_flag();
+        printf("Built %d presets into %s in %.2f s (%s %s%s-O3)\n", built, so_path, (double)(now_ns() - start) / 1e9,
+               getenv("NORA_CC") ? getenv("NORA_CC") : "cc", arch, *arch ? " " : "");
+        // Default macros, t over the first 2^16 samples and a stretch past 2^31.
+        double *t = (double *)malloc(2 * EVAL_BLOCK * sizeof(double));
+        double *want = (double *)malloc(AOT_CHECK_SAMPLES * sizeof(double));
+        const double macros[6] = {5.0, 3.0, 7.0, 10.0, 8.0, 127.0};
+        uint64_t mismatched = 0, interp_ns = 0, native_ns = 0;
+        for (int k = 0; k < built && t && want; ++k) {
+            ExprFrame frame;
+            if (!expr_frame_init(&frame, exprs[k])) continue;
+            for (int pass = 0; pass < 2; ++pass) {
+                double origin = pass ? 2147483000.0 : 0.0;
+                EvalContext ctx = {.a = 5.0, .b = 3.0, .c = 7.0, .d = 10.0, .sh = 8.0, .mask = 127.0};
+                memset(frame.vars, 0, ((size_t)frame.locals + frame.state) * sizeof(double));
+                uint64_t t0 = now_ns();
+                for (int base = 0; base < AOT_CHECK_SAMPLES; base += EVAL_BLOCK) {
+                    for (int i = 0; i < EVAL_BLOCK; ++i) t[i] = origin + base + i;
+                    expr_eval_frame(exprs[k], &frame, &ctx, t, want + base, EVAL_BLOCK);
+                }
+                uint64_t t1 = now_ns();
+                memset(frame.vars, 0, ((size_t)frame.locals + frame.state) * sizeof(double));
+                for (int base = 0; base < AOT_CHECK_SAMPLES; base += EVAL_BLOCK) {
+                    for (int i = 0; i < EVAL_BLOCK; ++i) t[i] = origin + base + i;
+                    m.entries[k].fn(macros, t, t + EVAL_BLOCK, EVAL_BLOCK, frame.vars + frame.locals);
+                    for (int i = 0; i < EVAL_BLOCK; ++i) {
+                        double a = want[base + i], b = t[EVAL_BLOCK + i];
+                        mismatched += !(a == b || (isnan(a) && isnan(b)));
+                    }
+                }
+                interp_ns += t1 - t0;
+                native_ns += now_ns() - t1;
+            }
+            expr_frame_free(&frame);
+        }
+        printf("Checked %d x %d samples against the interpreter: %llu mismatches; native %.1fx faster "
+               "(%.1f vs %.1f ns/sample)\n",
+               built, 2 * AOT_CHECK_SAMPLES, (unsigned long long)mismatched,
+               native_ns ? (double)interp_ns / (double)native_ns : 0.0,
+               (double)native_ns / (2.0 * AOT_CHECK_SAMPLES * built),
+               (double)interp_ns / (2.0 * AOT_CHECK_SAMPLES * built));
+        ok = mismatched == 0;
+        free(t);
+        free(want);
+        dlclose(m.handle);
+    }
+    for (int i = 0; i < built; ++i) {
+        free(srcs[i]);
+        expr_free(exprs[i]);
+    }
+    free(srcs);
+    free(exprs);
+    return ok ? 0 : 1;
 }
 
-static void audio_cb(void *user, AudioQueueRef q, AudioQueueBufferRef buf) {
-    (void)q;
-    Synth *s = (Synth *)user;
-    if (!atomic_load_explicit(&s->running, memory_order_relaxed)) return;
-    fill_buffer(s, buf);
-    AudioQueueEnqueueBuffer(s->queue, buf, 0, NULL);
+// --math-bench: per function, the error of the fast path against libm over
+// typical arguments (t/k for the trig functions, t and small powers for pow) and
+// how many output bytes that error changes, then the speed of each form, then
+// every preset that calls a function --math fast replaces rendered both ways.
+#define MATH_BENCH_ROUNDS 3
+
+// The in-tree pow --math-bench compares against libm: exp(y ln x) with fdlibm's
+// log kernel and a degree-13 Taylor exp, carrying y ln x in double double
+// precision so results stay within about an ulp and exact powers such as
+// pow(16, 0.5) do not come out as 3.999... and floor to 3. --math fast does not
+// use it: at the Makefile's -O2 gcc leaves the block loop scalar and it is about
+// twice as slow as libm, and only an AVX2 build beats libm with it.
+#define FAST_EXP_MAX 700.0
+
+// Nearest integer, for |x| < 2^51, by letting the addition round.
+static inline double fast_round(double x) { return (x + 0x1.8p52) - 0x1.8p52; }
+
+// Error-free a + b = *hi + *lo (Knuth's two-sum).
+static inline void fast_two_sum(double a, double b, double *hi, double *lo) {
+    double s = a + b;
+    double bb = s - a;
+    *hi = s;
+    *lo = (a - (s - bb)) + (b - bb);
 }
 
-static bool audio_start(Synth *s) {
-    AudioStreamBasicDescription fmt;
-    memset(&fmt, 0, sizeof(fmt));
-    fmt.mSampleRate = SAMPLE_RATE;
-    fmt.mFormatID = kAudioFormatLinearPCM;
-    fmt.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
-    fmt.mBitsPerChannel = 16;
-    fmt.mChannelsPerFrame = CHANNELS;
-    fmt.mBytesPerFrame = CHANNELS * 2;
-    fmt.mFramesPerPacket = 1;
-    fmt.mBytesPerPacket = fmt.mBytesPerFrame;
+// Error-free a * b = *hi + *lo (Dekker's product; |a|, |b| < 2^996). The halves
+// have 26 bits, so every partial product is exact, fused or not.
+static inline void fast_two_prod(double a, double b, double *hi, double *lo) {
+    double ca = 134217729.0 * a, cb = 134217729.0 * b;
+    double ah = ca - (ca - a), bh = cb - (cb - b);
+    double al = a - ah, bl = b - bh;
+    *hi = a * b;
+    *lo = ((ah * bh - *hi) + ah * bl + al * bh) + al * bl;
+}
 
-    OSStatus st = AudioQueueNewOutput(&fmt, audio_cb, s, NULL, NULL, 0, &s->queue);
-    if (st != noErr) {
-        fprintf(stderr, "AudioQueueNewOutput failed: %d\n", (int)st);
-        return false;
-    }
+// ln x as *hi + *lo for finite x >= 2^-1022: x = 2^e m with m in [sqrt(2)/2,
+// sqrt(2)), fdlibm's log kernel on f = m - 1, and the exact parts e ln2_hi and f
+// summed without rounding, so pow can scale it by y and keep ~2^-70 accuracy.
+static inline void fast_log2x(double x, double *hi, double *lo) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint64_t mant = bits & 0x000fffffffffffffull;
+    uint64_t up = (mant + 0x00095f6400000000ull) & 0x0010000000000000ull;  // m would be >= sqrt(2)
+    uint64_t mbits = mant | (up ^ 0x3ff0000000000000ull);
+    uint64_t ebits = 0x4330000000000000ull | ((bits >> 52) + (up >> 52));
+    double m, e;
+    memcpy(&m, &mbits, sizeof(m));
+    memcpy(&e, &ebits, sizeof(e));
+    e -= 0x1p52 + 1023.0;
+    double f = m - 1.0;
+    double s = f / (2.0 + f);
+    double z = s * s;
+    double w = z * z;
+    double t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+    double t2 = z * (6.666666666666735130e-01 +
+                     w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+    double hfsq = 0.5 * f * f;
+    double rest = s * (hfsq + t2 + t1) - hfsq + e * 1.90821492927058770002e-10;
+    double h, l, h2, l2;
+    fast_two_sum(e * 6.93147180369123816490e-01, f, &h, &l);
+    fast_two_sum(h, rest, &h2, &l2);
+    *hi = h2;
+    *lo = l + l2;
+}
 
-    for (int i = 0; i < BUFFER_COUNT; ++i) {
-        st = AudioQueueAllocateBuffer(s->queue, BUFFER_FRAMES * sizeof(int16_t), &s->buffers[i]);
-        if (st != noErr) {
-            fprintf(stderr, "AudioQueueAllocateBuffer failed: %d\n", (int)st);
-            return false;
-        }
-        fill_buffer(s, s->buffers[i]);
-        AudioQueueEnqueueBuffer(s->queue, s->buffers[i], 0, NULL);
-    }
+// e^(r + rlo) for |r| <= FAST_EXP_MAX and tiny rlo: r = k ln2 + f with |f| <=
+// ln2/2, a Taylor series for e^f, and 2^k put together in the exponent bits.
+static inline double fast_exp(double r, double rlo) {
+    double k = fast_round(r * 1.44269504088896338700e+00);
+    double f = ((r - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10) + rlo;
+    double p = 1.0 / 6227020800.0;
+    p = 1.0 / 479001600.0 + f * p;
+    p = 1.0 / 39916800.0 + f * p;
+    p = 1.0 / 3628800.0 + f * p;
+    p = 1.0 / 362880.0 + f * p;
+    p = 1.0 / 40320.0 + f * p;
+    p = 1.0 / 5040.0 + f * p;
+    p = 1.0 / 720.0 + f * p;
+    p = 1.0 / 120.0 + f * p;
+    p = 1.0 / 24.0 + f * p;
+    p = 1.0 / 6.0 + f * p;
+    p = 0.5 + f * p;
+    p = 1.0 + f * (1.0 + f * p);
+    double kb = k + 0x1.8p52;
+    uint64_t bits;
+    memcpy(&bits, &kb, sizeof(bits));
+    bits = (bits + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
 
-    st = AudioQueueStart(s->queue, NULL);
-    if (st != noErr) {
-        fprintf(stderr, "AudioQueueStart failed: %d\n", (int)st);
-        return false;
+// y ln x as *r + *rlo.
+static inline void fast_pow_exponent(double x, double y, double *r, double *rlo) {
+    double hi, lo, ph, pl;
+    fast_log2x(x, &hi, &lo);
+    fast_two_prod(y, hi, &ph, &pl);
+    *r = ph;
+    *rlo = pl + y * lo;
+}
+
+// Whether pow(x, y) takes the fast path: finite x > 0 and |y ln x| <= 700, judged
+// from x's exponent alone (|ln m| <= ln2 / 2) so the block loop can test it
+// without the logarithm.
+static inline bool fast_pow_ok(double x, double y) {
+    if (!(x >= 0x1p-1022 && x <= DBL_MAX)) return false;
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    double e = (double)(int)(bits >> 52) - 1023.0;
+    return fabs(y) * (fabs(e) + 0.5) * 6.93147180559945309417e-01 <= FAST_EXP_MAX;
+}
+
+static inline double fast_pow_core(double x, double y) {
+    double r, rlo;
+    fast_pow_exponent(x, y, &r, &rlo);
+    return fast_exp(r, rlo);
+}
+
+static double fast_pow(double x, double y) { return fast_pow_ok(x, y) ? fast_pow_core(x, y) : pow(x, y); }
+
+static void fast_pow_block(const double *x, const double *y, double *out, int n) {
+    for (int i = 0; i < n; ++i) out[i] = fast_pow_core(x[i], y[i]);
+    for (int i = 0; i < n; ++i) {
+        if (!fast_pow_ok(x[i], y[i])) out[i] = pow(x[i], y[i]);
     }
-    return true;
 }
 
-static void audio_stop(Synth *s) {
-    if (s->queue) {
-        AudioQueueStop(s->queue, true);
-        AudioQueueDispose(s->queue, true);
-        s->queue = NULL;
+static bool expr_calls_math(const Expr *e) {
+    if (!e) return false;
+    switch (e->type) {
+        case EX_UNARY:
+            return expr_calls_math(e->as.unary.a);
+        case EX_BINARY:
+            return expr_calls_math(e->as.binary.a) || expr_calls_math(e->as.binary.b);
+        case EX_TERNARY:
+            return expr_calls_math(e->as.ternary.cond) || expr_calls_math(e->as.ternary.yes) ||
+                   expr_calls_math(e->as.ternary.no);
+        case EX_FUNC: {
+            FnId fn = fn_lookup(e->as.func.name, e->as.func.argc);
+            if (fn == FN_SIN || fn == FN_COS || fn == FN_TAN) return true;
+            for (int i = 0; i < e->as.func.argc; ++i) {
+                if (expr_calls_math(e->as.func.args[i])) return true;
+            }
+            return false;
+        }
+        case EX_INDEX:
+            return expr_calls_math(e->as.ref.index);
+        case EX_ASSIGN:
+            return expr_calls_math(e->as.assign.target) || expr_calls_math(e->as.assign.value);
+        case EX_SEQ:
+            return expr_calls_math(e->as.seq.first) || expr_calls_math(e->as.seq.rest);
+        default:
+            return false;
     }
 }
 
-static void print_help(void) {
-    printf("Commands:\n");
-    printf("  eq <js_expr_or_js_return_program>  Set bytebeat equation\n");
-    printf("  a <value>                          Set macro a (float)\n");
-    printf("  b <value>                          Set macro b (float)\n");
-    printf("  c <value>                          Set macro c (float)\n");
-    printf("  d <value>                          Set macro d (float)\n");
-    printf("  sh <value>                         Set bit-shift macro (integer-ish)\n");
-    printf("  mask <value>                       Set bitmask macro (integer-ish)\n");
-    printf("  pl                                 List all built-in presets\n");
-    printf("  ps <index>                         Switch to preset index (1..%d)\n", PRESET_COUNT);
-    printf("  pn                                 Next preset\n");
-    printf("  pp                                 Previous preset\n");
-    printf("  p <semitones>                      Set pitch shift in semitones (e.g. -12, +7)\n");
-    printf("  tm <multiplier>                    Set tempo multiplier (0.05..8.0)\n");
-    printf("  s                                  Show current controls\n");
-    printf("  h                                  Help\n");
-    printf("  q                                  Quit\n");
+static double math_ulp(double v) {
+    v = fabs(v);
+    return v < DBL_MIN ? DBL_TRUE_MIN : nextafter(v, INFINITY) - v;
 }
 
-static bool set_expr(Synth *s, const char *js) {
-    char *c_expr = transpile_js_to_c(js);
-    if (!c_expr) {
-        fprintf(stderr, "Failed to transpile equation\n");
-        return false;
+static double math_bench_time(FnId fn, const double *x, const double *y, double *out, int count, int form) {
+    static double (*volatile scalar[])(double) = {fast_sin, fast_cos, fast_tan};
+    double (*volatile pow_scalar)(double, double) = fast_pow;
+    double best = -1.0;
+    for (int round = 0; round < MATH_BENCH_ROUNDS; ++round) {
+        uint64_t start = now_ns();
+        for (int base = 0; base < count; base += EVAL_BLOCK) {
+            int n = count - base < EVAL_BLOCK ? count - base : EVAL_BLOCK;
+            const double *xs = x + base, *ys = y + base;
+            double *o = out + base;
+            if (form == 0) {
+                double *const args[2] = {(double *)xs, (double *)ys};
+                g_math_mode = MATH_EXACT;
+                fn_eval_block(fn, args, o, n);
+            } else if (form == 1) {
+                for (int i = 0; i < n; ++i) o[i] = fn == FN_POW ? pow_scalar(xs[i], ys[i]) : scalar[fn - FN_SIN](xs[i]);
+            } else if (fn == FN_POW) {
+                fast_pow_block(xs, ys, o, n);  // not used by --math fast; timed for comparison
+            } else {
+                double *const args[2] = {(double *)xs, (double *)ys};
+                g_math_mode = MATH_FAST;
+                fn_eval_block(fn, args, o, n);
+            }
+        }
+        double ns = (double)(now_ns() - start) / count;
+        if (best < 0.0 || ns < best) best = ns;
     }
+    return best;
+}
 
-    char err[256];
-    Expr *root = compile_expr(c_expr, err, sizeof(err));
-    if (!root) {
-        fprintf(stderr, "Compile error: %s\n", err);
-        free(c_expr);
-        return false;
+static int run_math_bench(int count) {
+    static const double kDivisors[] = {1.0, 7.0, 20.0, 30.0, 64.0, 100.0, 256.0, 1000.0};
+    static const double kPowers[] = {0.5, 1.0 / 3.0, 0.75, 1.25, 1.5, 2.0, 3.0, 0.0};
+    static const struct {
+        FnId fn;
+        const char *name;
+        double scale;  // output byte = floor(scale * f(x)) & 0xFF
+    } kFns[] = {{FN_SIN, "sin", 32.0}, {FN_COS, "cos", 32.0}, {FN_TAN, "tan", 16.0}, {FN_POW, "pow", 1.0}};
+    const MathMode saved = g_math_mode;
+    double *buf = (double *)malloc((size_t)count * 4 * sizeof(double));
+    if (!buf) return 1;
+    double *x = buf, *y = buf + count, *want = buf + 2 * (size_t)count, *got = buf + 3 * (size_t)count;
+    printf("%d arguments per function; error against libm, output bytes at floor(scale * f) & 255\n", count);
+    printf("function  scale   max abs err   max err (ulp)   bytes changed   libm   fast scalar   fast block (ns)\n");
+    for (size_t f = 0; f < sizeof(kFns) / sizeof(kFns[0]); ++f) {
+        FnId fn = kFns[f].fn;
+        for (int i = 0; i < count; ++i) {
+            if (fn == FN_POW) {
+                // t and t/100 to fixed powers, and small integers to integer powers.
+                x[i] = (i & 16) ? (double)(i >> 5) / 100.0 : (double)(i >> 5);
+                y[i] = kPowers[i & 7] != 0.0 ? kPowers[i & 7] : (double)((i >> 3) & 15);
+                if (kPowers[i & 7] == 0.0) x[i] = (double)((i >> 7) & 31);
+            } else {
+                x[i] = (double)(i >> 3) / kDivisors[i & 7];
+                y[i] = 0.0;
+            }
+        }
+        double t_libm = math_bench_time(fn, x, y, want, count, 0);
+        double t_scalar = math_bench_time(fn, x, y, got, count, 1);
+        double t_block = math_bench_time(fn, x, y, got, count, 2);
+        double max_abs = 0.0, max_ulp = 0.0;
+        long long changed = 0;
+        for (int i = 0; i < count; ++i) {
+            double a = want[i], b = got[i];
+            if (a == b || (isnan(a) && isnan(b))) continue;
+            double d = fabs(a - b);
+            if (d > max_abs) max_abs = d;
+            if (d / math_ulp(a) > max_ulp) max_ulp = d / math_ulp(a);
+            double sa = a * kFns[f].scale, sb = b * kFns[f].scale;
+            if (fabs(sa) < 0x1p31 && fabs(sb) < 0x1p31) changed += (block_i32(sa) & 0xFF) != (block_i32(sb) & 0xFF);
+        }
+        printf("%-8s %6.0f   %11.2e   %13.2f   %13lld   %4.1f   %11.1f   %10.1f\n", kFns[f].name, kFns[f].scale,
+               max_abs, max_ulp, changed, t_libm, t_scalar, t_block);
     }
+    free(buf);
 
-    pthread_mutex_lock(&s->expr_lock);
-    Expr *old = s->expr;
-    s->expr = root;
-    pthread_mutex_unlock(&s->expr_lock);
-    expr_free(old);
-
-    printf("JS -> C: %s\n", c_expr);
-    free(c_expr);
-    return true;
+    // Whole presets: bytes that differ and render time per sample, exact vs fast.
+    const uint64_t samples = (uint64_t)count;
+    uint8_t *bytes[2] = {(uint8_t *)malloc(samples), (uint8_t *)malloc(samples)};
+    int shown = 0;
+    for (int i = 0; i < preset_count() && bytes[0] && bytes[1]; ++i) {
+        char err[256];
+        char *src =
+            g_bank.hdr ? strdup(g_bank.strings + g_bank.entries[i].src_offset) : transpile_js_to_c(preset_js(i));
+        Expr *e = src ? compile_expr(src, err, sizeof(err)) : NULL;
+        free(src);
+        if (!e || !expr_calls_math(e)) {
+            expr_free(e);
+            continue;
+        }
+        if (!shown++) printf("\npreset                      bytes changed     exact   fast (ns/sample)\n");
+        EvalContext ctx = {.a = 5.0, .b = 3.0, .c = 7.0, .d = 10.0, .sh = 8.0, .mask = 127.0};
+        double ns[2];
+        for (int mode = 0; mode < 2; ++mode) {
+            g_math_mode = mode ? MATH_FAST : MATH_EXACT;
+            uint64_t start = now_ns();
+            expr_render_bytes(e, &ctx, 0, bytes[mode], samples);
+            ns[mode] = (double)(now_ns() - start) / (double)samples;
+        }
+        uint64_t diff = 0;
+        for (uint64_t k = 0; k < samples; ++k) diff += bytes[0][k] != bytes[1][k];
+        printf("%-26s %14llu   %7.1f   %7.1f\n", preset_name(i), (unsigned long long)diff, ns[0], ns[1]);
+        expr_free(e);
+    }
+    free(bytes[0]);
+    free(bytes[1]);
+    g_math_mode = saved;
+    return 0;
 }
 
-static void print_presets(const Synth *s) {
-    puts("Built-in bytebeat presets:");
-    for (int i = 0; i < PRESET_COUNT; ++i) {
-        const char *marker = (i == s->current_preset) ? "*" : " ";
-        printf(" %s %2d. %s\n", marker, i + 1, kPresets[i].name);
+// Renders every preset and encodes it to FLAC, on one encoder thread and on
+// `threads`: compressed size against raw 16-bit, and encode speed.
+static int run_flac_bench(double seconds, int threads) {
+    size_t n = (size_t)(seconds * SAMPLE_RATE);
+    n -= n % BUFFER_FRAMES;
+    if (n == 0) n = BUFFER_FRAMES;
+    int16_t *pcm = (int16_t *)malloc(n * sizeof(int16_t));
+    FILE *f = tmpfile();
+    if (!pcm || !f) {
+        free(pcm);
+        if (f) fclose(f);
+        fprintf(stderr, "Cannot allocate the benchmark buffers\n");
+        return 1;
+    }
+    printf("%.1f s of each preset, 16-bit mono at %d Hz; encode speed in multiples of real time\n",
+           (double)n / SAMPLE_RATE, SAMPLE_RATE);
+    printf("preset                      flac bytes   ratio   1 thread   %2d threads\n", threads);
+    uint64_t total_raw = 0, total_flac = 0;
+    double total_wall[2] = {0.0, 0.0};
+    int failed = 0;
+    for (int i = 0; i < preset_count(); ++i) {
+        Synth *s = (Synth *)malloc(sizeof(Synth));
+        if (!s) break;
+        synth_init(s);
+        char err[300];
+        bool loaded = synth_load_preset(s, i, err, sizeof(err));
+        for (size_t at = 0; loaded && at < n; at += BUFFER_FRAMES) synth_render(s, pcm + at, BUFFER_FRAMES);
+        synth_destroy(s);
+        free(s);
+        if (!loaded) {
+            printf("%-26s %s\n", preset_name(i), err);
+            continue;
+        }
+        double wall[2];
+        uint64_t bytes = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            rewind(f);
+            FlacWriter fw;
+            uint64_t start = now_ns();
+            bool ok = flac_open(&fw, f, pass ? threads : 1);
+            if (ok) {
+                flac_write(&fw, pcm, n);
+                ok = flac_close(&fw);
+            }
+            wall[pass] = (double)(now_ns() - start) / 1e9;
+            failed += !ok;
+            bytes = fw.bytes;
+        }
+        uint64_t raw = n * sizeof(int16_t);
+        printf("%-26s %10llu   %5.3f   %8.0fx   %9.0fx\n", preset_name(i), (unsigned long long)bytes,
+               (double)bytes / (double)raw, (double)n / SAMPLE_RATE / wall[0], (double)n / SAMPLE_RATE / wall[1]);
+        total_raw += raw;
+        total_flac += bytes;
+        total_wall[0] += wall[0];
+        total_wall[1] += wall[1];
     }
+    if (total_raw) {
+        double audio_s = (double)total_raw / sizeof(int16_t) / SAMPLE_RATE;
+        printf("%-26s %10llu   %5.3f   %8.0fx   %9.0fx\n", "all", (unsigned long long)total_flac,
+               (double)total_flac / (double)total_raw, audio_s / total_wall[0], audio_s / total_wall[1]);
+    }
+    fclose(f);
+    free(pcm);
+    if (failed) fprintf(stderr, "%d encodes failed to write\n", failed);
+    return failed ? 1 : 0;
 }
 
-static void set_preset(Synth *s, int idx) {
-    if (idx < 0 || idx >= PRESET_COUNT) {
-        fprintf(stderr, "Preset index out of range (1..%d)\n", PRESET_COUNT);
-        return;
+// Per preset at the default macros: nodes left after specialization, whether the
+// specialized program renders the same bytes, and the time per sample of each
+// (best of three renders).
+static int run_spec_bench(double seconds) {
+    const uint64_t samples = (uint64_t)(seconds * SAMPLE_RATE) + 1;
+    const double key[6] = {5.0, 3.0, 7.0, 10.0, 8.0, 127.0};
+    EvalContext ctx;
+    loop_cache_context(&ctx, key);
+    uint8_t *bytes[2] = {(uint8_t *)malloc(samples), (uint8_t *)malloc(samples)};
+    if (!bytes[0] || !bytes[1]) {
+        free(bytes[0]);
+        free(bytes[1]);
+        fprintf(stderr, "Cannot allocate the benchmark buffers\n");
+        return 1;
     }
-    if (set_expr(s, kPresets[idx].js)) {
-        s->current_preset = idx;
-        printf("Preset %d selected: %s\n", idx + 1, kPresets[idx].name);
+    printf("%.1f s of each preset at a=5 b=3 c=7 d=10 sh=8 mask=127\n", (double)samples / SAMPLE_RATE);
+    printf("preset                      nodes   same   generic   specialized (ns/sample)   speedup\n");
+    double total[2] = {0.0, 0.0};
+    int mismatched = 0;
+    for (int i = 0; i < preset_count(); ++i) {
+        char err[256];
+        char *src =
+            g_bank.hdr ? strdup(g_bank.strings + g_bank.entries[i].src_offset) : transpile_js_to_c(preset_js(i));
+        Expr *e = src ? compile_expr(src, err, sizeof(err)) : NULL;
+        free(src);
+        SpecProgram *spec = e ? spec_create(e, key) : NULL;
+        if (!spec) {
+            printf("%-26s   (not specialized)\n", preset_name(i));
+            expr_free(e);
+            continue;
+        }
+        double ns[2];
+        for (int k = 0; k < 2; ++k) {
+            const Expr *run = k ? spec->expr : e;
+            ns[k] = INFINITY;
+            for (int rep = 0; rep < 3; ++rep) {
+                uint64_t start = now_ns();
+                expr_render_bytes(run, &ctx, 0, bytes[k], samples);
+                ns[k] = fmin(ns[k], (double)(now_ns() - start) / (double)samples);
+            }
+            total[k] += ns[k];
+        }
+        bool same = !memcmp(bytes[0], bytes[1], (size_t)samples);
+        mismatched += !same;
+        printf("%-26s %3d/%-3d   %-4s   %7.2f   %11.2f               %5.2fx\n", preset_name(i), spec->nodes,
+               spec->generic_nodes, same ? "yes" : "NO", ns[0], ns[1], ns[0] / ns[1]);
+        spec_free(spec);
+        expr_free(e);
     }
+    if (total[1] > 0.0) printf("all presets: %.2fx\n", total[0] / total[1]);
+    free(bytes[0]);
+    free(bytes[1]);
+    if (mismatched) fprintf(stderr, "%d presets rendered different bytes\n", mismatched);
+    return mismatched ? 1 : 0;
 }
 
-static void on_sigint(int sig) {
-    (void)sig;
-    atomic_store_explicit(&g_synth.running, false, memory_order_relaxed);
+static void print_usage(const char *argv0) {
+    printf("Usage: %s                          interactive synth\n", argv0);
+    printf("       %s --daemon <streams.conf> [threads]\n", argv0);
+    printf("       %s --daemon-bench [streams] [seconds] [threads]\n", argv0);
+    printf("       %s --corpus <equations.txt> [samples] [threads] [report.tsv]\n", argv0);
+    printf("       %s --sweep <equation> <grid> <out-dir> [seconds] [threads]\n", argv0);
+    printf("       %s --bank-build <presets.txt> <out.bank>\n", argv0);
+    printf("       %s --bank-bench <presets.bank>\n", argv0);
+    printf("       %s --replay <session.nses> <out.wav|out.flac|out.raw> [threads]\n", argv0);
+    printf("       %s --profile <equation> [seconds] [out.json]\n", argv0);
+    printf("       %s --aot-build <out.so>\n", argv0);
+    printf("       %s --math-bench [arguments]\n", argv0);
+    printf("       %s --flac-bench [seconds] [threads]\n", argv0);
+    printf("       %s --spec-bench [seconds]\n", argv0);
+    printf("  --bank <presets.bank> before any mode replaces the built-in presets\n");
+    printf("  --aot <presets.so> before any mode runs the equations it holds as native code\n");
+    printf("  --math exact|fast before any mode picks libm or the fast approximations for sin, cos, tan\n");
+    printf("  --shm <name> plays the interactive synth into a shared-memory ring instead of the audio device\n");
+    printf("  --lookahead <ms> renders the interactive synth that far ahead of the audio device\n");
+    printf("  --bits 8 before any mode writes raw, WAV and pipe output as unsigned 8-bit samples\n");
+    printf("  --seed <n> before any mode seeds random() and noise() (default 0)\n");
+    printf("  --rt[=priority] before any mode locks memory and runs render threads SCHED_FIFO (Linux)\n");
 }
 
-int main(void) {
-    memset(&g_synth, 0, sizeof(g_synth));
-    pthread_mutex_init(&g_synth.expr_lock, NULL);
-    atomic_store_explicit(&g_synth.target_tempo, 1.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.target_pitch, 1.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_a, 5.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_b, 3.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_c, 7.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_d, 10.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_shift, 8.0, memory_order_relaxed);
-    atomic_store_explicit(&g_synth.macro_mask, 127.0, memory_order_relaxed);
-    g_synth.smooth_tempo = 1.0;
-    g_synth.smooth_pitch = 1.0;
-    atomic_store_explicit(&g_synth.running, true, memory_order_relaxed);
+int main(int argc, char **argv) {
+    for (;;) {
+        if (argc >= 3 && !strcmp(argv[1], "--bank")) {
+            char err[300];
+            if (!preset_bank_load(argv[2], err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+                return 1;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--aot")) {
+            char err[300];
+            if (!aot_load_library(argv[2], err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+                return 1;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--math")) {
+            if (strcmp(argv[2], "exact") && strcmp(argv[2], "fast")) {
+                fprintf(stderr, "--math takes exact or fast\n");
+                return 2;
+            }
+            g_math_mode = strcmp(argv[2], "fast") ? MATH_EXACT : MATH_FAST;
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--shm")) {
+            g_shm_out.name = argv[2];
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--seed")) {
+            g_seed = strtoull(argv[2], NULL, 0);
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--bits")) {
+            g_output_bits = atoi(argv[2]);
+            if (g_output_bits != 8 && g_output_bits != 16) {
+                fprintf(stderr, "--bits takes 8 or 16\n");
+                return 2;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 3 && !strcmp(argv[1], "--lookahead")) {
+            g_lookahead_ms = strtod(argv[2], NULL);
+            if (!(g_lookahead_ms >= 1.0 && g_lookahead_ms <= LOOKAHEAD_MAX_MS)) {
+                fprintf(stderr, "--lookahead takes 1 to %d ms\n", LOOKAHEAD_MAX_MS);
+                return 2;
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        } else if (argc >= 2 && (!strcmp(argv[1], "--rt") || !strncmp(argv[1], "--rt=", 5))) {
+            g_rt.enabled = true;
+            if (argv[1][4] == '=') g_rt.priority = atoi(argv[1] + 5);
+            argv[1] = argv[0];
+            argv += 1;
+            argc -= 1;
+        } else {
+            break;
+        }
+    }
+    if (g_rt.enabled) rt_process_setup();
+    if (g_aot_lib_count && g_math_mode == MATH_FAST) {
+        fprintf(stderr, "--aot libraries call libm and cannot be combined with --math fast\n");
+        return 2;
+    }
+    if (g_lookahead_ms > 0.0 && g_shm_out.name) {
+        fprintf(stderr, "--lookahead applies to the audio device, not to --shm output\n");
+        return 2;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--daemon")) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        int threads = argc >= 4 ? atoi(argv[3]) : default_thread_count();
+        return run_daemon(argv[2], threads > 0 ? threads : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--daemon-bench")) {
+        int threads = argc >= 5 ? atoi(argv[4]) : default_thread_count();
+        return run_daemon_bench(argc >= 3 ? atoi(argv[2]) : 64, argc >= 4 ? atof(argv[3]) : 10.0,
+                                threads > 0 ? threads : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--corpus")) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        long long samples = argc >= 4 ? atoll(argv[3]) : 10LL * SAMPLE_RATE;
+        int threads = argc >= 5 ? atoi(argv[4]) : default_thread_count();
+        return run_corpus(argv[2], samples > 0 ? (uint64_t)samples : 1, threads > 0 ? threads : 1,
+                          argc >= 6 ? argv[5] : "corpus_report.tsv");
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--sweep")) {
+        if (argc < 5) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        double seconds = argc >= 6 ? atof(argv[5]) : 1.0;
+        int threads = argc >= 7 ? atoi(argv[6]) : default_thread_count();
+        return run_sweep(argv[2], argv[3], argv[4], fmin(seconds > 0.0 ? seconds : 1.0, 60.0),
+                         threads > 0 ? threads : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--bank-build")) {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_bank_build(argv[2], argv[3]);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--replay")) {
+        if (argc < 4) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        int threads = argc >= 5 ? atoi(argv[4]) : default_thread_count();
+        return run_replay(argv[2], argv[3], threads > 0 ? threads : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--profile")) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        char *c_expr = transpile_js_to_c(argv[2]);
+        if (!c_expr) {
+            fprintf(stderr, "Failed to transpile equation\n");
+            return 1;
+        }
+        EvalContext ctx = {.a = 5.0, .b = 3.0, .c = 7.0, .d = 10.0, .sh = 8.0, .mask = 127.0};
+        int rc = profile_equation(c_expr, &ctx, 0, argc >= 4 ? atof(argv[3]) : 2.0, argc >= 5 ? argv[4] : NULL);
+        free(c_expr);
+        return rc;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--bank-bench")) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_bank_bench(argv[2]);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--aot-build")) {
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        return run_aot_build(argv[2]);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--math-bench")) {
+        int count = argc >= 3 ? atoi(argv[2]) : 1 << 22;
+        return run_math_bench(count > 0 ? count : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--flac-bench")) {
+        double seconds = argc >= 3 ? atof(argv[2]) : 30.0;
+        int threads = argc >= 4 ? atoi(argv[3]) : default_thread_count();
+        return run_flac_bench(seconds > 0.0 ? seconds : 30.0, threads > 0 ? threads : 1);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--spec-bench")) {
+        double seconds = argc >= 3 ? atof(argv[2]) : 10.0;
+        return run_spec_bench(seconds > 0.0 ? seconds : 10.0);
+    }
+    if (argc >= 2) {
+        print_usage(argv[0]);
+        return argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) ? 0 : 2;
+    }
+
+    synth_init(&g_synth);
+    g_synth.cost_budget_ns = admit_budget_ns(1);
 
     signal(SIGINT, on_sigint);
 
-    g_synth.current_preset = 0;
-    set_preset(&g_synth, g_synth.current_preset);
+    set_preset(&g_synth, 0);
 
-    if (!audio_start(&g_synth)) {
-        expr_free(g_synth.expr);
-        pthread_mutex_destroy(&g_synth.expr_lock);
+    bool started = g_shm_out.name ? shm_output_start(&g_shm_out, &g_synth)
+                                  : (g_lookahead_ms <= 0.0 || lookahead_start(&g_synth, g_lookahead_ms)) &&
+                                        audio_start(&g_synth);
+    if (!started) {
+        lookahead_stop(&g_synth);
+        synth_destroy(&g_synth);
         return 1;
     }
 
@@ -1245,56 +11100,58 @@ int main(void) {
     print_help();
 
     char line[INPUT_LINE_MAX];
+    setvbuf(stdin, NULL, _IONBF, 0);
     while (atomic_load_explicit(&g_synth.running, memory_order_relaxed)) {
-        printf("> ");
-        fflush(stdout);
-        if (!fgets(line, sizeof(line), stdin)) break;
+        if (!repl_read_line(line, (int)sizeof(line))) break;
 
         size_t len = strlen(line);
         if (len > 0 && line[len - 1] == '\n') line[len - 1] = '\0';
 
         if (!strncmp(line, "eq ", 3)) {
             if (set_expr(&g_synth, line + 3)) {
-                g_synth.current_preset = -1;
+                atomic_store_explicit(&g_synth.current_preset, -1, memory_order_relaxed);
             }
         } else if (!strncmp(line, "a ", 2)) {
-            atomic_store_explicit(&g_synth.macro_a, strtod(line + 2, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_A, strtod(line + 2, NULL));
         } else if (!strncmp(line, "b ", 2)) {
-            atomic_store_explicit(&g_synth.macro_b, strtod(line + 2, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_B, strtod(line + 2, NULL));
         } else if (!strncmp(line, "c ", 2)) {
-            atomic_store_explicit(&g_synth.macro_c, strtod(line + 2, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_C, strtod(line + 2, NULL));
         } else if (!strncmp(line, "d ", 2)) {
-            atomic_store_explicit(&g_synth.macro_d, strtod(line + 2, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_D, strtod(line + 2, NULL));
         } else if (!strncmp(line, "sh ", 3)) {
-            atomic_store_explicit(&g_synth.macro_shift, strtod(line + 3, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_SHIFT, strtod(line + 3, NULL));
         } else if (!strncmp(line, "mask ", 5)) {
-            atomic_store_explicit(&g_synth.macro_mask, strtod(line + 5, NULL), memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_MASK, strtod(line + 5, NULL));
         } else if (!strcmp(line, "pl")) {
             print_presets(&g_synth);
         } else if (!strncmp(line, "ps ", 3)) {
             int idx = (int)strtol(line + 3, NULL, 10);
             set_preset(&g_synth, idx - 1);
         } else if (!strcmp(line, "pn")) {
-            int idx = g_synth.current_preset;
+            int idx = atomic_load_explicit(&g_synth.current_preset, memory_order_relaxed);
             if (idx < 0) idx = 0;
-            idx = (idx + 1) % PRESET_COUNT;
+            idx = (idx + 1) % preset_count();
             set_preset(&g_synth, idx);
         } else if (!strcmp(line, "pp")) {
-            int idx = g_synth.current_preset;
+            int idx = atomic_load_explicit(&g_synth.current_preset, memory_order_relaxed);
             if (idx < 0) idx = 0;
-            idx = (idx - 1 + PRESET_COUNT) % PRESET_COUNT;
+            idx = (idx - 1 + preset_count()) % preset_count();
             set_preset(&g_synth, idx);
         } else if (!strncmp(line, "p ", 2)) {
-            double semitones = strtod(line + 2, NULL);
-            double ratio = pow(2.0, semitones / 12.0);
-            atomic_store_explicit(&g_synth.target_pitch, ratio, memory_order_relaxed);
-            printf("Pitch target set: %.2f semitones (x%.4f)\n", semitones, ratio);
+            double ratio = pitch_ratio(strtod(line + 2, NULL));
+            synth_set_control(&g_synth, CTL_PITCH, ratio);
+            printf("Pitch target set: %.2f semitones (x%.4f)\n", 12.0 * log2(ratio), ratio);
         } else if (!strncmp(line, "tm ", 3)) {
             double tm = strtod(line + 3, NULL);
             if (tm < 0.05) tm = 0.05;
             if (tm > 8.0) tm = 8.0;
-            atomic_store_explicit(&g_synth.target_tempo, tm, memory_order_relaxed);
+            synth_set_control(&g_synth, CTL_TEMPO, tm);
             printf("Tempo target set: x%.3f\n", tm);
+        } else if (!strncmp(line, "seek ", 5)) {
+            seek_command(&g_synth, CTL_SEEK, line + 5);
+        } else if (!strncmp(line, "scrub ", 6)) {
+            seek_command(&g_synth, CTL_SCRUB, line + 6);
         } else if (!strcmp(line, "s")) {
             double tp = atomic_load_explicit(&g_synth.target_tempo, memory_order_relaxed);
             double pp = atomic_load_explicit(&g_synth.target_pitch, memory_order_relaxed);
@@ -1304,14 +11161,90 @@ int main(void) {
             double d = atomic_load_explicit(&g_synth.macro_d, memory_order_relaxed);
             double sh = atomic_load_explicit(&g_synth.macro_shift, memory_order_relaxed);
             double mask = atomic_load_explicit(&g_synth.macro_mask, memory_order_relaxed);
-            if (g_synth.current_preset >= 0) {
-                printf("Preset %d: %s\n", g_synth.current_preset + 1, kPresets[g_synth.current_preset].name);
+            int current = atomic_load_explicit(&g_synth.current_preset, memory_order_relaxed);
+            if (current >= 0) {
+                pthread_mutex_lock(&g_bank_lock);
+                printf("Preset %d: %s\n", current + 1, preset_name(current));
+                pthread_mutex_unlock(&g_bank_lock);
             } else {
                 puts("Preset: custom equation");
             }
             printf("Target tempo x%.3f | target pitch ratio x%.4f\n", tp, pp);
+            printf("Position: t=%llu\n",
+                   (unsigned long long)atomic_load_explicit(&g_synth.position, memory_order_relaxed));
             printf("Macros: a=%.3f b=%.3f c=%.3f d=%.3f sh=%d mask=%d\n", a, b, c, d, (int)llround(sh),
                    (int)llround(mask));
+        } else if (!strcmp(line, "bank off") || !strncmp(line, "bank ", 5)) {
+            char err[300];
+            bool off = !strcmp(line, "bank off");
+            if (!preset_bank_load(off ? NULL : line + 5, err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+            } else {
+                atomic_store_explicit(&g_synth.current_preset, -1, memory_order_relaxed);
+                if (off) {
+                    printf("Using the %d built-in presets\n", PRESET_COUNT);
+                } else {
+                    printf("Loaded bank %s: %d presets\n", line + 5, preset_count());
+                }
+            }
+        } else if (!strcmp(line, "watch off")) {
+            watch_stop(&g_watch);
+        } else if (!strncmp(line, "watch ", 6)) {
+            watch_start(&g_watch, &g_synth, line + 6);
+        } else if (!strcmp(line, "rec off")) {
+            session_stop(&g_synth);
+        } else if (!strncmp(line, "rec ", 4)) {
+            char err[INPUT_LINE_MAX + 128];  // holds the path from the command line
+            if (session_start(&g_synth, line + 4, err, sizeof(err))) {
+                printf("Recording session to %s\n", line + 4);
+            } else {
+                fprintf(stderr, "%s\n", err);
+            }
+        } else if (!strcmp(line, "osc off")) {
+            osc_stop(&g_osc);
+        } else if (!strncmp(line, "osc ", 4)) {
+            int port = (int)strtol(line + 4, NULL, 10);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "OSC port out of range (1..65535)\n");
+            } else {
+                osc_start(&g_osc, &g_synth, port);
+            }
+        } else if (!strcmp(line, "seq") || !strncmp(line, "seq ", 4)) {
+            sequencer_command(&g_synth, line[3] ? line + 4 : "");
+        } else if (!strcmp(line, "fx") || !strncmp(line, "fx ", 3)) {
+            fx_command(&g_synth, line[2] ? line + 3 : "");
+        } else if (!strcmp(line, "loop on") || !strcmp(line, "loop off")) {
+            bool on = !strcmp(line, "loop on");
+            atomic_store_explicit(&g_synth.loop_cache_enabled, on, memory_order_relaxed);
+            printf("Loop cache %s\n", on ? "enabled" : "disabled");
+        } else if (!strcmp(line, "spec on") || !strcmp(line, "spec off")) {
+            bool on = !strcmp(line, "spec on");
+            atomic_store_explicit(&g_synth.spec_enabled, on, memory_order_relaxed);
+            printf("Macro specialization %s\n", on ? "enabled" : "disabled");
+        } else if (!strcmp(line, "gov on") || !strcmp(line, "gov off")) {
+            bool on = !strcmp(line, "gov on");
+            atomic_store_explicit(&g_synth.governor_enabled, on, memory_order_relaxed);
+            printf("CPU governor %s\n", on ? "enabled" : "disabled");
+        } else if (!strcmp(line, "aot")) {
+            char err[300];
+            double ms = 0.0;
+            if (!synth_compile_native(&g_synth, &ms, err, sizeof(err))) {
+                fprintf(stderr, "%s\n", err);
+            } else if (ms > 0.0) {
+                printf("Native build: %.0f ms, now running compiled code\n", ms);
+            } else {
+                puts("Already running compiled code");
+            }
+        } else if (!strcmp(line, "aot on") || !strcmp(line, "aot off")) {
+            bool on = !strcmp(line, "aot on");
+            atomic_store_explicit(&g_aot_auto, on, memory_order_relaxed);
+            printf("Native builds of new equations %s\n", on ? "enabled" : "disabled");
+        } else if (!strcmp(line, "stats")) {
+            print_stats(&g_synth);
+            if (g_shm_out.name) print_shm_output(&g_shm_out);
+            if (g_synth.ahead) print_lookahead(g_synth.ahead);
+        } else if (!strcmp(line, "prof") || !strncmp(line, "prof ", 5)) {
+            profile_current(&g_synth, line[4] ? line + 5 : "");
         } else if (!strcmp(line, "h")) {
             print_help();
         } else if (!strcmp(line, "q")) {
@@ -1321,15 +11254,18 @@ int main(void) {
         }
     }
 
+    osc_stop(&g_osc);
+    watch_stop(&g_watch);
+    session_stop(&g_synth);
     atomic_store_explicit(&g_synth.running, false, memory_order_relaxed);
-    audio_stop(&g_synth);
-
-    pthread_mutex_lock(&g_synth.expr_lock);
-    Expr *final_expr = g_synth.expr;
-    g_synth.expr = NULL;
-    pthread_mutex_unlock(&g_synth.expr_lock);
-    expr_free(final_expr);
-
-    pthread_mutex_destroy(&g_synth.expr_lock);
+    if (g_shm_out.name) {
+        shm_output_stop(&g_shm_out);
+    } else {
+        audio_stop(&g_synth);
+        lookahead_stop(&g_synth);
+    }
+    aot_worker_stop();
+    sequencer_stop(&g_synth);
+    synth_destroy(&g_synth);
     return 0;
 }
@@ -0,0 +1,212 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loopback OSC sender for NORA's control server. Sends timestamped /nora/ping
+// messages (optionally bundled with macro updates, like a controller would) and
+// collects the /nora/pong replies, which carry the time the audio thread applied
+// the ping while rendering. Both ends use the system-wide monotonic clock.
+
+#define ENGINE_BUFFER_FRAMES 512
+#define ENGINE_BUFFER_COUNT 3
+#define ENGINE_SAMPLE_RATE 48000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint64_t be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+static size_t put_string(uint8_t *p, const char *s) {
+    size_t len = strlen(s);
+    size_t padded = (len + 4) & ~(size_t)3;
+    memset(p, 0, padded);
+    memcpy(p, s, len);
+    return padded;
+}
+
+static size_t build_ping(uint8_t *p, uint64_t seq, uint64_t sent_ns) {
+    size_t n = put_string(p, "/nora/ping");
+    n += put_string(p + n, ",hh");
+    put_be64(p + n, seq);
+    put_be64(p + n + 8, sent_ns);
+    return n + 16;
+}
+
+static size_t build_float(uint8_t *p, const char *addr, float v) {
+    size_t n = put_string(p, addr);
+    n += put_string(p + n, ",f");
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_be32(p + n, bits);
+    return n + 4;
+}
+
+static size_t bundle_add(uint8_t *p, size_t n, const uint8_t *elem, size_t len) {
+    put_be32(p + n, (uint32_t)len);
+    memcpy(p + n + 4, elem, len);
+    return n + 4 + len;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-p port] [-n count] [-i interval_ms] [-b]\n", argv0);
+    fprintf(stderr, "  -b  send each ping inside a bundle with /nora/a..d updates\n");
+}
+
+int main(int argc, char **argv) {
+    int port = 9000;
+    int count = 200;
+    double interval_ms = 5.0;
+    bool bundle = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            interval_ms = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-b")) {
+            bundle = true;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (count <= 0 || port <= 0 || port > 65535) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons((uint16_t)port);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) != 0) {
+        perror("connect");
+        close(fd);
+        return 1;
+    }
+
+    uint64_t *apply_ns = (uint64_t *)calloc((size_t)count, sizeof(uint64_t));
+    uint64_t *rtt_ns = (uint64_t *)calloc((size_t)count, sizeof(uint64_t));
+    if (!apply_ns || !rtt_ns) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int received = 0;
+    int lost = 0;
+    for (int i = 0; i < count; ++i) {
+        uint8_t pkt[512];
+        uint8_t elem[128];
+        size_t len = 0;
+        uint64_t seq = (uint64_t)i + 1;
+        uint64_t sent = now_ns();
+        if (bundle) {
+            memcpy(pkt, "#bundle\0", 8);
+            put_be64(pkt + 8, 1);  // "immediately"
+            len = 16;
+            static const char *kAddrs[4] = {"/nora/a", "/nora/b", "/nora/c", "/nora/d"};
+            for (int k = 0; k < 4; ++k) {
+                size_t el = build_float(elem, kAddrs[k], (float)((i + k) % 9 + 1));
+                len = bundle_add(pkt, len, elem, el);
+            }
+            size_t el = build_ping(elem, seq, sent);
+            len = bundle_add(pkt, len, elem, el);
+        } else {
+            len = build_ping(pkt, seq, sent);
+        }
+        if (send(fd, pkt, len, 0) < 0) {
+            perror("send");
+            break;
+        }
+
+        bool got = false;
+        uint64_t deadline = sent + 500000000ull;
+        while (!got) {
+            uint64_t now = now_ns();
+            if (now >= deadline) break;
+            struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+            int rc = poll(&pfd, 1, (int)((deadline - now) / 1000000ull) + 1);
+            if (rc <= 0) continue;
+            uint8_t in[64];
+            ssize_t n = recv(fd, in, sizeof(in), 0);
+            if (n < 44 || memcmp(in, "/nora/pong", 10) != 0) continue;
+            uint64_t ack = be64(in + 20);
+            if (ack != seq) continue;
+            uint64_t render = be64(in + 36);
+            apply_ns[received] = render > sent ? render - sent : 0;
+            rtt_ns[received] = now_ns() - sent;
+            received++;
+            got = true;
+        }
+        if (!got) lost++;
+        struct timespec pause = {0, (long)(interval_ms * 1e6)};
+        nanosleep(&pause, NULL);
+    }
+    close(fd);
+
+    if (received == 0) {
+        fprintf(stderr, "No replies from 127.0.0.1:%d (is `osc %d` running in NORA?)\n", port, port);
+        return 1;
+    }
+    qsort(apply_ns, (size_t)received, sizeof(uint64_t), cmp_u64);
+    qsort(rtt_ns, (size_t)received, sizeof(uint64_t), cmp_u64);
+    double sum = 0.0;
+    for (int i = 0; i < received; ++i) sum += (double)apply_ns[i];
+
+    double buffer_ms = 1000.0 * ENGINE_BUFFER_FRAMES / ENGINE_SAMPLE_RATE;
+    printf("%d/%d pings answered (%d lost), %s\n", received, count, lost, bundle ? "bundled" : "plain");
+    printf("message -> render:  min %.3f  avg %.3f  p50 %.3f  p99 %.3f  max %.3f ms\n", apply_ns[0] / 1e6,
+           sum / received / 1e6, apply_ns[received / 2] / 1e6, apply_ns[(received * 99) / 100] / 1e6,
+           apply_ns[received - 1] / 1e6);
+    printf("round trip:         p50 %.3f  max %.3f ms\n", rtt_ns[received / 2] / 1e6, rtt_ns[received - 1] / 1e6);
+    printf("message -> output:  add up to %.2f ms of queued audio (%d x %d-frame buffers)\n",
+           buffer_ms * ENGINE_BUFFER_COUNT, ENGINE_BUFFER_COUNT, ENGINE_BUFFER_FRAMES);
+    free(apply_ns);
+    free(rtt_ns);
+    return 0;
+}
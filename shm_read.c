@@ -0,0 +1,391 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Reference reader for NORA's shared-memory output rings (`--shm <name>` and
+// `shm:` daemon sinks). Follows a ring from its current write position and reads
+// the samples in place, optionally writing them out as raw s16le, and reports how
+// far behind the writer it ran. -B benchmarks the ring transport against a pipe.
+
+#define SHM_WRITER 1u
+#define SHM_READER 2u
+#define DEFAULT_BLOCK_FRAMES 512  // what version 1 rings were written in
+#define POLL_NS 250000L
+
+// Same layout as ShmRingHeader in main.c (see the README).
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bytes_per_sample;
+    uint64_t capacity_frames;
+    _Atomic uint64_t write_frames;
+    _Atomic uint64_t read_frames;
+    uint32_t block_frames;
+    _Atomic uint32_t state;
+    _Atomic uint64_t overruns;
+} RingHeader;
+
+typedef struct {
+    RingHeader *hdr;
+    int16_t *data;
+    size_t map_size;
+} Ring;
+
+static volatile sig_atomic_t g_stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void pause_ns(long ns) {
+    struct timespec pause = {0, ns};
+    nanosleep(&pause, NULL);
+}
+
+static void shm_path(char *buf, size_t size, const char *name) {
+    snprintf(buf, size, "/%s", name[0] == '/' ? name + 1 : name);
+}
+
+static bool ring_map(Ring *ring, const char *name) {
+    char path[128];
+    shm_path(path, sizeof(path), name);
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        fprintf(stderr, "shm_open %s failed: %s (is NORA writing to it?)\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(RingHeader)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return false;
+    }
+    ring->hdr = (RingHeader *)map;
+    ring->data = (int16_t *)((uint8_t *)map + sizeof(RingHeader));
+    ring->map_size = (size_t)st.st_size;
+    const RingHeader *h = ring->hdr;
+    uint64_t cap = h->capacity_frames;
+    if (memcmp(h->magic, "NORASHM1", 8) != 0 || h->version < 1 || h->version > 2 || h->bytes_per_sample != 2 ||
+        cap == 0 || (cap & (cap - 1)) != 0 || sizeof(RingHeader) + cap * 2 > ring->map_size) {
+        fprintf(stderr, "%s is not a NORA ring this reader understands\n", path);
+        munmap(map, ring->map_size);
+        return false;
+    }
+    return true;
+}
+
+static int follow(const char *name, const char *out_path, double seconds, bool passive) {
+    Ring ring;
+    if (!ring_map(&ring, name)) return 1;
+    RingHeader *h = ring.hdr;
+    bool v2 = h->version >= 2;
+    const uint64_t cap = h->capacity_frames;
+    const uint64_t block = v2 && h->block_frames ? h->block_frames : DEFAULT_BLOCK_FRAMES;
+    const uint64_t safe = cap - block;  // frames that can be behind the writer and still be intact
+    const double frame_ms = 1000.0 / (h->sample_rate ? h->sample_rate : 48000);
+    FILE *out = NULL;
+    if (out_path) {
+        out = strcmp(out_path, "-") ? fopen(out_path, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "Cannot open %s: %s\n", out_path, strerror(errno));
+            munmap(h, ring.map_size);
+            return 1;
+        }
+    }
+    bool primary = v2 && !passive;
+    uint64_t r = atomic_load_explicit(&h->write_frames, memory_order_acquire);
+    uint64_t overruns0 = v2 ? atomic_load_explicit(&h->overruns, memory_order_relaxed) : 0;
+    if (primary) {
+        atomic_store_explicit(&h->read_frames, r, memory_order_release);
+        atomic_fetch_or_explicit(&h->state, SHM_READER, memory_order_relaxed);
+    }
+    fprintf(stderr, "Reading %s: %u Hz, %llu-frame ring, %llu-frame blocks, %s reader\n", name, h->sample_rate,
+            (unsigned long long)cap, (unsigned long long)block, primary ? "primary" : "passive");
+
+    uint64_t start = now_ns(), frames = 0, lost = 0, torn = 0, wakeups = 0, lag_sum = 0, lag_max = 0;
+    int peak = 0;
+    while (!g_stop && (seconds <= 0.0 || (double)(now_ns() - start) < seconds * 1e9)) {
+        uint64_t w = atomic_load_explicit(&h->write_frames, memory_order_acquire);
+        if (w < r) r = w;  // the writer restarted the ring
+        if (w == r) {
+            if (v2 && !(atomic_load_explicit(&h->state, memory_order_relaxed) & SHM_WRITER)) break;
+            pause_ns(POLL_NS);
+            continue;
+        }
+        uint64_t lag = w - r;
+        wakeups++;
+        lag_sum += lag;
+        if (lag > lag_max) lag_max = lag;
+        if (lag > safe) {
+            lost += lag - safe;
+            r = w - safe;
+        }
+        uint64_t begin = r;
+        while (r < w) {
+            uint64_t pos = r & (cap - 1);
+            uint64_t n = cap - pos < w - r ? cap - pos : w - r;
+            const int16_t *span = ring.data + pos;  // read in place
+            for (uint64_t i = 0; i < n; ++i) {
+                int v = span[i] < 0 ? -span[i] : span[i];
+                if (v > peak) peak = v;
+            }
+            if (out && fwrite(span, sizeof(int16_t), (size_t)n, out) != (size_t)n) g_stop = 1;
+            r += n;
+        }
+        // Anything the writer may have started on while we read is suspect.
+        uint64_t after = atomic_load_explicit(&h->write_frames, memory_order_acquire);
+        if (after + block > begin + cap) torn += after + block - begin - cap;
+        frames += w - begin;
+        if (primary) atomic_store_explicit(&h->read_frames, r, memory_order_release);
+    }
+    if (primary) atomic_fetch_and_explicit(&h->state, ~SHM_READER, memory_order_relaxed);
+    double secs = (double)(now_ns() - start) / 1e9;
+    fprintf(stderr, "%llu frames (%.1f s of audio) in %.1f s, peak %.1f%% of full scale\n",
+            (unsigned long long)frames, frames * frame_ms / 1000.0, secs, 100.0 * peak / 32768.0);
+    fprintf(stderr, "new at each wakeup: avg %.0f frames (%.2f ms), max %llu frames (%.2f ms); polled every %.2f ms\n",
+            wakeups ? (double)lag_sum / wakeups : 0.0, wakeups ? (double)lag_sum / wakeups * frame_ms : 0.0,
+            (unsigned long long)lag_max, lag_max * frame_ms, POLL_NS / 1e6);
+    fprintf(stderr, "%llu frames lost to lag, %llu possibly overwritten while read", (unsigned long long)lost,
+            (unsigned long long)torn);
+    if (primary) {
+        fprintf(stderr, ", writer counted %llu overwritten unread",
+                (unsigned long long)(atomic_load_explicit(&h->overruns, memory_order_relaxed) - overruns0));
+    }
+    fprintf(stderr, "\n");
+    if (out && out != stdout) fclose(out);
+    munmap(h, ring.map_size);
+    return 0;
+}
+
+// Benchmark: a child process writes a counting pattern as fast as the transport
+// takes it; the parent reads and verifies every sample. The ring writer waits for
+// room here (NORA's never does) so the number is the transport's ceiling.
+static inline int16_t pattern(uint64_t frame) { return (int16_t)(frame * 2654435761u >> 16); }
+
+static double bench_ring(double seconds, uint64_t block, uint64_t *bad) {
+    const uint64_t cap = 1u << 16;
+    char name[64];
+    snprintf(name, sizeof(name), "/nora-shm-bench-%d", (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    size_t size = sizeof(RingHeader) + cap * sizeof(int16_t);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0.0;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    shm_unlink(name);
+    if (map == MAP_FAILED) return 0.0;
+    RingHeader *h = (RingHeader *)map;
+    int16_t *data = (int16_t *)(h + 1);
+    h->capacity_frames = cap;
+    h->block_frames = (uint32_t)block;
+    atomic_store(&h->state, SHM_WRITER | SHM_READER);
+
+    pid_t child = fork();
+    if (child == 0) {
+        uint64_t w = 0;
+        while (atomic_load_explicit(&h->state, memory_order_relaxed) & SHM_WRITER) {
+            if (w + block - atomic_load_explicit(&h->read_frames, memory_order_acquire) > cap) {
+                sched_yield();
+                continue;
+            }
+            int16_t *dst = data + (w & (cap - 1));
+            for (uint64_t i = 0; i < block; ++i) dst[i] = pattern(w + i);
+            w += block;
+            atomic_store_explicit(&h->write_frames, w, memory_order_release);
+        }
+        _exit(0);
+    }
+    uint64_t r = 0, start = now_ns(), end = start + (uint64_t)(seconds * 1e9);
+    while (now_ns() < end) {
+        uint64_t w = atomic_load_explicit(&h->write_frames, memory_order_acquire);
+        if (w == r) {
+            sched_yield();
+            continue;
+        }
+        for (; r < w; ++r) *bad += data[r & (cap - 1)] != pattern(r);
+        atomic_store_explicit(&h->read_frames, r, memory_order_release);
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+    atomic_store(&h->state, 0u);
+    waitpid(child, NULL, 0);
+    munmap(map, size);
+    return (double)r / secs;
+}
+
+static double bench_pipe(double seconds, uint64_t block, uint64_t *bad) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0.0;
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        int16_t *buf = (int16_t *)malloc(block * sizeof(int16_t));
+        for (uint64_t w = 0; buf; w += block) {
+            for (uint64_t i = 0; i < block; ++i) buf[i] = pattern(w + i);
+            if (write(fds[1], buf, block * sizeof(int16_t)) != (ssize_t)(block * sizeof(int16_t))) break;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    int16_t *buf = (int16_t *)malloc(block * sizeof(int16_t));
+    uint64_t r = 0, start = now_ns(), end = start + (uint64_t)(seconds * 1e9);
+    size_t have = 0;
+    while (buf && now_ns() < end) {
+        ssize_t n = read(fds[0], (uint8_t *)buf + have, block * sizeof(int16_t) - have);
+        if (n <= 0) break;
+        have += (size_t)n;
+        for (size_t i = 0; i < have / sizeof(int16_t); ++i, ++r) *bad += buf[i] != pattern(r);
+        size_t used = have / sizeof(int16_t) * sizeof(int16_t);
+        memmove(buf, (uint8_t *)buf + used, have - used);
+        have -= used;
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+    close(fds[0]);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    free(buf);
+    return (double)r / secs;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Publish-to-read latency of a follower polling like follow() does: the child
+// publishes one 512-frame block per millisecond with its publish time in the
+// first four samples.
+static void bench_latency(int blocks) {
+    const uint64_t cap = 1u << 16, block = 512;
+    size_t size = sizeof(RingHeader) + cap * sizeof(int16_t);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    uint64_t *seen = (uint64_t *)calloc((size_t)blocks, sizeof(uint64_t));
+    if (map == MAP_FAILED || !seen) return;
+    RingHeader *h = (RingHeader *)map;
+    int16_t *data = (int16_t *)(h + 1);
+    pid_t child = fork();
+    if (child == 0) {
+        for (uint64_t w = 0; w < (uint64_t)blocks * block; w += block) {
+            int16_t *dst = data + (w & (cap - 1));
+            uint64_t stamp = now_ns();
+            memcpy(dst, &stamp, sizeof(stamp));
+            atomic_store_explicit(&h->write_frames, w + block, memory_order_release);
+            pause_ns(1000000L);
+        }
+        _exit(0);
+    }
+    uint64_t r = 0;
+    int got = 0;
+    while (got < blocks) {
+        uint64_t w = atomic_load_explicit(&h->write_frames, memory_order_acquire);
+        if (w == r) {
+            pause_ns(POLL_NS);
+            continue;
+        }
+        uint64_t now = now_ns();
+        for (; r < w && got < blocks; r += block) {
+            uint64_t stamp;
+            memcpy(&stamp, data + (r & (cap - 1)), sizeof(stamp));
+            seen[got++] = now - stamp;
+        }
+    }
+    waitpid(child, NULL, 0);
+    qsort(seen, (size_t)blocks, sizeof(uint64_t), cmp_u64);
+    printf("publish -> read, %d blocks polled every %.2f ms: p50 %.3f  p99 %.3f  max %.3f ms "
+           "(a 512-frame block lasts 10.67 ms)\n",
+           blocks, POLL_NS / 1e6, seen[blocks / 2] / 1e6, seen[(blocks * 99) / 100] / 1e6, seen[blocks - 1] / 1e6);
+    free(seen);
+    munmap(map, size);
+}
+
+static int bench(double seconds) {
+    printf("Transport benchmark, %.1f s per run, s16 mono, verified sample by sample\n", seconds);
+    printf("%8s %16s %16s %9s\n", "block", "shm ring", "pipe", "ratio");
+    static const uint64_t kBlocks[] = {64, 512, 4096};
+    int rc = 0;
+    for (size_t k = 0; k < sizeof(kBlocks) / sizeof(kBlocks[0]); ++k) {
+        uint64_t bad = 0;
+        double ring = bench_ring(seconds, kBlocks[k], &bad);
+        double piped = bench_pipe(seconds, kBlocks[k], &bad);
+        printf("%8llu %9.1f Mfr/s %9.1f Mfr/s %8.1fx  (%.0fx / %.0fx real time at 48 kHz)\n",
+               (unsigned long long)kBlocks[k], ring / 1e6, piped / 1e6, piped > 0.0 ? ring / piped : 0.0,
+               ring / 48000.0, piped / 48000.0);
+        if (bad) {
+            printf("  %llu samples did not match the pattern\n", (unsigned long long)bad);
+            rc = 1;
+        }
+    }
+    bench_latency(1000);
+    return rc;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-o out.raw|-] [-t seconds] [-p] <ring name>\n", argv0);
+    fprintf(stderr, "       %s -B [seconds]\n", argv0);
+    fprintf(stderr, "  -o  write the audio as raw s16le (- for stdout)\n");
+    fprintf(stderr, "  -p  passive: do not publish a read position to the writer\n");
+    fprintf(stderr, "  -B  benchmark the shm ring against a pipe\n");
+}
+
+int main(int argc, char **argv) {
+    const char *out = NULL;
+    const char *name = NULL;
+    double seconds = 0.0;
+    bool passive = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out = argv[++i];
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-p")) {
+            passive = true;
+        } else if (!strcmp(argv[i], "-B")) {
+            return bench(i + 1 < argc ? atof(argv[i + 1]) : 2.0);
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!name) {
+        usage(argv[0]);
+        return 2;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    return follow(name, out, seconds, passive);
+}